@@ -0,0 +1,12 @@
+(def run (lambda (n)
+  (def kept (list))
+  (def i 0)
+  (while (< i n)
+    (def garbage (list i (list i i) (list i i i)))
+    (if (= 0 (rem i 100))
+        (push! kept garbage)
+        null)
+    (def i (+ i 1)))
+  (len kept)))
+
+(print (run 1500000))
@@ -0,0 +1,141 @@
+// Microbenchmark of the allocation patterns that reallocate serves: pooled
+// small blocks, growing arrays, and large blocks from realloc.
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "memory.h"
+#include "micro.h"
+#include "vm.h"
+
+// Number of blocks live at once in the pooled patterns.
+#define BLOCK_COUNT 100000
+
+// Times each pattern is repeated.
+#define ROUNDS 20
+
+// Largest size used for pooled blocks, the largest size class of the pools.
+#define SMALL_MAX 256
+
+// Size of the blocks that are too large for the pools.
+#define LARGE_SIZE 4096
+
+// Allocate blocks of one size and free them in the reverse order.
+static void fixedSize(VM* vm, void** blocks, size_t size)
+{
+    char name[64];
+    uint64_t start = nowNs();
+
+    for (int round = 0; round < ROUNDS; round++) {
+        for (int i = 0; i < BLOCK_COUNT; i++) {
+            blocks[i] = reallocate(vm, NULL, 0, size);
+        }
+        for (int i = BLOCK_COUNT - 1; i >= 0; i--) {
+            reallocate(vm, blocks[i], size, 0);
+        }
+    }
+
+    snprintf(name, sizeof(name), "alloc + free %zu bytes (LIFO)", size);
+    reportOp(name, start, (long)ROUNDS * BLOCK_COUNT * 2);
+}
+
+// Allocate blocks of random pooled sizes, then free them in a random order,
+// so the free lists of the pools get shuffled.
+static void randomSizes(VM* vm, void** blocks, size_t* sizes)
+{
+    uint64_t state = 88172645463325252u;
+    for (int i = 0; i < BLOCK_COUNT; i++) {
+        sizes[i] = (size_t)(nextRandom(&state) % SMALL_MAX) + 1;
+    }
+
+    uint64_t start = nowNs();
+    for (int round = 0; round < ROUNDS; round++) {
+        for (int i = 0; i < BLOCK_COUNT; i++) {
+            blocks[i] = reallocate(vm, NULL, 0, sizes[i]);
+        }
+
+        for (int i = BLOCK_COUNT - 1; i > 0; i--) {
+            int j = (int)(nextRandom(&state) % (uint64_t)(i + 1));
+            void* block = blocks[i];
+            size_t size = sizes[i];
+            blocks[i] = blocks[j];
+            sizes[i] = sizes[j];
+            blocks[j] = block;
+            sizes[j] = size;
+        }
+
+        for (int i = 0; i < BLOCK_COUNT; i++) {
+            reallocate(vm, blocks[i], sizes[i], 0);
+        }
+    }
+    reportOp("alloc + free 1-256 bytes (random order)", start,
+        (long)ROUNDS * BLOCK_COUNT * 2);
+}
+
+// Grow an array one element at a time the way the VM's arrays do, doubling
+// its capacity whenever it is full.
+static void growingArray(VM* vm)
+{
+    uint64_t start = nowNs();
+
+    for (int round = 0; round < ROUNDS; round++) {
+        Value* values = NULL;
+        int count = 0;
+        int capacity = 0;
+
+        for (int i = 0; i < BLOCK_COUNT; i++) {
+            if (count == capacity) {
+                int oldCapacity = capacity;
+                capacity = (int)GROW_CAPACITY(oldCapacity);
+                values = GROW_ARRAY(vm, Value, values, oldCapacity, capacity);
+            }
+            values[count++] = NUMBER_VAL(i);
+        }
+
+        FREE_ARRAY(vm, Value, values, capacity);
+    }
+    reportOp("append to a growing array", start, (long)ROUNDS * BLOCK_COUNT);
+}
+
+// Allocate and free blocks too large for the pools.
+static void largeBlocks(VM* vm, void** blocks)
+{
+    uint64_t start = nowNs();
+    int count = BLOCK_COUNT / 10;
+
+    for (int round = 0; round < ROUNDS; round++) {
+        for (int i = 0; i < count; i++) {
+            blocks[i] = reallocate(vm, NULL, 0, LARGE_SIZE);
+        }
+        for (int i = 0; i < count; i++) {
+            reallocate(vm, blocks[i], LARGE_SIZE, 0);
+        }
+    }
+    reportOp("alloc + free 4096 bytes (realloc)", start,
+        (long)ROUNDS * count * 2);
+}
+
+int main(void)
+{
+    VM* vm = malloc(sizeof(VM));
+    void** blocks = malloc(sizeof(void*) * BLOCK_COUNT);
+    size_t* sizes = malloc(sizeof(size_t) * BLOCK_COUNT);
+    if (vm == NULL || blocks == NULL || sizes == NULL)
+        exit(1);
+
+    // Only the allocator is measured, so the collector is kept from running.
+    initVM(vm);
+    vm->nextGC = SIZE_MAX;
+
+    fixedSize(vm, blocks, 16);
+    fixedSize(vm, blocks, 64);
+    fixedSize(vm, blocks, SMALL_MAX);
+    randomSizes(vm, blocks, sizes);
+    growingArray(vm);
+    largeBlocks(vm, blocks);
+
+    freeVM(vm);
+    free(vm);
+    free(blocks);
+    free(sizes);
+    return 0;
+}
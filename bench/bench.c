@@ -0,0 +1,339 @@
+// Benchmark harness for the interpreter.
+//
+// Usage: bench [--runs n] [--threshold percent] [--baseline file]
+//              [--save file] lisp script...
+//
+// Runs each script n times with the given interpreter, and reports the median
+// and 95th percentile wall time, the peak resident set size, and the number
+// of minor and major garbage collections. With --baseline, each median is
+// compared with the one stored in the baseline file, and the harness fails if
+// any script is slower by more than the threshold. With --save, the results
+// are written to a baseline file.
+//
+// The scripts in this directory each exercise one kind of workload:
+//   loop      numeric loop over locals
+//   fib       recursive calls
+//   closures  creating and calling closures
+//   lists     building lists, map, filter, reduce and sequences
+//   dicts     setting and getting keys of persistent dicts
+//   strings   concatenating and interning strings
+//   alloc     short-lived allocation with some survivors
+#include <errno.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+// Default number of times each script is run.
+#define DEFAULT_RUNS 10
+
+// Default percentage a median may grow by before it counts as a regression.
+#define DEFAULT_THRESHOLD 10.0
+
+// Most scripts that can be benchmarked at once.
+#define MAX_SCRIPTS 256
+
+typedef struct {
+    char name[64];
+    double median;
+    double p95;
+    long peakRss;
+    long minorCollections;
+    long majorCollections;
+} Result;
+
+// Return the name of the script, its file name without the extension.
+static void scriptName(const char* path, char* name, size_t size)
+{
+    const char* base = strrchr(path, '/');
+    base = base == NULL ? path : base + 1;
+
+    snprintf(name, size, "%s", base);
+    char* extension = strrchr(name, '.');
+    if (extension != NULL)
+        *extension = '\0';
+}
+
+static double elapsedMs(struct timespec* start, struct timespec* end)
+{
+    return (double)(end->tv_sec - start->tv_sec) * 1e3
+        + (double)(end->tv_nsec - start->tv_nsec) / 1e6;
+}
+
+// Read the collection counts printed by --gc-stats from the file.
+static void readGcStats(FILE* stats, Result* result)
+{
+    char line[256];
+    rewind(stats);
+
+    while (fgets(line, sizeof(line), stats) != NULL) {
+        sscanf(line, "minor collections: %ld", &result->minorCollections);
+        sscanf(line, "major collections: %ld", &result->majorCollections);
+    }
+}
+
+// Run the script once, storing its wall time in time and recording its peak
+// RSS and collections in the result. Return false if it failed.
+static bool runOnce(const char* lisp, const char* script, double* time,
+    Result* result)
+{
+    FILE* stats = tmpfile();
+    if (stats == NULL) {
+        perror("tmpfile");
+        return false;
+    }
+
+    // Anything still buffered would be written again by the child.
+    fflush(stdout);
+
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    pid_t pid = fork();
+    if (pid < 0) {
+        perror("fork");
+        fclose(stats);
+        return false;
+    }
+
+    if (pid == 0) {
+        FILE* null = freopen("/dev/null", "w", stdout);
+        (void)null;
+        dup2(fileno(stats), STDERR_FILENO);
+        execl(lisp, lisp, "--no-cache", "--gc-stats", script, (char*)NULL);
+        _exit(127);
+    }
+
+    int status;
+    struct rusage usage;
+    while (wait4(pid, &status, 0, &usage) < 0) {
+        if (errno != EINTR) {
+            perror("wait4");
+            fclose(stats);
+            return false;
+        }
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    *time = elapsedMs(&start, &end);
+
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        fprintf(stderr, "%s failed with status %d.\n", script,
+            WIFEXITED(status) ? WEXITSTATUS(status) : -1);
+        fclose(stats);
+        return false;
+    }
+
+    // ru_maxrss is in kilobytes on Linux.
+    if (usage.ru_maxrss > result->peakRss)
+        result->peakRss = usage.ru_maxrss;
+    readGcStats(stats, result);
+
+    fclose(stats);
+    return true;
+}
+
+static int compareDoubles(const void* a, const void* b)
+{
+    double x = *(const double*)a;
+    double y = *(const double*)b;
+    return (x > y) - (x < y);
+}
+
+// Return the value at the percentile of the sorted times, by nearest rank.
+static double percentile(double* times, int count, double percent)
+{
+    int rank = (int)((percent / 100.0) * count + 0.999999);
+    if (rank < 1)
+        rank = 1;
+    if (rank > count)
+        rank = count;
+    return times[rank - 1];
+}
+
+// Run the script the given number of times and fill in the result. Return
+// false if any run failed.
+static bool benchmark(const char* lisp, const char* script, int runs,
+    Result* result)
+{
+    double* times = malloc(sizeof(double) * (size_t)runs);
+    if (times == NULL)
+        exit(1);
+
+    memset(result, 0, sizeof(*result));
+    scriptName(script, result->name, sizeof(result->name));
+
+    for (int i = 0; i < runs; i++) {
+        if (!runOnce(lisp, script, &times[i], result)) {
+            free(times);
+            return false;
+        }
+    }
+
+    qsort(times, (size_t)runs, sizeof(double), compareDoubles);
+    result->median = runs % 2 == 1
+        ? times[runs / 2]
+        : (times[runs / 2 - 1] + times[runs / 2]) / 2;
+    result->p95 = percentile(times, runs, 95);
+
+    free(times);
+    return true;
+}
+
+// Read the whole file into a string, or return NULL if it can't be read.
+static char* readFile(const char* path)
+{
+    FILE* file = fopen(path, "rb");
+    if (file == NULL)
+        return NULL;
+
+    fseek(file, 0L, SEEK_END);
+    long size = ftell(file);
+    rewind(file);
+
+    char* contents = malloc((size_t)size + 1);
+    if (contents == NULL)
+        exit(1);
+
+    size_t read = fread(contents, 1, (size_t)size, file);
+    contents[read] = '\0';
+    fclose(file);
+    return contents;
+}
+
+// Find the median stored for the named script in a baseline written by
+// saveBaseline. Return false if the baseline has no entry for it.
+static bool baselineMedian(const char* baseline, const char* name,
+    double* median)
+{
+    char key[96];
+    snprintf(key, sizeof(key), "\"name\": \"%s\"", name);
+
+    const char* entry = strstr(baseline, key);
+    if (entry == NULL)
+        return false;
+
+    const char* field = strstr(entry, "\"median_ms\":");
+    const char* next = strstr(entry + 1, "\"name\":");
+    if (field == NULL || (next != NULL && field > next))
+        return false;
+
+    *median = strtod(field + strlen("\"median_ms\":"), NULL);
+    return true;
+}
+
+static bool saveBaseline(const char* path, Result* results, int count)
+{
+    FILE* file = fopen(path, "w");
+    if (file == NULL)
+        return false;
+
+    fprintf(file, "{\n  \"benchmarks\": [\n");
+    for (int i = 0; i < count; i++) {
+        Result* result = &results[i];
+        fprintf(file,
+            "    {\"name\": \"%s\", \"median_ms\": %.3f, \"p95_ms\": %.3f, "
+            "\"peak_rss_kb\": %ld, \"minor_gcs\": %ld, \"major_gcs\": %ld}%s\n",
+            result->name, result->median, result->p95, result->peakRss,
+            result->minorCollections, result->majorCollections,
+            i + 1 < count ? "," : "");
+    }
+    fprintf(file, "  ]\n}\n");
+
+    return fclose(file) == 0;
+}
+
+static void usage(void)
+{
+    fprintf(stderr, "Usage: bench [--runs n] [--threshold percent] "
+                    "[--baseline file] [--save file] lisp script...\n");
+    exit(64);
+}
+
+int main(int argc, char* argv[])
+{
+    int runs = DEFAULT_RUNS;
+    double threshold = DEFAULT_THRESHOLD;
+    const char* baselinePath = NULL;
+    const char* savePath = NULL;
+
+    int i = 1;
+    for (; i < argc && strncmp(argv[i], "--", 2) == 0; i++) {
+        if (strcmp(argv[i], "--runs") == 0 && i + 1 < argc) {
+            runs = atoi(argv[++i]);
+            if (runs < 1)
+                usage();
+        } else if (strcmp(argv[i], "--threshold") == 0 && i + 1 < argc) {
+            threshold = atof(argv[++i]);
+        } else if (strcmp(argv[i], "--baseline") == 0 && i + 1 < argc) {
+            baselinePath = argv[++i];
+        } else if (strcmp(argv[i], "--save") == 0 && i + 1 < argc) {
+            savePath = argv[++i];
+        } else {
+            usage();
+        }
+    }
+
+    if (argc - i < 2 || argc - i - 1 > MAX_SCRIPTS)
+        usage();
+
+    const char* lisp = argv[i++];
+    int count = argc - i;
+    Result* results = malloc(sizeof(Result) * (size_t)count);
+    if (results == NULL)
+        exit(1);
+
+    char* baseline = baselinePath == NULL ? NULL : readFile(baselinePath);
+    if (baselinePath != NULL && baseline == NULL) {
+        fprintf(stderr, "Could not read baseline \"%s\".\n", baselinePath);
+        exit(74);
+    }
+
+    printf("%-10s %10s %10s %10s %8s %8s %10s %9s\n", "benchmark",
+        "median ms", "p95 ms", "peak KB", "minor", "major", "baseline",
+        "change");
+
+    int regressions = 0;
+    for (int j = 0; j < count; j++) {
+        Result* result = &results[j];
+        if (!benchmark(lisp, argv[i + j], runs, result))
+            exit(70);
+
+        printf("%-10s %10.1f %10.1f %10ld %8ld %8ld", result->name,
+            result->median, result->p95, result->peakRss,
+            result->minorCollections, result->majorCollections);
+
+        double before;
+        if (baseline != NULL && baselineMedian(baseline, result->name, &before)
+            && before > 0) {
+            double change = (result->median - before) / before * 100;
+            bool regressed = change > threshold;
+            regressions += regressed;
+            printf(" %10.1f %+8.1f%%%s", before, change,
+                regressed ? "  REGRESSION" : "");
+        }
+        printf("\n");
+        fflush(stdout);
+    }
+
+    if (savePath != NULL && !saveBaseline(savePath, results, count)) {
+        fprintf(stderr, "Could not write baseline \"%s\".\n", savePath);
+        exit(74);
+    }
+
+    free(baseline);
+    free(results);
+
+    if (regressions > 0) {
+        printf("%d benchmark%s slower than the baseline by more than %.1f%%.\n",
+            regressions, regressions == 1 ? "" : "s", threshold);
+        return 1;
+    }
+
+    return 0;
+}
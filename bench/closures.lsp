@@ -0,0 +1,14 @@
+(def make-adder (lambda (n) (lambda (x) (+ x n))))
+
+(def compose (lambda (f g) (lambda (x) (f (g x)))))
+
+(def run (lambda (n)
+  (def total 0)
+  (def i 0)
+  (while (< i n)
+    (def add-both (compose (make-adder i) (make-adder 1)))
+    (def total (+ total (add-both 0)))
+    (def i (+ i 1)))
+  total))
+
+(print (run 1000000))
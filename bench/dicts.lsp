@@ -0,0 +1,12 @@
+(def run (lambda (n)
+  (def d (dict))
+  (def total 0)
+  (def i 0)
+  (while (< i n)
+    (def d (set d (rem i 5000) i))
+    (def d (set d (str "k" (rem i 300)) i))
+    (def total (+ total (get d (rem i 5000))))
+    (def i (+ i 1)))
+  total))
+
+(print (run 300000))
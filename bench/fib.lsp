@@ -0,0 +1,6 @@
+(def fib (lambda (n)
+  (if (< n 2)
+      n
+      (+ (fib (- n 1)) (fib (- n 2))))))
+
+(print (fib 30))
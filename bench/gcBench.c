@@ -0,0 +1,146 @@
+// Microbenchmark of collectGarbage on synthetic heaps of different shapes and
+// sizes, each built with as much garbage as live data.
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "dict.h"
+#include "memory.h"
+#include "micro.h"
+#include "object.h"
+#include "value.h"
+#include "vm.h"
+
+// Times the collection of the live heap alone is repeated.
+#define ROUNDS 5
+
+typedef enum {
+    SHAPE_WIDE,
+    SHAPE_DEEP,
+    SHAPE_STRINGS,
+    SHAPE_DICT,
+} HeapShape;
+
+static const char* shapeNames[] = {
+    "wide lists",
+    "deep list chain",
+    "strings",
+    "dict",
+};
+
+// Build a structure of the given shape and size in the stack slot. Nothing
+// is collected while it is built, so young pointers can be held in C.
+static void build(VM* vm, HeapShape shape, int size, int slot)
+{
+    switch (shape) {
+    case SHAPE_WIDE: {
+        // A list of small lists of numbers.
+        ObjList* root = newList(vm);
+        vm->stack[slot] = OBJ_VAL(root);
+        for (int i = 0; i < size; i++) {
+            ObjList* list = newList(vm);
+            for (int j = 0; j < 4; j++) {
+                appendToList(vm, list, NUMBER_VAL(i + j));
+            }
+            appendToList(vm, root, OBJ_VAL(list));
+        }
+        break;
+    }
+    case SHAPE_DEEP: {
+        // Each list holds the one before it.
+        Value previous = NULL_VAL;
+        for (int i = 0; i < size; i++) {
+            ObjList* list = newList(vm);
+            appendToList(vm, list, previous);
+            previous = OBJ_VAL(list);
+        }
+        vm->stack[slot] = previous;
+        break;
+    }
+    case SHAPE_STRINGS: {
+        // A list of distinct strings, which are also in the string table.
+        ObjList* root = newList(vm);
+        vm->stack[slot] = OBJ_VAL(root);
+        for (int i = 0; i < size; i++) {
+            char chars[32];
+            int length = snprintf(chars, sizeof(chars), "%d-%d", slot, i);
+            appendToList(vm, root, OBJ_VAL(copyString(vm, chars, length)));
+        }
+        break;
+    }
+    case SHAPE_DICT: {
+        // A persistent dict, whose earlier versions are garbage too.
+        ObjDict* dict = newDict(vm);
+        for (int i = 0; i < size; i++) {
+            dict = dictSet(vm, dict, NUMBER_VAL(i), NUMBER_VAL(i));
+        }
+        vm->stack[slot] = OBJ_VAL(dict);
+        break;
+    }
+    }
+}
+
+// Return the number of objects in the old generation.
+static long countOld(VM* vm)
+{
+    long count = 0;
+    for (Obj* object = vm->objects; object != NULL; object = object->next) {
+        count++;
+    }
+    return count;
+}
+
+// Time full collections of a heap of the shape and size, first with the
+// garbage built alongside it, then with only the live objects left.
+static void benchmarkHeap(HeapShape shape, int size)
+{
+    VM* vm = malloc(sizeof(VM));
+    if (vm == NULL)
+        exit(1);
+
+    initVM(vm);
+    vm->nextGC = SIZE_MAX;
+
+    // The live structure is kept in the first slot, and the garbage in the
+    // second until both have been promoted to the old generation.
+    ensureStack(vm, 2);
+    push(vm, NULL_VAL);
+    push(vm, NULL_VAL);
+    build(vm, shape, size, 0);
+    build(vm, shape, size, 1);
+    collectYoung(vm);
+    vm->stack[1] = NULL_VAL;
+
+    char name[96];
+    long before = countOld(vm);
+    uint64_t start = nowNs();
+    collectGarbage(vm);
+    snprintf(name, sizeof(name), "%s x%d, half garbage (per object)",
+        shapeNames[shape], size);
+    reportOp(name, start, before);
+
+    long live = countOld(vm);
+    start = nowNs();
+    for (int round = 0; round < ROUNDS; round++) {
+        vm->nextGC = SIZE_MAX;
+        collectGarbage(vm);
+    }
+    snprintf(name, sizeof(name), "%s x%d, all live (per object)",
+        shapeNames[shape], size);
+    reportOp(name, start, (long)ROUNDS * live);
+
+    freeVM(vm);
+    free(vm);
+}
+
+int main(void)
+{
+    static const int sizes[] = { 10000, 200000 };
+
+    for (HeapShape shape = SHAPE_WIDE; shape <= SHAPE_DICT; shape++) {
+        for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+            benchmarkHeap(shape, sizes[i]);
+        }
+    }
+
+    return 0;
+}
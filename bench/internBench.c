@@ -0,0 +1,96 @@
+// Microbenchmark of interning strings with copyString and takeString.
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "memory.h"
+#include "micro.h"
+#include "object.h"
+#include "value.h"
+#include "vm.h"
+
+// Number of distinct strings interned.
+#define STRING_COUNT 200000
+
+// Times the interned strings are looked up again.
+#define ROUNDS 10
+
+// Write the characters of the ith string into chars, and return its length.
+// Lengths vary from a few characters up to about 60.
+static int makeChars(char* chars, size_t size, int i)
+{
+    static const char padding[] = "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ";
+    int pad = (int)((unsigned)i * 2654435761u % (sizeof(padding) - 1));
+    return snprintf(chars, size, "%d-%.*s", i, pad, padding);
+}
+
+int main(void)
+{
+    VM* vm = malloc(sizeof(VM));
+    if (vm == NULL)
+        exit(1);
+
+    // The strings are only reachable from the string table, so the collector
+    // is kept from running.
+    initVM(vm);
+    vm->nextGC = SIZE_MAX;
+
+    char chars[128];
+    int length;
+
+    uint64_t start = nowNs();
+    for (int i = 0; i < STRING_COUNT; i++) {
+        length = makeChars(chars, sizeof(chars), i);
+        copyString(vm, chars, length);
+    }
+    reportOp("copyString (new)", start, STRING_COUNT);
+
+    start = nowNs();
+    for (int round = 0; round < ROUNDS; round++) {
+        for (int i = 0; i < STRING_COUNT; i++) {
+            length = makeChars(chars, sizeof(chars), i);
+            copyString(vm, chars, length);
+        }
+    }
+    reportOp("copyString (interned)", start, (long)ROUNDS * STRING_COUNT);
+
+    // Building the characters is part of every lookup, so it is timed alone
+    // to be subtracted from the numbers above.
+    long total = 0;
+    start = nowNs();
+    for (int round = 0; round < ROUNDS; round++) {
+        for (int i = 0; i < STRING_COUNT; i++) {
+            total += makeChars(chars, sizeof(chars), i);
+        }
+    }
+    reportOp("building the characters alone", start,
+        (long)ROUNDS * STRING_COUNT);
+
+    start = nowNs();
+    for (int round = 0; round < ROUNDS; round++) {
+        for (int i = 0; i < STRING_COUNT; i++) {
+            length = makeChars(chars, sizeof(chars), i);
+            char* owned = ALLOCATE(vm, char, (size_t)length + 1);
+            memcpy(owned, chars, (size_t)length + 1);
+            takeString(vm, owned, length);
+        }
+    }
+    reportOp("takeString (interned, frees the copy)", start,
+        (long)ROUNDS * STRING_COUNT);
+
+    start = nowNs();
+    for (int i = 0; i < STRING_COUNT; i++) {
+        length = snprintf(chars, sizeof(chars), "taken-%d", i);
+        char* owned = ALLOCATE(vm, char, (size_t)length + 1);
+        memcpy(owned, chars, (size_t)length + 1);
+        takeString(vm, owned, length);
+    }
+    reportOp("takeString (new)", start, STRING_COUNT);
+
+    if (total == 0)
+        fprintf(stderr, "No characters built.\n");
+
+    freeVM(vm);
+    free(vm);
+    return 0;
+}
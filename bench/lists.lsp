@@ -0,0 +1,20 @@
+(def build (lambda (n)
+  (def l (list))
+  (def i 0)
+  (while (< i n)
+    (push! l i)
+    (def i (+ i 1)))
+  l))
+
+(def run (lambda (rounds)
+  (def total 0)
+  (def i 0)
+  (while (< i rounds)
+    (def l (build 20000))
+    (def evens (filter (lambda (x) (= 0 (rem x 2))) l))
+    (def total (+ total (reduce + 0 (map (lambda (x) (* x 2)) evens))))
+    (def total (+ total (len (collect (take 1000 (lazy-map (lambda (x) (+ x 1)) l))))))
+    (def i (+ i 1)))
+  total))
+
+(print (run 80))
@@ -0,0 +1,9 @@
+(def sum-squares (lambda (n)
+  (def total 0)
+  (def i 0)
+  (while (< i n)
+    (def total (+ total (rem (* i i) 7)))
+    (def i (+ i 1)))
+  total))
+
+(print (sum-squares 5000000))
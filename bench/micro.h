@@ -0,0 +1,40 @@
+#ifndef clisp_micro_h
+#define clisp_micro_h
+
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+
+// Helpers shared by the C microbenchmarks, which link against the
+// interpreter's objects and call its functions directly.
+
+// Return the time in nanoseconds from an arbitrary start.
+static inline uint64_t nowNs(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000u + (uint64_t)now.tv_nsec;
+}
+
+// Print the average time of an operation that ran count times, starting at
+// the given time.
+static inline void reportOp(const char* name, uint64_t start, long count)
+{
+    double ns = (double)(nowNs() - start) / (double)count;
+    printf("%-52s %10.2f ns/op\n", name, ns);
+    fflush(stdout);
+}
+
+// Return the next number of a xorshift sequence, so every run sees the same
+// "random" keys and sizes.
+static inline uint64_t nextRandom(uint64_t* state)
+{
+    uint64_t x = *state;
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    *state = x;
+    return x;
+}
+
+#endif
@@ -0,0 +1,10 @@
+(def run (lambda (n)
+  (def total 0)
+  (def i 0)
+  (while (< i n)
+    (def s (str "key-" i "-" (rem i 13)))
+    (def total (+ total (len (str s s))))
+    (def i (+ i 1)))
+  total))
+
+(print (run 300000))
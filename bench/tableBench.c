@@ -0,0 +1,162 @@
+// Microbenchmark of tableSet, tableGet and tableDelete with different mixes
+// of keys.
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "memory.h"
+#include "micro.h"
+#include "object.h"
+#include "table.h"
+#include "value.h"
+#include "vm.h"
+
+// Number of keys in each table.
+#define KEY_COUNT 100000
+
+// Times each operation is repeated over every key.
+#define ROUNDS 10
+
+typedef enum {
+    KEYS_SEQUENTIAL,
+    KEYS_RANDOM,
+    KEYS_STRING,
+    KEYS_MIXED,
+} KeyMix;
+
+static const char* mixNames[] = {
+    "sequential numbers",
+    "random numbers",
+    "strings",
+    "mixed",
+};
+
+// Fill the keys array with keys of the given mix, none of them equal.
+static void makeKeys(VM* vm, KeyMix mix, Value* keys, int count)
+{
+    uint64_t state = 88172645463325252u;
+
+    for (int i = 0; i < count; i++) {
+        char chars[32];
+        int length;
+
+        switch (mix) {
+        case KEYS_SEQUENTIAL:
+            keys[i] = NUMBER_VAL(i);
+            break;
+        case KEYS_RANDOM:
+            // Distinct, as the index is in the low bits.
+            keys[i] = NUMBER_VAL(
+                (double)((nextRandom(&state) & 0xfffff00000u) | (uint64_t)i));
+            break;
+        case KEYS_STRING:
+            length = snprintf(chars, sizeof(chars), "key-%d", i);
+            keys[i] = OBJ_VAL(copyString(vm, chars, length));
+            break;
+        case KEYS_MIXED:
+            if (i % 3 == 0) {
+                length = snprintf(chars, sizeof(chars), "key-%d", i);
+                keys[i] = OBJ_VAL(copyString(vm, chars, length));
+            } else {
+                keys[i] = NUMBER_VAL(i % 3 == 1 ? i : -i - 0.5);
+            }
+            break;
+        }
+    }
+}
+
+// Time each table operation for the keys.
+static void benchmarkMix(VM* vm, KeyMix mix, Value* keys, Value* missing)
+{
+    char name[64];
+    makeKeys(vm, mix, keys, KEY_COUNT);
+
+    // Keys that were never set, so every lookup misses.
+    for (int i = 0; i < KEY_COUNT; i++) {
+        missing[i] = mix == KEYS_STRING ? NUMBER_VAL(i) : NUMBER_VAL(-1e9 - i);
+    }
+
+    Table table;
+    uint64_t start = nowNs();
+    for (int round = 0; round < ROUNDS; round++) {
+        initTable(&table);
+        for (int i = 0; i < KEY_COUNT; i++) {
+            tableSet(vm, &table, keys[i], NUMBER_VAL(i));
+        }
+        if (round + 1 < ROUNDS)
+            freeTable(vm, &table);
+    }
+    snprintf(name, sizeof(name), "tableSet (%s, growing)", mixNames[mix]);
+    reportOp(name, start, (long)ROUNDS * KEY_COUNT);
+
+    start = nowNs();
+    for (int round = 0; round < ROUNDS; round++) {
+        for (int i = 0; i < KEY_COUNT; i++) {
+            tableSet(vm, &table, keys[i], NUMBER_VAL(round));
+        }
+    }
+    snprintf(name, sizeof(name), "tableSet (%s, existing)", mixNames[mix]);
+    reportOp(name, start, (long)ROUNDS * KEY_COUNT);
+
+    Value value;
+    long found = 0;
+    start = nowNs();
+    for (int round = 0; round < ROUNDS; round++) {
+        for (int i = 0; i < KEY_COUNT; i++) {
+            found += tableGet(&table, keys[i], &value);
+        }
+    }
+    snprintf(name, sizeof(name), "tableGet (%s, hit)", mixNames[mix]);
+    reportOp(name, start, (long)ROUNDS * KEY_COUNT);
+
+    start = nowNs();
+    for (int round = 0; round < ROUNDS; round++) {
+        for (int i = 0; i < KEY_COUNT; i++) {
+            found += tableGet(&table, missing[i], &value);
+        }
+    }
+    snprintf(name, sizeof(name), "tableGet (%s, miss)", mixNames[mix]);
+    reportOp(name, start, (long)ROUNDS * KEY_COUNT);
+
+    // Deleting and setting again keeps the table the same size, so every
+    // round deletes the same number of keys.
+    start = nowNs();
+    for (int round = 0; round < ROUNDS; round++) {
+        for (int i = 0; i < KEY_COUNT; i++) {
+            found += tableDelete(&table, keys[i]);
+        }
+        for (int i = 0; i < KEY_COUNT; i++) {
+            tableSet(vm, &table, keys[i], NUMBER_VAL(i));
+        }
+    }
+    snprintf(name, sizeof(name), "tableDelete + tableSet (%s)",
+        mixNames[mix]);
+    reportOp(name, start, (long)ROUNDS * KEY_COUNT);
+
+    if (found != (long)ROUNDS * KEY_COUNT * 2)
+        fprintf(stderr, "Unexpected number of keys found: %ld.\n", found);
+
+    freeTable(vm, &table);
+}
+
+int main(void)
+{
+    VM* vm = malloc(sizeof(VM));
+    Value* keys = malloc(sizeof(Value) * KEY_COUNT);
+    Value* missing = malloc(sizeof(Value) * KEY_COUNT);
+    if (vm == NULL || keys == NULL || missing == NULL)
+        exit(1);
+
+    // Nothing here is reachable by the collector, so it is kept from running.
+    initVM(vm);
+    vm->nextGC = SIZE_MAX;
+
+    for (KeyMix mix = KEYS_SEQUENTIAL; mix <= KEYS_MIXED; mix++) {
+        benchmarkMix(vm, mix, keys, missing);
+    }
+
+    freeVM(vm);
+    free(vm);
+    free(keys);
+    free(missing);
+    return 0;
+}
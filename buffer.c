@@ -0,0 +1,74 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "buffer.h"
+
+// initBuffer sets a Buffer to be empty.
+void initBuffer(Buffer* buffer)
+{
+    buffer->bytes = NULL;
+    buffer->count = 0;
+    buffer->capacity = 0;
+}
+
+// freeBuffer frees the bytes of a Buffer and leaves it empty.
+void freeBuffer(Buffer* buffer)
+{
+    free(buffer->bytes);
+    initBuffer(buffer);
+}
+
+// Pad the buffer with zeros up to a multiple of the alignment, then append the
+// bytes. Return the offset they were placed at.
+size_t appendBytes(Buffer* buffer, const void* bytes, size_t size,
+    size_t alignment)
+{
+    size_t offset = (buffer->count + alignment - 1) / alignment * alignment;
+
+    if (buffer->capacity < offset + size) {
+        size_t capacity = buffer->capacity < 64 ? 64 : buffer->capacity;
+        while (capacity < offset + size)
+            capacity *= 2;
+
+        buffer->bytes = realloc(buffer->bytes, capacity);
+        if (buffer->bytes == NULL)
+            exit(1);
+        buffer->capacity = capacity;
+    }
+
+    memset(buffer->bytes + buffer->count, 0, offset - buffer->count);
+    if (size > 0)
+        memcpy(buffer->bytes + offset, bytes, size);
+    buffer->count = offset + size;
+    return offset;
+}
+
+// Write the contents of the buffer to a file at the path. The file is written
+// under a temporary name and then renamed, so that other processes never read
+// a partly written file. Return false if the file could not be written.
+bool writeBufferFile(Buffer* buffer, const char* path)
+{
+    // Each process writes its own temporary file, as several may be writing
+    // the same file at once.
+    size_t length = strlen(path) + 32;
+    char* temporary = malloc(length);
+    if (temporary == NULL)
+        exit(1);
+    snprintf(temporary, length, "%s.%ld.tmp", path, (long)getpid());
+
+    bool written = false;
+    FILE* out = fopen(temporary, "wb");
+    if (out != NULL) {
+        written = buffer->count == 0
+            || fwrite(buffer->bytes, 1, buffer->count, out) == buffer->count;
+        written = fclose(out) == 0 && written;
+        written = written && rename(temporary, path) == 0;
+        if (!written)
+            remove(temporary);
+    }
+
+    free(temporary);
+    return written;
+}
@@ -0,0 +1,20 @@
+#ifndef clisp_buffer_h
+#define clisp_buffer_h
+
+#include "common.h"
+#include <stdint.h>
+
+// A growable block of bytes, used to build up files before they are written.
+typedef struct {
+    uint8_t* bytes;
+    size_t count;
+    size_t capacity;
+} Buffer;
+
+void initBuffer(Buffer* buffer);
+void freeBuffer(Buffer* buffer);
+size_t appendBytes(Buffer* buffer, const void* bytes, size_t size,
+    size_t alignment);
+bool writeBufferFile(Buffer* buffer, const char* path);
+
+#endif
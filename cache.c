@@ -0,0 +1,456 @@
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "buffer.h"
+#include "cache.h"
+#include "chunk.h"
+#include "memory.h"
+#include "object.h"
+#include "table.h"
+#include "value.h"
+#include "vm.h"
+
+static const char cacheMagic[4] = { 'C', 'L', 'B', 'C' };
+
+// Sections of the file start on this boundary, so records holding doubles can
+// be read in place from a mapping.
+#define CACHE_ALIGN 8
+
+// Return the 64 bit FNV-1a hash of the source.
+static uint64_t hashSource(const char* source, size_t length)
+{
+    uint64_t hash = 14695981039346656037u;
+
+    for (size_t i = 0; i < length; i++) {
+        hash ^= (uint8_t)source[i];
+        hash *= 1099511628211u;
+    }
+
+    return hash;
+}
+
+// The sections of a cache file while it is being written.
+typedef struct {
+    Buffer constants;
+    Buffer functions;
+    Buffer strings;
+    Buffer data;
+
+    // Maps each string already written to the index of its record.
+    Table stringIndexes;
+    uint32_t stringCount;
+    uint32_t functionCount;
+
+    // Set when the function tree holds something that can't be cached.
+    bool failed;
+} Writer;
+
+// Return the index of the string's record, adding the record if it's the
+// first time the string has been seen.
+static uint32_t writeString(VM* vm, Writer* writer, ObjString* string)
+{
+    Value index;
+    if (tableGet(&writer->stringIndexes, OBJ_VAL(string), &index))
+        return (uint32_t)AS_NUMBER(index);
+
+    CacheString record;
+    record.chars = (uint32_t)appendBytes(&writer->data, string->chars,
+        (size_t)string->length, 1);
+    record.length = (uint32_t)string->length;
+    appendBytes(&writer->strings, &record, sizeof(record), 1);
+
+    tableSet(vm, &writer->stringIndexes, OBJ_VAL(string),
+        NUMBER_VAL(writer->stringCount));
+    return writer->stringCount++;
+}
+
+// Write the function's record, then the records of the functions in its
+// constant pool. Return the index of the function's record.
+static uint32_t writeFunction(VM* vm, Writer* writer, ObjFunction* function)
+{
+    Chunk* chunk = &function->chunk;
+    FunctionParts parts = functionParts(function);
+    uint32_t index = writer->functionCount++;
+
+    CacheFunction record;
+    record.arity = parts.arity;
+    record.upvalueCount = parts.upvalueCount;
+    record.name = function->name == NULL
+        ? -1
+        : (int32_t)writeString(vm, writer, function->name);
+    record.codeCount = parts.codeCount;
+    record.code = (uint32_t)appendBytes(&writer->data, parts.code,
+        parts.codeCount, 1);
+    record.lines = (uint32_t)appendBytes(&writer->data, parts.lines,
+        sizeof(int) * parts.codeCount, sizeof(int));
+    record.constantCount = parts.constantCount;
+    record.constants = (uint32_t)(writer->constants.count
+        / sizeof(CacheConstant));
+    appendBytes(&writer->functions, &record, sizeof(record), 1);
+
+    for (int i = 0; i < chunk->constants.count; i++) {
+        Value value = chunk->constants.values[i];
+        CacheConstant constant = { CACHE_NUMBER, 0, 0 };
+
+        if (IS_NUMBER(value)) {
+            constant.number = AS_NUMBER(value);
+        } else if (IS_STRING(value)) {
+            constant.type = CACHE_STRING;
+            constant.index = writeString(vm, writer, AS_STRING(value));
+        } else if (IS_FUNCTION(value)) {
+            // The index is filled in once the function has been written.
+            constant.type = CACHE_FUNCTION;
+        } else {
+            writer->failed = true;
+        }
+
+        appendBytes(&writer->constants, &constant, sizeof(constant), 1);
+    }
+
+    for (int i = 0; i < chunk->constants.count; i++) {
+        Value value = chunk->constants.values[i];
+        if (!IS_FUNCTION(value))
+            continue;
+
+        uint32_t nested = writeFunction(vm, writer, AS_FUNCTION(value));
+        CacheConstant* constants = (CacheConstant*)writer->constants.bytes;
+        constants[record.constants + (uint32_t)i].index = nested;
+    }
+
+    return index;
+}
+
+// Write the bytecode of the compiled script to a cache file at the path, along
+// with the hash of the source it was compiled from. Return false if the cache
+// could not be written.
+bool writeCache(VM* vm, const char* path, const char* source,
+    ObjFunction* function)
+{
+    Writer writer;
+    memset(&writer, 0, sizeof(writer));
+    initTable(&writer.stringIndexes);
+
+    writeFunction(vm, &writer, function);
+
+    // Global slots are numbered in the order names were first seen, so record
+    // the name of every slot the bytecode might refer to.
+    Buffer globals;
+    initBuffer(&globals);
+    for (int i = 0; i < vm->globalCount; i++) {
+        uint32_t name = writeString(vm, &writer, vm->globals[i].name);
+        appendBytes(&globals, &name, sizeof(name), 1);
+    }
+
+    CacheHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, cacheMagic, sizeof(header.magic));
+    header.version = CACHE_VERSION;
+    header.opcodeCount = OP_RETURN + 1;
+    header.sourceLength = strlen(source);
+    header.sourceHash = hashSource(source, header.sourceLength);
+    header.constantCount = (uint32_t)(writer.constants.count
+        / sizeof(CacheConstant));
+    header.functionCount = writer.functionCount;
+    header.stringCount = writer.stringCount;
+    header.globalCount = (uint32_t)vm->globalCount;
+
+    Buffer file;
+    initBuffer(&file);
+    appendBytes(&file, &header, sizeof(header), 1);
+    header.constantsOffset = (uint32_t)appendBytes(&file,
+        writer.constants.bytes, writer.constants.count, CACHE_ALIGN);
+    header.functionsOffset = (uint32_t)appendBytes(&file,
+        writer.functions.bytes, writer.functions.count, CACHE_ALIGN);
+    header.stringsOffset = (uint32_t)appendBytes(&file, writer.strings.bytes,
+        writer.strings.count, CACHE_ALIGN);
+    header.globalsOffset = (uint32_t)appendBytes(&file, globals.bytes,
+        globals.count, CACHE_ALIGN);
+    header.dataOffset = (uint32_t)appendBytes(&file, writer.data.bytes,
+        writer.data.count, CACHE_ALIGN);
+    header.fileSize = (uint32_t)file.count;
+    memcpy(file.bytes, &header, sizeof(header));
+
+    bool written = !writer.failed && file.count <= UINT32_MAX
+        && writeBufferFile(&file, path);
+
+    freeBuffer(&file);
+    freeBuffer(&globals);
+    freeBuffer(&writer.constants);
+    freeBuffer(&writer.functions);
+    freeBuffer(&writer.strings);
+    freeBuffer(&writer.data);
+    freeTable(vm, &writer.stringIndexes);
+    return written;
+}
+
+// A cache file mapped into memory.
+typedef struct {
+    const uint8_t* bytes;
+    const CacheHeader* header;
+    const CacheConstant* constants;
+    const CacheFunction* functions;
+    const CacheString* strings;
+    const uint32_t* globals;
+    const uint8_t* data;
+    size_t dataSize;
+} Reader;
+
+// Return true if a section of count records of the given size lies inside the
+// file, starting on an aligned offset.
+static bool sectionFits(const CacheHeader* header, uint32_t offset,
+    uint32_t count, size_t size)
+{
+    return offset % CACHE_ALIGN == 0 && offset >= sizeof(CacheHeader)
+        && offset <= header->fileSize
+        && (uint64_t)count * size <= header->fileSize - offset;
+}
+
+// Return true if the range of the data section is inside it.
+static bool dataFits(Reader* reader, uint32_t offset, uint64_t size)
+{
+    return offset <= reader->dataSize && size <= reader->dataSize - offset;
+}
+
+// Check the header of a file of the given size, and set up the reader to find
+// each section if the file is a cache for this source.
+static bool openCache(Reader* reader, const uint8_t* bytes, size_t size,
+    const char* source)
+{
+    const CacheHeader* header = (const CacheHeader*)bytes;
+
+    if (size < sizeof(CacheHeader)
+        || memcmp(header->magic, cacheMagic, sizeof(cacheMagic)) != 0
+        || header->version != CACHE_VERSION
+        || header->opcodeCount != OP_RETURN + 1
+        || header->fileSize != size) {
+        return false;
+    }
+
+    size_t length = strlen(source);
+    if (header->sourceLength != length
+        || header->sourceHash != hashSource(source, length)) {
+        return false;
+    }
+
+    if (!sectionFits(header, header->constantsOffset, header->constantCount,
+            sizeof(CacheConstant))
+        || !sectionFits(header, header->functionsOffset,
+            header->functionCount, sizeof(CacheFunction))
+        || !sectionFits(header, header->stringsOffset, header->stringCount,
+            sizeof(CacheString))
+        || !sectionFits(header, header->globalsOffset, header->globalCount,
+            sizeof(uint32_t))
+        || !sectionFits(header, header->dataOffset, 0, 1)
+        || header->functionCount == 0) {
+        return false;
+    }
+
+    reader->bytes = bytes;
+    reader->header = header;
+    reader->constants = (const CacheConstant*)(bytes + header->constantsOffset);
+    reader->functions = (const CacheFunction*)(bytes + header->functionsOffset);
+    reader->strings = (const CacheString*)(bytes + header->stringsOffset);
+    reader->globals = (const uint32_t*)(bytes + header->globalsOffset);
+    reader->data = bytes + header->dataOffset;
+    reader->dataSize = header->fileSize - header->dataOffset;
+    return true;
+}
+
+// Intern the string with the given record index, or return NULL if the record
+// is out of range.
+static ObjString* readString(VM* vm, Reader* reader, uint32_t index)
+{
+    if (index >= reader->header->stringCount)
+        return NULL;
+
+    const CacheString* record = &reader->strings[index];
+    if (record->length > INT32_MAX
+        || !dataFits(reader, record->chars, record->length)) {
+        return NULL;
+    }
+
+    return copyString(vm, (const char*)reader->data + record->chars,
+        (int)record->length);
+}
+
+// Build the function with the given record index. Every function in its
+// constant pool has a higher index, and must already be in functions.
+static ObjFunction* readFunction(VM* vm, Reader* reader, uint32_t index,
+    ObjFunction** functions)
+{
+    const CacheFunction* record = &reader->functions[index];
+
+    if (!dataFits(reader, record->code, record->codeCount)
+        || !dataFits(reader, record->lines,
+            (uint64_t)record->codeCount * sizeof(int))
+        || record->lines % sizeof(int) != 0
+        || record->constants > reader->header->constantCount
+        || record->constantCount
+            > reader->header->constantCount - record->constants) {
+        return NULL;
+    }
+
+    // Objects built here stay in the nursery until the next safepoint, so
+    // they don't need to be rooted while the rest of the file is read.
+    ObjFunction* function = newFunction(vm);
+    FunctionParts parts = {
+        record->arity,
+        record->upvalueCount,
+        record->codeCount,
+        record->constantCount,
+        reader->data + record->code,
+        (const int*)(reader->data + record->lines),
+    };
+    if (!fillFunction(vm, function, &parts))
+        return NULL;
+
+    if (record->name >= 0) {
+        function->name = readString(vm, reader, (uint32_t)record->name);
+        if (function->name == NULL)
+            return NULL;
+    }
+
+    Chunk* chunk = &function->chunk;
+
+    for (uint32_t i = 0; i < record->constantCount; i++) {
+        const CacheConstant* constant = &reader->constants[record->constants + i];
+        Value value;
+
+        switch (constant->type) {
+        case CACHE_NUMBER:
+            value = NUMBER_VAL(constant->number);
+            break;
+        case CACHE_STRING: {
+            ObjString* string = readString(vm, reader, constant->index);
+            if (string == NULL)
+                return NULL;
+            value = OBJ_VAL(string);
+            break;
+        }
+        case CACHE_FUNCTION:
+            if (constant->index <= index
+                || constant->index >= reader->header->functionCount) {
+                return NULL;
+            }
+            value = OBJ_VAL(functions[constant->index]);
+            break;
+        default:
+            return NULL;
+        }
+
+        addConstant(vm, chunk, value);
+    }
+
+    return function;
+}
+
+// Rewrite the global slot operands in the function's bytecode, which were
+// numbered when the cache was written, to the slots of the same names in this
+// VM. Return false if the bytecode can't be walked.
+static bool relocateGlobals(ObjFunction* function, int* slots, int slotCount)
+{
+    Chunk* chunk = &function->chunk;
+    int offset = 0;
+
+    while (offset < chunk->count) {
+        int length = instructionLength(chunk, offset);
+        if (length < 0 || offset + length > chunk->count)
+            return false;
+
+        uint8_t instruction = chunk->code[offset];
+        if (instruction == OP_DEFINE_GLOBAL || instruction == OP_GET_GLOBAL) {
+            int slot = chunk->code[offset + 1] << 8 | chunk->code[offset + 2];
+            if (slot >= slotCount)
+                return false;
+
+            chunk->code[offset + 1] = (uint8_t)(slots[slot] >> 8);
+            chunk->code[offset + 2] = (uint8_t)slots[slot];
+        }
+
+        offset += length;
+    }
+
+    return true;
+}
+
+// Build the function tree of a valid cache file, or return NULL if any record
+// in it is malformed.
+static ObjFunction* readCache(VM* vm, Reader* reader)
+{
+    const CacheHeader* header = reader->header;
+    ObjFunction* script = NULL;
+
+    int* slots = malloc(sizeof(int) * (header->globalCount + 1));
+    ObjFunction** functions = malloc(sizeof(ObjFunction*)
+        * header->functionCount);
+    if (slots == NULL || functions == NULL)
+        exit(1);
+
+    // Look up the global names first so that in a fresh VM they are given
+    // the same slots as when the cache was written, and nothing needs
+    // relocating.
+    bool relocate = false;
+    for (uint32_t i = 0; i < header->globalCount; i++) {
+        ObjString* name = readString(vm, reader, reader->globals[i]);
+        slots[i] = name == NULL ? -1 : globalSlot(vm, name);
+        if (slots[i] < 0)
+            goto done;
+
+        relocate = relocate || slots[i] != (int)i;
+    }
+
+    for (uint32_t i = header->functionCount; i > 0; i--) {
+        functions[i - 1] = readFunction(vm, reader, i - 1, functions);
+        if (functions[i - 1] == NULL)
+            goto done;
+    }
+
+    if (relocate) {
+        for (uint32_t i = 0; i < header->functionCount; i++) {
+            if (!relocateGlobals(functions[i], slots, (int)header->globalCount))
+                goto done;
+        }
+    }
+
+    script = functions[0];
+
+done:
+    free(slots);
+    free(functions);
+    return script;
+}
+
+// Load the script compiled from the source out of the cache file at the path.
+// Return NULL if there's no cache file, or it was written for different source
+// or by a different version of the interpreter.
+ObjFunction* loadCache(VM* vm, const char* path, const char* source)
+{
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return NULL;
+
+    struct stat status;
+    if (fstat(fd, &status) != 0 || status.st_size < (off_t)sizeof(CacheHeader)) {
+        close(fd);
+        return NULL;
+    }
+
+    size_t size = (size_t)status.st_size;
+    void* bytes = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (bytes == MAP_FAILED)
+        return NULL;
+
+    Reader reader;
+    ObjFunction* function = NULL;
+    if (openCache(&reader, bytes, size, source))
+        function = readCache(vm, &reader);
+
+    munmap(bytes, size);
+    return function;
+}
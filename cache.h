@@ -0,0 +1,89 @@
+#ifndef clisp_cache_h
+#define clisp_cache_h
+
+#include "common.h"
+#include "object.h"
+#include <stdint.h>
+
+// Increase whenever the layout of a cache file, or the meaning of any
+// bytecode, changes so that older cache files are compiled again. Checking the
+// number of opcodes only catches opcodes being added or removed, not a change
+// to their operands.
+//
+// 2: the coroutine and iterator opcodes.
+#define CACHE_VERSION 2
+
+// Header at the start of a bytecode cache file.
+//
+// The rest of the file is made of fixed size records, followed by one data
+// section holding bytecode, line numbers and string characters. Every offset
+// is from the start of the file, or of the data section for offsets stored in
+// records, so the file can be mapped into memory and read in place.
+typedef struct {
+    char magic[4];
+    uint16_t version;
+
+    // Number of opcodes the writer knew about, as a second guard against
+    // reading bytecode from a different build of the interpreter.
+    uint16_t opcodeCount;
+
+    // Hash and length of the source the cache was compiled from.
+    uint64_t sourceHash;
+    uint64_t sourceLength;
+
+    uint32_t fileSize;
+    uint32_t constantCount;
+    uint32_t functionCount;
+    uint32_t stringCount;
+    uint32_t globalCount;
+
+    uint32_t constantsOffset;
+    uint32_t functionsOffset;
+    uint32_t stringsOffset;
+    uint32_t globalsOffset;
+    uint32_t dataOffset;
+} CacheHeader;
+
+// The kinds of value that the compiler places in constant pools.
+typedef enum {
+    CACHE_NUMBER,
+    CACHE_STRING,
+    CACHE_FUNCTION,
+} CacheConstantType;
+
+// A constant pool entry. index refers to the string or function records.
+typedef struct {
+    uint32_t type;
+    uint32_t index;
+    double number;
+} CacheConstant;
+
+// A compiled function. The script itself is always the first record, and
+// nested functions always come after the function whose constants hold them.
+typedef struct {
+    int32_t arity;
+    int32_t upvalueCount;
+
+    // Index of the name in the string records, or -1 for the script.
+    int32_t name;
+
+    uint32_t codeCount;
+    uint32_t code;
+    uint32_t lines;
+
+    // Range of this function's entries in the constant records.
+    uint32_t constantCount;
+    uint32_t constants;
+} CacheFunction;
+
+// A string, stored in the data section without a terminator.
+typedef struct {
+    uint32_t chars;
+    uint32_t length;
+} CacheString;
+
+ObjFunction* loadCache(VM* vm, const char* path, const char* source);
+bool writeCache(VM* vm, const char* path, const char* source,
+    ObjFunction* function);
+
+#endif
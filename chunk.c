@@ -4,6 +4,7 @@
 
 #include "chunk.h"
 #include "memory.h"
+#include "object.h"
 #include "value.h"
 #include "vm.h"
 
@@ -18,14 +19,14 @@ void initChunk(Chunk* chunk)
 }
 
 // writeChunk writes a byte to the given Chunk.
-void writeChunk(Chunk* chunk, uint8_t byte, int line)
+void writeChunk(VM* vm, Chunk* chunk, uint8_t byte, int line)
 {
     if (chunk->capacity < chunk->count + 1) {
         int oldCapacity = chunk->capacity;
         chunk->capacity = (int)GROW_CAPACITY(oldCapacity);
-        chunk->code = GROW_ARRAY(uint8_t, chunk->code, oldCapacity,
+        chunk->code = GROW_ARRAY(vm, uint8_t, chunk->code, oldCapacity,
             chunk->capacity);
-        chunk->lines = GROW_ARRAY(int, chunk->lines, oldCapacity,
+        chunk->lines = GROW_ARRAY(vm, int, chunk->lines, oldCapacity,
             chunk->capacity);
     }
 
@@ -41,19 +42,79 @@ void overwriteLast(Chunk* chunk, uint8_t byte)
 }
 
 // freeChunk frees any allocated memory associated with a Chunk.
-void freeChunk(Chunk* chunk)
+void freeChunk(VM* vm, Chunk* chunk)
 {
-    FREE_ARRAY(uint8_t, chunk->code, chunk->capacity);
-    FREE_ARRAY(int, chunk->lines, chunk->capacity);
-    freeValueArray(&chunk->constants);
+    FREE_ARRAY(vm, uint8_t, chunk->code, chunk->capacity);
+    FREE_ARRAY(vm, int, chunk->lines, chunk->capacity);
+    freeValueArray(vm, &chunk->constants);
     initChunk(chunk);
 }
 
 // addConstant adds another constant to the provided Chunk.
-int addConstant(Chunk* chunk, Value value)
+int addConstant(VM* vm, Chunk* chunk, Value value)
 {
-    push(value);
-    writeValueArray(&chunk->constants, value);
-    pop();
+    push(vm, value);
+    writeValueArray(vm, &chunk->constants, value);
+    pop(vm);
     return chunk->constants.count - 1;
 }
+
+// Return the number of bytes taken by the instruction at the offset, or -1 if
+// the byte there is not an opcode.
+int instructionLength(Chunk* chunk, int offset)
+{
+    switch (chunk->code[offset]) {
+    case OP_NULL:
+    case OP_TRUE:
+    case OP_FALSE:
+    case OP_POP:
+    case OP_CLOSE_UPVALUE:
+    case OP_BINARY_ADD:
+    case OP_BINARY_SUBTRACT:
+    case OP_BINARY_MULTIPLY:
+    case OP_BINARY_DIVIDE:
+    case OP_YIELD:
+    case OP_RESUME:
+    case OP_ITERATE:
+    case OP_RETURN:
+        return 1;
+    case OP_CONSTANT:
+    case OP_DEFINE_LOCAL:
+    case OP_GET_LOCAL:
+    case OP_GET_UPVALUE:
+    case OP_CALL:
+    case OP_TAIL_CALL:
+    case OP_ADD:
+    case OP_SUBTRACT:
+    case OP_MULTIPLY:
+    case OP_DIVIDE:
+    case OP_LESS:
+    case OP_GREATER:
+    case OP_EQUAL:
+        return 2;
+    case OP_DEFINE_GLOBAL:
+    case OP_GET_GLOBAL:
+    case OP_JUMP_FALSE:
+    case OP_JUMP:
+    case OP_LOOP:
+    case OP_LESS_JUMP_FALSE:
+    case OP_GREATER_JUMP_FALSE:
+    case OP_EQUAL_JUMP_FALSE:
+    case OP_POP_JUMP_FALSE:
+    case OP_ITERATE_NEXT:
+        return 3;
+    case OP_CLOSURE: {
+        if (offset + 1 >= chunk->count
+            || chunk->code[offset + 1] >= chunk->constants.count)
+            return -1;
+
+        Value constant = chunk->constants.values[chunk->code[offset + 1]];
+        if (!IS_FUNCTION(constant))
+            return -1;
+
+        return 2 + 2 * AS_FUNCTION(constant)->upvalueCount;
+    }
+    default:
+        return -1;
+    }
+}
@@ -22,11 +22,27 @@ typedef enum {
     OP_JUMP,
     OP_LOOP,
     OP_CALL,
+    OP_TAIL_CALL,
     OP_ADD,
     OP_SUBTRACT,
     OP_MULTIPLY,
     OP_DIVIDE,
+    OP_BINARY_ADD,
+    OP_BINARY_SUBTRACT,
+    OP_BINARY_MULTIPLY,
+    OP_BINARY_DIVIDE,
+    OP_LESS,
+    OP_GREATER,
+    OP_EQUAL,
+    OP_LESS_JUMP_FALSE,
+    OP_GREATER_JUMP_FALSE,
+    OP_EQUAL_JUMP_FALSE,
+    OP_POP_JUMP_FALSE,
     OP_CLOSURE,
+    OP_YIELD,
+    OP_RESUME,
+    OP_ITERATE,
+    OP_ITERATE_NEXT,
     OP_RETURN,
 } OpCode;
 
@@ -49,9 +65,10 @@ typedef struct {
 } Chunk;
 
 void initChunk(Chunk* chunk);
-void writeChunk(Chunk* chunk, uint8_t byte, int line);
+void writeChunk(VM* vm, Chunk* chunk, uint8_t byte, int line);
 void overwriteLast(Chunk* chnk, uint8_t byte);
-int addConstant(Chunk* chunk, Value value);
-void freeChunk(Chunk* chunk);
+int addConstant(VM* vm, Chunk* chunk, Value value);
+void freeChunk(VM* vm, Chunk* chunk);
+int instructionLength(Chunk* chunk, int offset);
 
 #endif
@@ -4,6 +4,7 @@
 #include <stdbool.h>
 #include <stddef.h>
 #include <stdint.h>
+#include <time.h>
 
 // Change Value representation to be contained within a double type.
 // When not defined, uses a tagged union to represent data.
@@ -22,7 +23,18 @@
 // Print information to the console when garbage collection is called.
 // #define DEBUG_LOG_GC
 
+// State of an interpreter, defined in vm.h.
+typedef struct VM VM;
+
 // Maximum number of Values that can be represented in an array of size UINT8_MAX.
 #define UINT8_COUNT (UINT8_MAX + 1)
 
+// Return the time in nanoseconds from an arbitrary start.
+static inline uint64_t nanoseconds(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000u + (uint64_t)now.tv_nsec;
+}
+
 #endif
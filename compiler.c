@@ -17,8 +17,19 @@
 #include "debug.h"
 #endif
 
-// Representation of the current state of the parser.
-typedef struct {
+struct Compiler;
+
+// Representation of the current state of the parser->
+typedef struct Parser {
+    // The VM that compiled functions are allocated in.
+    VM* vm;
+
+    // Scanner for the source being compiled.
+    Scanner scanner;
+
+    // Compiler for the innermost function being compiled.
+    struct Compiler* compiler;
+
     // The most recent token from scanToken.
     Token current;
 
@@ -36,7 +47,17 @@ typedef struct {
     int lParenCount;
 } Parser;
 
-static void expression(void);
+static void expression(Parser* parser);
+
+// A list of jump instructions that have the same destination, which is not
+// known until later in compilation.
+typedef struct {
+    // Offsets of the jump operands to be patched.
+    int offsets[UINT8_COUNT];
+
+    // Number of jumps in the list.
+    int count;
+} JumpList;
 
 // Local is the compiler's representation of a local variable that will exist
 // on the stack.
@@ -94,30 +115,31 @@ typedef struct Compiler {
     // Collection of Upvalues.
     Upvalue upvalues[UINT8_COUNT];
 
+    // Offsets of the calls made by the expression currently being compiled
+    // in a function body, which are checked for tail position once the body
+    // is complete.
+    int calls[UINT8_COUNT];
+
+    // Number of offsets in calls.
+    int callCount;
+
     // How many scopes enclose this one.
     int scopeDepth;
 } Compiler;
 
-// Single instance parser and chunks.
-// - replace these as args passed to functions in order to support concurrent
-//   parser usage for embedding.
-Parser parser;
-Compiler* current = NULL;
-Chunk* compilingChunk;
-
 // Should be useful later, when compiling separate chunks for each function.
-static Chunk* currentChunk(void)
+static Chunk* currentChunk(Parser* parser)
 {
-    return &current->function->chunk;
+    return &parser->compiler->function->chunk;
 }
 
 // Print a structured error message to stderr that lets the user know what the
 // error is and where it took place (line number and offending token).
-static void errorAt(Token* token, const char* message)
+static void errorAt(Parser* parser, Token* token, const char* message)
 {
-    if (parser.panicMode)
+    if (parser->panicMode)
         return;
-    parser.panicMode = true;
+    parser->panicMode = true;
 
     fprintf(stderr, "[line %d] Error", token->line);
 
@@ -130,135 +152,155 @@ static void errorAt(Token* token, const char* message)
     }
 
     fprintf(stderr, ": %s\n", message);
-    parser.hadError = true;
+    parser->hadError = true;
 }
 
 // Wrapper around errorAt to output an error message for the token currently
 // being compiled.
-static void error(const char* message)
+static void error(Parser* parser, const char* message)
 {
-    errorAt(&parser.previous, message);
+    errorAt(parser, &parser->previous, message);
 }
 
 // Wrapper around errorAt to output an error message for the next token to be
 // compiled.
-static void errorAtCurrent(const char* message)
+static void errorAtCurrent(Parser* parser, const char* message)
 {
-    errorAt(&parser.current, message);
+    errorAt(parser, &parser->current, message);
 }
 
 // Move to the next token generated by the scanner in order to compile it.
-static void advance(void)
+static void advance(Parser* parser)
 {
-    parser.previous = parser.current;
+    parser->previous = parser->current;
 
     for (;;) {
-        parser.current = scanToken();
-        if (parser.current.type != TOKEN_ERROR)
+        parser->current = scanToken(&parser->scanner);
+        if (parser->current.type != TOKEN_ERROR)
             break;
-        errorAtCurrent(parser.current.start);
+        errorAtCurrent(parser, parser->current.start);
     }
 }
 
-// Used to conditionally advance to the next token, only if parser.current is of
+// Used to conditionally advance to the next token, only if parser->current is of
 // the provided token type.
-static void consume(TokenType type, const char* message)
+static void consume(Parser* parser, TokenType type, const char* message)
 {
-    if (parser.current.type == type) {
-        advance();
+    if (parser->current.type == type) {
+        advance(parser);
         return;
     }
 
-    errorAtCurrent(message);
+    errorAtCurrent(parser, message);
 }
 
 // Is the next token to be compiled of the given type?
-static bool check(TokenType type)
+static bool check(Parser* parser, TokenType type)
 {
-    return parser.current.type == type;
+    return parser->current.type == type;
 }
 
 // If the next token is of the provided token type, consume it and return true.
-static bool match(TokenType type)
+static bool match(Parser* parser, TokenType type)
 {
-    if (!check(type))
+    if (!check(parser, type))
         return false;
-    advance();
+    advance(parser);
     return true;
 }
 
 // Write a byte to the current chunk, along with accurate line information.
-static void emitByte(uint8_t byte)
+static void emitByte(Parser* parser, uint8_t byte)
 {
-    writeChunk(currentChunk(), byte, parser.previous.line);
+    writeChunk(parser->vm, currentChunk(parser), byte, parser->previous.line);
 }
 
 // Wrapper around emitByte for emitting two bytes at once. Added purely as a
 // convenience for implementation.
-static void emitBytes(uint8_t byte1, uint8_t byte2)
+static void emitBytes(Parser* parser, uint8_t byte1, uint8_t byte2)
 {
-    emitByte(byte1);
-    emitByte(byte2);
+    emitByte(parser, byte1);
+    emitByte(parser, byte2);
 }
 
 // Wrapper around emitByte for emitting an OP_RETURN byte.
-static void emitReturn(void)
+static void emitReturn(Parser* parser)
 {
-    overwriteLast(currentChunk(), OP_RETURN);
+    overwriteLast(currentChunk(parser), OP_RETURN);
 }
 
 // Emit a jump instruction with a dummy value, with all bits set to 1.
 // This allows it to be replaced with bitwise and operations.
-static int emitJump(uint8_t instruction)
+static int emitJump(Parser* parser, uint8_t instruction)
 {
-    emitByte(instruction);
-    emitByte(0xff);
-    emitByte(0xff);
-    return currentChunk()->count - 2;
+    emitByte(parser, instruction);
+    emitByte(parser, 0xff);
+    emitByte(parser, 0xff);
+    return currentChunk(parser)->count - 2;
 }
 
 // Replace the jump instruction at the provided offset with the current
 // location.
-static void patchJump(int offset)
+static void patchJump(Parser* parser, int offset)
 {
     // -2 to get before the jump offset operand
-    int jump = currentChunk()->count - offset - 2;
+    int jump = currentChunk(parser)->count - offset - 2;
 
     if (jump > UINT16_MAX) {
-        error("Too much code to jump over.");
+        error(parser, "Too much code to jump over.");
     }
 
     // bit manipulation to replace the two 8 bit numbers with a 16 bit number.
     // 8 bits at a time, only keep the bytes that are set to 1.
-    currentChunk()->code[offset] = (uint8_t)(jump >> 8) & 0xff;
-    currentChunk()->code[offset + 1] = (uint8_t)jump & 0xff;
+    currentChunk(parser)->code[offset] = (uint8_t)(jump >> 8) & 0xff;
+    currentChunk(parser)->code[offset + 1] = (uint8_t)jump & 0xff;
 }
 
 // Emit a loop instruction that will jump back to the provided offset.
-static void emitLoop(int loopStart)
+static void emitLoop(Parser* parser, int loopStart)
 {
-    emitByte(OP_LOOP);
+    emitByte(parser, OP_LOOP);
 
-    int offset = currentChunk()->count - loopStart + 2;
+    int offset = currentChunk(parser)->count - loopStart + 2;
 
     if (offset > UINT16_MAX) {
-        error("Loop body too large.");
+        error(parser, "Loop body too large.");
+    }
+
+    emitByte(parser, (uint8_t)(offset >> 8) & 0xff);
+    emitByte(parser, (uint8_t)offset & 0xff);
+}
+
+// Add a jump instruction's offset to the list of jumps with a shared
+// destination.
+static void addJump(Parser* parser, JumpList* jumps, int offset)
+{
+    if (jumps->count == UINT8_COUNT) {
+        error(parser, "Too many branches in condition.");
+        return;
     }
 
-    emitByte((uint8_t)(offset >> 8) & 0xff);
-    emitByte((uint8_t)offset & 0xff);
+    jumps->offsets[jumps->count++] = offset;
+}
+
+// Replace every jump in the list with the current location.
+static void patchJumps(Parser* parser, JumpList* jumps)
+{
+    for (int i = 0; i < jumps->count; i++) {
+        patchJump(parser, jumps->offsets[i]);
+    }
 }
 
 // Add the provided value as a constant to the current chunk, returning its
 // index in the constant pool.
 //
 // todo: check for identical constants and return its index instead.
-static uint8_t makeConstant(Value value)
+static uint8_t makeConstant(Parser* parser, Value value)
 {
-    int constant = addConstant(currentChunk(), value);
+    int constant = addConstant(parser->vm, currentChunk(parser), value);
 
     if (constant > UINT8_MAX) {
-        error("Too many constants in one chunk.");
+        error(parser, "Too many constants in one chunk.");
         return 0;
     }
 
@@ -269,27 +311,28 @@ static uint8_t makeConstant(Value value)
 //
 // Add the given constant to the chunk's constant pool, and add the bytecode
 // needed to push the value onto the VM's stack.
-static void emitConstant(Value value)
+static void emitConstant(Parser* parser, Value value)
 {
-    emitBytes(OP_CONSTANT, makeConstant(value));
+    emitBytes(parser, OP_CONSTANT, makeConstant(parser, value));
 }
 
 // Set the zero value of all the fields in a compiler.
-static void initCompiler(Compiler* compiler, FunctionType type)
+static void initCompiler(Parser* parser, Compiler* compiler, FunctionType type)
 {
-    compiler->enclosing = current;
+    compiler->enclosing = parser->compiler;
     compiler->function = NULL;
     compiler->type = type;
     compiler->localCount = 0;
+    compiler->callCount = 0;
     compiler->scopeDepth = 0;
-    compiler->function = newFunction();
-    current = compiler;
+    compiler->function = newFunction(parser->vm);
+    parser->compiler = compiler;
 
     if (type != TYPE_SCRIPT) {
-        current->function->name = copyString("lambda", 6);
+        parser->compiler->function->name = copyString(parser->vm, "lambda", 6);
     }
 
-    Local* local = &current->locals[current->localCount++];
+    Local* local = &parser->compiler->locals[parser->compiler->localCount++];
     local->depth = 0;
     local->name.start = "";
     local->name.length = 0;
@@ -297,132 +340,317 @@ static void initCompiler(Compiler* compiler, FunctionType type)
 
 // Currently used for debug purposes and emitting a final return, to be updated
 // in the future.
-static ObjFunction* endCompiler(void)
+static ObjFunction* endCompiler(Parser* parser)
 {
-    emitReturn();
-    ObjFunction* function = current->function;
+    emitReturn(parser);
+    ObjFunction* function = parser->compiler->function;
 
 #ifdef DEBUG_PRINT_CODE
-    if (!parser.hadError) {
-        disassembleChunk(currentChunk(), function->name != NULL ? function->name->chars : "<script>");
+    if (!parser->hadError) {
+        disassembleChunk(parser->vm, currentChunk(parser),
+            function->name != NULL ? function->name->chars : "<script>");
     }
 #endif
 
-    current = current->enclosing;
+    parser->compiler = parser->compiler->enclosing;
     return function;
 }
 
 // Add one to the scope depth, used to track the nesting depth of local
 // variables.
-static void beginScope(void)
+static void beginScope(Parser* parser)
 {
-    current->scopeDepth++;
+    parser->compiler->scopeDepth++;
 }
 
 // Emit an instruction to retrieve the constant number value and place it on
 // the stack.
-static void number(void)
+static void number(Parser* parser)
 {
-    double value = strtod(parser.previous.start, NULL);
-    emitConstant(NUMBER_VAL(value));
+    double value = strtod(parser->previous.start, NULL);
+    emitConstant(parser, NUMBER_VAL(value));
 }
 
-static uint8_t parseVariable(const char* message);
-static void defineVariable(uint8_t index);
+static int parseVariable(Parser* parser, const char* message);
+static void defineVariable(Parser* parser, int index);
+
+// Turn the calls whose result is returned straight from the function being
+// compiled into tail calls. A call is in tail position when the instruction
+// after it is the final OP_POP of the body (which endCompiler rewrites into
+// OP_RETURN), or a jump, or chain of jumps, that lands on it.
+static void markTailCalls(Parser* parser)
+{
+    Chunk* chunk = currentChunk(parser);
+    int end = chunk->count - 1;
+
+    for (int i = 0; i < parser->compiler->callCount; i++) {
+        int offset = parser->compiler->calls[i];
+        int next = offset + 2;
+
+        while (next < end && chunk->code[next] == OP_JUMP) {
+            next += 3 + ((chunk->code[next + 1] << 8) | chunk->code[next + 2]);
+        }
+
+        if (next == end) {
+            chunk->code[offset] = OP_TAIL_CALL;
+        }
+    }
+}
 
 // Compile a function object from a lambda definition, emit bytes that will
 // convert the function to a closure at runtime.
-static void lambda(void)
+static void lambda(Parser* parser)
 {
     Compiler compiler;
-    initCompiler(&compiler, TYPE_FUNCTION);
-    beginScope();
+    initCompiler(parser, &compiler, TYPE_FUNCTION);
+    beginScope(parser);
 
-    consume(TOKEN_LEFT_PAREN, "Expect '(' after lambda keyword\n");
+    consume(parser, TOKEN_LEFT_PAREN, "Expect '(' after lambda keyword\n");
 
-    while (!match(TOKEN_RIGHT_PAREN)) {
-        current->function->arity++;
-        if (current->function->arity > 255) {
-            errorAtCurrent("Can't have more than 255 parameters\n");
+    while (!match(parser, TOKEN_RIGHT_PAREN)) {
+        parser->compiler->function->arity++;
+        if (parser->compiler->function->arity > 255) {
+            errorAtCurrent(parser, "Can't have more than 255 parameters\n");
         }
 
-        parseVariable("Expect parameter name\n");
+        parseVariable(parser, "Expect parameter name\n");
     }
 
-    while (!match(TOKEN_RIGHT_PAREN)) {
-        expression();
-        emitByte(OP_POP);
+    while (!match(parser, TOKEN_RIGHT_PAREN)) {
+        // Only calls in the final expression can be in tail position.
+        parser->compiler->callCount = 0;
+        expression(parser);
+        emitByte(parser, OP_POP);
     }
 
-    ObjFunction* function = endCompiler();
-    emitBytes(OP_CLOSURE, makeConstant(OBJ_VAL(function)));
+    markTailCalls(parser);
+    ObjFunction* function = endCompiler(parser);
+    emitBytes(parser, OP_CLOSURE, makeConstant(parser, OBJ_VAL(function)));
 
     for (int i = 0; i < function->upvalueCount; i++) {
-        emitByte(compiler.upvalues[i].isLocal ? 1 : 0);
-        emitByte(compiler.upvalues[i].index);
+        emitByte(parser, compiler.upvalues[i].isLocal ? 1 : 0);
+        emitByte(parser, compiler.upvalues[i].index);
     }
 }
 
-// Compile an if expression, with an optional else value (defaults to null).
-static void ifExpr(void)
+static int resolveLocal(Compiler* compiler, Token* name);
+static int resolveUpvalue(Parser* parser, Compiler* compiler, Token* name);
+static int addLocal(Parser* parser, Token name);
+static void condition(Parser* parser, JumpList* falseJumps);
+static void synchronize(Parser* parser);
+static uint8_t parseArgs(Parser* parser);
+static void parseExpression(Parser* parser);
+
+// Return the instruction for the comparison operator named by the given token,
+// or -1 if the token is not a comparison operator. Operators that have been
+// shadowed by a local variable are called like any other function.
+static int comparisonOp(Parser* parser, Token* name)
+{
+    if (name->type != TOKEN_IDENTIFIER || name->length != 1)
+        return -1;
+
+    int op;
+    switch (name->start[0]) {
+    case '<':
+        op = OP_LESS;
+        break;
+    case '>':
+        op = OP_GREATER;
+        break;
+    case '=':
+        op = OP_EQUAL;
+        break;
+    default:
+        return -1;
+    }
+
+    if (resolveLocal(parser->compiler, name) != -1
+        || resolveUpvalue(parser, parser->compiler, name) != -1) {
+        return -1;
+    }
+
+    return op;
+}
+
+// Compile a comparison used as a condition. With two operands the comparison
+// and the jump are fused into one instruction that leaves nothing on the stack.
+static void conditionCompare(Parser* parser, uint8_t compareOp,
+    JumpList* falseJumps)
+{
+    uint8_t argCount = parseArgs(parser);
+
+    if (argCount != 2) {
+        emitBytes(parser, compareOp, argCount);
+        addJump(parser, falseJumps, emitJump(parser, OP_POP_JUMP_FALSE));
+        return;
+    }
+
+    switch (compareOp) {
+    case OP_LESS:
+        addJump(parser, falseJumps, emitJump(parser, OP_LESS_JUMP_FALSE));
+        break;
+    case OP_GREATER:
+        addJump(parser, falseJumps, emitJump(parser, OP_GREATER_JUMP_FALSE));
+        break;
+    default:
+        addJump(parser, falseJumps, emitJump(parser, OP_EQUAL_JUMP_FALSE));
+        break;
+    }
+}
+
+// Compile an and expression used as a condition. Every operand is compiled as a
+// condition itself, jumping straight to the false destination when it fails.
+static void conditionAnd(Parser* parser, JumpList* falseJumps)
+{
+    while (!match(parser, TOKEN_RIGHT_PAREN)) {
+        if (check(parser, TOKEN_EOF)) {
+            error(parser, "Unexpected end of file");
+            return;
+        }
+
+        condition(parser, falseJumps);
+    }
+}
+
+// Compile an or expression used as a condition. A passing operand jumps past
+// the remaining operands, a failing one falls through to the next. Only the
+// final operand can jump to the false destination.
+static void conditionOr(Parser* parser, JumpList* falseJumps)
+{
+    if (match(parser, TOKEN_RIGHT_PAREN)) {
+        // An empty or is always false.
+        addJump(parser, falseJumps, emitJump(parser, OP_JUMP));
+        return;
+    }
+
+    JumpList trueJumps;
+    trueJumps.count = 0;
+
+    for (;;) {
+        if (check(parser, TOKEN_EOF)) {
+            error(parser, "Unexpected end of file");
+            return;
+        }
+
+        JumpList operandJumps;
+        operandJumps.count = 0;
+        condition(parser, &operandJumps);
+
+        if (match(parser, TOKEN_RIGHT_PAREN)) {
+            for (int i = 0; i < operandJumps.count; i++) {
+                addJump(parser, falseJumps, operandJumps.offsets[i]);
+            }
+            break;
+        }
+
+        addJump(parser, &trueJumps, emitJump(parser, OP_JUMP));
+        patchJumps(parser, &operandJumps);
+    }
+
+    patchJumps(parser, &trueJumps);
+}
+
+// Compile the condition of an if or while expression. Rather than leaving a
+// value on the stack, the compiled condition falls through when truthy and
+// jumps when falsey, with each jump added to falseJumps for the caller to
+// patch. Comparisons, and, and or are compiled directly into branches so that
+// no boolean value is created for them.
+static void condition(Parser* parser, JumpList* falseJumps)
 {
-    expression();
+    advance(parser);
+
+    if (parser->previous.type == TOKEN_LEFT_PAREN) {
+        Token operator = parser->current;
+        int compareOp = comparisonOp(parser, &operator);
+
+        if (operator.type == TOKEN_AND || operator.type == TOKEN_OR
+            || compareOp != -1) {
+            parser->lParenCount++;
+            advance(parser);
+
+            if (operator.type == TOKEN_AND) {
+                conditionAnd(parser, falseJumps);
+            } else if (operator.type == TOKEN_OR) {
+                conditionOr(parser, falseJumps);
+            } else {
+                conditionCompare(parser, (uint8_t)compareOp, falseJumps);
+            }
+
+            parser->lParenCount--;
+
+            if (parser->panicMode)
+                synchronize(parser);
+            return;
+        }
+    }
 
-    int thenJump = emitJump(OP_JUMP_FALSE);
+    parseExpression(parser);
 
-    emitByte(OP_POP);
-    expression();
+    if (parser->panicMode)
+        synchronize(parser);
 
-    int elseJump = emitJump(OP_JUMP);
-    patchJump(thenJump);
+    addJump(parser, falseJumps, emitJump(parser, OP_POP_JUMP_FALSE));
+}
+
+// Compile an if expression, with an optional else value (defaults to null).
+static void ifExpr(Parser* parser)
+{
+    JumpList elseJumps;
+    elseJumps.count = 0;
+    condition(parser, &elseJumps);
+
+    expression(parser);
 
-    emitByte(OP_POP);
-    if (match(TOKEN_RIGHT_PAREN)) {
-        emitByte(OP_NULL);
+    int endJump = emitJump(parser, OP_JUMP);
+    patchJumps(parser, &elseJumps);
+
+    if (match(parser, TOKEN_RIGHT_PAREN)) {
+        emitByte(parser, OP_NULL);
     } else {
-        expression();
-        consume(TOKEN_RIGHT_PAREN, "Expect ')' at end of if expression.");
+        expression(parser);
+        consume(parser, TOKEN_RIGHT_PAREN,
+            "Expect ')' at end of if expression.");
     }
 
-    patchJump(elseJump);
+    patchJump(parser, endJump);
 }
 
 // Compile an and expression, which executes expressions until one is falsey,
 // at which point it skips the remaining expressions and returns the falsey
 // value. If none are falsey then the final expression is returned.
-static void and_(void)
+static void and_(Parser* parser)
 {
     int operandCount = 0;
     int jumps[UINT8_MAX];
 
-    while (parser.current.type != TOKEN_RIGHT_PAREN) {
-        if (parser.current.type == TOKEN_EOF) {
-            error("Unexpected end of file");
+    while (parser->current.type != TOKEN_RIGHT_PAREN) {
+        if (parser->current.type == TOKEN_EOF) {
+            error(parser, "Unexpected end of file");
             return;
         }
 
         if (operandCount > UINT8_MAX) {
-            error("Too many arguments in s-expression.");
+            error(parser, "Too many arguments in s-expression.");
             return;
         }
 
-        expression();
+        expression(parser);
 
-        int jump = emitJump(OP_JUMP_FALSE);
+        int jump = emitJump(parser, OP_JUMP_FALSE);
         jumps[operandCount++] = jump;
-        emitByte(OP_POP);
+        emitByte(parser, OP_POP);
     }
 
-    currentChunk()->count--;
+    currentChunk(parser)->count--;
 
     for (int i = 0; i < operandCount; i++) {
-        patchJump(jumps[i]);
+        patchJump(parser, jumps[i]);
     }
 
     if (operandCount == 0) {
-        emitByte(OP_TRUE);
+        emitByte(parser, OP_TRUE);
     }
-    advance();
+    advance(parser);
 
     return;
 }
@@ -430,42 +658,42 @@ static void and_(void)
 // Compile an or expression, which executes expressions until one is thruthy,
 // at which point it skips the remaining expressions and returns the truthy
 // value. If none are truthy then the final expression is returned.
-static void or_(void)
+static void or_(Parser* parser)
 {
     int operandCount = 0;
     int jumps[UINT8_MAX];
 
-    while (parser.current.type != TOKEN_RIGHT_PAREN) {
-        if (parser.current.type == TOKEN_EOF) {
-            error("Unexpected end of file");
+    while (parser->current.type != TOKEN_RIGHT_PAREN) {
+        if (parser->current.type == TOKEN_EOF) {
+            error(parser, "Unexpected end of file");
             return;
         }
 
         if (operandCount > UINT8_MAX) {
-            error("Too many arguments in s-expression.");
+            error(parser, "Too many arguments in s-expression.");
             return;
         }
 
-        expression();
+        expression(parser);
 
-        int jumpFalse = emitJump(OP_JUMP_FALSE);
-        int jump = emitJump(OP_JUMP);
+        int jumpFalse = emitJump(parser, OP_JUMP_FALSE);
+        int jump = emitJump(parser, OP_JUMP);
         jumps[operandCount++] = jump;
 
-        patchJump(jumpFalse);
-        emitByte(OP_POP);
+        patchJump(parser, jumpFalse);
+        emitByte(parser, OP_POP);
     }
 
-    currentChunk()->count--;
+    currentChunk(parser)->count--;
 
     for (int i = 0; i < operandCount; i++) {
-        patchJump(jumps[i]);
+        patchJump(parser, jumps[i]);
     }
 
     if (operandCount == 0) {
-        emitByte(OP_FALSE);
+        emitByte(parser, OP_FALSE);
     }
-    advance();
+    advance(parser);
 
     return;
 }
@@ -473,40 +701,97 @@ static void or_(void)
 // Compiles a while expression, which always returns a null value.
 // Repeatedly executes the provided expressions until the condition expression
 // evaluates to a falsey value.
-static void while_(void)
+static void while_(Parser* parser)
+{
+    int loopStart = currentChunk(parser)->count;
+
+    JumpList exitJumps;
+    exitJumps.count = 0;
+    condition(parser, &exitJumps);
+
+    while (parser->current.type != TOKEN_RIGHT_PAREN) {
+        expression(parser);
+        emitByte(parser, OP_POP);
+    }
+
+    emitLoop(parser, loopStart);
+    patchJumps(parser, &exitJumps);
+    emitByte(parser, OP_NULL);
+    advance(parser);
+}
+
+// Discard the locals above the given count, closing any that have been
+// captured by a closure.
+static void popLocals(Parser* parser, int localCount)
 {
-    int loopStart = currentChunk()->count;
-    expression();
+    Compiler* compiler = parser->compiler;
+
+    while (compiler->localCount > localCount) {
+        if (compiler->locals[compiler->localCount - 1].isCaptured) {
+            emitByte(parser, OP_CLOSE_UPVALUE);
+        } else {
+            emitByte(parser, OP_POP);
+        }
+        compiler->localCount--;
+    }
+}
 
-    int endJump = emitJump(OP_JUMP_FALSE);
-    emitByte(OP_POP);
+// Compiles a for expression, which always returns a null value.
+// (for x sequence body...) executes the body once for each value of a list or
+// sequence, with x bound to the value. Locals defined by the body only last
+// for one iteration, so closures created by the body each capture a separate
+// x.
+static void for_(Parser* parser)
+{
+    consume(parser, TOKEN_IDENTIFIER, "Expect variable name after for.");
+    Token name = parser->previous;
+
+    expression(parser);
+    emitByte(parser, OP_ITERATE);
+
+    // The iterator is kept in a local with an empty name, which can't be
+    // referred to.
+    Token iterator = name;
+    iterator.length = 0;
+    int localCount = parser->compiler->localCount;
+    addLocal(parser, iterator);
+
+    int loopStart = currentChunk(parser)->count;
+    int exitJump = emitJump(parser, OP_ITERATE_NEXT);
+    addLocal(parser, name);
+
+    while (parser->current.type != TOKEN_RIGHT_PAREN) {
+        if (check(parser, TOKEN_EOF)) {
+            error(parser, "Unexpected end of file.");
+            return;
+        }
 
-    while (parser.current.type != TOKEN_RIGHT_PAREN) {
-        expression();
-        emitByte(OP_POP);
+        expression(parser);
+        emitByte(parser, OP_POP);
     }
 
-    emitLoop(loopStart);
-    patchJump(endJump);
-    emitByte(OP_POP);
-    emitByte(OP_NULL);
-    advance();
+    popLocals(parser, localCount + 1);
+    emitLoop(parser, loopStart);
+    patchJump(parser, exitJump);
+    popLocals(parser, localCount);
+    emitByte(parser, OP_NULL);
+    advance(parser);
 }
 
-static uint8_t parseArgs(void)
+static uint8_t parseArgs(Parser* parser)
 {
     uint8_t argCount = 0;
-    while (!match(TOKEN_RIGHT_PAREN)) {
-        if (check(TOKEN_EOF)) {
-            error("Unexpected end of file.");
+    while (!match(parser, TOKEN_RIGHT_PAREN)) {
+        if (check(parser, TOKEN_EOF)) {
+            error(parser, "Unexpected end of file.");
             // dummy value since compilation fails with error
             return 0;
         }
 
-        expression();
+        expression(parser);
 
         if (argCount == 255) {
-            error("Can't have more than 255 arguments.");
+            error(parser, "Can't have more than 255 arguments.");
             // dummy value since compilation fails with error
             return 0;
         }
@@ -517,108 +802,189 @@ static uint8_t parseArgs(void)
     return argCount;
 }
 
-static void nativeMath(uint8_t ins)
+// Compile a call to one of the arithmetic operators. The overwhelmingly common
+// two operand form gets its own instruction, which the VM can execute without
+// going through the variadic native function.
+static void nativeMath(Parser* parser, uint8_t ins, uint8_t binaryIns)
+{
+    uint8_t argCount = parseArgs(parser);
+
+    if (argCount == 2) {
+        emitByte(parser, binaryIns);
+    } else {
+        emitBytes(parser, ins, argCount);
+    }
+}
+
+// Compile a call to one of the comparison operators. Two operand comparisons of
+// numbers are handled inline by the VM, anything else falls back to the native
+// function.
+static void nativeCompare(Parser* parser, uint8_t ins)
+{
+    uint8_t argCount = parseArgs(parser);
+    emitBytes(parser, ins, argCount);
+}
+
+// Compile a yield expression, which suspends the running coroutine and hands
+// the value, or null if there is none, to the code that resumed it. The value
+// of the expression is the value that the coroutine is next resumed with.
+static void yield(Parser* parser)
 {
-    uint8_t argCount = parseArgs();
-    emitBytes(ins, argCount);
+    if (check(parser, TOKEN_RIGHT_PAREN)) {
+        emitByte(parser, OP_NULL);
+    } else {
+        expression(parser);
+    }
+
+    consume(parser, TOKEN_RIGHT_PAREN,
+        "Expect ')' at end of yield expression.");
+    emitByte(parser, OP_YIELD);
+}
+
+// Compile a resume expression, which runs a coroutine until it yields or
+// returns, and has the value it yielded or returned. An optional second value
+// is passed back to the coroutine as the value of the yield it is suspended in.
+static void resume(Parser* parser)
+{
+    expression(parser);
+
+    if (check(parser, TOKEN_RIGHT_PAREN)) {
+        emitByte(parser, OP_NULL);
+    } else {
+        expression(parser);
+    }
+
+    consume(parser, TOKEN_RIGHT_PAREN,
+        "Expect ')' at end of resume expression.");
+    emitByte(parser, OP_RESUME);
 }
 
 // Parse a def expression by finding the associated variable location,
 // parsing the expression associated with the variable's value, and emitting a
 // define OpCode to put the variable in the correct corresponding location.
-static void def(void)
+static void def(Parser* parser)
 {
-    uint8_t index = parseVariable("Expect variable name.");
+    int index = parseVariable(parser, "Expect variable name.");
+    int constantCount = currentChunk(parser)->constants.count;
 
-    expression();
-    consume(TOKEN_RIGHT_PAREN, "Expect ')' at end of def expression.");
+    expression(parser);
+    consume(parser, TOKEN_RIGHT_PAREN, "Expect ')' at end of def expression.");
 
-    Value* val = &currentChunk()->constants.values[currentChunk()->constants.count - 1];
-    if (IS_FUNCTION(*val)) {
-        ObjString* name = AS_STRING(currentChunk()->constants.values[index]);
-        AS_FUNCTION(*val)->name = name;
+    // Name the function if the value is a lambda defined by this expression.
+    ValueArray* constants = &currentChunk(parser)->constants;
+    if (index != -1 && constants->count > constantCount
+        && IS_FUNCTION(constants->values[constants->count - 1])) {
+        ObjString* name;
+
+        if (parser->compiler->scopeDepth == 0) {
+            name = parser->vm->globals[index].name;
+        } else {
+            Token* token = &parser->compiler->locals[index].name;
+            name = copyString(parser->vm, token->start, token->length);
+        }
+
+        AS_FUNCTION(constants->values[constants->count - 1])->name = name;
     }
 
-    defineVariable(index);
+    defineVariable(parser, index);
 }
 
-static void parseExpression(void);
-
 // Compile a call in an s-expression.
 // First compiles the expression that places the function on the stack.
 // Next, compile the expressions for each of the arguments so they're placed
 // on the stack above the function.
 // Finally, emit the call opcode for calling the function, along with the
 // argument count.
-static void call(void)
+static void call(Parser* parser)
 {
     // retrieve function
-    parseExpression();
+    parseExpression(parser);
 
-    uint8_t argCount = parseArgs();
+    uint8_t argCount = parseArgs(parser);
 
-    emitBytes(OP_CALL, argCount);
+    if (parser->compiler->callCount < UINT8_COUNT) {
+        Compiler* compiler = parser->compiler;
+        compiler->calls[compiler->callCount++] = currentChunk(parser)->count;
+    }
+
+    emitBytes(parser, OP_CALL, argCount);
 }
 
 // Compile an S expression of the form (fn arg1 arg2 arg3...) where the fn is
 // compiled based on its associated rule, followed by each arg as an expression.
-static void sExpression(void)
+static void sExpression(Parser* parser)
 {
-    parser.lParenCount++;
-    advance();
+    parser->lParenCount++;
+    advance(parser);
 
-    TokenType operatorType = parser.previous.type;
+    TokenType operatorType = parser->previous.type;
 
     switch (operatorType) {
     case TOKEN_AND:
-        and_();
+        and_(parser);
         break;
     case TOKEN_DEF:
-        def();
+        def(parser);
         break;
     case TOKEN_IF:
-        ifExpr();
+        ifExpr(parser);
         break;
     case TOKEN_LAMBDA:
-        lambda();
+        lambda(parser);
         break;
     case TOKEN_OR:
-        or_();
+        or_(parser);
         break;
     case TOKEN_WHILE:
-        while_();
+        while_(parser);
+        break;
+    case TOKEN_FOR:
+        for_(parser);
+        break;
+    case TOKEN_YIELD:
+        yield(parser);
+        break;
+    case TOKEN_RESUME:
+        resume(parser);
         break;
     case TOKEN_PLUS:
-        nativeMath(OP_ADD);
+        nativeMath(parser, OP_ADD, OP_BINARY_ADD);
         break;
     case TOKEN_DASH:
-        nativeMath(OP_SUBTRACT);
+        nativeMath(parser, OP_SUBTRACT, OP_BINARY_SUBTRACT);
         break;
     case TOKEN_STAR:
-        nativeMath(OP_MULTIPLY);
+        nativeMath(parser, OP_MULTIPLY, OP_BINARY_MULTIPLY);
         break;
     case TOKEN_SLASH:
-        nativeMath(OP_DIVIDE);
+        nativeMath(parser, OP_DIVIDE, OP_BINARY_DIVIDE);
         break;
-    default:
-        call();
+    default: {
+        int compareOp = comparisonOp(parser, &parser->previous);
+
+        if (compareOp != -1) {
+            nativeCompare(parser, (uint8_t)compareOp);
+        } else {
+            call(parser);
+        }
+    }
     }
 
-    parser.lParenCount--;
+    parser->lParenCount--;
 }
 
 // Compile the given token to the current form of literal value.
-static void literal(void)
+static void literal(Parser* parser)
 {
-    switch (parser.previous.type) {
+    switch (parser->previous.type) {
     case TOKEN_FALSE:
-        emitByte(OP_FALSE);
+        emitByte(parser, OP_FALSE);
         break;
     case TOKEN_NULL:
-        emitByte(OP_NULL);
+        emitByte(parser, OP_NULL);
         break;
     case TOKEN_TRUE:
-        emitByte(OP_TRUE);
+        emitByte(parser, OP_TRUE);
         break;
     default:
         return; // unreachable
@@ -627,68 +993,86 @@ static void literal(void)
 
 // Create a string constant from the previously consumed token, and emit an
 // OpCode to load it onto the stack.
-static void string(void)
+static void string(Parser* parser)
 {
-    emitConstant(OBJ_VAL(copyString(parser.previous.start + 1,
-        parser.previous.length - 2)));
+    emitConstant(parser, OBJ_VAL(copyString(parser->vm,
+        parser->previous.start + 1, parser->previous.length - 2)));
 }
 
-static void variable(void);
-static void callDict(void);
+static void variable(Parser* parser);
+static void callDict(Parser* parser);
 
 // Internal function for parsing all forms of expression.
-static void parseExpression(void)
+static void parseExpression(Parser* parser)
 {
-    switch (parser.previous.type) {
+    switch (parser->previous.type) {
     case TOKEN_QUOTE:
-        if (parser.current.type == TOKEN_LEFT_PAREN) {
-            parser.previous.type = TOKEN_LEFT_PAREN;
-            parser.current.type = TOKEN_IDENTIFIER;
-            parser.current.start = "list";
-            parser.current.length = 4;
+        if (parser->current.type == TOKEN_LEFT_PAREN) {
+            parser->previous.type = TOKEN_LEFT_PAREN;
+            parser->current.type = TOKEN_IDENTIFIER;
+            parser->current.start = "list";
+            parser->current.length = 4;
         } else {
-            error("Expect `(` after `'`.");
+            error(parser, "Expect `(` after `'`.");
             break;
         }
         [[fallthrough]];
     case TOKEN_LEFT_PAREN:
-        sExpression();
+        sExpression(parser);
         break;
     case TOKEN_LEFT_BRACE:
-        callDict();
+        callDict(parser);
         break;
     case TOKEN_PLUS:
     case TOKEN_DASH:
     case TOKEN_STAR:
     case TOKEN_SLASH:
     case TOKEN_IDENTIFIER:
-        variable();
+        variable(parser);
         break;
     case TOKEN_STRING:
-        string();
+        string(parser);
         break;
     case TOKEN_NUMBER:
-        number();
+        number(parser);
         break;
     case TOKEN_FALSE:
-        literal();
+        literal(parser);
         break;
     case TOKEN_NULL:
-        literal();
+        literal(parser);
         break;
     case TOKEN_TRUE:
-        literal();
+        literal(parser);
         break;
     default:
-        error("Expect expression.");
+        error(parser, "Expect expression.");
+    }
+}
+
+// Find the slot of the global variable with the given identifier, assigning a
+// new slot the first time an identifier is seen. Slots are shared by every
+// chunk compiled by the VM, so the global instructions can index them directly
+// rather than hashing the name at runtime. Return -1 if there are too many
+// globals.
+static int identifierSlot(Parser* parser, Token* name)
+{
+    ObjString* string = copyString(parser->vm, name->start, name->length);
+    int slot = globalSlot(parser->vm, string);
+
+    if (slot == -1) {
+        error(parser, "Too many global variables.");
     }
+
+    return slot;
 }
 
-// Add the given identifier token to the constant table as a string value.
-// Return the constant index.
-static uint8_t identifierConstant(Token* name)
+// Emit a global instruction along with the 16 bit slot it operates on.
+static void emitGlobal(Parser* parser, uint8_t instruction, int slot)
 {
-    return makeConstant(OBJ_VAL(copyString(name->start, name->length)));
+    emitByte(parser, instruction);
+    emitByte(parser, (uint8_t)(slot >> 8) & 0xff);
+    emitByte(parser, (uint8_t)slot & 0xff);
 }
 
 // Check if 2 identifier tokens are of the same length and contain the same
@@ -716,7 +1100,8 @@ static int resolveLocal(Compiler* compiler, Token* name)
 
 // Add a new Upvalue to the compiler's list and return the index.
 // If the variable is already captured then return its existing index.
-static int addUpvalue(Compiler* compiler, uint8_t index, bool isLocal)
+static int addUpvalue(Parser* parser, Compiler* compiler, uint8_t index,
+    bool isLocal)
 {
     int upvalueCount = compiler->function->upvalueCount;
 
@@ -728,7 +1113,7 @@ static int addUpvalue(Compiler* compiler, uint8_t index, bool isLocal)
     }
 
     if (upvalueCount == UINT8_COUNT) {
-        error("Too many closure variables in function.");
+        error(parser, "Too many closure variables in function.");
         return 0;
     }
 
@@ -742,7 +1127,7 @@ static int addUpvalue(Compiler* compiler, uint8_t index, bool isLocal)
 // search the scopes around that one. The variable that is captured from further
 // scopes is bubbled up as an Upvalue through each scope until the current one
 // is reached, so that each Upvalue forms a chain to the current innermost scope.
-static int resolveUpvalue(Compiler* compiler, Token* name)
+static int resolveUpvalue(Parser* parser, Compiler* compiler, Token* name)
 {
     if (compiler->enclosing == NULL)
         return -1;
@@ -750,14 +1135,14 @@ static int resolveUpvalue(Compiler* compiler, Token* name)
     int local = resolveLocal(compiler->enclosing, name);
     if (local != -1) {
         compiler->enclosing->locals[local].isCaptured = true;
-        return addUpvalue(compiler, (uint8_t)local, true);
+        return addUpvalue(parser, compiler, (uint8_t)local, true);
     }
 
     // Recursive call to enclosing function, allowing Upvalues to bubble up
     // through enclosing scopes.
-    int upvalue = resolveUpvalue(compiler->enclosing, name);
+    int upvalue = resolveUpvalue(parser, compiler->enclosing, name);
     if (upvalue != -1) {
-        return addUpvalue(compiler, (uint8_t)upvalue, false);
+        return addUpvalue(parser, compiler, (uint8_t)upvalue, false);
     }
 
     return -1;
@@ -768,92 +1153,92 @@ static int resolveUpvalue(Compiler* compiler, Token* name)
 // if none are found then recursively search enclosing scopes for a matching
 // Upvalue to capture. If there is no matching local at any enclosing scope,
 // assume the variable is a global.
-static void namedVariable(Token name)
+static void namedVariable(Parser* parser, Token name)
 {
-    int arg = resolveLocal(current, &name);
+    int arg = resolveLocal(parser->compiler, &name);
     uint8_t getOp;
 
     if (arg != -1) {
         getOp = OP_GET_LOCAL;
-    } else if ((arg = resolveUpvalue(current, &name)) != -1) {
+    } else if ((arg = resolveUpvalue(parser, parser->compiler, &name)) != -1) {
         getOp = OP_GET_UPVALUE;
     } else {
-        arg = identifierConstant(&name);
-        getOp = OP_GET_GLOBAL;
+        emitGlobal(parser, OP_GET_GLOBAL, identifierSlot(parser, &name));
+        return;
     }
 
-    emitBytes(getOp, (uint8_t)arg);
+    emitBytes(parser, getOp, (uint8_t)arg);
 }
 
 // Fetch a variable with the name given in the last consumed token.
-static void variable(void)
+static void variable(Parser* parser)
 {
-    namedVariable(parser.previous);
+    namedVariable(parser, parser->previous);
 }
 
 // Called in the event an error has occurred. Finds the next likely point that
 // the current expression ends, in order to find multiple genuine errors without
 // multiple errors being reported for the same problem.
-static void synchronize(void)
+static void synchronize(Parser* parser)
 {
-    parser.panicMode = false;
+    parser->panicMode = false;
 
-    while (parser.current.type != TOKEN_EOF) {
-        if (parser.lParenCount == 0)
+    while (parser->current.type != TOKEN_EOF) {
+        if (parser->lParenCount == 0)
             return;
 
-        switch (parser.current.type) {
+        switch (parser->current.type) {
         case TOKEN_LEFT_PAREN:
-            parser.lParenCount++;
+            parser->lParenCount++;
             break;
         case TOKEN_RIGHT_PAREN:
-            parser.lParenCount--;
+            parser->lParenCount--;
         default:;
         }
 
-        advance();
+        advance(parser);
     }
 }
 
 // Top level parsing function to compile all expressions.
 // Parse the expression and handle any error that occurred in it.
-static void expression(void)
+static void expression(Parser* parser)
 {
-    advance();
-    parseExpression();
+    advance(parser);
+    parseExpression(parser);
 
-    if (parser.panicMode)
-        synchronize();
+    if (parser->panicMode)
+        synchronize(parser);
 }
 
 // Add a new local variable to the currently compiling function.
-static int addLocal(Token name)
+static int addLocal(Parser* parser, Token name)
 {
-    if (current->localCount == UINT8_COUNT) {
-        error("Too many local variables in function.");
+    if (parser->compiler->localCount == UINT8_COUNT) {
+        error(parser, "Too many local variables in function.");
         return -1;
     }
 
-    Local* local = &current->locals[current->localCount++];
+    Local* local = &parser->compiler->locals[parser->compiler->localCount++];
     local->name = name;
-    local->depth = current->scopeDepth;
+    local->depth = parser->compiler->scopeDepth;
     local->isCaptured = false;
-    return current->localCount - 1;
+    return parser->compiler->localCount - 1;
 }
 
 // If a local variable already exists, return it's index. If not, create a new
 // local variable. Return -1 if the variable is being declared at global scope.
-static int declareVariable(void)
+static int declareVariable(Parser* parser)
 {
-    if (current->scopeDepth == 0)
+    if (parser->compiler->scopeDepth == 0)
         return -1;
 
-    Token* name = &parser.previous;
+    Token* name = &parser->previous;
 
-    for (int i = current->localCount - 1; i >= 0; i--) {
-        Local* local = &current->locals[i];
+    for (int i = parser->compiler->localCount - 1; i >= 0; i--) {
+        Local* local = &parser->compiler->locals[i];
 
-        if (local->depth != -1 && local->depth < current->scopeDepth) {
+        if (local->depth != -1 && local->depth < parser->compiler->scopeDepth) {
             break;
         }
 
@@ -862,89 +1247,98 @@ static int declareVariable(void)
         }
     }
 
-    return addLocal(*name);
+    return addLocal(parser, *name);
 }
 
-// Parse an identifier token to return the associated variable's index.
-static uint8_t parseVariable(const char* errorMessage)
+// Parse an identifier token to return the associated variable's index. This is
+// a local slot inside a function, or a global slot at the top level of the
+// script. Return -1 if the variable could not be declared.
+static int parseVariable(Parser* parser, const char* errorMessage)
 {
-    consume(TOKEN_IDENTIFIER, errorMessage);
+    consume(parser, TOKEN_IDENTIFIER, errorMessage);
 
-    int index = declareVariable();
-    if (index == -1) {
-        return identifierConstant(&parser.previous);
-    } else {
-        return (uint8_t)index;
+    if (parser->compiler->scopeDepth == 0) {
+        return identifierSlot(parser, &parser->previous);
     }
+
+    return declareVariable(parser);
 }
 
 // Emit a define OpCode based on the current scope depth.
-static void defineVariable(uint8_t index)
+static void defineVariable(Parser* parser, int index)
 {
-    uint8_t setOp = OP_DEFINE_LOCAL;
-    if (current->scopeDepth == 0) {
-        setOp = OP_DEFINE_GLOBAL;
+    if (parser->compiler->scopeDepth == 0) {
+        emitGlobal(parser, OP_DEFINE_GLOBAL, index);
+    } else {
+        emitBytes(parser, OP_DEFINE_LOCAL, (uint8_t)index);
     }
-
-    emitBytes(setOp, index);
 }
 
 // Allows dict objects to be defined in code with brace syntax, so that
 // { k1 v1 k2 v2 } is equivalent to (dict k1 v1 k2 v2).
-static void callDict(void)
+static void callDict(Parser* parser)
 {
     Token dict;
-    dict.line = parser.previous.line;
+    dict.line = parser->previous.line;
     dict.start = "dict";
     dict.length = 4;
     dict.type = TOKEN_IDENTIFIER;
 
-    namedVariable(dict);
+    namedVariable(parser, dict);
 
     uint16_t argCount = 0;
-    while (!match(TOKEN_RIGHT_BRACE)) {
-        expression();
+    while (!match(parser, TOKEN_RIGHT_BRACE)) {
+        expression(parser);
         argCount++;
 
         if (argCount > UINT8_COUNT) {
-            error("Too many arguments in dictionary declaration.");
+            error(parser, "Too many arguments in dictionary declaration.");
         }
     }
 
-    emitBytes(OP_CALL, (uint8_t)argCount);
+    emitBytes(parser, OP_CALL, (uint8_t)argCount);
 }
 
 // Compile takes a string of source code, scans the tokens, and compiles them
 // into a chunk.
-ObjFunction* compile(const char* source)
+ObjFunction* compile(VM* vm, const char* source)
 {
-    initScanner(source);
+    Parser parser;
+    parser.vm = vm;
+    parser.compiler = NULL;
+    initScanner(&parser.scanner, source);
+    vm->parser = &parser;
+
     Compiler compiler;
-    initCompiler(&compiler, TYPE_SCRIPT);
+    initCompiler(&parser, &compiler, TYPE_SCRIPT);
 
     parser.hadError = false;
     parser.panicMode = false;
     parser.lParenCount = 0;
 
-    advance();
-    while (!match(TOKEN_EOF)) {
-        expression();
-        emitByte(OP_POP); // Rewritten by endCompiler() to OP_RETURN on last expression.
+    advance(&parser);
+    while (!match(&parser, TOKEN_EOF)) {
+        expression(&parser);
+        emitByte(&parser, OP_POP); // Rewritten by endCompiler() to OP_RETURN on last expression.
     }
 
-    ObjFunction* function = endCompiler();
+    ObjFunction* function = endCompiler(&parser);
+    vm->parser = NULL;
     return parser.hadError ? NULL : function;
 }
 
 // To ensure no values are cleaned up by the garbage collector during
 // compilation. Marks the function currently being compiled and any enclosing
 // functions.
-void markCompilerRoots(void)
+void markCompilerRoots(VM* vm)
 {
-    Compiler* compiler = current;
+    if (vm->parser == NULL)
+        return;
+
+    Compiler* compiler = vm->parser->compiler;
 
     while (compiler != NULL) {
-        markObject((Obj*)compiler->function);
+        markObject(vm, (Obj*)compiler->function);
         compiler = compiler->enclosing;
     }
 }
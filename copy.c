@@ -0,0 +1,319 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "chunk.h"
+#include "copy.h"
+#include "memory.h"
+#include "object.h"
+#include "pointerMap.h"
+#include "scheduler.h"
+#include "value.h"
+#include "vm.h"
+
+// Set up a copier from the heap of one VM into the heap of another.
+void initCopier(Copier* copier, VM* from, VM* to, bool withGlobals)
+{
+    copier->from = from;
+    copier->to = to;
+    initPointerMap(&copier->objects);
+    copier->copies = NULL;
+    copier->capacity = 0;
+    copier->withGlobals = withGlobals;
+    copier->pending = NULL;
+    copier->pendingCount = 0;
+    copier->pendingCapacity = 0;
+    copier->failed = false;
+}
+
+// Forget every copy that has been made, once the VM they were copied into has
+// run code and may have moved them.
+void resetCopier(Copier* copier)
+{
+    freePointerMap(&copier->objects);
+}
+
+// Free the memory held by the copier.
+void freeCopier(Copier* copier)
+{
+    freePointerMap(&copier->objects);
+    free(copier->copies);
+    copier->copies = NULL;
+    copier->capacity = 0;
+    free(copier->pending);
+    copier->pending = NULL;
+    copier->pendingCapacity = 0;
+}
+
+// Give a VM that has only been initialised the same global slots as another,
+// so that bytecode copied between them needs no relocating. Builtins the
+// other VM has since redefined are left undefined, to be copied on demand.
+// Return false if the slots can't be made to match.
+bool copyGlobalSlots(VM* to, VM* from)
+{
+    int defined = to->globalCount;
+
+    for (int i = 0; i < from->globalCount; i++) {
+        ObjString* name = from->globals[i].name;
+        if (globalSlot(to, copyString(to, name->chars, name->length)) != i)
+            return false;
+    }
+
+    for (int i = 0; i < defined; i++) {
+        Value value = from->globals[i].value;
+        Value builtin = to->globals[i].value;
+
+        if (!from->globals[i].isDefined || !IS_NATIVE(value)
+            || !IS_NATIVE(builtin) || AS_NATIVE(value) != AS_NATIVE(builtin)) {
+            to->globals[i].value = NULL_VAL;
+            to->globals[i].isDefined = false;
+        }
+    }
+
+    return true;
+}
+
+static Obj* copyObject(Copier* copier, Obj* object);
+
+// Return a copy of a value found while copying another.
+static Value copyNested(Copier* copier, Value value)
+{
+    if (!IS_OBJ(value))
+        return value;
+
+    if (IS_COROUTINE(value) || IS_ITERATOR(value)) {
+        copier->failed = true;
+        return NULL_VAL;
+    }
+
+    return OBJ_VAL(copyObject(copier, AS_OBJ(value)));
+}
+
+// Define a global in the VM being copied into, unless it has already been
+// defined there, with its value to be copied once nothing is half copied.
+static void copyGlobal(Copier* copier, int slot)
+{
+    if (!copier->from->globals[slot].isDefined
+        || copier->to->globals[slot].isDefined)
+        return;
+
+    if (copier->pendingCount == copier->pendingCapacity) {
+        copier->pendingCapacity = (int)GROW_CAPACITY(copier->pendingCapacity);
+        copier->pending = realloc(copier->pending,
+            sizeof(int) * (size_t)copier->pendingCapacity);
+        if (copier->pending == NULL)
+            exit(1);
+    }
+
+    copier->to->globals[slot].isDefined = true;
+    copier->pending[copier->pendingCount++] = slot;
+}
+
+// Return a copy of the value in the heap being copied into.
+//
+// The globals read by copied functions are copied last, as a global may refer
+// back to an object that is still being copied, such as a closure whose
+// function calls the global holding the closure.
+Value copyValue(Copier* copier, Value value)
+{
+    Value copy = copyNested(copier, value);
+
+    while (copier->pendingCount > 0) {
+        int slot = copier->pending[--copier->pendingCount];
+        Value global = copyNested(copier, copier->from->globals[slot].value);
+        copier->to->globals[slot].value = global;
+        globalBarrier(copier->to, global);
+    }
+
+    return copy;
+}
+
+// Copy the globals read by the function's bytecode.
+static void copyGlobalsRead(Copier* copier, Chunk* chunk)
+{
+    int offset = 0;
+
+    while (offset < chunk->count) {
+        if (chunk->code[offset] == OP_GET_GLOBAL) {
+            copyGlobal(copier,
+                chunk->code[offset + 1] << 8 | chunk->code[offset + 2]);
+        }
+
+        offset += instructionLength(chunk, offset);
+    }
+}
+
+// Record the copy of an object, by the number the object was given.
+static void addCopy(Copier* copier, uint32_t number, Obj* copy)
+{
+    if (number >= copier->capacity) {
+        copier->capacity = copier->capacity < 64 ? 64 : copier->capacity * 2;
+        copier->copies = realloc(copier->copies,
+            sizeof(Obj*) * copier->capacity);
+        if (copier->copies == NULL)
+            exit(1);
+    }
+
+    copier->copies[number] = copy;
+}
+
+// Copy a function, its constants and, if enabled, the globals it reads.
+static Obj* copyFunction(Copier* copier, uint32_t number,
+    ObjFunction* function)
+{
+    VM* to = copier->to;
+    ObjFunction* copy = newFunction(to);
+    addCopy(copier, number, (Obj*)copy);
+
+    FunctionParts parts = functionParts(function);
+    fillFunction(to, copy, &parts);
+    copy->id = function->id;
+    if (function->name != NULL)
+        copy->name = (ObjString*)copyObject(copier, (Obj*)function->name);
+
+    ValueArray* constants = &function->chunk.constants;
+    for (int i = 0; i < constants->count; i++) {
+        addConstant(to, &copy->chunk,
+            copyNested(copier, constants->values[i]));
+    }
+
+    if (copier->withGlobals)
+        copyGlobalsRead(copier, &function->chunk);
+
+    return (Obj*)copy;
+}
+
+// Copy a list into a buffer of its own, holding only the list's values.
+static Obj* copyList(Copier* copier, uint32_t number, ObjList* list)
+{
+    VM* to = copier->to;
+    ObjList* copy = newList(to);
+    addCopy(copier, number, (Obj*)copy);
+
+    if (list->count == 0)
+        return (Obj*)copy;
+
+    copy->buffer = newListBuffer(to, list->count);
+    copy->buffer->refCount = 1;
+
+    // Counted as each value is copied, so the list only ever covers values
+    // that have been filled in.
+    Value* values = listValues(list);
+    for (int i = 0; i < list->count; i++) {
+        copy->buffer->values[i] = copyNested(copier, values[i]);
+        copy->buffer->count++;
+        copy->count++;
+    }
+
+    return (Obj*)copy;
+}
+
+// Copy a node of a dict's trie. Keys are hashed by their contents, or for
+// functions and closures by the identity that their copies keep, and natives
+// hash the same in every VM, so the copy has the same shape as the original.
+static Obj* copyDictNode(Copier* copier, uint32_t number, ObjDictNode* node)
+{
+    ObjDictNode* copy = newDictNode(copier->to, node->count);
+    addCopy(copier, number, (Obj*)copy);
+    copy->bitmap = node->bitmap;
+
+    for (int i = 0; i < node->count; i++) {
+        copy->slots[i].key = copyNested(copier, node->slots[i].key);
+        copy->slots[i].value = copyNested(copier, node->slots[i].value);
+    }
+
+    return (Obj*)copy;
+}
+
+// Return the copy of an object, copying it if it hasn't been copied yet.
+static Obj* copyObject(Copier* copier, Obj* object)
+{
+    VM* to = copier->to;
+
+    // Strings are interned and natives hold nothing, so neither needs to be
+    // remembered.
+    switch (object->type) {
+    case OBJ_STRING: {
+        ObjString* string = (ObjString*)object;
+        return (Obj*)copyString(to, string->chars, string->length);
+    }
+    case OBJ_NATIVE:
+        return (Obj*)newNative(to, ((ObjNative*)object)->function);
+    default:
+        break;
+    }
+
+    uint32_t count = copier->objects.count;
+    uint32_t number = numberPointer(&copier->objects, object);
+    if (number < count)
+        return copier->copies[number];
+
+    switch (object->type) {
+    case OBJ_FUNCTION:
+        return copyFunction(copier, number, (ObjFunction*)object);
+    case OBJ_CLOSURE: {
+        ObjClosure* closure = (ObjClosure*)object;
+        ObjFunction* function = (ObjFunction*)copyObject(copier,
+            (Obj*)closure->function);
+        ObjClosure* copy = newClosure(to, function);
+        copy->id = closure->id;
+        addCopy(copier, number, (Obj*)copy);
+
+        for (int i = 0; i < closure->upvalueCount; i++) {
+            copy->upvalues[i] = (ObjUpvalue*)copyObject(copier,
+                (Obj*)closure->upvalues[i]);
+        }
+        return (Obj*)copy;
+    }
+    case OBJ_UPVALUE: {
+        // Copies are always closed, holding the value the variable has now.
+        ObjUpvalue* upvalue = (ObjUpvalue*)object;
+        ObjUpvalue* copy = newUpvalue(to, NULL);
+        copy->location = &copy->closed;
+        addCopy(copier, number, (Obj*)copy);
+
+        copy->closed = copyNested(copier, *upvalue->location);
+        return (Obj*)copy;
+    }
+    case OBJ_LIST:
+        return copyList(copier, number, (ObjList*)object);
+    case OBJ_DICT: {
+        ObjDict* dict = (ObjDict*)object;
+        ObjDict* copy = newDict(to);
+        addCopy(copier, number, (Obj*)copy);
+
+        if (dict->root != NULL)
+            copy->root = (ObjDictNode*)copyObject(copier, (Obj*)dict->root);
+        copy->count = dict->count;
+        return (Obj*)copy;
+    }
+    case OBJ_DICT_NODE:
+        return copyDictNode(copier, number, (ObjDictNode*)object);
+    case OBJ_SEQUENCE: {
+        ObjSequence* sequence = (ObjSequence*)object;
+        ObjSequence* copy = newSequence(to, sequence->kind);
+        addCopy(copier, number, (Obj*)copy);
+
+        copy->start = sequence->start;
+        copy->step = sequence->step;
+        copy->count = sequence->count;
+        copy->source = copyNested(copier, sequence->source);
+        copy->function = copyNested(copier, sequence->function);
+        return (Obj*)copy;
+    }
+    case OBJ_FUTURE: {
+        // The copy shares the task, and is given its own copy of the result.
+        ObjFuture* future = (ObjFuture*)object;
+        retainTask(future->task);
+        ObjFuture* copy = newFuture(to, future->task);
+        addCopy(copier, number, (Obj*)copy);
+
+        if (future->hasValue) {
+            copy->value = copyNested(copier, future->value);
+            copy->hasValue = true;
+        }
+        return (Obj*)copy;
+    }
+    default:
+        return NULL;
+    }
+}
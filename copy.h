@@ -0,0 +1,48 @@
+#ifndef clisp_copy_h
+#define clisp_copy_h
+
+#include <stdint.h>
+
+#include "common.h"
+#include "object.h"
+#include "pointerMap.h"
+#include "value.h"
+
+// Copies values out of the heap of one VM into the heap of another, so that
+// VMs running on separate threads never share an object. Objects reachable
+// more than once, including through cycles, are copied once.
+//
+// The copies are young objects, so the map of copies is only valid until the
+// VM they were copied into next runs code, when they may be moved.
+typedef struct {
+    VM* from;
+    VM* to;
+
+    // Numbers each object that has been copied, indexing its copy.
+    PointerMap objects;
+    Obj** copies;
+    uint32_t capacity;
+
+    // Whether copying a function also copies the globals that it reads, when
+    // they are not yet defined in the VM being copied into.
+    bool withGlobals;
+
+    // Slots of globals that have been defined, but whose values have not been
+    // copied yet.
+    int* pending;
+    int pendingCount;
+    int pendingCapacity;
+
+    // Set when a value can't be copied, as it is a coroutine, whose suspended
+    // stack belongs to the VM it was created in. Such values are copied as
+    // null.
+    bool failed;
+} Copier;
+
+void initCopier(Copier* copier, VM* from, VM* to, bool withGlobals);
+void resetCopier(Copier* copier);
+void freeCopier(Copier* copier);
+bool copyGlobalSlots(VM* to, VM* from);
+Value copyValue(Copier* copier, Value value);
+
+#endif
@@ -5,15 +5,16 @@
 #include "debug.h"
 #include "object.h"
 #include "value.h"
+#include "vm.h"
 
 // disassembleChunk prints out a human-readable representation of a chunk of
 // bytecode.
-void disassembleChunk(Chunk* chunk, const char* name)
+void disassembleChunk(VM* vm, Chunk* chunk, const char* name)
 {
     printf("== %s ==\n", name);
 
     for (int offset = 0; offset < chunk->count;) {
-        offset = disassembleInstruction(chunk, offset);
+        offset = disassembleInstruction(vm, chunk, offset);
     }
 
     printf("\n");
@@ -45,6 +46,17 @@ static int constantInstruction(const char* name, Chunk* chunk, int offset)
     return offset + 2;
 }
 
+// Prints an instruction that operates on a global slot, along with the name of
+// the global assigned to that slot.
+static int globalInstruction(VM* vm, const char* name, Chunk* chunk, int offset)
+{
+    uint16_t slot = (uint16_t)(chunk->code[offset + 1] << 8);
+    slot |= chunk->code[offset + 2];
+    printf("%-16s %4d '%s'\n", name, slot, vm->globals[slot].name->chars);
+
+    return offset + 3;
+}
+
 // Prints a jump instruction, along with the destination index.
 static int jumpInstruction(const char* name, int sign, Chunk* chunk, int offset)
 {
@@ -58,7 +70,7 @@ static int jumpInstruction(const char* name, int sign, Chunk* chunk, int offset)
 
 // disassembleInstruction prints the instruction at the provided offset.
 // It dispatches to the correct printing function depending on the instruction.
-int disassembleInstruction(Chunk* chunk, int offset)
+int disassembleInstruction(VM* vm, Chunk* chunk, int offset)
 {
     printf("%04d ", offset);
 
@@ -79,14 +91,20 @@ int disassembleInstruction(Chunk* chunk, int offset)
         return simpleInstruction("OP_TRUE", offset);
     case OP_FALSE:
         return simpleInstruction("OP_FALSE", offset);
+    case OP_YIELD:
+        return simpleInstruction("OP_YIELD", offset);
+    case OP_RESUME:
+        return simpleInstruction("OP_RESUME", offset);
+    case OP_ITERATE:
+        return simpleInstruction("OP_ITERATE", offset);
     case OP_RETURN:
         return simpleInstruction("OP_RETURN", offset);
     case OP_POP:
         return simpleInstruction("OP_POP", offset);
     case OP_DEFINE_GLOBAL:
-        return constantInstruction("OP_DEFINE_GLOBAL", chunk, offset);
+        return globalInstruction(vm, "OP_DEFINE_GLOBAL", chunk, offset);
     case OP_GET_GLOBAL:
-        return constantInstruction("OP_GET_GLOBAL", chunk, offset);
+        return globalInstruction(vm, "OP_GET_GLOBAL", chunk, offset);
     case OP_DEFINE_LOCAL:
         return byteInstruction("OP_DEFINE_LOCAL", chunk, offset);
     case OP_GET_LOCAL:
@@ -103,6 +121,8 @@ int disassembleInstruction(Chunk* chunk, int offset)
         return jumpInstruction("OP_LOOP", -1, chunk, offset);
     case OP_CALL:
         return byteInstruction("OP_CALL", chunk, offset);
+    case OP_TAIL_CALL:
+        return byteInstruction("OP_TAIL_CALL", chunk, offset);
     case OP_ADD:
         return byteInstruction("OP_ADD", chunk, offset);
     case OP_SUBTRACT:
@@ -111,6 +131,30 @@ int disassembleInstruction(Chunk* chunk, int offset)
         return byteInstruction("OP_MULTIPLY", chunk, offset);
     case OP_DIVIDE:
         return byteInstruction("OP_DIVIDE", chunk, offset);
+    case OP_BINARY_ADD:
+        return simpleInstruction("OP_BINARY_ADD", offset);
+    case OP_BINARY_SUBTRACT:
+        return simpleInstruction("OP_BINARY_SUBTRACT", offset);
+    case OP_BINARY_MULTIPLY:
+        return simpleInstruction("OP_BINARY_MULTIPLY", offset);
+    case OP_BINARY_DIVIDE:
+        return simpleInstruction("OP_BINARY_DIVIDE", offset);
+    case OP_LESS:
+        return byteInstruction("OP_LESS", chunk, offset);
+    case OP_GREATER:
+        return byteInstruction("OP_GREATER", chunk, offset);
+    case OP_EQUAL:
+        return byteInstruction("OP_EQUAL", chunk, offset);
+    case OP_LESS_JUMP_FALSE:
+        return jumpInstruction("OP_LESS_JUMP_FALSE", 1, chunk, offset);
+    case OP_GREATER_JUMP_FALSE:
+        return jumpInstruction("OP_GREATER_JUMP_FALSE", 1, chunk, offset);
+    case OP_EQUAL_JUMP_FALSE:
+        return jumpInstruction("OP_EQUAL_JUMP_FALSE", 1, chunk, offset);
+    case OP_POP_JUMP_FALSE:
+        return jumpInstruction("OP_POP_JUMP_FALSE", 1, chunk, offset);
+    case OP_ITERATE_NEXT:
+        return jumpInstruction("OP_ITERATE_NEXT", 1, chunk, offset);
     case OP_CLOSURE: {
         offset++;
         uint8_t constant = chunk->code[offset++];
@@ -0,0 +1,247 @@
+#include "dict.h"
+#include "memory.h"
+#include "object.h"
+#include "table.h"
+#include "value.h"
+#include <stdint.h>
+#include <string.h>
+
+// Number of bits of a key's hash used to pick a slot at each level of the trie.
+#define DICT_LEVEL_BITS 5
+
+// Number of bits in a key's hash. Nodes at this depth or below hold entries
+// with colliding hashes.
+#define DICT_HASH_BITS 32
+
+// Return the bit in a node's bitmap for the hash chunk used at the given
+// shift.
+static uint32_t bitFor(uint32_t hash, int shift)
+{
+    return (uint32_t)1 << ((hash >> shift) & ((1 << DICT_LEVEL_BITS) - 1));
+}
+
+// Return the index of the slot for the given bit, which is the number of slots
+// for lower hash chunks that are in the node.
+static int slotIndex(ObjDictNode* node, uint32_t bit)
+{
+    return __builtin_popcount(node->bitmap & (bit - 1));
+}
+
+// Return a node with a new slot holding the key and value at the given index.
+// Copies the node, unless inPlace is set.
+static ObjDictNode* insertSlot(VM* vm, ObjDictNode* node, int index,
+    uint32_t bit, Value key, Value value, bool inPlace)
+{
+    size_t before = sizeof(Entry) * (size_t)index;
+    size_t after = sizeof(Entry) * (size_t)(node->count - index);
+
+    if (inPlace) {
+        Entry* slots = GROW_ARRAY(vm, Entry, node->slots, node->count,
+            node->count + 1);
+        memmove(slots + index + 1, slots + index, after);
+        node->slots = slots;
+        node->count++;
+    } else {
+        ObjDictNode* copy = newDictNode(vm, node->count + 1);
+        memcpy(copy->slots, node->slots, before);
+        memcpy(copy->slots + index + 1, node->slots + index, after);
+        copy->bitmap = node->bitmap;
+        node = copy;
+    }
+
+    node->bitmap |= bit;
+    node->slots[index].key = key;
+    node->slots[index].value = value;
+    return node;
+}
+
+// Return a node with the slot at the given index replaced by the key and
+// value. Copies the node, unless inPlace is set.
+static ObjDictNode* replaceSlot(VM* vm, ObjDictNode* node, int index, Value key,
+    Value value, bool inPlace)
+{
+    if (!inPlace) {
+        ObjDictNode* copy = newDictNode(vm, node->count);
+        memcpy(copy->slots, node->slots, sizeof(Entry) * (size_t)node->count);
+        copy->bitmap = node->bitmap;
+        node = copy;
+    }
+
+    node->slots[index].key = key;
+    node->slots[index].value = value;
+    return node;
+}
+
+// Return a node of colliding hashes with the key set to the value.
+static ObjDictNode* insertCollision(VM* vm, ObjDictNode* node, Value key,
+    Value value, bool inPlace, bool* added)
+{
+    for (int i = 0; i < node->count; i++) {
+        if (valuesEqual(node->slots[i].key, key))
+            return replaceSlot(vm, node, i, key, value, inPlace);
+    }
+
+    *added = true;
+    return insertSlot(vm, node, node->count, 0, key, value, inPlace);
+}
+
+// Return the root of a trie, at the depth given by shift, that has the key set
+// to the value. added is set when the key was not already in the trie.
+//
+// Nodes on the path to the key are copied, and the rest are shared with the
+// original trie. When inPlace is set the nodes are changed directly instead,
+// which must only be done while building a dict that no other dict shares
+// nodes with.
+static ObjDictNode* insertNode(VM* vm, ObjDictNode* node, int shift,
+    uint32_t hash, Value key, Value value, bool inPlace, bool* added)
+{
+    if (node == NULL) {
+        ObjDictNode* leaf = newDictNode(vm, 1);
+        if (shift < DICT_HASH_BITS)
+            leaf->bitmap = bitFor(hash, shift);
+        leaf->slots[0].key = key;
+        leaf->slots[0].value = value;
+        *added = true;
+        return leaf;
+    }
+
+    if (shift >= DICT_HASH_BITS)
+        return insertCollision(vm, node, key, value, inPlace, added);
+
+    uint32_t bit = bitFor(hash, shift);
+    int index = slotIndex(node, bit);
+
+    if ((node->bitmap & bit) == 0) {
+        *added = true;
+        return insertSlot(vm, node, index, bit, key, value, inPlace);
+    }
+
+    Value slotKey = node->slots[index].key;
+    Value slotValue = node->slots[index].value;
+    ObjDictNode* child;
+
+    if (IS_NULL(slotKey)) {
+        child = insertNode(vm, (ObjDictNode*)AS_OBJ(slotValue),
+            shift + DICT_LEVEL_BITS, hash, key, value, inPlace, added);
+    } else if (valuesEqual(slotKey, key)) {
+        return replaceSlot(vm, node, index, key, value, inPlace);
+    } else {
+        // Move the existing entry down a level, next to the new one.
+        uint32_t slotHash = 0;
+        hashOf(&slotKey, &slotHash);
+
+        bool ignored;
+        child = insertNode(vm, NULL, shift + DICT_LEVEL_BITS, slotHash, slotKey,
+            slotValue, true, &ignored);
+        child = insertNode(vm, child, shift + DICT_LEVEL_BITS, hash, key, value,
+            true, added);
+    }
+
+    return replaceSlot(vm, node, index, NULL_VAL, OBJ_VAL(child), inPlace);
+}
+
+// Retrieve the value in the dict associated with the given key, and place it
+// in the provided value address. Return false if the key is not in the dict.
+bool dictGet(ObjDict* dict, Value key, Value* value)
+{
+    uint32_t hash;
+    if (!hashOf(&key, &hash))
+        return false;
+
+    ObjDictNode* node = dict->root;
+    int shift = 0;
+
+    while (node != NULL) {
+        if (shift >= DICT_HASH_BITS) {
+            for (int i = 0; i < node->count; i++) {
+                if (valuesEqual(node->slots[i].key, key)) {
+                    *value = node->slots[i].value;
+                    return true;
+                }
+            }
+            return false;
+        }
+
+        uint32_t bit = bitFor(hash, shift);
+        if ((node->bitmap & bit) == 0)
+            return false;
+
+        Entry* slot = &node->slots[slotIndex(node, bit)];
+        if (!IS_NULL(slot->key)) {
+            if (!valuesEqual(slot->key, key))
+                return false;
+
+            *value = slot->value;
+            return true;
+        }
+
+        node = (ObjDictNode*)AS_OBJ(slot->value);
+        shift += DICT_LEVEL_BITS;
+    }
+
+    return false;
+}
+
+// Return a new dict with the key set to the value, sharing all unchanged nodes
+// with the given dict. The key must be hashable.
+ObjDict* dictSet(VM* vm, ObjDict* dict, Value key, Value value)
+{
+    uint32_t hash = 0;
+    hashOf(&key, &hash);
+
+    bool added = false;
+    ObjDictNode* root = insertNode(vm, dict->root, 0, hash, key, value, false,
+        &added);
+
+    ObjDict* result = newDict(vm);
+    result->root = root;
+    result->count = dict->count + (added ? 1 : 0);
+    return result;
+}
+
+// Set the key to the value by changing the dict in place. Only to be used to
+// build up a new dict, before it has been used by any other code. The key must
+// be hashable.
+void dictInsert(VM* vm, ObjDict* dict, Value key, Value value)
+{
+    uint32_t hash = 0;
+    hashOf(&key, &hash);
+
+    bool added = false;
+    dict->root = insertNode(vm, dict->root, 0, hash, key, value, true, &added);
+    dict->isHashed = false;
+    if (added)
+        dict->count++;
+}
+
+// Return true if every entry in the trie node and its children has an equal
+// entry in the dict.
+static bool nodeEntriesIn(ObjDictNode* node, ObjDict* dict)
+{
+    for (int i = 0; i < node->count; i++) {
+        Entry* slot = &node->slots[i];
+
+        if (IS_NULL(slot->key)) {
+            if (!nodeEntriesIn((ObjDictNode*)AS_OBJ(slot->value), dict))
+                return false;
+            continue;
+        }
+
+        Value value;
+        if (!dictGet(dict, slot->key, &value)
+            || !valuesEqual(value, slot->value)) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+// Return true if both dicts have the same keys, with equal values.
+bool dictsEqual(ObjDict* a, ObjDict* b)
+{
+    if (a->count != b->count)
+        return false;
+
+    return a->root == NULL || nodeEntriesIn(a->root, b);
+}
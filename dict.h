@@ -0,0 +1,13 @@
+#ifndef clisp_dict_h
+#define clisp_dict_h
+
+#include "common.h"
+#include "object.h"
+#include "value.h"
+
+bool dictGet(ObjDict* dict, Value key, Value* value);
+ObjDict* dictSet(VM* vm, ObjDict* dict, Value key, Value value);
+void dictInsert(VM* vm, ObjDict* dict, Value key, Value value);
+bool dictsEqual(ObjDict* a, ObjDict* b);
+
+#endif
@@ -0,0 +1,856 @@
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "buffer.h"
+#include "chunk.h"
+#include "dict.h"
+#include "image.h"
+#include "memory.h"
+#include "object.h"
+#include "pointerMap.h"
+#include "value.h"
+#include "vm.h"
+
+static const char imageMagic[4] = { 'C', 'L', 'I', 'M' };
+
+// Records and sections start on this boundary, so that the doubles in them
+// can be read in place from a mapping.
+#define IMAGE_ALIGN 8
+
+// Return the FNV-1a hash of the names of the builtins, in order.
+static uint64_t hashBuiltins(void)
+{
+    uint64_t hash = 14695981039346656037u;
+
+    for (int i = 0; i < builtinCount; i++) {
+        for (const char* c = builtins[i].name; *c != '\0'; c++) {
+            hash ^= (uint8_t)*c;
+            hash *= 1099511628211u;
+        }
+
+        // Hash a zero byte between names, so that moving a character from one
+        // name to the next changes the hash.
+        hash *= 1099511628211u;
+    }
+
+    return hash;
+}
+
+// The sections of an image while it is being written.
+typedef struct {
+    PointerMap objects;
+    PointerMap buffers;
+
+    Buffer types;
+    Buffer objectOffsets;
+    Buffer bufferOffsets;
+    Buffer globals;
+    Buffer data;
+
+    // Set when the heap holds something that can't be written to an image.
+    bool failed;
+} Writer;
+
+// Return the number of the object, or IMAGE_NONE for NULL.
+static uint32_t objectNumber(Writer* writer, Obj* object)
+{
+    if (object == NULL)
+        return IMAGE_NONE;
+
+    return numberPointer(&writer->objects, object);
+}
+
+static ImageValue imageValue(Writer* writer, Value value)
+{
+    ImageValue image = { IMAGE_NULL, IMAGE_NONE, 0 };
+
+    if (IS_NUMBER(value)) {
+        image.type = IMAGE_NUMBER;
+        image.number = AS_NUMBER(value);
+    } else if (IS_BOOL(value)) {
+        image.type = IMAGE_BOOL;
+        image.number = AS_BOOL(value) ? 1 : 0;
+    } else if (IS_OBJ(value)) {
+        image.type = IMAGE_OBJECT;
+        image.object = objectNumber(writer, AS_OBJ(value));
+    }
+
+    return image;
+}
+
+// Append the values to the data section.
+static void writeValues(Writer* writer, Value* values, int count)
+{
+    for (int i = 0; i < count; i++) {
+        ImageValue image = imageValue(writer, values[i]);
+        appendBytes(&writer->data, &image, sizeof(image), IMAGE_ALIGN);
+    }
+}
+
+// Return the offset of a new record in the data section, holding the fixed
+// size part of an object.
+static uint32_t writeRecord(Writer* writer, const void* record, size_t size)
+{
+    return (uint32_t)appendBytes(&writer->data, record, size, IMAGE_ALIGN);
+}
+
+// Write the record of the object, numbering any objects it refers to that
+// haven't been reached yet.
+static void writeObject(Writer* writer, Obj* object)
+{
+    uint8_t type = (uint8_t)object->type;
+    uint32_t offset = 0;
+
+    switch (object->type) {
+    case OBJ_STRING: {
+        ObjString* string = (ObjString*)object;
+        ImageString record = { (uint32_t)string->length, string->hash };
+        offset = writeRecord(writer, &record, sizeof(record));
+        appendBytes(&writer->data, string->chars, (size_t)string->length, 1);
+        break;
+    }
+    case OBJ_FUNCTION: {
+        ObjFunction* function = (ObjFunction*)object;
+        FunctionParts parts = functionParts(function);
+        ImageFunction record = {
+            parts.arity,
+            parts.upvalueCount,
+            objectNumber(writer, (Obj*)function->name),
+            parts.codeCount,
+            parts.constantCount,
+            0,
+        };
+        offset = writeRecord(writer, &record, sizeof(record));
+        writeValues(writer, function->chunk.constants.values,
+            function->chunk.constants.count);
+        appendBytes(&writer->data, parts.lines,
+            sizeof(int) * parts.codeCount, sizeof(int));
+        appendBytes(&writer->data, parts.code, parts.codeCount, 1);
+        break;
+    }
+    case OBJ_NATIVE: {
+        ObjNative* native = (ObjNative*)object;
+        ImageNative record = { IMAGE_NONE };
+
+        for (int i = 0; i < builtinCount; i++) {
+            if (builtins[i].function == native->function)
+                record.builtin = (uint32_t)i;
+        }
+
+        writer->failed = writer->failed || record.builtin == IMAGE_NONE;
+        offset = writeRecord(writer, &record, sizeof(record));
+        break;
+    }
+    case OBJ_CLOSURE: {
+        ObjClosure* closure = (ObjClosure*)object;
+        ImageClosure record = {
+            objectNumber(writer, (Obj*)closure->function),
+            (uint32_t)closure->upvalueCount,
+        };
+        offset = writeRecord(writer, &record, sizeof(record));
+
+        for (int i = 0; i < closure->upvalueCount; i++) {
+            uint32_t upvalue = objectNumber(writer, (Obj*)closure->upvalues[i]);
+            appendBytes(&writer->data, &upvalue, sizeof(upvalue), 1);
+        }
+        break;
+    }
+    case OBJ_UPVALUE: {
+        // An open upvalue points into the stack, which isn't part of an image.
+        ObjUpvalue* upvalue = (ObjUpvalue*)object;
+        writer->failed = writer->failed
+            || upvalue->location != &upvalue->closed;
+
+        ImageUpvalue record = { imageValue(writer, upvalue->closed) };
+        offset = writeRecord(writer, &record, sizeof(record));
+        break;
+    }
+    case OBJ_LIST: {
+        ObjList* list = (ObjList*)object;
+        ImageList record = {
+            list->buffer == NULL
+                ? IMAGE_NONE
+                : numberPointer(&writer->buffers, list->buffer),
+            list->start,
+            list->count,
+        };
+        offset = writeRecord(writer, &record, sizeof(record));
+        break;
+    }
+    case OBJ_DICT: {
+        ObjDict* dict = (ObjDict*)object;
+        ImageDict record = {
+            objectNumber(writer, (Obj*)dict->root),
+            dict->count,
+        };
+        offset = writeRecord(writer, &record, sizeof(record));
+        break;
+    }
+    case OBJ_DICT_NODE: {
+        ObjDictNode* node = (ObjDictNode*)object;
+        ImageDictNode record = { node->bitmap, node->count };
+        offset = writeRecord(writer, &record, sizeof(record));
+
+        for (int i = 0; i < node->count; i++) {
+            writeValues(writer, &node->slots[i].key, 1);
+            writeValues(writer, &node->slots[i].value, 1);
+        }
+        break;
+    }
+    case OBJ_SEQUENCE: {
+        ObjSequence* sequence = (ObjSequence*)object;
+        ImageSequence record = {
+            (uint32_t)sequence->kind,
+            0,
+            sequence->start,
+            sequence->step,
+            sequence->count,
+            imageValue(writer, sequence->source),
+            imageValue(writer, sequence->function),
+        };
+        offset = writeRecord(writer, &record, sizeof(record));
+        break;
+    }
+    case OBJ_FUTURE:
+    case OBJ_COROUTINE:
+    case OBJ_ITERATOR:
+        // A future's task belongs to the scheduler of the running process,
+        // and a coroutine's frames and an iterator's progress belong to code
+        // that is running.
+        writer->failed = true;
+        break;
+    }
+
+    appendBytes(&writer->types, &type, sizeof(type), 1);
+    appendBytes(&writer->objectOffsets, &offset, sizeof(offset), 1);
+}
+
+// Write the record of a list buffer, numbering any objects in it.
+static void writeListBuffer(Writer* writer, const ListBuffer* buffer)
+{
+    ImageListBuffer record = { (uint32_t)buffer->count, 0 };
+    uint32_t offset = writeRecord(writer, &record, sizeof(record));
+
+    for (int i = 0; i < buffer->count; i++) {
+        ImageValue image = imageValue(writer, buffer->values[i]);
+        appendBytes(&writer->data, &image, sizeof(image), IMAGE_ALIGN);
+    }
+
+    appendBytes(&writer->bufferOffsets, &offset, sizeof(offset), 1);
+}
+
+// Write every global, and every object reachable from them, to an image file
+// at the path. Only to be called between running scripts, when the stack is
+// empty. Return false if the image could not be written.
+bool writeImage(VM* vm, const char* path)
+{
+    Writer writer;
+    initPointerMap(&writer.objects);
+    initPointerMap(&writer.buffers);
+    initBuffer(&writer.types);
+    initBuffer(&writer.objectOffsets);
+    initBuffer(&writer.bufferOffsets);
+    initBuffer(&writer.globals);
+    initBuffer(&writer.data);
+    writer.failed = false;
+
+    for (int i = 0; i < vm->globalCount; i++) {
+        ImageGlobal global = {
+            objectNumber(&writer, (Obj*)vm->globals[i].name),
+            vm->globals[i].isDefined,
+            imageValue(&writer, vm->globals[i].value),
+        };
+        appendBytes(&writer.globals, &global, sizeof(global), 1);
+    }
+
+    // Writing a record numbers the objects it refers to, so keep going until
+    // every numbered object and buffer has a record.
+    uint32_t objectsWritten = 0;
+    uint32_t buffersWritten = 0;
+
+    while (objectsWritten < writer.objects.count
+        || buffersWritten < writer.buffers.count) {
+        while (objectsWritten < writer.objects.count) {
+            writeObject(&writer,
+                (Obj*)writer.objects.pointers[objectsWritten++]);
+        }
+
+        while (buffersWritten < writer.buffers.count) {
+            writeListBuffer(&writer,
+                writer.buffers.pointers[buffersWritten++]);
+        }
+    }
+
+    ImageHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, imageMagic, sizeof(header.magic));
+    header.version = IMAGE_VERSION;
+    header.opcodeCount = OP_RETURN + 1;
+    header.builtinsHash = hashBuiltins();
+    header.objectCount = writer.objects.count;
+    header.bufferCount = writer.buffers.count;
+    header.globalCount = (uint32_t)vm->globalCount;
+
+    Buffer file;
+    initBuffer(&file);
+    appendBytes(&file, &header, sizeof(header), 1);
+    header.typesOffset = (uint32_t)appendBytes(&file, writer.types.bytes,
+        writer.types.count, IMAGE_ALIGN);
+    header.objectsOffset = (uint32_t)appendBytes(&file,
+        writer.objectOffsets.bytes, writer.objectOffsets.count, IMAGE_ALIGN);
+    header.buffersOffset = (uint32_t)appendBytes(&file,
+        writer.bufferOffsets.bytes, writer.bufferOffsets.count, IMAGE_ALIGN);
+    header.globalsOffset = (uint32_t)appendBytes(&file, writer.globals.bytes,
+        writer.globals.count, IMAGE_ALIGN);
+    header.dataOffset = (uint32_t)appendBytes(&file, writer.data.bytes,
+        writer.data.count, IMAGE_ALIGN);
+    header.fileSize = (uint32_t)file.count;
+    memcpy(file.bytes, &header, sizeof(header));
+
+    bool written = !writer.failed && file.count <= UINT32_MAX
+        && writeBufferFile(&file, path);
+
+    freeBuffer(&file);
+    freeBuffer(&writer.types);
+    freeBuffer(&writer.objectOffsets);
+    freeBuffer(&writer.bufferOffsets);
+    freeBuffer(&writer.globals);
+    freeBuffer(&writer.data);
+    freePointerMap(&writer.objects);
+    freePointerMap(&writer.buffers);
+    return written;
+}
+
+// An image mapped into memory, and the objects and buffers allocated for it.
+typedef struct {
+    const ImageHeader* header;
+    const uint8_t* types;
+    const uint32_t* objectOffsets;
+    const uint32_t* bufferOffsets;
+    const ImageGlobal* globals;
+    const uint8_t* data;
+    size_t dataSize;
+
+    Obj** objects;
+    ListBuffer** buffers;
+} Loader;
+
+// Return true if a section of count items of the given size lies inside the
+// file, starting on an aligned offset.
+static bool sectionFits(const ImageHeader* header, uint32_t offset,
+    uint32_t count, size_t size)
+{
+    return offset % IMAGE_ALIGN == 0 && offset >= sizeof(ImageHeader)
+        && offset <= header->fileSize
+        && (uint64_t)count * size <= header->fileSize - offset;
+}
+
+// Return the record at the offset in the data section, if the record and the
+// given number of trailing items fit inside it.
+static const void* record(Loader* loader, uint32_t offset, size_t size,
+    uint64_t count, size_t itemSize)
+{
+    uint64_t total = size + count * itemSize;
+    if (offset % IMAGE_ALIGN != 0 || offset > loader->dataSize
+        || total > loader->dataSize - offset) {
+        return NULL;
+    }
+
+    return loader->data + offset;
+}
+
+// Check the header of a mapped file of the given size, and set up the loader
+// to find each section if the file is an image this build can load.
+static bool openImage(Loader* loader, const uint8_t* bytes, size_t size)
+{
+    const ImageHeader* header = (const ImageHeader*)bytes;
+
+    if (size < sizeof(ImageHeader)
+        || memcmp(header->magic, imageMagic, sizeof(imageMagic)) != 0
+        || header->version != IMAGE_VERSION
+        || header->opcodeCount != OP_RETURN + 1
+        || header->builtinsHash != hashBuiltins()
+        || header->fileSize != size
+        || header->globalCount > GLOBAL_MAX
+        || header->objectCount > INT32_MAX
+        || header->bufferCount > INT32_MAX) {
+        return false;
+    }
+
+    if (!sectionFits(header, header->typesOffset, header->objectCount, 1)
+        || !sectionFits(header, header->objectsOffset, header->objectCount,
+            sizeof(uint32_t))
+        || !sectionFits(header, header->buffersOffset, header->bufferCount,
+            sizeof(uint32_t))
+        || !sectionFits(header, header->globalsOffset, header->globalCount,
+            sizeof(ImageGlobal))
+        || !sectionFits(header, header->dataOffset, 0, 1)) {
+        return false;
+    }
+
+    loader->header = header;
+    loader->types = bytes + header->typesOffset;
+    loader->objectOffsets = (const uint32_t*)(bytes + header->objectsOffset);
+    loader->bufferOffsets = (const uint32_t*)(bytes + header->buffersOffset);
+    loader->globals = (const ImageGlobal*)(bytes + header->globalsOffset);
+    loader->data = bytes + header->dataOffset;
+    loader->dataSize = header->fileSize - header->dataOffset;
+    return true;
+}
+
+// Return the object with the given number, or NULL if there's no such object
+// or it hasn't been allocated yet.
+static Obj* loadedObject(Loader* loader, uint32_t number)
+{
+    if (number >= loader->header->objectCount)
+        return NULL;
+
+    return loader->objects[number];
+}
+
+// Return the object with the given number if it has the type, or NULL.
+static Obj* loadedOfType(Loader* loader, uint32_t number, ObjType type)
+{
+    Obj* object = loadedObject(loader, number);
+    return object != NULL && object->type == type ? object : NULL;
+}
+
+// Relocate an image value into a value. Return false if it refers to an
+// object that doesn't exist.
+static bool loadValue(Loader* loader, const ImageValue* image, Value* value)
+{
+    switch (image->type) {
+    case IMAGE_NULL:
+        *value = NULL_VAL;
+        return true;
+    case IMAGE_BOOL:
+        *value = BOOL_VAL(image->number != 0);
+        return true;
+    case IMAGE_NUMBER:
+        *value = NUMBER_VAL(image->number);
+        return true;
+    case IMAGE_OBJECT: {
+        Obj* object = loadedObject(loader, image->object);
+        if (object == NULL)
+            return false;
+
+        *value = OBJ_VAL(object);
+        return true;
+    }
+    default:
+        return false;
+    }
+}
+
+// Allocate the object with the given number, empty apart from anything needed
+// to size it. Closures are sized by their function, so are allocated later.
+//
+// Objects loaded from an image stay in the nursery until the next safepoint,
+// so they don't need to be rooted while the rest of the image is loaded.
+static bool allocateObject(VM* vm, Loader* loader, uint32_t number)
+{
+    uint32_t offset = loader->objectOffsets[number];
+    Obj* object = NULL;
+
+    switch (loader->types[number]) {
+    case OBJ_STRING: {
+        const ImageString* string = record(loader, offset,
+            sizeof(ImageString), 0, 0);
+        if (string == NULL || string->length > INT32_MAX
+            || record(loader, offset, sizeof(ImageString), string->length, 1)
+                == NULL) {
+            return false;
+        }
+
+        object = (Obj*)copyString(vm, (const char*)(string + 1),
+            (int)string->length);
+        break;
+    }
+    case OBJ_FUNCTION:
+        object = (Obj*)newFunction(vm);
+        break;
+    case OBJ_NATIVE: {
+        const ImageNative* native = record(loader, offset, sizeof(ImageNative),
+            0, 0);
+        if (native == NULL || native->builtin >= (uint32_t)builtinCount)
+            return false;
+
+        object = (Obj*)newNative(vm, builtins[native->builtin].function);
+        break;
+    }
+    case OBJ_CLOSURE:
+        return true;
+    case OBJ_UPVALUE: {
+        ObjUpvalue* upvalue = newUpvalue(vm, NULL);
+        upvalue->location = &upvalue->closed;
+        object = (Obj*)upvalue;
+        break;
+    }
+    case OBJ_LIST:
+        object = (Obj*)newList(vm);
+        break;
+    case OBJ_DICT:
+        object = (Obj*)newDict(vm);
+        break;
+    case OBJ_DICT_NODE: {
+        const ImageDictNode* node = record(loader, offset,
+            sizeof(ImageDictNode), 0, 0);
+        if (node == NULL || node->count < 0)
+            return false;
+
+        object = (Obj*)newDictNode(vm, node->count);
+        break;
+    }
+    case OBJ_SEQUENCE: {
+        const ImageSequence* sequence = record(loader, offset,
+            sizeof(ImageSequence), 0, 0);
+        if (sequence == NULL || sequence->kind > SEQUENCE_TAKE)
+            return false;
+
+        object = (Obj*)newSequence(vm, (SequenceKind)sequence->kind);
+        break;
+    }
+    default:
+        return false;
+    }
+
+    loader->objects[number] = object;
+    return true;
+}
+
+// Fill in the code and constants of a function.
+static bool loadFunction(VM* vm, Loader* loader, uint32_t offset,
+    ObjFunction* function)
+{
+    const ImageFunction* image = record(loader, offset, sizeof(ImageFunction),
+        0, 0);
+    if (image == NULL)
+        return false;
+
+    uint64_t size = (uint64_t)image->constantCount * sizeof(ImageValue)
+        + (uint64_t)image->codeCount * (sizeof(int) + 1);
+    if (record(loader, offset, sizeof(ImageFunction), size, 1) == NULL)
+        return false;
+
+    const ImageValue* constants = (const ImageValue*)(image + 1);
+    const int* lines = (const int*)(constants + image->constantCount);
+    const uint8_t* code = (const uint8_t*)(lines + image->codeCount);
+
+    FunctionParts parts = {
+        image->arity,
+        image->upvalueCount,
+        image->codeCount,
+        image->constantCount,
+        code,
+        lines,
+    };
+    if (!fillFunction(vm, function, &parts))
+        return false;
+
+    if (image->name != IMAGE_NONE) {
+        function->name = (ObjString*)loadedOfType(loader, image->name,
+            OBJ_STRING);
+        if (function->name == NULL)
+            return false;
+    }
+
+    for (uint32_t i = 0; i < image->constantCount; i++) {
+        Value value;
+        if (!loadValue(loader, &constants[i], &value))
+            return false;
+
+        addConstant(vm, &function->chunk, value);
+    }
+
+    return true;
+}
+
+// Allocate a closure, now that its function has been loaded.
+static bool allocateClosure(VM* vm, Loader* loader, uint32_t number)
+{
+    const ImageClosure* image = record(loader, loader->objectOffsets[number],
+        sizeof(ImageClosure), 0, 0);
+    if (image == NULL)
+        return false;
+
+    ObjFunction* function = (ObjFunction*)loadedOfType(loader,
+        image->function, OBJ_FUNCTION);
+    if (function == NULL
+        || image->upvalueCount != (uint32_t)function->upvalueCount) {
+        return false;
+    }
+
+    loader->objects[number] = (Obj*)newClosure(vm, function);
+    return true;
+}
+
+// Allocate a list buffer and fill in its values.
+static bool loadListBuffer(VM* vm, Loader* loader, uint32_t number)
+{
+    uint32_t offset = loader->bufferOffsets[number];
+    const ImageListBuffer* image = record(loader, offset,
+        sizeof(ImageListBuffer), 0, 0);
+    if (image == NULL || image->count > INT32_MAX
+        || record(loader, offset, sizeof(ImageListBuffer), image->count,
+               sizeof(ImageValue))
+            == NULL) {
+        return false;
+    }
+
+    const ImageValue* values = (const ImageValue*)(image + 1);
+    ListBuffer* buffer = newListBuffer(vm, (int)image->count);
+    loader->buffers[number] = buffer;
+
+    for (uint32_t i = 0; i < image->count; i++) {
+        if (!loadValue(loader, &values[i], &buffer->values[i]))
+            return false;
+        buffer->count++;
+    }
+
+    return true;
+}
+
+// Fill in the references of an object that has been allocated.
+static bool loadReferences(Loader* loader, uint32_t number)
+{
+    uint32_t offset = loader->objectOffsets[number];
+    Obj* object = loader->objects[number];
+
+    switch (object->type) {
+    case OBJ_CLOSURE: {
+        ObjClosure* closure = (ObjClosure*)object;
+        const uint32_t* upvalues = record(loader, offset,
+            sizeof(ImageClosure), (uint64_t)closure->upvalueCount,
+            sizeof(uint32_t));
+        if (upvalues == NULL)
+            return false;
+        upvalues = (const uint32_t*)((const ImageClosure*)upvalues + 1);
+
+        for (int i = 0; i < closure->upvalueCount; i++) {
+            closure->upvalues[i] = (ObjUpvalue*)loadedOfType(loader,
+                upvalues[i], OBJ_UPVALUE);
+            if (closure->upvalues[i] == NULL)
+                return false;
+        }
+        return true;
+    }
+    case OBJ_UPVALUE: {
+        const ImageUpvalue* image = record(loader, offset,
+            sizeof(ImageUpvalue), 0, 0);
+        return image != NULL
+            && loadValue(loader, &image->closed, &((ObjUpvalue*)object)->closed);
+    }
+    case OBJ_LIST: {
+        ObjList* list = (ObjList*)object;
+        const ImageList* image = record(loader, offset, sizeof(ImageList), 0,
+            0);
+        if (image == NULL)
+            return false;
+        if (image->buffer == IMAGE_NONE)
+            return image->count == 0;
+
+        if (image->buffer >= loader->header->bufferCount || image->start < 0
+            || image->count < 0)
+            return false;
+
+        ListBuffer* buffer = loader->buffers[image->buffer];
+        if (image->count > buffer->count - image->start)
+            return false;
+
+        buffer->refCount++;
+        list->buffer = buffer;
+        list->start = image->start;
+        list->count = image->count;
+        return true;
+    }
+    case OBJ_DICT: {
+        ObjDict* dict = (ObjDict*)object;
+        const ImageDict* image = record(loader, offset, sizeof(ImageDict), 0,
+            0);
+        if (image == NULL || image->count < 0)
+            return false;
+
+        if (image->root != IMAGE_NONE) {
+            dict->root = (ObjDictNode*)loadedOfType(loader, image->root,
+                OBJ_DICT_NODE);
+            if (dict->root == NULL)
+                return false;
+        }
+
+        dict->count = image->count;
+        return true;
+    }
+    case OBJ_DICT_NODE: {
+        ObjDictNode* node = (ObjDictNode*)object;
+        const ImageDictNode* image = record(loader, offset,
+            sizeof(ImageDictNode), (uint64_t)node->count * 2,
+            sizeof(ImageValue));
+        if (image == NULL)
+            return false;
+
+        const ImageValue* slots = (const ImageValue*)(image + 1);
+        node->bitmap = image->bitmap;
+
+        for (int i = 0; i < node->count; i++) {
+            if (!loadValue(loader, &slots[2 * i], &node->slots[i].key)
+                || !loadValue(loader, &slots[2 * i + 1], &node->slots[i].value))
+                return false;
+        }
+        return true;
+    }
+    case OBJ_SEQUENCE: {
+        ObjSequence* sequence = (ObjSequence*)object;
+        const ImageSequence* image = record(loader, offset,
+            sizeof(ImageSequence), 0, 0);
+        if (image == NULL || !loadValue(loader, &image->source,
+                                 &sequence->source)
+            || !loadValue(loader, &image->function, &sequence->function))
+            return false;
+
+        sequence->start = image->start;
+        sequence->step = image->step;
+        sequence->count = image->count;
+        return true;
+    }
+    default:
+        return true;
+    }
+}
+
+// Insert the entries of a trie node and its children into the dict.
+static void insertEntries(VM* vm, ObjDict* dict, ObjDictNode* node)
+{
+    for (int i = 0; i < node->count; i++) {
+        Entry* slot = &node->slots[i];
+
+        if (IS_NULL(slot->key)) {
+            insertEntries(vm, dict, (ObjDictNode*)AS_OBJ(slot->value));
+        } else {
+            dictInsert(vm, dict, slot->key, slot->value);
+        }
+    }
+}
+
+// Build a loaded dict again by inserting each of its entries into an empty
+// trie. The shape of the trie depends on how the keys hash, which is not the
+// same in every process for functions, closures and natives.
+static void rebuildDict(VM* vm, ObjDict* dict)
+{
+    ObjDictNode* root = dict->root;
+    dict->root = NULL;
+    dict->count = 0;
+    dict->isHashed = false;
+
+    if (root != NULL)
+        insertEntries(vm, dict, root);
+}
+
+// Allocate the objects of a valid image, relocate the references between
+// them, and fill in the globals. Return false if any record is malformed.
+static bool loadObjects(VM* vm, Loader* loader)
+{
+    const ImageHeader* header = loader->header;
+
+    // Functions are filled in before closures are allocated, as a closure's
+    // upvalue array is sized by its function. The constants of a function
+    // never include a closure.
+    for (uint32_t i = 0; i < header->objectCount; i++) {
+        if (!allocateObject(vm, loader, i))
+            return false;
+    }
+
+    for (uint32_t i = 0; i < header->objectCount; i++) {
+        Obj* object = loader->objects[i];
+        if (object != NULL && object->type == OBJ_FUNCTION
+            && !loadFunction(vm, loader, loader->objectOffsets[i],
+                (ObjFunction*)object)) {
+            return false;
+        }
+    }
+
+    for (uint32_t i = 0; i < header->objectCount; i++) {
+        if (loader->types[i] == OBJ_CLOSURE && !allocateClosure(vm, loader, i))
+            return false;
+    }
+
+    for (uint32_t i = 0; i < header->bufferCount; i++) {
+        if (!loadListBuffer(vm, loader, i))
+            return false;
+    }
+
+    for (uint32_t i = 0; i < header->objectCount; i++) {
+        if (!loadReferences(loader, i))
+            return false;
+    }
+
+    // Objects are numbered as they are reached, so a dict inside a key is
+    // numbered after the dict holding the key, and is rebuilt first.
+    for (uint32_t i = header->objectCount; i > 0; i--) {
+        Obj* object = loader->objects[i - 1];
+        if (object->type == OBJ_DICT)
+            rebuildDict(vm, (ObjDict*)object);
+    }
+
+    // The VM has no globals yet, so each name is given the slot it had when
+    // the image was written, and the bytecode needs no relocating.
+    for (uint32_t i = 0; i < header->globalCount; i++) {
+        const ImageGlobal* image = &loader->globals[i];
+        ObjString* name = (ObjString*)loadedOfType(loader, image->name,
+            OBJ_STRING);
+        if (name == NULL || globalSlot(vm, name) != (int)i)
+            return false;
+
+        Global* global = &vm->globals[i];
+        if (!loadValue(loader, &image->value, &global->value))
+            return false;
+        global->isDefined = image->isDefined != 0;
+    }
+
+    return true;
+}
+
+// Load the globals, and every object reachable from them, out of the image
+// file at the path into a VM that has no globals yet. Return false if the file
+// isn't an image written by this build of the interpreter.
+bool loadImage(VM* vm, const char* path)
+{
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return false;
+
+    struct stat status;
+    if (fstat(fd, &status) != 0
+        || status.st_size < (off_t)sizeof(ImageHeader)) {
+        close(fd);
+        return false;
+    }
+
+    size_t size = (size_t)status.st_size;
+    void* bytes = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (bytes == MAP_FAILED)
+        return false;
+
+    Loader loader;
+    bool loaded = false;
+
+    if (openImage(&loader, bytes, size)) {
+        loader.objects = calloc(loader.header->objectCount + 1, sizeof(Obj*));
+        loader.buffers = calloc(loader.header->bufferCount + 1,
+            sizeof(ListBuffer*));
+        if (loader.objects == NULL || loader.buffers == NULL)
+            exit(1);
+
+        loaded = loadObjects(vm, &loader);
+        free(loader.objects);
+        free(loader.buffers);
+    }
+
+    munmap(bytes, size);
+    return loaded;
+}
@@ -0,0 +1,153 @@
+#ifndef clisp_image_h
+#define clisp_image_h
+
+#include "common.h"
+#include <stdint.h>
+
+// Increase whenever the layout of an image file, or the meaning of any
+// bytecode, changes so that older images are refused. Checking the number of
+// opcodes only catches opcodes being added or removed, not a change to their
+// operands or to the records.
+//
+// 2: sequence records, and the coroutine and iterator opcodes.
+#define IMAGE_VERSION 2
+
+// Marks a missing object in a reference, such as the name of the script.
+#define IMAGE_NONE UINT32_MAX
+
+// Header at the start of a heap image, a copy of every global and all of the
+// objects reachable from them.
+//
+// Objects are numbered in the order they were reached, and every reference
+// between them is stored as that number. Loading allocates each object and
+// then relocates the references to the new addresses. Record offsets are from
+// the start of the data section, other offsets from the start of the file.
+typedef struct {
+    char magic[4];
+    uint16_t version;
+
+    // Number of opcodes the writer knew about, as a second guard against
+    // loading bytecode from a different build of the interpreter.
+    uint16_t opcodeCount;
+
+    uint32_t fileSize;
+
+    // Hash of the names of the builtins, in order, since natives are stored
+    // as their index in the builtins.
+    uint64_t builtinsHash;
+
+    uint32_t objectCount;
+    uint32_t bufferCount;
+    uint32_t globalCount;
+
+    // One ObjType byte for each object.
+    uint32_t typesOffset;
+
+    // The offset of each object's record.
+    uint32_t objectsOffset;
+
+    // The offset of each list buffer's record.
+    uint32_t buffersOffset;
+
+    // One ImageGlobal for each global slot.
+    uint32_t globalsOffset;
+
+    uint32_t dataOffset;
+} ImageHeader;
+
+// The kinds of value stored in an image.
+typedef enum {
+    IMAGE_NULL,
+    IMAGE_BOOL,
+    IMAGE_NUMBER,
+    IMAGE_OBJECT,
+} ImageValueType;
+
+// A value, either a number or boolean held in number, or an object number.
+typedef struct {
+    uint32_t type;
+    uint32_t object;
+    double number;
+} ImageValue;
+
+// A global slot.
+typedef struct {
+    uint32_t name;
+    uint32_t isDefined;
+    ImageValue value;
+} ImageGlobal;
+
+// Followed by the characters of the string.
+typedef struct {
+    uint32_t length;
+    uint32_t hash;
+} ImageString;
+
+// Followed by the constants, then the line of each byte of code, then the
+// code itself.
+typedef struct {
+    int32_t arity;
+    int32_t upvalueCount;
+    uint32_t name;
+    uint32_t codeCount;
+    uint32_t constantCount;
+    uint32_t padding;
+} ImageFunction;
+
+typedef struct {
+    // Index of the function in the builtins.
+    uint32_t builtin;
+} ImageNative;
+
+// Followed by the object number of each upvalue.
+typedef struct {
+    uint32_t function;
+    uint32_t upvalueCount;
+} ImageClosure;
+
+// Upvalues are always closed when an image is written.
+typedef struct {
+    ImageValue closed;
+} ImageUpvalue;
+
+typedef struct {
+    // Index of the list's buffer, or IMAGE_NONE for an empty list.
+    uint32_t buffer;
+    int32_t start;
+    int32_t count;
+} ImageList;
+
+typedef struct {
+    uint32_t root;
+    int32_t count;
+} ImageDict;
+
+// Followed by a key and a value for each slot. Loading only uses the entries,
+// rebuilding each dict by insertion, as keys may hash differently in the
+// loading process.
+typedef struct {
+    uint32_t bitmap;
+    int32_t count;
+} ImageDictNode;
+
+// A range, or a map, filter or take chained onto its source.
+typedef struct {
+    uint32_t kind;
+    uint32_t padding;
+    double start;
+    double step;
+    double count;
+    ImageValue source;
+    ImageValue function;
+} ImageSequence;
+
+// Followed by the values in the buffer.
+typedef struct {
+    uint32_t count;
+    uint32_t padding;
+} ImageListBuffer;
+
+bool writeImage(VM* vm, const char* path);
+bool loadImage(VM* vm, const char* path);
+
+#endif
@@ -2,9 +2,48 @@
 #include <stdlib.h>
 #include <string.h>
 
+#include "cache.h"
+#include "compiler.h"
+#include "image.h"
+#include "memory.h"
+#include "opcodeStats.h"
+#include "profile.h"
 #include "vm.h"
 
-static void repl(void)
+// Whether scripts are loaded from and compiled to bytecode cache files.
+static bool useCache = true;
+
+// Whether the collector's statistics are printed at exit.
+static bool gcStats = false;
+
+// Where the stacks sampled while the script runs are written, or NULL if it
+// isn't profiled.
+static const char* profilePath = NULL;
+
+// Write the stacks sampled by the profiler started for --profile, unless the
+// script has already stopped it, and print the counts of instructions run for
+// --opcode-stats and the collector's statistics for --gc-stats.
+static void writeReports(VM* vm)
+{
+    if (vm->opcodeStats != NULL)
+        printOpcodeStats(vm->opcodeStats, stderr);
+
+    if (gcStats)
+        printGcStats(vm, stderr);
+
+    if (profilePath == NULL || vm->profiler == NULL)
+        return;
+
+    Buffer output;
+    initBuffer(&output);
+    stopProfiler(vm, &output);
+
+    if (!writeBufferFile(&output, profilePath))
+        fprintf(stderr, "Could not write profile \"%s\".\n", profilePath);
+    freeBuffer(&output);
+}
+
+static void repl(VM* vm)
 {
     char line[1024];
 
@@ -17,7 +56,7 @@ static void repl(void)
         }
 
         if (strlen(line) > 1)
-            interpret(line);
+            interpret(vm, line);
     }
 }
 
@@ -51,31 +90,185 @@ static char* readFile(const char* path)
     return buffer;
 }
 
-static void runFile(const char* path)
+// Return the path of the bytecode cache file kept next to the script.
+static char* cachePath(const char* path)
+{
+    size_t length = strlen(path);
+    char* cache = (char*)malloc(length + 2);
+    if (cache == NULL) {
+        fprintf(stderr, "Not enough memory to read \"%s\".\n", path);
+        exit(74);
+    }
+
+    memcpy(cache, path, length);
+    memcpy(cache + length, "c", 2);
+    return cache;
+}
+
+// Return the compiled script at the path, or NULL if it has compilation
+// errors. Unless caching is turned off, the compiled bytecode is loaded from
+// the cache file next to the script when that was written for the same source,
+// and otherwise the cache file is written after compiling.
+static ObjFunction* loadScript(VM* vm, const char* path)
 {
     char* source = readFile(path);
-    InterpretResult result = interpret(source);
+    char* cache = useCache ? cachePath(path) : NULL;
+
+    ObjFunction* function = useCache ? loadCache(vm, cache, source) : NULL;
+    if (function == NULL) {
+        function = compile(vm, source);
+
+        // Failing to write the cache, for example into a read-only
+        // directory, only means the script is compiled again next time.
+        if (function != NULL && useCache)
+            writeCache(vm, cache, source, function);
+    }
+
+    free(cache);
     free(source);
+    return function;
+}
 
-    if (result == INTERPRET_COMPILE_ERROR)
+static void runFile(VM* vm, const char* path)
+{
+    ObjFunction* function = loadScript(vm, path);
+    if (function == NULL)
         exit(65);
-    if (result == INTERPRET_RUNTIME_ERROR)
+
+    InterpretResult result = interpretFunction(vm, function);
+    if (result == INTERPRET_RUNTIME_ERROR) {
+        writeReports(vm);
         exit(70);
+    }
+}
+
+// Compile the script at the path once, then run it for each line of standard
+// input, with the line bound to the `input` global. Results are not printed,
+// so the script decides what to output.
+static void runEach(VM* vm, const char* path)
+{
+    Script script;
+    ObjFunction* function = loadScript(vm, path);
+    if (function == NULL || !newScript(vm, function, &script))
+        exit(65);
+
+    char* line = NULL;
+    size_t capacity = 0;
+    ssize_t length;
+
+    while ((length = getline(&line, &capacity, stdin)) != -1) {
+        if (length > 0 && line[length - 1] == '\n')
+            length--;
+
+        Value result;
+        Value input = OBJ_VAL(copyString(vm, line, (int)length));
+        if (runScript(vm, script, input, &result) != INTERPRET_OK) {
+            free(line);
+            writeReports(vm);
+            exit(70);
+        }
+    }
+
+    free(line);
+    freeScript(vm, script);
+}
+
+static void usage(void)
+{
+    fprintf(stderr, "Usage: lisp [--gc-slice budget] [--no-cache] "
+                    "[--image file] [--dump-image file] [--each] "
+                    "[--profile file] [--opcode-stats] [--gc-stats] [path]\n");
+    exit(64);
 }
 
 int main(int argc, const char* argv[])
 {
-    initVM();
+    const char* path = NULL;
+    const char* imagePath = NULL;
+    const char* dumpPath = NULL;
+    long gcSliceBudget = -1;
+    bool each = false;
+    bool opcodeStats = false;
 
-    if (argc == 1) {
-        repl();
-    } else if (argc == 2) {
-        runFile(argv[1]);
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--gc-slice") == 0 && i + 1 < argc) {
+            // Objects to mark or sweep per slice, 0 to collect in one pause.
+            char* end;
+            gcSliceBudget = strtol(argv[++i], &end, 10);
+            if (*end != '\0' || gcSliceBudget < 0)
+                usage();
+        } else if (strcmp(argv[i], "--no-cache") == 0) {
+            useCache = false;
+        } else if (strcmp(argv[i], "--image") == 0 && i + 1 < argc) {
+            // Start from the globals saved by --dump-image.
+            imagePath = argv[++i];
+        } else if (strcmp(argv[i], "--dump-image") == 0 && i + 1 < argc) {
+            // Run the script, as a prelude, then save the globals to an image
+            // instead of starting the REPL.
+            dumpPath = argv[++i];
+        } else if (strcmp(argv[i], "--each") == 0) {
+            // Run the script once for every line of standard input.
+            each = true;
+        } else if (strcmp(argv[i], "--profile") == 0 && i + 1 < argc) {
+            // Sample the call stack while the script runs, and write the
+            // stacks to the file in collapsed stack format.
+            profilePath = argv[++i];
+        } else if (strcmp(argv[i], "--opcode-stats") == 0) {
+            // Count the instructions run, and print the counts at exit.
+            opcodeStats = true;
+        } else if (strcmp(argv[i], "--gc-stats") == 0) {
+            // Print the collector's statistics at exit: collection counts,
+            // the pause histogram, bytes promoted and freed, the nextGC
+            // thresholds, and the objects of each type in the heap.
+            gcStats = true;
+        } else if (path == NULL && argv[i][0] != '-') {
+            path = argv[i];
+        } else {
+            usage();
+        }
+    }
+
+    VM* vm = (VM*)malloc(sizeof(VM));
+    if (vm == NULL)
+        exit(1);
+
+    if (imagePath == NULL) {
+        initVM(vm);
+    } else if (!initVMFromImage(vm, imagePath)) {
+        fprintf(stderr, "Could not load image \"%s\".\n", imagePath);
+        exit(74);
+    }
+
+    if (gcSliceBudget >= 0)
+        vm->gcSliceBudget = (size_t)gcSliceBudget;
+
+    if (each && (path == NULL || dumpPath != NULL))
+        usage();
+
+    if (profilePath != NULL)
+        startProfiler(vm);
+
+    if (opcodeStats)
+        vm->opcodeStats = newOpcodeStats();
+
+    if (each) {
+        runEach(vm, path);
+    } else if (dumpPath != NULL) {
+        if (path != NULL)
+            runFile(vm, path);
+
+        if (!writeImage(vm, dumpPath)) {
+            fprintf(stderr, "Could not write image \"%s\".\n", dumpPath);
+            exit(74);
+        }
+    } else if (path == NULL) {
+        repl(vm);
     } else {
-        fprintf(stderr, "Usage: lisp [path]\n");
-        exit(64);
+        runFile(vm, path);
     }
 
-    freeVM();
+    writeReports(vm);
+    freeVM(vm);
+    free(vm);
     return 0;
 }
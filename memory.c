@@ -1,59 +1,329 @@
 #include <stddef.h>
+#include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include "chunk.h"
 #include "compiler.h"
 #include "memory.h"
 #include "object.h"
+#include "scheduler.h"
 #include "table.h"
 #include "value.h"
 #include "vm.h"
 
-#ifdef DEBUG_LOG_GC
-#include <stdio.h>
-#endif
-
 #define GC_HEAP_GROW_FACTOR 2
 
+// Number of bytes available for objects in each block of the nursery.
+#define NURSERY_SIZE (256 * 1024)
+
+// Round the size of an object up so that every object in the nursery starts
+// on an 8 byte boundary.
+#define NURSERY_ALIGN(size) (((size) + 7) & ~(size_t)7)
+
+// Size classes of the pools are multiples of POOL_GRANULE bytes, up to
+// POOL_MAX_SIZE. Anything larger goes straight to realloc.
+#define POOL_GRANULE 16
+#define POOL_MAX_SIZE (POOL_GRANULE * POOL_CLASSES)
+
+// Size of each page in a pool. Pages are aligned to their size, so the page
+// that a cell belongs to can be found from the cell's address.
+#define POOL_PAGE_SIZE (64 * 1024)
+
+// Space at the start of each page used for its header.
+#define POOL_PAGE_HEADER \
+    ((sizeof(PoolPage) + POOL_GRANULE - 1) & ~(size_t)(POOL_GRANULE - 1))
+
+// Index of the size class used for allocations of the given size.
+#define POOL_CLASS(size) (((size) - 1) / POOL_GRANULE)
+
+// Return the page that a pool cell was allocated from.
+static PoolPage* pageOf(void* cell)
+{
+    return (PoolPage*)((uintptr_t)cell & ~(uintptr_t)(POOL_PAGE_SIZE - 1));
+}
+
+// Allocate a new page for a pool, and split it into free cells. The cells are
+// linked in address order, so that objects allocated together end up next to
+// each other in memory.
+static void addPoolPage(Pool* pool, size_t cellSize)
+{
+    PoolPage* page = (PoolPage*)aligned_alloc(POOL_PAGE_SIZE, POOL_PAGE_SIZE);
+    if (page == NULL)
+        exit(1);
+
+    page->next = pool->pages;
+    page->liveCells = 0;
+    pool->pages = page;
+    pool->pageCount++;
+
+    uint8_t* start = (uint8_t*)page + POOL_PAGE_HEADER;
+    size_t cellCount = (POOL_PAGE_SIZE - POOL_PAGE_HEADER) / cellSize;
+
+    for (size_t i = cellCount; i > 0; i--) {
+        FreeCell* cell = (FreeCell*)(start + (i - 1) * cellSize);
+        cell->next = pool->freeList;
+        pool->freeList = cell;
+    }
+}
+
+// Take a cell from the pool for the size class of the given size.
+static void* poolAllocate(VM* vm, size_t size)
+{
+    size_t sizeClass = POOL_CLASS(size);
+    Pool* pool = &vm->pools[sizeClass];
+
+    if (pool->freeList == NULL)
+        addPoolPage(pool, (sizeClass + 1) * POOL_GRANULE);
+
+    FreeCell* cell = pool->freeList;
+    pool->freeList = cell->next;
+    pool->liveCells++;
+    pageOf(cell)->liveCells++;
+
+    return cell;
+}
+
+// Return a cell to the pool for the size class of the given size.
+static void poolFree(VM* vm, void* pointer, size_t size)
+{
+    Pool* pool = &vm->pools[POOL_CLASS(size)];
+    FreeCell* cell = (FreeCell*)pointer;
+
+    cell->next = pool->freeList;
+    pool->freeList = cell;
+    pool->liveCells--;
+    pageOf(cell)->liveCells--;
+}
+
 // reallocate takes a pointer and does one of three actions:
 // 1. if the newSize is 0, free the pointer
 // 2. if the oldSize is 0, initialise a new block of memory
 // 3. resize the memory block at the pointer from the old to the new size
 //
-// realloc from stdlib takes care of case 2 and 3.
+// Blocks of up to POOL_MAX_SIZE bytes come from the pools, and larger ones
+// from realloc in stdlib. As the pools rely on the size to find the block's
+// size class, oldSize must always be the size the block was allocated with.
 //
 // All memory allocation and deallocation goes through this function, to
 // assist in tracking for the garbage collector.
-void* reallocate(void* pointer, size_t oldSize, size_t newSize)
+void* reallocate(VM* vm, void* pointer, size_t oldSize, size_t newSize)
 {
-    vm.bytesAllocated += newSize - oldSize;
+    vm->bytesAllocated += newSize - oldSize;
     if (newSize > oldSize) {
 #ifdef DEBUG_STRESS_GC
-        collectGarbage();
+        collectGarbage(vm);
 #else
-        if (vm.bytesAllocated > vm.nextGC) {
-            collectGarbage();
-        }
+        stepGarbage(vm);
 #endif
     }
 
+    bool oldPooled = pointer != NULL && oldSize <= POOL_MAX_SIZE;
+    bool newPooled = newSize <= POOL_MAX_SIZE;
+
     if (newSize == 0) {
-        free(pointer);
+        if (oldPooled) {
+            poolFree(vm, pointer, oldSize);
+        } else {
+            free(pointer);
+        }
         return NULL;
     }
 
-    void* result = realloc(pointer, newSize);
+    if (pointer == NULL && newPooled)
+        return poolAllocate(vm, newSize);
+
+    if (oldPooled && newPooled && POOL_CLASS(oldSize) == POOL_CLASS(newSize))
+        return pointer;
+
+    if (!oldPooled && !newPooled) {
+        void* result = realloc(pointer, newSize);
+        if (result == NULL)
+            exit(1);
+        return result;
+    }
+
+    // The block moves between a pool and realloc, or between size classes.
+    void* result = newPooled ? poolAllocate(vm, newSize) : malloc(newSize);
     if (result == NULL)
         exit(1);
+
+    memcpy(result, pointer, oldSize < newSize ? oldSize : newSize);
+
+    if (oldPooled) {
+        poolFree(vm, pointer, oldSize);
+    } else {
+        free(pointer);
+    }
     return result;
 }
 
-// Mark object as visited during garbage collection.
-void markObject(Obj* object)
+// Old objects are promoted into pool cells and swept straight back onto the
+// pools' free lists, so every object struct has to fit in a cell.
+#define ASSERT_POOLED(type) \
+    _Static_assert(sizeof(type) <= POOL_MAX_SIZE, #type " is too big to pool")
+
+ASSERT_POOLED(ObjString);
+ASSERT_POOLED(ObjList);
+ASSERT_POOLED(ObjDict);
+ASSERT_POOLED(ObjFunction);
+ASSERT_POOLED(ObjClosure);
+ASSERT_POOLED(ObjNative);
+ASSERT_POOLED(ObjUpvalue);
+ASSERT_POOLED(ObjDictNode);
+ASSERT_POOLED(ObjFuture);
+ASSERT_POOLED(ObjCoroutine);
+ASSERT_POOLED(ObjSequence);
+ASSERT_POOLED(ObjIterator);
+
+// Return the size of the struct used for objects of the given type.
+static size_t objectSize(ObjType type)
+{
+    switch (type) {
+    case OBJ_STRING:
+        return sizeof(ObjString);
+    case OBJ_LIST:
+        return sizeof(ObjList);
+    case OBJ_DICT:
+        return sizeof(ObjDict);
+    case OBJ_FUNCTION:
+        return sizeof(ObjFunction);
+    case OBJ_CLOSURE:
+        return sizeof(ObjClosure);
+    case OBJ_NATIVE:
+        return sizeof(ObjNative);
+    case OBJ_UPVALUE:
+        return sizeof(ObjUpvalue);
+    case OBJ_DICT_NODE:
+        return sizeof(ObjDictNode);
+    case OBJ_FUTURE:
+        return sizeof(ObjFuture);
+    case OBJ_COROUTINE:
+        return sizeof(ObjCoroutine);
+    case OBJ_SEQUENCE:
+        return sizeof(ObjSequence);
+    case OBJ_ITERATOR:
+        return sizeof(ObjIterator);
+    }
+
+    return 0;
+}
+
+// Allocate a new, empty block for the nursery and make it the block that
+// objects are allocated from.
+static void addNurseryBlock(VM* vm)
+{
+    NurseryBlock* block = (NurseryBlock*)malloc(sizeof(NurseryBlock)
+        + NURSERY_SIZE);
+
+    if (block == NULL)
+        exit(1);
+
+    block->next = vm->nursery;
+    block->used = 0;
+    vm->nursery = block;
+}
+
+// Set up the nursery, the remembered set, and the state of incremental
+// collections for a fresh VM.
+void initGC(VM* vm)
+{
+    for (int i = 0; i < POOL_CLASSES; i++) {
+        vm->pools[i].freeList = NULL;
+        vm->pools[i].pages = NULL;
+        vm->pools[i].pageCount = 0;
+        vm->pools[i].liveCells = 0;
+    }
+
+    vm->gcPhase = GC_IDLE;
+    vm->sweepList = NULL;
+    vm->gcSliceBudget = GC_SLICE_BUDGET;
+    vm->nursery = NULL;
+    vm->gcRequested = false;
+    vm->rememberedSet = NULL;
+    vm->rememberedCount = 0;
+    vm->rememberedCapacity = 0;
+    memset(&vm->gcStats, 0, sizeof(vm->gcStats));
+    addNurseryBlock(vm);
+}
+
+// Allocate memory for a young object by bumping the used count of the current
+// nursery block.
+//
+// Minor collections move objects, so they cannot run while C code may be
+// holding pointers to young objects. When the block is full, another block is
+// chained on instead and a collection is requested for the next safepoint.
+Obj* allocateYoung(VM* vm, size_t size)
+{
+    size = NURSERY_ALIGN(size);
+
+    if (vm->nursery->used + size > NURSERY_SIZE) {
+        addNurseryBlock(vm);
+        vm->gcRequested = true;
+    }
+
+#ifdef DEBUG_STRESS_GC
+    vm->gcRequested = true;
+#endif
+
+    Obj* object = (Obj*)(vm->nursery->data + vm->nursery->used);
+    vm->nursery->used += size;
+    return object;
+}
+
+// Call the given function on every object in the nursery.
+static void forEachYoung(VM* vm, void (*visit)(VM* vm, Obj* object))
+{
+    for (NurseryBlock* block = vm->nursery; block != NULL;
+        block = block->next) {
+        size_t offset = 0;
+
+        while (offset < block->used) {
+            Obj* object = (Obj*)(block->data + offset);
+            offset += NURSERY_ALIGN(objectSize(object->type));
+            visit(vm, object);
+        }
+    }
+}
+
+// Add an old object to the remembered set.
+void rememberObject(VM* vm, Obj* object)
+{
+    if (vm->rememberedCapacity < vm->rememberedCount + 1) {
+        vm->rememberedCapacity = (int)GROW_CAPACITY(vm->rememberedCapacity);
+        vm->rememberedSet = (Obj**)realloc(vm->rememberedSet,
+            sizeof(Obj*) * (size_t)vm->rememberedCapacity);
+
+        if (vm->rememberedSet == NULL)
+            exit(1);
+    }
+
+    object->isRemembered = true;
+    vm->rememberedSet[vm->rememberedCount++] = object;
+}
+
+// Add an object to the greyStack, to have its references processed later.
+static void pushGrey(VM* vm, Obj* object)
+{
+    if (vm->greyCapacity < vm->greyCount + 1) {
+        vm->greyCapacity = (int)GROW_CAPACITY(vm->greyCapacity);
+        vm->greyStack = (Obj**)realloc(vm->greyStack,
+            sizeof(Obj*) * (size_t)vm->greyCapacity);
+
+        if (vm->greyStack == NULL)
+            exit(1);
+    }
+
+    vm->greyStack[vm->greyCount++] = object;
+}
+
+// Mark object as visited during garbage collection. Young objects are left
+// unmarked, since they are traced when marking finishes instead.
+void markObject(VM* vm, Obj* object)
 {
     if (object == NULL)
         return;
-    if (object->isMarked)
+    if (object->isMarked || object->isYoung)
         return;
 
 #ifdef DEBUG_LOG_GC
@@ -63,36 +333,40 @@ void markObject(Obj* object)
 #endif
 
     object->isMarked = true;
-
-    if (vm.greyCapacity < vm.greyCount + 1) {
-        vm.greyCapacity = (int)GROW_CAPACITY(vm.greyCapacity);
-        vm.greyStack = (Obj**)realloc(vm.greyStack,
-            sizeof(Obj*) * (size_t)vm.greyCapacity);
-
-        if (vm.greyStack == NULL)
-            exit(1);
-    }
-
-    vm.greyStack[vm.greyCount++] = object;
+    pushGrey(vm, object);
 }
 
 // Mark the object associated with a Value during garbage collection.
-void markValue(Value value)
+void markValue(VM* vm, Value value)
 {
     if (IS_OBJ(value))
-        markObject(AS_OBJ(value));
+        markObject(vm, AS_OBJ(value));
+}
+
+// Barrier for a coroutine whose stack and frames have just been swapped with
+// the VM's. The VM writes to its stack without barriers, so the coroutine is
+// treated as though anything could have been stored into it.
+void coroutineBarrier(VM* vm, Obj* object)
+{
+    if (object->isYoung)
+        return;
+
+    if (!object->isRemembered)
+        rememberObject(vm, object);
+    if (vm->gcPhase == GC_MARK && object->isMarked)
+        pushGrey(vm, object);
 }
 
 // Mark every value in a dynamically allocated array during garbage collection.
-static void markArray(ValueArray* array)
+static void markArray(VM* vm, ValueArray* array)
 {
     for (int i = 0; i < array->count; i++) {
-        markValue(array->values[i]);
+        markValue(vm, array->values[i]);
     }
 }
 
 // Mark all objects associated with the current object.
-static void blackenObject(Obj* object)
+static void blackenObject(VM* vm, Obj* object)
 {
 #ifdef DEBUG_LOG_GC
     printf("%p blacken ", (void*)object);
@@ -103,34 +377,73 @@ static void blackenObject(Obj* object)
     switch (object->type) {
     case OBJ_CLOSURE: {
         ObjClosure* closure = (ObjClosure*)object;
-        markObject((Obj*)closure->function);
+        markObject(vm, (Obj*)closure->function);
         for (int i = 0; i < closure->upvalueCount; i++) {
-            markObject((Obj*)closure->upvalues[i]);
+            markObject(vm, (Obj*)closure->upvalues[i]);
         }
         break;
     }
     case OBJ_FUNCTION: {
         ObjFunction* function = (ObjFunction*)object;
-        markObject((Obj*)function->name);
-        markArray(&function->chunk.constants);
+        markObject(vm, (Obj*)function->name);
+        markArray(vm, &function->chunk.constants);
         break;
     }
     case OBJ_UPVALUE:
-        markValue(((ObjUpvalue*)object)->closed);
+        markValue(vm, ((ObjUpvalue*)object)->closed);
+        markObject(vm, (Obj*)((ObjUpvalue*)object)->coroutine);
         break;
     case OBJ_LIST: {
         ObjList* list = (ObjList*)object;
-        for (int i = 0; i < list->array.count; i++) {
-            markValue(list->array.values[i]);
+        Value* values = listValues(list);
+        for (int i = 0; i < list->count; i++) {
+            markValue(vm, values[i]);
         }
         break;
     }
-    case OBJ_DICT: {
-        ObjDict* dict = (ObjDict*)object;
-        for (int i = 0; i < dict->table.capacity; i++) {
-            Entry entry = dict->table.entries[i];
-            markValue(entry.key);
-            markValue(entry.value);
+    case OBJ_DICT:
+        markObject(vm, (Obj*)((ObjDict*)object)->root);
+        break;
+    case OBJ_DICT_NODE: {
+        ObjDictNode* node = (ObjDictNode*)object;
+        for (int i = 0; i < node->count; i++) {
+            markValue(vm, node->slots[i].key);
+            markValue(vm, node->slots[i].value);
+        }
+        break;
+    }
+    case OBJ_FUTURE:
+        markValue(vm, ((ObjFuture*)object)->value);
+        break;
+    case OBJ_COROUTINE: {
+        ObjCoroutine* coroutine = (ObjCoroutine*)object;
+        markObject(vm, (Obj*)coroutine->closure);
+        markObject(vm, (Obj*)coroutine->caller);
+
+        for (Value* slot = coroutine->stack; slot < coroutine->stackTop;
+            slot++) {
+            markValue(vm, *slot);
+        }
+
+        for (int i = 0; i < coroutine->frameCount; i++) {
+            markObject(vm, (Obj*)coroutine->frames[i].closure);
+        }
+
+        for (ObjUpvalue* upvalue = coroutine->openUpvalues; upvalue != NULL;
+            upvalue = upvalue->next) {
+            markObject(vm, (Obj*)upvalue);
+        }
+        break;
+    }
+    case OBJ_SEQUENCE:
+        markValue(vm, ((ObjSequence*)object)->source);
+        markValue(vm, ((ObjSequence*)object)->function);
+        break;
+    case OBJ_ITERATOR: {
+        ObjIterator* iterator = (ObjIterator*)object;
+        markValue(vm, iterator->list);
+        for (int i = 0; i < iterator->stageCount; i++) {
+            markValue(vm, iterator->stages[i].function);
         }
         break;
     }
@@ -140,145 +453,811 @@ static void blackenObject(Obj* object)
     }
 }
 
-// Free the memory used by the object at the given address.
-static void freeObject(Obj* object)
+// Free the memory owned by the object at the given address, without freeing
+// the object itself.
+static void freeObjectContents(VM* vm, Obj* object)
 {
-#ifdef DEBUG_LOG_GC
-    printf("%p free type %d\n", (void*)object, object->type);
-#endif
-
     switch (object->type) {
     case OBJ_STRING: {
         ObjString* string = (ObjString*)object;
-        FREE_ARRAY(char, string->chars, string->length + 1);
-        FREE(ObjString, object);
+        FREE_ARRAY(vm, char, string->chars, string->length + 1);
         break;
     }
-    case OBJ_FUNCTION: {
-        ObjFunction* function = (ObjFunction*)object;
-        freeChunk(&function->chunk);
-        FREE(ObjFunction, function);
+    case OBJ_FUNCTION:
+        freeChunk(vm, &((ObjFunction*)object)->chunk);
         break;
-    }
     case OBJ_CLOSURE: {
         ObjClosure* closure = (ObjClosure*)object;
-        FREE_ARRAY(ObjUpvalue*, closure->upvalues, closure->upvalueCount);
-        FREE(ObjClosure, object);
+        FREE_ARRAY(vm, ObjUpvalue*, closure->upvalues, closure->upvalueCount);
         break;
     }
-    case OBJ_NATIVE:
-        FREE(ObjNative, object);
-        break;
-    case OBJ_UPVALUE:
-        FREE(ObjUpvalue, object);
+    case OBJ_LIST:
+        releaseList(vm, (ObjList*)object);
         break;
-    case OBJ_LIST: {
-        ObjList* list = (ObjList*)object;
-        initValueArray(&list->array);
-        FREE(ObjList, list);
+    case OBJ_DICT_NODE: {
+        ObjDictNode* node = (ObjDictNode*)object;
+        FREE_ARRAY(vm, Entry, node->slots, node->count);
         break;
     }
-    case OBJ_DICT: {
-        ObjDict* dict = (ObjDict*)object;
-        initTable(&dict->table);
-        FREE(ObjDict, dict);
+    case OBJ_FUTURE:
+        releaseTask(((ObjFuture*)object)->task);
+        break;
+    case OBJ_COROUTINE:
+        freeCoroutineStack((ObjCoroutine*)object);
+        break;
+    case OBJ_ITERATOR: {
+        ObjIterator* iterator = (ObjIterator*)object;
+        FREE_ARRAY(vm, IteratorStage, iterator->stages, iterator->stageCount);
         break;
     }
+    case OBJ_SEQUENCE:
+    case OBJ_DICT:
+    case OBJ_NATIVE:
+    case OBJ_UPVALUE:
+        break;
     }
 }
 
-// Mark all Values directly accessible by the VM.
-static void markRoots(void)
+// Free the memory used by the old object at the given address.
+static void freeObject(VM* vm, Obj* object)
+{
+#ifdef DEBUG_LOG_GC
+    printf("%p free type %d\n", (void*)object, object->type);
+#endif
+
+    freeObjectContents(vm, object);
+    reallocate(vm, object, objectSize(object->type), 0);
+}
+
+// Mark the Values on the stack, and the objects used by the code that is
+// running. These are written to without a barrier, so they are marked again
+// when marking finishes.
+static void markStackRoots(VM* vm)
 {
-    for (Value* slot = vm.stack; slot < vm.stackTop; slot++) {
-        markValue(*slot);
+    for (Value* slot = vm->stack; slot < vm->stackTop; slot++) {
+        markValue(vm, *slot);
     }
 
-    for (int i = 0; i < vm.frameCount; i++) {
-        markObject((Obj*)vm.frames[i].closure);
+    for (int i = 0; i < vm->frameCount; i++) {
+        markObject(vm, (Obj*)vm->frames[i].closure);
     }
 
-    for (ObjUpvalue* upvalue = vm.openUpvalues; upvalue != NULL;
+    for (ObjUpvalue* upvalue = vm->openUpvalues; upvalue != NULL;
         upvalue = upvalue->next) {
-        markObject((Obj*)upvalue);
+        markObject(vm, (Obj*)upvalue);
     }
 
-    markTable(&vm.globals);
-    markCompilerRoots();
+    markObject(vm, (Obj*)vm->coroutine);
+    markCompilerRoots(vm);
 }
 
-// For each marked object, remove it from the greyStack and add all associated
-// values onto the greyStack.
-static void traceReferences(void)
+// Mark all Values directly accessible by the VM.
+static void markRoots(VM* vm)
 {
-    while (vm.greyCount > 0) {
-        Obj* object = vm.greyStack[--vm.greyCount];
-        blackenObject(object);
+    markStackRoots(vm);
+
+    for (int i = 0; i < vm->globalCount; i++) {
+        markObject(vm, (Obj*)vm->globals[i].name);
+        markValue(vm, vm->globals[i].value);
+    }
+
+    markTable(vm, &vm->globalNames);
+
+    for (int i = 0; i < vm->scripts.count; i++) {
+        markValue(vm, vm->scripts.values[i]);
     }
 }
 
-// Go through all the objects that have been allocated. Free any that have not
-// been marked.
-static void sweep(void)
+// Blacken objects from the greyStack until it is empty, or the budget of
+// objects has been used up. Return the unused budget.
+static size_t traceReferences(VM* vm, size_t budget)
 {
-    Obj* previous = NULL;
-    Obj* object = vm.objects;
+    while (vm->greyCount > 0 && budget > 0) {
+        Obj* object = vm->greyStack[--vm->greyCount];
+        blackenObject(vm, object);
+        budget--;
+    }
+
+    return budget;
+}
+
+// Free unmarked objects from the sweepList, until it is empty or the budget of
+// objects has been used up. Marked objects are unmarked and moved back onto
+// the objects list. Return the unused budget.
+//
+// Objects promoted while sweeping are added to the objects list rather than
+// the sweepList, so they are never mistaken for garbage.
+static size_t sweep(VM* vm, size_t budget)
+{
+    size_t before = vm->bytesAllocated;
+    // Freed objects are gathered into a list for each size class, and
+    // returned to the pools in bulk at the end.
+    FreeCell* freed[POOL_CLASSES] = { NULL };
+    FreeCell* freedTail[POOL_CLASSES] = { NULL };
+    size_t freedCount[POOL_CLASSES] = { 0 };
+
+    while (vm->sweepList != NULL && budget > 0) {
+        Obj* object = vm->sweepList;
+        vm->sweepList = object->next;
+        budget--;
 
-    while (object != NULL) {
         if (object->isMarked) {
             object->isMarked = false;
-            previous = object;
-            object = object->next;
-        } else {
-            Obj* unreached = object;
-            object = object->next;
+            object->next = vm->objects;
+            vm->objects = object;
+            continue;
+        }
+
+#ifdef DEBUG_LOG_GC
+        printf("%p free type %d\n", (void*)object, object->type);
+#endif
 
-            if (previous != NULL) {
-                previous->next = object;
-            } else {
-                vm.objects = object;
-            }
+        freeObjectContents(vm, object);
 
-            freeObject(unreached);
-        }
+        size_t size = objectSize(object->type);
+        size_t sizeClass = POOL_CLASS(size);
+        vm->bytesAllocated -= size;
+        pageOf(object)->liveCells--;
+
+        FreeCell* cell = (FreeCell*)object;
+        cell->next = freed[sizeClass];
+        if (freed[sizeClass] == NULL)
+            freedTail[sizeClass] = cell;
+        freed[sizeClass] = cell;
+        freedCount[sizeClass]++;
     }
+
+    for (int i = 0; i < POOL_CLASSES; i++) {
+        if (freed[i] == NULL)
+            continue;
+
+        Pool* pool = &vm->pools[i];
+        freedTail[i]->next = pool->freeList;
+        pool->freeList = freed[i];
+        pool->liveCells -= freedCount[i];
+    }
+
+    vm->gcStats.currentFreed += before - vm->bytesAllocated;
+    return budget;
 }
 
-// Straightforward mark and sweep garbage collection. Stops code execution when
-// running.
-// Starts by recursively tracing through all objects reachable from the VM,
-// then delete all objects that have not been marked as reachable.
-void collectGarbage(void)
+// Remove any old objects that are about to be swept from the remembered set.
+static void pruneRememberedSet(VM* vm)
+{
+    int count = 0;
+
+    for (int i = 0; i < vm->rememberedCount; i++) {
+        if (vm->rememberedSet[i]->isMarked)
+            vm->rememberedSet[count++] = vm->rememberedSet[i];
+    }
+
+    vm->rememberedCount = count;
+}
+
+// Begin a collection of the old generation by marking the roots.
+static void startCollection(VM* vm)
 {
 #ifdef DEBUG_LOG_GC
     printf("-- gc begin\n");
-    size_t before = vm.bytesAllocated;
 #endif
 
-    markRoots();
-    traceReferences();
+    vm->gcPhase = GC_MARK;
+    markRoots(vm);
+}
+
+// Complete the mark phase in a single step, then start sweeping.
+//
+// Young objects are never freed by a collection of the old generation, as C
+// code may still be holding them, so everything they reference has to be kept
+// as well. They are traced here rather than marked, as the mark is used for
+// forwarding by minor collections.
+static void finishMarking(VM* vm)
+{
+    markStackRoots(vm);
+    forEachYoung(vm, blackenObject);
+    traceReferences(vm, SIZE_MAX);
+
     // Extra stage for removing strings that have no references.
-    tableRemoveWhite(&vm.strings);
-    sweep();
+    tableRemoveWhite(&vm->strings);
+    pruneRememberedSet(vm);
+
+    vm->sweepList = vm->objects;
+    vm->objects = NULL;
+    vm->gcPhase = GC_SWEEP;
+}
 
-    vm.nextGC = vm.bytesAllocated * GC_HEAP_GROW_FACTOR;
+// Add a pause that began at the given time to the histogram.
+static void recordPause(VM* vm, size_t* histogram, uint64_t started)
+{
+    uint64_t pause = nanoseconds() - started;
+    uint64_t micros = pause / 1000;
+
+    int bucket = 0;
+    while (bucket < GC_PAUSE_BUCKETS - 1 && micros >= (uint64_t)1 << bucket)
+        bucket++;
+
+    histogram[bucket]++;
+    vm->gcStats.totalPauseNs += pause;
+    if (pause > vm->gcStats.maxPauseNs)
+        vm->gcStats.maxPauseNs = pause;
+}
+
+// Complete the collection, and set the threshold for the next one.
+static void finishCollection(VM* vm)
+{
+    vm->gcPhase = GC_IDLE;
+    vm->nextGC = vm->bytesAllocated * GC_HEAP_GROW_FACTOR;
+
+    GcStats* stats = &vm->gcStats;
+    stats->majorCollections++;
+    stats->bytesFreed += stats->currentFreed;
+    stats->lastFreed = stats->currentFreed;
+    if (stats->currentFreed > stats->maxFreed)
+        stats->maxFreed = stats->currentFreed;
+    stats->currentFreed = 0;
+    stats->nextGCHistory[stats->historyCount++ % GC_HISTORY] = vm->nextGC;
 
 #ifdef DEBUG_LOG_GC
     printf("-- gc end\n");
-    printf("\tcollected %zu bytes (from %zu to %zu) next at %zu\n",
-        before - vm.bytesAllocated, before, vm.bytesAllocated, vm.nextGC);
+    printf("\t%zu bytes allocated, next at %zu\n", vm->bytesAllocated,
+        vm->nextGC);
+    printPoolStats(vm);
+#endif
+}
+
+// Do a bounded amount of collection work, moving the collection on to its
+// next phase when the current one is done.
+static void collectSlice(VM* vm, size_t budget)
+{
+    if (vm->gcPhase == GC_MARK) {
+        budget = traceReferences(vm, budget);
+        if (vm->greyCount > 0)
+            return;
+
+        finishMarking(vm);
+    }
+
+    sweep(vm, budget);
+    if (vm->sweepList == NULL)
+        finishCollection(vm);
+}
+
+// Advance the collection of the old generation, starting a new one when the
+// heap has grown past the threshold. With a slice budget, the work is spread
+// over many calls, so that each pause is bounded by the budget rather than
+// the size of the heap.
+//
+// Objects stored into marked objects during the mark phase are marked by the
+// write barrier, so that nothing reachable is left unmarked.
+void stepGarbage(VM* vm)
+{
+    if (vm->gcPhase == GC_IDLE && vm->bytesAllocated <= vm->nextGC)
+        return;
+
+    uint64_t started = nanoseconds();
+    if (vm->gcPhase == GC_IDLE)
+        startCollection(vm);
+
+    collectSlice(vm, vm->gcSliceBudget == 0 ? SIZE_MAX : vm->gcSliceBudget);
+    recordPause(vm, vm->gcStats.majorPauses, started);
+}
+
+// Straightforward mark and sweep garbage collection of the old generation.
+// Stops code execution when running, finishing any incremental collection
+// that is in progress, or doing a complete one.
+// Starts by recursively tracing through all objects reachable from the VM,
+// then delete all old objects that have not been marked as reachable. Objects
+// in the nursery are left in place, for the next minor collection to handle.
+void collectGarbage(VM* vm)
+{
+    uint64_t started = nanoseconds();
+    if (vm->gcPhase == GC_IDLE)
+        startCollection(vm);
+
+    collectSlice(vm, SIZE_MAX);
+    recordPause(vm, vm->gcStats.majorPauses, started);
+}
+
+// Copy a young object out of the nursery into the old generation, and return
+// the address of the copy. The young object is left behind with a forwarding
+// pointer to the copy, so every reference to it gets updated to the same
+// address. References held by the copy are updated once it is scanned.
+static Obj* promoteObject(VM* vm, Obj* object)
+{
+    if (object->isMarked)
+        return object->next;
+
+    size_t size = objectSize(object->type);
+    Obj* promoted = (Obj*)poolAllocate(vm, size);
+    memcpy(promoted, object, size);
+    vm->bytesAllocated += size;
+    vm->gcStats.bytesPromoted += size;
+
+    promoted->isYoung = false;
+    promoted->isMarked = false;
+    promoted->isRemembered = false;
+    promoted->next = vm->objects;
+    vm->objects = promoted;
+
+    // Closed upvalues point at their own closed field, which has moved.
+    if (object->type == OBJ_UPVALUE) {
+        ObjUpvalue* upvalue = (ObjUpvalue*)promoted;
+        if (upvalue->location == &((ObjUpvalue*)object)->closed)
+            upvalue->location = &upvalue->closed;
+    }
+
+#ifdef DEBUG_LOG_GC
+    printf("%p promote to %p ", (void*)object, (void*)promoted);
+    printValue(OBJ_VAL(promoted));
+    printf("\n");
+#endif
+
+    object->isMarked = true;
+    object->next = promoted;
+    pushGrey(vm, promoted);
+
+    return promoted;
+}
+
+// Update an object reference to point at the promoted copy of a young object.
+static void forwardObject(VM* vm, Obj** object)
+{
+    if (*object != NULL && (*object)->isYoung)
+        *object = promoteObject(vm, *object);
+}
+
+// Update a Value to point at the promoted copy of a young object.
+static void forwardValue(VM* vm, Value* value)
+{
+    if (IS_OBJ(*value) && AS_OBJ(*value)->isYoung)
+        *value = OBJ_VAL(promoteObject(vm, AS_OBJ(*value)));
+}
+
+// Update every key and value in a Table that refers to a young object.
+static void forwardTable(VM* vm, Table* table)
+{
+    for (int i = 0; i < table->capacity; i++) {
+        forwardValue(vm, &table->entries[i].key);
+        forwardValue(vm, &table->entries[i].value);
+    }
+}
+
+// Update every reference held by an old object, promoting any young objects
+// that it refers to.
+static void scanObject(VM* vm, Obj* object)
+{
+    switch (object->type) {
+    case OBJ_CLOSURE: {
+        ObjClosure* closure = (ObjClosure*)object;
+        forwardObject(vm, (Obj**)&closure->function);
+        for (int i = 0; i < closure->upvalueCount; i++) {
+            forwardObject(vm, (Obj**)&closure->upvalues[i]);
+        }
+        break;
+    }
+    case OBJ_FUNCTION: {
+        ObjFunction* function = (ObjFunction*)object;
+        forwardObject(vm, (Obj**)&function->name);
+        for (int i = 0; i < function->chunk.constants.count; i++) {
+            forwardValue(vm, &function->chunk.constants.values[i]);
+        }
+        break;
+    }
+    case OBJ_UPVALUE:
+        forwardValue(vm, &((ObjUpvalue*)object)->closed);
+        forwardObject(vm, (Obj**)&((ObjUpvalue*)object)->coroutine);
+        break;
+    case OBJ_LIST: {
+        ObjList* list = (ObjList*)object;
+        Value* values = listValues(list);
+        for (int i = 0; i < list->count; i++) {
+            forwardValue(vm, &values[i]);
+        }
+        break;
+    }
+    case OBJ_DICT:
+        forwardObject(vm, (Obj**)&((ObjDict*)object)->root);
+        break;
+    case OBJ_DICT_NODE: {
+        ObjDictNode* node = (ObjDictNode*)object;
+        for (int i = 0; i < node->count; i++) {
+            forwardValue(vm, &node->slots[i].key);
+            forwardValue(vm, &node->slots[i].value);
+        }
+        break;
+    }
+    case OBJ_FUTURE:
+        forwardValue(vm, &((ObjFuture*)object)->value);
+        break;
+    case OBJ_COROUTINE: {
+        ObjCoroutine* coroutine = (ObjCoroutine*)object;
+        forwardObject(vm, (Obj**)&coroutine->closure);
+        forwardObject(vm, (Obj**)&coroutine->caller);
+
+        for (Value* slot = coroutine->stack; slot < coroutine->stackTop;
+            slot++) {
+            forwardValue(vm, slot);
+        }
+
+        for (int i = 0; i < coroutine->frameCount; i++) {
+            forwardObject(vm, (Obj**)&coroutine->frames[i].closure);
+        }
+
+        for (ObjUpvalue** upvalue = &coroutine->openUpvalues; *upvalue != NULL;
+            upvalue = &(*upvalue)->next) {
+            forwardObject(vm, (Obj**)upvalue);
+        }
+        break;
+    }
+    case OBJ_SEQUENCE:
+        forwardValue(vm, &((ObjSequence*)object)->source);
+        forwardValue(vm, &((ObjSequence*)object)->function);
+        break;
+    case OBJ_ITERATOR: {
+        ObjIterator* iterator = (ObjIterator*)object;
+        forwardValue(vm, &iterator->list);
+        for (int i = 0; i < iterator->stageCount; i++) {
+            forwardValue(vm, &iterator->stages[i].function);
+        }
+        break;
+    }
+    case OBJ_NATIVE:
+    case OBJ_STRING:
+        break;
+    }
+}
+
+// Promote every young object directly accessible by the VM, or stored in an
+// old object since the last minor collection.
+static void forwardRoots(VM* vm)
+{
+    for (Value* slot = vm->stack; slot < vm->stackTop; slot++) {
+        forwardValue(vm, slot);
+    }
+
+    for (int i = 0; i < vm->frameCount; i++) {
+        forwardObject(vm, (Obj**)&vm->frames[i].closure);
+    }
+
+    for (ObjUpvalue** upvalue = &vm->openUpvalues; *upvalue != NULL;
+        upvalue = &(*upvalue)->next) {
+        forwardObject(vm, (Obj**)upvalue);
+    }
+
+    forwardObject(vm, (Obj**)&vm->coroutine);
+
+    for (int i = 0; i < vm->globalCount; i++) {
+        forwardObject(vm, (Obj**)&vm->globals[i].name);
+        forwardValue(vm, &vm->globals[i].value);
+    }
+
+    forwardTable(vm, &vm->globalNames);
+
+    for (int i = 0; i < vm->scripts.count; i++) {
+        forwardValue(vm, &vm->scripts.values[i]);
+    }
+
+    for (int i = 0; i < vm->rememberedCount; i++) {
+        vm->rememberedSet[i]->isRemembered = false;
+        scanObject(vm, vm->rememberedSet[i]);
+    }
+    vm->rememberedCount = 0;
+}
+
+// Point interned strings at their promoted copies, and remove the strings
+// that died in the nursery.
+static void forwardStrings(VM* vm)
+{
+    for (int i = 0; i < vm->strings.capacity; i++) {
+        Entry* entry = &vm->strings.entries[i];
+        if (!IS_OBJ(entry->key) || !AS_OBJ(entry->key)->isYoung)
+            continue;
+
+        Obj* string = AS_OBJ(entry->key);
+        if (string->isMarked) {
+            entry->key = OBJ_VAL(string->next);
+        } else {
+            tableDelete(&vm->strings, entry->key);
+        }
+    }
+}
+
+// Free the memory owned by a young object that was not promoted.
+static void freeYoung(VM* vm, Obj* object)
+{
+    if (!object->isMarked)
+        freeObjectContents(vm, object);
+}
+
+// Empty the nursery, keeping a single block to allocate from.
+static void resetNursery(VM* vm)
+{
+    NurseryBlock* block = vm->nursery->next;
+    while (block != NULL) {
+        NurseryBlock* next = block->next;
+        free(block);
+        block = next;
+    }
+
+    vm->nursery->next = NULL;
+    vm->nursery->used = 0;
+}
+
+// Minor collection of the nursery. Young objects that are reachable from the
+// roots or the remembered set are copied into the old generation, and the
+// nursery is emptied, so the cost depends on the number of survivors rather
+// than the number of objects allocated.
+//
+// As objects are moved, this must only be called at a safepoint where the only
+// pointers to objects are the ones known to the collector.
+void collectYoung(VM* vm)
+{
+#ifdef DEBUG_LOG_GC
+    printf("-- minor gc begin\n");
+    size_t before = vm->bytesAllocated;
 #endif
+
+    uint64_t started = nanoseconds();
+    vm->gcRequested = false;
+    vm->gcStats.minorCollections++;
+
+    // The greyStack may already hold objects for the mark phase, so only the
+    // part above them is used for promoted objects.
+    int greyBase = vm->greyCount;
+    Obj* oldObjects = vm->objects;
+
+    forwardRoots(vm);
+    while (vm->greyCount > greyBase) {
+        scanObject(vm, vm->greyStack[--vm->greyCount]);
+    }
+
+    // Promoted objects may have been stored into objects that are already
+    // marked, so they are marked too while marking is in progress.
+    if (vm->gcPhase == GC_MARK) {
+        for (Obj* object = vm->objects; object != oldObjects;
+            object = object->next) {
+            markObject(vm, object);
+        }
+    }
+
+    forwardStrings(vm);
+    forEachYoung(vm, freeYoung);
+    resetNursery(vm);
+
+#ifdef DEBUG_LOG_GC
+    printf("-- minor gc end\n");
+    printf("\tpromoted %zu bytes (from %zu to %zu)\n",
+        vm->bytesAllocated - before, before, vm->bytesAllocated);
+#endif
+
+    recordPause(vm, vm->gcStats.minorPauses, started);
+    stepGarbage(vm);
 }
 
 // Free all objects that have been allocated in the VM.
-void freeObjects(void)
+void freeObjects(VM* vm)
+{
+    Obj* lists[] = { vm->objects, vm->sweepList };
+    for (int i = 0; i < 2; i++) {
+        Obj* object = lists[i];
+        while (object != NULL) {
+            Obj* next = object->next;
+            freeObject(vm, object);
+            object = next;
+        }
+    }
+    vm->objects = NULL;
+    vm->sweepList = NULL;
+
+    forEachYoung(vm, freeObjectContents);
+
+    NurseryBlock* block = vm->nursery;
+    while (block != NULL) {
+        NurseryBlock* next = block->next;
+        free(block);
+        block = next;
+    }
+    vm->nursery = NULL;
+
+    free(vm->greyStack);
+    free(vm->rememberedSet);
+}
+
+// Release every page of the pools. Must be called after everything allocated
+// through reallocate has been freed.
+void freePools(VM* vm)
+{
+    for (int i = 0; i < POOL_CLASSES; i++) {
+        Pool* pool = &vm->pools[i];
+        PoolPage* page = pool->pages;
+
+        while (page != NULL) {
+            PoolPage* next = page->next;
+            free(page);
+            page = next;
+        }
+
+        pool->freeList = NULL;
+        pool->pages = NULL;
+        pool->pageCount = 0;
+        pool->liveCells = 0;
+    }
+}
+
+// Print the number of pages and cells in use for each size class of the
+// pools, along with how many of the pages are empty.
+void printPoolStats(VM* vm)
+{
+    printf("%-6s %6s %10s %10s %6s\n", "class", "pages", "live", "capacity",
+        "empty");
+
+    for (int i = 0; i < POOL_CLASSES; i++) {
+        Pool* pool = &vm->pools[i];
+        if (pool->pageCount == 0)
+            continue;
+
+        size_t cellSize = (size_t)(i + 1) * POOL_GRANULE;
+        size_t cellsPerPage = (POOL_PAGE_SIZE - POOL_PAGE_HEADER) / cellSize;
+        int emptyPages = 0;
+
+        for (PoolPage* page = pool->pages; page != NULL; page = page->next) {
+            if (page->liveCells == 0)
+                emptyPages++;
+        }
+
+        printf("%-6zu %6d %10zu %10zu %6d\n", cellSize, pool->pageCount,
+            pool->liveCells, cellsPerPage * (size_t)pool->pageCount,
+            emptyPages);
+    }
+}
+
+// Names of the types of objects, indexed by type.
+const char* const objectTypeNames[OBJ_TYPE_COUNT] = {
+    [OBJ_STRING] = "string",
+    [OBJ_LIST] = "list",
+    [OBJ_DICT] = "dict",
+    [OBJ_FUNCTION] = "function",
+    [OBJ_CLOSURE] = "closure",
+    [OBJ_NATIVE] = "native fn",
+    [OBJ_UPVALUE] = "upvalue",
+    [OBJ_DICT_NODE] = "dict node",
+    [OBJ_FUTURE] = "future",
+    [OBJ_COROUTINE] = "coroutine",
+    [OBJ_SEQUENCE] = "sequence",
+    [OBJ_ITERATOR] = "iterator",
+};
+
+// Return the number of bytes of heap memory owned by the object, as freed by
+// freeObjectContents. A list buffer is shared out evenly between the lists
+// that use it.
+static size_t ownedSize(Obj* object)
 {
-    Obj* object = vm.objects;
-    while (object != NULL) {
-        Obj* next = object->next;
-        freeObject(object);
-        object = next;
+    switch (object->type) {
+    case OBJ_STRING:
+        return (size_t)((ObjString*)object)->length + 1;
+    case OBJ_FUNCTION: {
+        Chunk* chunk = &((ObjFunction*)object)->chunk;
+        return (sizeof(uint8_t) + sizeof(int)) * (size_t)chunk->capacity
+            + sizeof(Value) * (size_t)chunk->constants.capacity;
     }
+    case OBJ_CLOSURE:
+        return sizeof(ObjUpvalue*)
+            * (size_t)((ObjClosure*)object)->upvalueCount;
+    case OBJ_LIST: {
+        ListBuffer* buffer = ((ObjList*)object)->buffer;
+        if (buffer == NULL)
+            return 0;
+
+        return (sizeof(ListBuffer) + sizeof(Value) * (size_t)buffer->capacity)
+            / (size_t)buffer->refCount;
+    }
+    case OBJ_DICT_NODE:
+        return sizeof(Entry) * (size_t)((ObjDictNode*)object)->count;
+    case OBJ_ITERATOR:
+        return sizeof(IteratorStage)
+            * (size_t)((ObjIterator*)object)->stageCount;
+    case OBJ_FUTURE:
+    case OBJ_COROUTINE:
+    case OBJ_SEQUENCE:
+    case OBJ_DICT:
+    case OBJ_NATIVE:
+    case OBJ_UPVALUE:
+        break;
+    }
+
+    return 0;
+}
+
+static void countObject(HeapCensus* census, Obj* object)
+{
+    ObjType type = object->type;
+    size_t bytes = objectSize(type) + ownedSize(object);
+
+    census->counts[type]++;
+    census->bytes[type] += bytes;
+}
 
-    free(vm.greyStack);
+// Count the objects of each type that have not been freed, in both
+// generations, along with the bytes they use. Objects that have become
+// unreachable are counted until a collection frees them.
+void takeCensus(VM* vm, HeapCensus* census)
+{
+    memset(census, 0, sizeof(*census));
+
+    Obj* lists[] = { vm->objects, vm->sweepList };
+    for (int i = 0; i < 2; i++) {
+        for (Obj* object = lists[i]; object != NULL; object = object->next)
+            countObject(census, object);
+    }
+
+    for (NurseryBlock* block = vm->nursery; block != NULL;
+        block = block->next) {
+        size_t offset = 0;
+
+        while (offset < block->used) {
+            Obj* object = (Obj*)(block->data + offset);
+            offset += NURSERY_ALIGN(objectSize(object->type));
+            countObject(census, object);
+        }
+    }
+}
+
+// Print the histogram of pauses of both generations, leaving out the buckets
+// that no pause fell into.
+static void printPauses(GcStats* stats, FILE* out)
+{
+    fprintf(out, "%-16s %10s %10s\n", "pause (us)", "minor", "major");
+
+    for (int i = 0; i < GC_PAUSE_BUCKETS; i++) {
+        if (stats->minorPauses[i] == 0 && stats->majorPauses[i] == 0)
+            continue;
+
+        char bucket[32];
+        if (i < GC_PAUSE_BUCKETS - 1)
+            snprintf(bucket, sizeof(bucket), "< %llu", 1ull << i);
+        else
+            snprintf(bucket, sizeof(bucket), ">= %llu", 1ull << (i - 1));
+
+        fprintf(out, "%-16s %10zu %10zu\n", bucket, stats->minorPauses[i],
+            stats->majorPauses[i]);
+    }
+}
+
+// Print the number of collections of each generation that have run, followed
+// by their pause times, how the heap has grown, and the objects in it.
+void printGcStats(VM* vm, FILE* out)
+{
+    GcStats* stats = &vm->gcStats;
+
+    fprintf(out, "minor collections: %zu\n", stats->minorCollections);
+    fprintf(out, "major collections: %zu\n", stats->majorCollections);
+    fprintf(out, "total pause: %.3f ms, longest %.3f ms\n",
+        (double)stats->totalPauseNs / 1e6, (double)stats->maxPauseNs / 1e6);
+    printPauses(stats, out);
+
+    fprintf(out, "bytes promoted: %zu\n", stats->bytesPromoted);
+    fprintf(out, "bytes freed: %zu, last collection %zu, most %zu\n",
+        stats->bytesFreed, stats->lastFreed, stats->maxFreed);
+    fprintf(out, "bytes allocated: %zu, next gc at %zu\n",
+        vm->bytesAllocated, vm->nextGC);
+
+    fprintf(out, "next gc history:");
+    size_t first = stats->historyCount > GC_HISTORY
+        ? stats->historyCount - GC_HISTORY
+        : 0;
+    for (size_t i = first; i < stats->historyCount; i++)
+        fprintf(out, " %zu", stats->nextGCHistory[i % GC_HISTORY]);
+    fprintf(out, "\n");
+
+    HeapCensus census;
+    takeCensus(vm, &census);
+
+    fprintf(out, "%-16s %10s %10s\n", "type", "objects", "bytes");
+    for (int i = 0; i < OBJ_TYPE_COUNT; i++) {
+        if (census.counts[i] == 0)
+            continue;
+
+        fprintf(out, "%-16s %10zu %10zu\n", objectTypeNames[i],
+            census.counts[i], census.bytes[i]);
+    }
 }
@@ -1,15 +1,31 @@
 #ifndef clisp_memory_h
 #define clisp_memory_h
 
+#include <stdio.h>
+
 #include "common.h"
 #include "object.h"
+#include "vm.h"
+
+// Default number of objects marked or swept in each slice of an incremental
+// collection.
+#define GC_SLICE_BUDGET 1024
+
+// The objects of each type that have not yet been freed, and the bytes used
+// by them and the memory they own.
+typedef struct {
+    size_t counts[OBJ_TYPE_COUNT];
+    size_t bytes[OBJ_TYPE_COUNT];
+} HeapCensus;
+
+extern const char* const objectTypeNames[OBJ_TYPE_COUNT];
 
 // Helper macro to allocate memory via the reallocate function.
-#define ALLOCATE(type, count) \
-    (type*)reallocate(NULL, 0, sizeof(type) * ((size_t)count))
+#define ALLOCATE(vm, type, count) \
+    (type*)reallocate(vm, NULL, 0, sizeof(type) * ((size_t)count))
 
 // Helper macro to deallocate memory via the reallocate function.
-#define FREE(type, pointer) reallocate(pointer, sizeof(type), 0)
+#define FREE(vm, type, pointer) reallocate(vm, pointer, sizeof(type), 0)
 
 // Simple macro for defining the growth of the capacity of a dynamically
 // allocated array.
@@ -19,18 +35,55 @@
 // Macro for correctly calling the reallocate function.
 // Handles the growing, shrinking, allocating, and freeing of memory for
 // dynamically allocated arrays.
-#define GROW_ARRAY(type, pointer, oldCount, newCount)             \
-    (type*)reallocate(pointer, sizeof(type) * ((size_t)oldCount), \
+#define GROW_ARRAY(vm, type, pointer, oldCount, newCount)             \
+    (type*)reallocate(vm, pointer, sizeof(type) * ((size_t)oldCount), \
         sizeof(type) * ((size_t)newCount))
 
 // Macro for specifically freeing memory from a pointer.
-#define FREE_ARRAY(type, pointer, oldCount) \
-    reallocate(pointer, sizeof(type) * ((size_t)oldCount), 0)
-
-void* reallocate(void* pointer, size_t oldSize, size_t newSize);
-void markObject(Obj* object);
-void markValue(Value value);
-void collectGarbage(void);
-void freeObjects(void);
+#define FREE_ARRAY(vm, type, pointer, oldCount) \
+    reallocate(vm, pointer, sizeof(type) * ((size_t)oldCount), 0)
+
+void* reallocate(VM* vm, void* pointer, size_t oldSize, size_t newSize);
+void initGC(VM* vm);
+Obj* allocateYoung(VM* vm, size_t size);
+void rememberObject(VM* vm, Obj* object);
+void markObject(VM* vm, Obj* object);
+void markValue(VM* vm, Value value);
+void coroutineBarrier(VM* vm, Obj* object);
+void collectYoung(VM* vm);
+void stepGarbage(VM* vm);
+void collectGarbage(VM* vm);
+void freeObjects(VM* vm);
+void freePools(VM* vm);
+void printPoolStats(VM* vm);
+void takeCensus(VM* vm, HeapCensus* census);
+void printGcStats(VM* vm, FILE* out);
+
+// Write barrier for storing a Value into an object. Old objects that are given
+// a reference to a young object are added to the remembered set, so that the
+// next minor collection can find the young object through them. While marking
+// is in progress, anything stored into a marked object is marked as well.
+static inline void writeBarrier(VM* vm, Obj* object, Value value)
+{
+    if (object->isYoung || !IS_OBJ(value))
+        return;
+
+    Obj* target = AS_OBJ(value);
+    if (target->isYoung) {
+        if (!object->isRemembered)
+            rememberObject(vm, object);
+    } else if (vm->gcPhase == GC_MARK && object->isMarked) {
+        markObject(vm, target);
+    }
+}
+
+// Write barrier for storing a Value into a global variable. Globals are only
+// marked when a collection starts, so anything stored into one while marking
+// is in progress is marked as well.
+static inline void globalBarrier(VM* vm, Value value)
+{
+    if (vm->gcPhase == GC_MARK)
+        markValue(vm, value);
+}
 
 #endif
@@ -0,0 +1,637 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "chunk.h"
+#include "dict.h"
+#include "memory.h"
+#include "message.h"
+#include "object.h"
+#include "pointerMap.h"
+#include "value.h"
+#include "vm.h"
+
+// The kind of each value in a message, written before the value's contents.
+//
+// Objects other than strings and natives are numbered in the order they are
+// written, and an object that has already been written is written as a
+// reference to its number. Dicts are written as their entries and built up
+// again by the reader, as the trie's shape depends on hashes that may differ
+// in the reading VM. Globals read or defined by the functions in the
+// message follow the values, so that the reader can give the functions the
+// slots of the same globals in its own VM.
+typedef enum {
+    MESSAGE_NULL,
+    MESSAGE_TRUE,
+    MESSAGE_FALSE,
+    MESSAGE_NUMBER,
+    MESSAGE_REFERENCE,
+    MESSAGE_STRING,
+    MESSAGE_NATIVE,
+    MESSAGE_FUNCTION,
+    MESSAGE_CLOSURE,
+    MESSAGE_UPVALUE,
+    MESSAGE_LIST,
+    MESSAGE_DICT,
+    MESSAGE_SEQUENCE,
+    MESSAGE_GLOBAL,
+    MESSAGE_END,
+} MessageTag;
+
+// Flags recording what the writer has queued for a global.
+#define GLOBAL_NAME 1
+#define GLOBAL_VALUE 2
+
+typedef struct {
+    VM* vm;
+    Buffer* buffer;
+    PointerMap objects;
+
+    // Whether the values of the globals read by functions are written too.
+    bool withGlobals;
+
+    // GLOBAL_ flags for each global slot of the VM.
+    uint8_t* globals;
+
+    // Global entries still to be written, each a slot shifted left by one,
+    // with the lowest bit set if the value is to be written.
+    uint32_t* queue;
+    int queueCount;
+    int queueCapacity;
+
+    // Set if a value can't be written.
+    bool failed;
+} Writer;
+
+static void writeBytes(Writer* writer, const void* bytes, size_t size)
+{
+    appendBytes(writer->buffer, bytes, size, 1);
+}
+
+static void writeTag(Writer* writer, MessageTag tag)
+{
+    uint8_t byte = (uint8_t)tag;
+    writeBytes(writer, &byte, sizeof(byte));
+}
+
+static void writeU32(Writer* writer, uint32_t number)
+{
+    writeBytes(writer, &number, sizeof(number));
+}
+
+// Queue an entry for the global in the given slot, unless one has already
+// been queued.
+static void queueGlobal(Writer* writer, int slot, bool withValue)
+{
+    uint8_t flags = withValue ? GLOBAL_NAME | GLOBAL_VALUE : GLOBAL_NAME;
+    if ((writer->globals[slot] & flags) == flags)
+        return;
+    writer->globals[slot] |= flags;
+
+    if (writer->queueCount == writer->queueCapacity) {
+        writer->queueCapacity = (int)GROW_CAPACITY(writer->queueCapacity);
+        writer->queue = realloc(writer->queue,
+            sizeof(uint32_t) * (size_t)writer->queueCapacity);
+        if (writer->queue == NULL)
+            exit(1);
+    }
+
+    writer->queue[writer->queueCount++] = (uint32_t)slot << 1 | withValue;
+}
+
+// Queue the globals read and defined by the function's bytecode.
+static void queueGlobals(Writer* writer, Chunk* chunk)
+{
+    VM* vm = writer->vm;
+    int offset = 0;
+
+    if (writer->globals == NULL) {
+        writer->globals = calloc((size_t)vm->globalCount, sizeof(uint8_t));
+        if (writer->globals == NULL && vm->globalCount > 0)
+            exit(1);
+    }
+
+    while (offset < chunk->count) {
+        uint8_t instruction = chunk->code[offset];
+
+        if (instruction == OP_GET_GLOBAL || instruction == OP_DEFINE_GLOBAL) {
+            int slot = chunk->code[offset + 1] << 8 | chunk->code[offset + 2];
+            queueGlobal(writer, slot, instruction == OP_GET_GLOBAL
+                    && writer->withGlobals && vm->globals[slot].isDefined);
+        }
+
+        offset += instructionLength(chunk, offset);
+    }
+}
+
+static void writeValue(Writer* writer, Value value);
+
+// Write a function, its constants and its bytecode.
+static void writeFunction(Writer* writer, ObjFunction* function)
+{
+    Chunk* chunk = &function->chunk;
+    FunctionParts parts = functionParts(function);
+
+    writeTag(writer, MESSAGE_FUNCTION);
+    writeU32(writer, (uint32_t)parts.arity);
+    writeU32(writer, (uint32_t)parts.upvalueCount);
+    writeU32(writer, parts.codeCount);
+    writeU32(writer, parts.constantCount);
+    writeBytes(writer, parts.code, parts.codeCount);
+    writeBytes(writer, parts.lines, sizeof(int) * parts.codeCount);
+    writeBytes(writer, &function->id, sizeof(function->id));
+    writeValue(writer,
+        function->name == NULL ? NULL_VAL : OBJ_VAL(function->name));
+
+    for (int i = 0; i < chunk->constants.count; i++) {
+        writeValue(writer, chunk->constants.values[i]);
+    }
+
+    queueGlobals(writer, chunk);
+}
+
+// Write the entries of a trie node and its children as keys and values.
+static void writeDictEntries(Writer* writer, ObjDictNode* node)
+{
+    for (int i = 0; i < node->count; i++) {
+        Entry* slot = &node->slots[i];
+
+        if (IS_NULL(slot->key)) {
+            writeDictEntries(writer, (ObjDictNode*)AS_OBJ(slot->value));
+        } else {
+            writeValue(writer, slot->key);
+            writeValue(writer, slot->value);
+        }
+    }
+}
+
+// Write an object, or a reference to it if it has already been written.
+static void writeObject(Writer* writer, Obj* object)
+{
+    switch (object->type) {
+    case OBJ_STRING: {
+        ObjString* string = (ObjString*)object;
+        writeTag(writer, MESSAGE_STRING);
+        writeU32(writer, (uint32_t)string->length);
+        writeBytes(writer, string->chars, (size_t)string->length);
+        return;
+    }
+    case OBJ_NATIVE:
+        writeTag(writer, MESSAGE_NATIVE);
+        writeBytes(writer, &((ObjNative*)object)->function, sizeof(NativeFn));
+        return;
+    case OBJ_FUTURE:
+    case OBJ_COROUTINE:
+    case OBJ_ITERATOR:
+        // A future can only be awaited by the VM that spawned it, and a
+        // coroutine can only be resumed by the VM it was created in. An
+        // iterator belongs to the loop that is running it.
+        writer->failed = true;
+        writeTag(writer, MESSAGE_NULL);
+        return;
+    default:
+        break;
+    }
+
+    uint32_t count = writer->objects.count;
+    uint32_t number = numberPointer(&writer->objects, object);
+    if (number < count) {
+        writeTag(writer, MESSAGE_REFERENCE);
+        writeU32(writer, number);
+        return;
+    }
+
+    switch (object->type) {
+    case OBJ_FUNCTION:
+        writeFunction(writer, (ObjFunction*)object);
+        break;
+    case OBJ_CLOSURE: {
+        ObjClosure* closure = (ObjClosure*)object;
+        writeTag(writer, MESSAGE_CLOSURE);
+        writeBytes(writer, &closure->id, sizeof(closure->id));
+        writeObject(writer, (Obj*)closure->function);
+        for (int i = 0; i < closure->upvalueCount; i++) {
+            writeObject(writer, (Obj*)closure->upvalues[i]);
+        }
+        break;
+    }
+    case OBJ_UPVALUE:
+        // Upvalues are read back closed, holding the value the variable has
+        // now.
+        writeTag(writer, MESSAGE_UPVALUE);
+        writeValue(writer, *((ObjUpvalue*)object)->location);
+        break;
+    case OBJ_LIST: {
+        ObjList* list = (ObjList*)object;
+        Value* values = listValues(list);
+        writeTag(writer, MESSAGE_LIST);
+        writeU32(writer, (uint32_t)list->count);
+        for (int i = 0; i < list->count; i++) {
+            writeValue(writer, values[i]);
+        }
+        break;
+    }
+    case OBJ_DICT: {
+        ObjDict* dict = (ObjDict*)object;
+        writeTag(writer, MESSAGE_DICT);
+        writeU32(writer, (uint32_t)dict->count);
+        if (dict->root != NULL)
+            writeDictEntries(writer, dict->root);
+        break;
+    }
+    case OBJ_SEQUENCE: {
+        ObjSequence* sequence = (ObjSequence*)object;
+        writeTag(writer, MESSAGE_SEQUENCE);
+        writeU32(writer, (uint32_t)sequence->kind);
+        writeBytes(writer, &sequence->start, sizeof(double));
+        writeBytes(writer, &sequence->step, sizeof(double));
+        writeBytes(writer, &sequence->count, sizeof(double));
+        writeValue(writer, sequence->source);
+        writeValue(writer, sequence->function);
+        break;
+    }
+    default:
+        break;
+    }
+}
+
+static void writeValue(Writer* writer, Value value)
+{
+    if (IS_NULL(value)) {
+        writeTag(writer, MESSAGE_NULL);
+    } else if (IS_BOOL(value)) {
+        writeTag(writer, AS_BOOL(value) ? MESSAGE_TRUE : MESSAGE_FALSE);
+    } else if (IS_NUMBER(value)) {
+        double number = AS_NUMBER(value);
+        writeTag(writer, MESSAGE_NUMBER);
+        writeBytes(writer, &number, sizeof(number));
+    } else {
+        writeObject(writer, AS_OBJ(value));
+    }
+}
+
+// Write the queued globals, with their names so that the reader can find the
+// matching slots. Writing a global's value may queue more globals.
+static void writeGlobals(Writer* writer)
+{
+    for (int i = 0; i < writer->queueCount; i++) {
+        uint16_t slot = (uint16_t)(writer->queue[i] >> 1);
+        uint8_t hasValue = (uint8_t)(writer->queue[i] & 1);
+        Global* global = &writer->vm->globals[slot];
+
+        writeTag(writer, MESSAGE_GLOBAL);
+        writeBytes(writer, &slot, sizeof(slot));
+        writeU32(writer, (uint32_t)global->name->length);
+        writeBytes(writer, global->name->chars, (size_t)global->name->length);
+        writeBytes(writer, &hasValue, sizeof(hasValue));
+
+        if (hasValue)
+            writeValue(writer, global->value);
+    }
+
+    writeTag(writer, MESSAGE_END);
+}
+
+// Write the values to the buffer, along with everything they refer to. If
+// withGlobals is set, the values of the globals that functions in the message
+// read are written too, to be defined in the VM that reads the message.
+// Return false if a value can't be written, as it is or refers to a future or
+// a coroutine.
+bool writeMessage(VM* vm, Buffer* buffer, Value* values, int count,
+    bool withGlobals)
+{
+    Writer writer;
+    writer.vm = vm;
+    writer.buffer = buffer;
+    initPointerMap(&writer.objects);
+    writer.withGlobals = withGlobals;
+    writer.globals = NULL;
+    writer.queue = NULL;
+    writer.queueCount = 0;
+    writer.queueCapacity = 0;
+    writer.failed = false;
+
+    writeU32(&writer, (uint32_t)count);
+    for (int i = 0; i < count; i++) {
+        writeValue(&writer, values[i]);
+    }
+    writeGlobals(&writer);
+
+    freePointerMap(&writer.objects);
+    free(writer.globals);
+    free(writer.queue);
+    return !writer.failed;
+}
+
+typedef struct {
+    VM* vm;
+    const uint8_t* bytes;
+    size_t offset;
+
+    // Objects that have been read, by the number the writer gave them.
+    Obj** objects;
+    uint32_t count;
+    uint32_t capacity;
+
+    // Slot in the reading VM of each global slot of the writer's VM, or -1.
+    int* slots;
+    int slotCapacity;
+} Reader;
+
+static void readBytes(Reader* reader, void* bytes, size_t size)
+{
+    memcpy(bytes, reader->bytes + reader->offset, size);
+    reader->offset += size;
+}
+
+static MessageTag readTag(Reader* reader)
+{
+    return (MessageTag)reader->bytes[reader->offset++];
+}
+
+static uint32_t readU32(Reader* reader)
+{
+    uint32_t number;
+    readBytes(reader, &number, sizeof(number));
+    return number;
+}
+
+// Number the next object of the message, returning its number. The object is
+// filled in once it has been allocated.
+static uint32_t addObject(Reader* reader, Obj* object)
+{
+    if (reader->count == reader->capacity) {
+        reader->capacity = reader->capacity < 64 ? 64 : reader->capacity * 2;
+        reader->objects = realloc(reader->objects,
+            sizeof(Obj*) * reader->capacity);
+        if (reader->objects == NULL)
+            exit(1);
+    }
+
+    reader->objects[reader->count] = object;
+    return reader->count++;
+}
+
+static Value readValue(Reader* reader);
+
+static Obj* readFunction(Reader* reader)
+{
+    VM* vm = reader->vm;
+    ObjFunction* function = newFunction(vm);
+    addObject(reader, (Obj*)function);
+
+    // The code and lines are used where they lie in the message.
+    FunctionParts parts;
+    parts.arity = (int32_t)readU32(reader);
+    parts.upvalueCount = (int32_t)readU32(reader);
+    parts.codeCount = readU32(reader);
+    parts.constantCount = readU32(reader);
+    parts.code = reader->bytes + reader->offset;
+    reader->offset += parts.codeCount;
+    parts.lines = (const int*)(reader->bytes + reader->offset);
+    reader->offset += sizeof(int) * parts.codeCount;
+    fillFunction(vm, function, &parts);
+
+    readBytes(reader, &function->id, sizeof(function->id));
+    Value name = readValue(reader);
+    if (!IS_NULL(name))
+        function->name = AS_STRING(name);
+
+    for (uint32_t i = 0; i < parts.constantCount; i++) {
+        addConstant(vm, &function->chunk, readValue(reader));
+    }
+
+    return (Obj*)function;
+}
+
+static Obj* readClosure(Reader* reader)
+{
+    // The closure is numbered before its function, as it was written first.
+    uint32_t number = addObject(reader, NULL);
+    uint64_t id;
+    readBytes(reader, &id, sizeof(id));
+    ObjFunction* function = AS_FUNCTION(readValue(reader));
+    ObjClosure* closure = newClosure(reader->vm, function);
+    closure->id = id;
+    reader->objects[number] = (Obj*)closure;
+
+    for (int i = 0; i < closure->upvalueCount; i++) {
+        closure->upvalues[i] = (ObjUpvalue*)AS_OBJ(readValue(reader));
+    }
+
+    return (Obj*)closure;
+}
+
+static Obj* readList(Reader* reader)
+{
+    VM* vm = reader->vm;
+    ObjList* list = newList(vm);
+    addObject(reader, (Obj*)list);
+
+    int count = (int)readU32(reader);
+    if (count == 0)
+        return (Obj*)list;
+
+    list->buffer = newListBuffer(vm, count);
+    list->buffer->refCount = 1;
+
+    // Counted as each value is read, so the list only ever covers values
+    // that have been filled in.
+    for (int i = 0; i < count; i++) {
+        list->buffer->values[i] = readValue(reader);
+        list->buffer->count++;
+        list->count++;
+    }
+
+    return (Obj*)list;
+}
+
+// Read a dict's entries, inserting each into a new dict so that the trie is
+// shaped by how the keys hash in this VM.
+static Obj* readDict(Reader* reader)
+{
+    ObjDict* dict = newDict(reader->vm);
+    addObject(reader, (Obj*)dict);
+
+    int count = (int)readU32(reader);
+    for (int i = 0; i < count; i++) {
+        Value key = readValue(reader);
+        Value value = readValue(reader);
+        dictInsert(reader->vm, dict, key, value);
+    }
+
+    return (Obj*)dict;
+}
+
+static Obj* readSequence(Reader* reader)
+{
+    ObjSequence* sequence = newSequence(reader->vm,
+        (SequenceKind)readU32(reader));
+    addObject(reader, (Obj*)sequence);
+
+    readBytes(reader, &sequence->start, sizeof(double));
+    readBytes(reader, &sequence->step, sizeof(double));
+    readBytes(reader, &sequence->count, sizeof(double));
+    sequence->source = readValue(reader);
+    sequence->function = readValue(reader);
+
+    return (Obj*)sequence;
+}
+
+static Value readValue(Reader* reader)
+{
+    VM* vm = reader->vm;
+
+    switch (readTag(reader)) {
+    case MESSAGE_NULL:
+        return NULL_VAL;
+    case MESSAGE_TRUE:
+        return BOOL_VAL(true);
+    case MESSAGE_FALSE:
+        return BOOL_VAL(false);
+    case MESSAGE_NUMBER: {
+        double number;
+        readBytes(reader, &number, sizeof(number));
+        return NUMBER_VAL(number);
+    }
+    case MESSAGE_REFERENCE:
+        return OBJ_VAL(reader->objects[readU32(reader)]);
+    case MESSAGE_STRING: {
+        int length = (int)readU32(reader);
+        const char* chars = (const char*)reader->bytes + reader->offset;
+        reader->offset += (size_t)length;
+        return OBJ_VAL(copyString(vm, chars, length));
+    }
+    case MESSAGE_NATIVE: {
+        NativeFn function;
+        readBytes(reader, &function, sizeof(function));
+        return OBJ_VAL(newNative(vm, function));
+    }
+    case MESSAGE_FUNCTION:
+        return OBJ_VAL(readFunction(reader));
+    case MESSAGE_CLOSURE:
+        return OBJ_VAL(readClosure(reader));
+    case MESSAGE_UPVALUE: {
+        ObjUpvalue* upvalue = newUpvalue(vm, NULL);
+        upvalue->location = &upvalue->closed;
+        addObject(reader, (Obj*)upvalue);
+        upvalue->closed = readValue(reader);
+        return OBJ_VAL(upvalue);
+    }
+    case MESSAGE_LIST:
+        return OBJ_VAL(readList(reader));
+    case MESSAGE_DICT:
+        return OBJ_VAL(readDict(reader));
+    case MESSAGE_SEQUENCE:
+        return OBJ_VAL(readSequence(reader));
+    default:
+        return NULL_VAL;
+    }
+}
+
+// Read the global entries, finding the slot of each global in the reading VM
+// and defining the ones written with a value. Return false if there is no
+// room for another global.
+static bool readGlobals(Reader* reader)
+{
+    VM* vm = reader->vm;
+
+    while (readTag(reader) == MESSAGE_GLOBAL) {
+        uint16_t slot;
+        readBytes(reader, &slot, sizeof(slot));
+        int length = (int)readU32(reader);
+        const char* chars = (const char*)reader->bytes + reader->offset;
+        reader->offset += (size_t)length;
+        uint8_t hasValue;
+        readBytes(reader, &hasValue, sizeof(hasValue));
+
+        int readSlot = globalSlot(vm, copyString(vm, chars, length));
+        if (readSlot < 0)
+            return false;
+
+        if (slot >= reader->slotCapacity) {
+            int oldCapacity = reader->slotCapacity;
+            reader->slotCapacity = slot + 1 > oldCapacity * 2
+                ? slot + 1
+                : oldCapacity * 2;
+            reader->slots = realloc(reader->slots,
+                sizeof(int) * (size_t)reader->slotCapacity);
+            if (reader->slots == NULL)
+                exit(1);
+        }
+        reader->slots[slot] = readSlot;
+
+        if (hasValue) {
+            Value value = readValue(reader);
+            vm->globals[readSlot].value = value;
+            vm->globals[readSlot].isDefined = true;
+            globalBarrier(vm, value);
+        }
+    }
+
+    return true;
+}
+
+// Give the global instructions of every function that was read the slots of
+// the reading VM.
+static void relocateGlobals(Reader* reader)
+{
+    for (uint32_t i = 0; i < reader->count; i++) {
+        if (reader->objects[i]->type != OBJ_FUNCTION)
+            continue;
+
+        Chunk* chunk = &((ObjFunction*)reader->objects[i])->chunk;
+        int offset = 0;
+
+        while (offset < chunk->count) {
+            uint8_t instruction = chunk->code[offset];
+
+            if (instruction == OP_GET_GLOBAL
+                || instruction == OP_DEFINE_GLOBAL) {
+                uint8_t* operand = &chunk->code[offset + 1];
+                int slot = reader->slots[operand[0] << 8 | operand[1]];
+                operand[0] = (uint8_t)(slot >> 8);
+                operand[1] = (uint8_t)slot;
+            }
+
+            offset += instructionLength(chunk, offset);
+        }
+    }
+}
+
+// Read the values of a message written by writeMessage into the VM's heap,
+// pushing them onto the stack. Return the number of values pushed, or -1 if
+// the VM has no room for the globals that the message refers to.
+//
+// Globals written with their values are defined in the VM, replacing any
+// values they already have.
+int readMessage(VM* vm, Buffer* buffer)
+{
+    Reader reader;
+    reader.vm = vm;
+    reader.bytes = buffer->bytes;
+    reader.offset = 0;
+    reader.objects = NULL;
+    reader.count = 0;
+    reader.capacity = 0;
+    reader.slots = NULL;
+    reader.slotCapacity = 0;
+
+    // The objects read are young, and no collection moves them until the VM
+    // next runs code, so they don't need to be rooted while they are read.
+    int count = (int)readU32(&reader);
+    ensureStack(vm, count);
+    for (int i = 0; i < count; i++) {
+        push(vm, readValue(&reader));
+    }
+
+    bool read = readGlobals(&reader);
+    if (read) {
+        relocateGlobals(&reader);
+    } else {
+        vm->stackTop -= count;
+    }
+
+    free(reader.objects);
+    free(reader.slots);
+    return read ? count : -1;
+}
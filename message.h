@@ -0,0 +1,17 @@
+#ifndef clisp_message_h
+#define clisp_message_h
+
+#include "buffer.h"
+#include "common.h"
+#include "value.h"
+
+// Messages hold values written out of the heap of one VM, to be read into the
+// heap of another at a later time. Unlike a Copier, the VM that wrote a
+// message is free to keep running, and to collect the values it wrote, before
+// the message is read.
+
+bool writeMessage(VM* vm, Buffer* buffer, Value* values, int count,
+    bool withGlobals);
+int readMessage(VM* vm, Buffer* buffer);
+
+#endif
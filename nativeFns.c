@@ -5,6 +5,7 @@
 #include <string.h>
 #include <time.h>
 
+#include "dict.h"
 #include "memory.h"
 #include "object.h"
 #include "table.h"
@@ -15,8 +16,9 @@
 #define UNUSED(x) (void)(x)
 
 // Return the amount of seconds since execution began.
-bool clockNative(int argCount, Value* args, Value* result)
+bool clockNative(VM* vm, int argCount, Value* args, Value* result)
 {
+    UNUSED(vm);
     UNUSED(argCount);
     UNUSED(args);
     *result = NUMBER_VAL((double)clock() / CLOCKS_PER_SEC);
@@ -24,13 +26,13 @@ bool clockNative(int argCount, Value* args, Value* result)
 }
 
 // Add up all numbers passed to +. Throws error when non-number types are given.
-bool add(int argCount, Value* args, Value* result)
+bool add(VM* vm, int argCount, Value* args, Value* result)
 {
     double total = 0;
 
     for (int i = 0; i < argCount; i++) {
         if (!IS_NUMBER(args[i])) {
-            runtimeError("Operand must be a number.");
+            runtimeError(vm, "Operand must be a number.");
             return false;
         }
         total += AS_NUMBER(args[i]);
@@ -42,13 +44,13 @@ bool add(int argCount, Value* args, Value* result)
 
 // Multiply togather all numbers passed to *. Throws error when non-number types
 // are given.
-bool multiply(int argCount, Value* args, Value* result)
+bool multiply(VM* vm, int argCount, Value* args, Value* result)
 {
     double total = 1;
 
     for (int i = 0; i < argCount; i++) {
         if (!IS_NUMBER(args[i])) {
-            runtimeError("Operand must be a number.");
+            runtimeError(vm, "Operand must be a number.");
             return false;
         }
 
@@ -69,15 +71,15 @@ bool multiply(int argCount, Value* args, Value* result)
 //
 // Throws an error if no Values are provided, or if one of the arguments is not
 // a number.
-bool subtract(int argCount, Value* args, Value* result)
+bool subtract(VM* vm, int argCount, Value* args, Value* result)
 {
     switch (argCount) {
     case 0:
-        runtimeError("Attempted to call `-` with no arguments.");
+        runtimeError(vm, "Attempted to call `-` with no arguments.");
         return false;
     case 1:
         if (!IS_NUMBER(args[0])) {
-            runtimeError("Operand must be a number.");
+            runtimeError(vm, "Operand must be a number.");
             return false;
         }
         *result = NUMBER_VAL(-(AS_NUMBER(args[0])));
@@ -87,7 +89,7 @@ bool subtract(int argCount, Value* args, Value* result)
 
         for (int i = 1; i < argCount; i++) {
             if (!IS_NUMBER(args[i])) {
-                runtimeError("Operand must be a number.");
+                runtimeError(vm, "Operand must be a number.");
                 return false;
             }
 
@@ -111,20 +113,20 @@ bool subtract(int argCount, Value* args, Value* result)
 //
 // Throws an error if no Values are provided, or if one of the arguments is not
 // a number.
-bool divide(int argCount, Value* args, Value* result)
+bool divide(VM* vm, int argCount, Value* args, Value* result)
 {
     switch (argCount) {
     case 0:
-        runtimeError("Attempted to call `/` with no arguments.");
+        runtimeError(vm, "Attempted to call `/` with no arguments.");
         return false;
     case 1:
         if (!IS_NUMBER(args[0])) {
-            runtimeError("Operand must be a number.");
+            runtimeError(vm, "Operand must be a number.");
             return false;
         }
 
         if (AS_NUMBER(args[0]) == 0) {
-            runtimeError("Cannot divide by zero.");
+            runtimeError(vm, "Cannot divide by zero.");
             return false;
         }
 
@@ -132,21 +134,21 @@ bool divide(int argCount, Value* args, Value* result)
         return true;
     default: {
         if (!IS_NUMBER(args[0])) {
-            runtimeError("Operand must be a number.");
+            runtimeError(vm, "Operand must be a number.");
             return false;
         }
         double first = AS_NUMBER(args[0]);
 
         for (int i = 1; i < argCount; i++) {
             if (!IS_NUMBER(args[i])) {
-                runtimeError("Operand must be a number.");
+                runtimeError(vm, "Operand must be a number.");
                 return false;
             }
 
             double div = AS_NUMBER(args[i]);
 
             if (div == 0) {
-                runtimeError("Attemped divide by zero");
+                runtimeError(vm, "Attemped divide by zero");
                 return false;
             }
 
@@ -163,15 +165,16 @@ bool divide(int argCount, Value* args, Value* result)
 //
 // Returns the remainder when the first Value is divided by the second Value.
 // The result is signed the same as the second argument.
-bool rem(int argCount, Value* args, Value* result)
+bool rem(VM* vm, int argCount, Value* args, Value* result)
 {
     if (argCount != 2) {
-        runtimeError("Attempted to call `rem` with wrong number of arguments.");
+        runtimeError(vm,
+            "Attempted to call `rem` with wrong number of arguments.");
         return false;
     }
 
     if (!IS_NUMBER(args[0]) || !IS_NUMBER(args[1])) {
-        runtimeError("Attempted to call `rem` with non-number.");
+        runtimeError(vm, "Attempted to call `rem` with non-number.");
         return false;
     }
 
@@ -190,17 +193,17 @@ bool rem(int argCount, Value* args, Value* result)
 // Ensure all Values are greater than the following one.
 //
 // Error thrown if there are no arguments, or if any argument is not a number.
-bool greater(int argCount, Value* args, Value* result)
+bool greater(VM* vm, int argCount, Value* args, Value* result)
 {
     bool isGreater = true;
 
     if (argCount == 0) {
-        runtimeError("Attempted to call `>` with no arguments.");
+        runtimeError(vm, "Attempted to call `>` with no arguments.");
         return false;
     }
 
     if (!IS_NUMBER(args[0])) {
-        runtimeError("Attempted `>` with non-number");
+        runtimeError(vm, "Attempted `>` with non-number");
         return false;
     }
 
@@ -209,7 +212,7 @@ bool greater(int argCount, Value* args, Value* result)
         Value second = args[i + 1];
 
         if (!IS_NUMBER(second)) {
-            runtimeError("Attempted `>` with non-number");
+            runtimeError(vm, "Attempted `>` with non-number");
             return false;
         }
 
@@ -229,17 +232,17 @@ bool greater(int argCount, Value* args, Value* result)
 // Ensure all Values are less than the following one.
 //
 // Error thrown if there are no arguments, or if any argument is not a number.
-bool less(int argCount, Value* args, Value* result)
+bool less(VM* vm, int argCount, Value* args, Value* result)
 {
     bool isLess = true;
 
     if (argCount == 0) {
-        runtimeError("Attempted to call `<` with no arguments.");
+        runtimeError(vm, "Attempted to call `<` with no arguments.");
         return false;
     }
 
     if (!IS_NUMBER(args[0])) {
-        runtimeError("Attempted `<` with non-number");
+        runtimeError(vm, "Attempted `<` with non-number");
         return false;
     }
 
@@ -248,7 +251,7 @@ bool less(int argCount, Value* args, Value* result)
         Value second = args[i + 1];
 
         if (!IS_NUMBER(second)) {
-            runtimeError("Attempted `>` with non-number");
+            runtimeError(vm, "Attempted `>` with non-number");
             return false;
         }
 
@@ -266,8 +269,9 @@ bool less(int argCount, Value* args, Value* result)
 }
 
 // Returns true if all Values passed as argument are equivalent.
-bool equal(int count, Value* args, Value* result)
+bool equal(VM* vm, int count, Value* args, Value* result)
 {
+    UNUSED(vm);
     bool areEqual = true;
     for (int i = 0; i < count - 1; i++) {
         if (!valuesEqual(args[i], args[i + 1])) {
@@ -281,8 +285,9 @@ bool equal(int count, Value* args, Value* result)
 }
 
 // Print all Values given, separated by a space. Returns null.
-bool printVals(int argCount, Value* args, Value* result)
+bool printVals(VM* vm, int argCount, Value* args, Value* result)
 {
+    UNUSED(vm);
     UNUSED(result);
     for (int i = 0; i < argCount; i++) {
         printValue(args[i]);
@@ -296,7 +301,7 @@ bool printVals(int argCount, Value* args, Value* result)
 
 // Create a string of all the Values passed to the function, separated by a
 // space, and returns it.
-bool strCat(int argCount, Value* args, Value* result)
+bool strCat(VM* vm, int argCount, Value* args, Value* result)
 {
     int len = 1; // 1 for null terminator
     char str[30];
@@ -324,13 +329,26 @@ bool strCat(int argCount, Value* args, Value* result)
             case OBJ_DICT:
                 len += 6;
                 break;
+            case OBJ_FUTURE:
+                len += 8;
+                break;
+            case OBJ_COROUTINE:
+                len += 11;
+                break;
+            case OBJ_SEQUENCE:
+                len += 10;
+                break;
+            case OBJ_ITERATOR:
+                len += 10;
+                break;
             case OBJ_FUNCTION:
             case OBJ_CLOSURE:
             case OBJ_NATIVE:
                 len += 6;
                 [[fallthrough]];
             case OBJ_UPVALUE:
-                runtimeError("Should not be able to pass upvalue.");
+            case OBJ_DICT_NODE:
+                runtimeError(vm, "Should not be able to pass upvalue.");
                 return false;
             }
         }
@@ -357,7 +375,7 @@ bool strCat(int argCount, Value* args, Value* result)
 #endif
     }
 
-    char* chars = ALLOCATE(char, len);
+    char* chars = ALLOCATE(vm, char, len);
     int current = 0;
     ObjString* s;
 
@@ -397,6 +415,22 @@ bool strCat(int argCount, Value* args, Value* result)
                 memcpy(chars + current, "<dict>", 6);
                 current += 6;
                 break;
+            case OBJ_FUTURE:
+                memcpy(chars + current, "<future>", 8);
+                current += 8;
+                break;
+            case OBJ_COROUTINE:
+                memcpy(chars + current, "<coroutine>", 11);
+                current += 11;
+                break;
+            case OBJ_SEQUENCE:
+                memcpy(chars + current, "<sequence>", 10);
+                current += 10;
+                break;
+            case OBJ_ITERATOR:
+                memcpy(chars + current, "<iterator>", 10);
+                current += 10;
+                break;
             case OBJ_FUNCTION:
             case OBJ_CLOSURE:
             case OBJ_NATIVE:
@@ -404,7 +438,8 @@ bool strCat(int argCount, Value* args, Value* result)
                 current += 6;
                 break;
             case OBJ_UPVALUE:
-                runtimeError("Should not be able to pass upvalue.");
+            case OBJ_DICT_NODE:
+                runtimeError(vm, "Should not be able to pass upvalue.");
                 return false;
             }
         }
@@ -439,35 +474,36 @@ bool strCat(int argCount, Value* args, Value* result)
 #endif
     }
     chars[len - 1] = '\0';
-    s = takeString(chars, len);
+    s = takeString(vm, chars, len - 1);
 
     *result = OBJ_VAL(s);
     return true;
 }
 
 // Return false if Value evaluates to true, return false otherwise.
-bool not_(int argCount, Value* args, Value* result)
+bool not_(VM* vm, int argCount, Value* args, Value* result)
 {
     switch (argCount) {
     case 0:
-        runtimeError("Attempted to call `not` with no arguments.");
+        runtimeError(vm, "Attempted to call `not` with no arguments.");
         return false;
     case 1:
         *result = BOOL_VAL(isFalsey(args[0]));
         return true;
     default:
-        runtimeError("Attempted to call `not` with more than one argument.");
+        runtimeError(vm,
+            "Attempted to call `not` with more than one argument.");
         return false;
     }
 }
 
 // Return a List object containing all Values passed in to the function.
-bool list(int argCount, Value* args, Value* result)
+bool list(VM* vm, int argCount, Value* args, Value* result)
 {
-    ObjList* list = newList();
+    ObjList* list = newList(vm);
 
     for (int i = 0; i < argCount; i++) {
-        writeValueArray(&list->array, args[i]);
+        appendToList(vm, list, args[i]);
     }
 
     *result = OBJ_VAL(list);
@@ -476,133 +512,112 @@ bool list(int argCount, Value* args, Value* result)
 
 // Return a new list, containing all the values of the list passed in and with
 // the new Value appended to it.
-bool push_(int argCount, Value* args, Value* result)
+bool push_(VM* vm, int argCount, Value* args, Value* result)
 {
     if (argCount != 2) {
-        runtimeError(
+        runtimeError(vm,
             "Attempted to call `push` with incorrect number of arguments.");
         return false;
     }
 
     if (!IS_LIST(args[0])) {
-        runtimeError("Attempted to call `push` on non-list object.");
+        runtimeError(vm, "Attempted to call `push` on non-list object.");
         return false;
     }
 
+    // The new list shares the old one's values, and is usually able to append
+    // to the shared buffer without copying.
     ObjList* oldList = AS_LIST(args[0]);
-    ObjList* newlist = newList();
-
-    newlist->array.count = oldList->array.count;
-    newlist->array.capacity = oldList->array.capacity;
-    newlist->array.values = ALLOCATE(Value, newlist->array.capacity);
-
-    for (int i = 0; i < oldList->array.count; i++) {
-        newlist->array.values[i] = oldList->array.values[i];
-    }
-
-    writeValueArray(&newlist->array, args[1]);
+    ObjList* newlist = shareList(vm, oldList, 0, oldList->count);
+    appendToList(vm, newlist, args[1]);
 
     *result = OBJ_VAL(newlist);
     return true;
 }
 
 // Append the provided Value to the List. Return null.
-bool pushMut(int argCount, Value* args, Value* result)
+bool pushMut(VM* vm, int argCount, Value* args, Value* result)
 {
     UNUSED(result);
     if (argCount != 2) {
-        runtimeError(
+        runtimeError(vm,
             "Attempted to call `push!` with incorrect number of arguments.");
         return false;
     }
 
     if (!IS_LIST(args[0])) {
-        runtimeError("Attempted to call `push!` on non-list object.");
+        runtimeError(vm, "Attempted to call `push!` on non-list object.");
         return false;
     }
 
-    writeValueArray(&AS_LIST(args[0])->array, args[1]);
+    appendToList(vm, AS_LIST(args[0]), args[1]);
 
     return true;
 }
 
 // Return the first item of the provided list, null if list is empty.
-bool first(int argCount, Value* args, Value* result)
+bool first(VM* vm, int argCount, Value* args, Value* result)
 {
     if (argCount != 1) {
-        runtimeError(
+        runtimeError(vm,
             "Attempted to call `first` with incorrect number of arguments.");
         return false;
     }
 
     if (!IS_LIST(args[0])) {
-        runtimeError("Attempted to call `first` on non-list object.");
+        runtimeError(vm, "Attempted to call `first` on non-list object.");
         return false;
     }
 
     ObjList* list = AS_LIST(args[0]);
 
-    if (list->array.count > 0) {
-        *result = list->array.values[0];
+    if (list->count > 0) {
+        *result = listValues(list)[0];
     }
 
     return true;
 }
 
 // Return a new list containing all but the first element of the provided list.
-bool rest(int argCount, Value* args, Value* result)
+bool rest(VM* vm, int argCount, Value* args, Value* result)
 {
     if (argCount != 1) {
-        runtimeError(
+        runtimeError(vm,
             "Attempted to call `rest` with incorrect number of arguments.");
         return false;
     }
 
     if (!IS_LIST(args[0])) {
-        runtimeError("Attempted to call `rest` on non-list object.");
+        runtimeError(vm, "Attempted to call `rest` on non-list object.");
         return false;
     }
 
     ObjList* oldList = AS_LIST(args[0]);
 
-    switch (oldList->array.count) {
-    case 0:
-        return true;
-    case 1:
-        *result = OBJ_VAL(newList());
+    if (oldList->count == 0)
         return true;
-    }
 
-    ObjList* newlist = newList();
-    newlist->array.capacity = oldList->array.capacity;
-    newlist->array.count = oldList->array.count - 1;
-    newlist->array.values = ALLOCATE(Value, newlist->array.capacity);
-
-    for (int i = 0; i < newlist->array.count; i++) {
-        newlist->array.values[i] = oldList->array.values[i + 1];
-    }
-
-    *result = OBJ_VAL(newlist);
+    *result = OBJ_VAL(shareList(vm, oldList, 1, oldList->count - 1));
     return true;
 }
 
 // Return the length of the provided string or list.
-bool len(int argCount, Value* args, Value* result)
+bool len(VM* vm, int argCount, Value* args, Value* result)
 {
     if (argCount != 1) {
-        runtimeError(
+        runtimeError(vm,
             "Attempted to call `len` with incorrect number of arguments.");
         return false;
     }
 
     if (!IS_OBJ(args[0])) {
-        runtimeError("Attempted to call `len` on incompatible type.");
+        runtimeError(vm, "Attempted to call `len` on incompatible type.");
         return false;
     }
 
     switch (AS_OBJ(args[0])->type) {
     case OBJ_LIST: {
-        *result = NUMBER_VAL(AS_LIST(args[0])->array.count);
+        *result = NUMBER_VAL(AS_LIST(args[0])->count);
         return true;
     }
     case OBJ_STRING: {
@@ -610,30 +625,30 @@ bool len(int argCount, Value* args, Value* result)
         return true;
     }
     default:
-        runtimeError("Attempted to call `len` on incompatible type.");
+        runtimeError(vm, "Attempted to call `len` on incompatible type.");
         return false;
     }
 }
 
 // Create and return a new Dict object, with each 2 passed in Values used as
 // key/value pairs.
-bool dict(int argCount, Value* args, Value* result)
+bool dict(VM* vm, int argCount, Value* args, Value* result)
 {
     if (argCount % 2 != 0) {
-        runtimeError("Dict definition must have a value for every key.");
+        runtimeError(vm, "Dict definition must have a value for every key.");
         return false;
     }
 
-    ObjDict* dict = newDict();
+    ObjDict* dict = newDict(vm);
 
     for (int i = 0; i < argCount - 1; i += 2) {
         uint32_t hash;
         if (!hashOf(&args[i], &hash)) {
-            runtimeError("Invalid Dict key type: %s.", valueType(args[i]));
+            runtimeError(vm, "Invalid Dict key type: %s.", valueType(args[i]));
             return false;
         }
 
-        tableSet(&dict->table, args[i], args[i + 1]);
+        dictInsert(vm, dict, args[i], args[i + 1]);
     }
 
     *result = OBJ_VAL(dict);
@@ -644,58 +659,185 @@ bool dict(int argCount, Value* args, Value* result)
 // Entry constructed of the two provided Values as a key/value pair.
 //
 // If the key already exists in the provided Dict, overwrite its value.
-bool set(int argCount, Value* args, Value* result)
+bool set(VM* vm, int argCount, Value* args, Value* result)
 {
     if (argCount != 3) {
-        runtimeError("Attempted to call `set` with wrong number of arguments.");
+        runtimeError(vm,
+            "Attempted to call `set` with wrong number of arguments.");
         return false;
     }
 
     if (!IS_DICT(args[0])) {
-        runtimeError("Cannot call set on non-dict type.");
+        runtimeError(vm, "Cannot call set on non-dict type.");
         return false;
     }
 
     uint32_t hash;
     if (!hashOf(&args[1], &hash)) {
-        runtimeError("Invalid Dict key type: %s.", valueType(args[1]));
+        runtimeError(vm, "Invalid Dict key type: %s.", valueType(args[1]));
         return false;
     }
 
-    ObjDict* dict = newDict();
-
-    tableAddAll(&AS_DICT(args[0])->table, &dict->table);
-    tableSet(&dict->table, args[1], args[2]);
-
-    *result = OBJ_VAL(dict);
+    *result = OBJ_VAL(dictSet(vm, AS_DICT(args[0]), args[1], args[2]));
     return true;
 }
 
 // Return the Value from the given Dict that's associated with the provided key.
 // Return null if the key is not found.
-bool get(int argCount, Value* args, Value* result)
+bool get(VM* vm, int argCount, Value* args, Value* result)
 {
     if (argCount != 2) {
-        runtimeError("Attempted to call `get` with wrong number of arguments.");
+        runtimeError(vm,
+            "Attempted to call `get` with wrong number of arguments.");
         return false;
     }
 
     if (!IS_DICT(args[0])) {
-        runtimeError("Cannot call get on non-dict type.");
+        runtimeError(vm, "Cannot call get on non-dict type.");
         return false;
     }
 
     uint32_t hash;
     if (!hashOf(&args[1], &hash)) {
-        runtimeError("Invalid Dict key type: %s.", valueType(args[1]));
+        runtimeError(vm, "Invalid Dict key type: %s.", valueType(args[1]));
         return false;
     }
 
     Value got;
-    if (tableGet(&AS_DICT(args[0])->table, args[1], &got)) {
+    if (dictGet(AS_DICT(args[0]), args[1], &got)) {
         *result = got;
     }
 
     return true;
 }
+
+// Return a new coroutine that calls the given closure with the rest of the
+// arguments when it is first resumed.
+bool coroutine(VM* vm, int argCount, Value* args, Value* result)
+{
+    if (argCount < 1 || !IS_CLOSURE(args[0])) {
+        runtimeError(vm, "Attempted to create coroutine from non-closure.");
+        return false;
+    }
+
+    ObjClosure* closure = AS_CLOSURE(args[0]);
+    if (closure->function->arity != argCount - 1) {
+        runtimeError(vm, "Expected %d arguments but got %d.",
+            closure->function->arity, argCount - 1);
+        return false;
+    }
+
+    *result = OBJ_VAL(newCoroutine(vm, closure, argCount - 1, args + 1));
+    return true;
+}
+
+// Return true if the coroutine has returned from its function, and can't be
+// resumed again.
+bool isDone(VM* vm, int argCount, Value* args, Value* result)
+{
+    if (argCount != 1) {
+        runtimeError(vm,
+            "Attempted to call `done?` with wrong number of arguments.");
+        return false;
+    }
+
+    if (!IS_COROUTINE(args[0])) {
+        runtimeError(vm, "Attempted to call `done?` on non-coroutine.");
+        return false;
+    }
+
+    *result = BOOL_VAL(AS_COROUTINE(args[0])->state == COROUTINE_DONE);
+    return true;
+}
+
+// Set the key of a dict being built up by `gc-stats` to the value.
+static void insertStat(VM* vm, ObjDict* dict, const char* key, Value value)
+{
+    Value name = OBJ_VAL(copyString(vm, key, (int)strlen(key)));
+    dictInsert(vm, dict, name, value);
+}
+
+// Return a new list of the counts, as numbers.
+static Value countList(VM* vm, const size_t* counts, int count)
+{
+    ObjList* list = newList(vm);
+
+    for (int i = 0; i < count; i++) {
+        appendToList(vm, list, NUMBER_VAL((double)counts[i]));
+    }
+
+    return OBJ_VAL(list);
+}
+
+// Return a dict of the statistics kept by the garbage collector: how many
+// collections have run, histograms of their pauses, the bytes they promoted
+// and freed, the nextGC thresholds they set, the objects of each type in the
+// heap along with the bytes they use, and the slots of the value stack, which
+// is scanned as a root.
+bool gcStatsNative(VM* vm, int argCount, Value* args, Value* result)
+{
+    UNUSED(args);
+
+    if (argCount != 0) {
+        runtimeError(vm,
+            "Attempted to call `gc-stats` with wrong number of arguments.");
+        return false;
+    }
+
+    GcStats* stats = &vm->gcStats;
+    HeapCensus census;
+    takeCensus(vm, &census);
+
+    size_t history[GC_HISTORY];
+    size_t first = stats->historyCount > GC_HISTORY
+        ? stats->historyCount - GC_HISTORY
+        : 0;
+    int historyCount = (int)(stats->historyCount - first);
+    for (int i = 0; i < historyCount; i++) {
+        history[i] = stats->nextGCHistory[(first + (size_t)i) % GC_HISTORY];
+    }
+
+    ObjDict* objects = newDict(vm);
+    ObjDict* bytes = newDict(vm);
+    for (int i = 0; i < OBJ_TYPE_COUNT; i++) {
+        Value type = OBJ_VAL(copyString(vm, objectTypeNames[i],
+            (int)strlen(objectTypeNames[i])));
+        dictInsert(vm, objects, type, NUMBER_VAL((double)census.counts[i]));
+        dictInsert(vm, bytes, type, NUMBER_VAL((double)census.bytes[i]));
+    }
+
+    ObjDict* dict = newDict(vm);
+    insertStat(vm, dict, "minor-collections",
+        NUMBER_VAL((double)stats->minorCollections));
+    insertStat(vm, dict, "major-collections",
+        NUMBER_VAL((double)stats->majorCollections));
+    insertStat(vm, dict, "minor-pauses",
+        countList(vm, stats->minorPauses, GC_PAUSE_BUCKETS));
+    insertStat(vm, dict, "major-pauses",
+        countList(vm, stats->majorPauses, GC_PAUSE_BUCKETS));
+    insertStat(vm, dict, "total-pause-ms",
+        NUMBER_VAL((double)stats->totalPauseNs / 1e6));
+    insertStat(vm, dict, "max-pause-ms",
+        NUMBER_VAL((double)stats->maxPauseNs / 1e6));
+    insertStat(vm, dict, "bytes-promoted",
+        NUMBER_VAL((double)stats->bytesPromoted));
+    insertStat(vm, dict, "bytes-freed",
+        NUMBER_VAL((double)stats->bytesFreed));
+    insertStat(vm, dict, "last-bytes-freed",
+        NUMBER_VAL((double)stats->lastFreed));
+    insertStat(vm, dict, "max-bytes-freed",
+        NUMBER_VAL((double)stats->maxFreed));
+    insertStat(vm, dict, "bytes-allocated",
+        NUMBER_VAL((double)vm->bytesAllocated));
+    insertStat(vm, dict, "next-gc", NUMBER_VAL((double)vm->nextGC));
+    insertStat(vm, dict, "next-gc-history",
+        countList(vm, history, historyCount));
+    insertStat(vm, dict, "objects", OBJ_VAL(objects));
+    insertStat(vm, dict, "object-bytes", OBJ_VAL(bytes));
+    insertStat(vm, dict, "stack-capacity",
+        NUMBER_VAL((double)vm->stackCapacity));
+
+    *result = OBJ_VAL(dict);
+    return true;
+}
 #undef UNUSED
@@ -1,28 +1,35 @@
 #include "value.h"
 #include <stdbool.h>
 
-bool add(int argCount, Value* args, Value* result);
-bool clockNative(int argCount, Value* args, Value* result);
-bool divide(int argCount, Value* args, Value* result);
-bool equal(int count, Value* args, Value* result);
-bool greater(int argCount, Value* args, Value* result);
-bool less(int argCount, Value* args, Value* result);
-bool multiply(int argCount, Value* args, Value* result);
-bool printVals(int argCount, Value* args, Value* result);
-bool strCat(int argCount, Value* args, Value* result);
-bool subtract(int argCount, Value* args, Value* result);
-bool not_(int argCount, Value* args, Value* result);
-bool rem(int argCount, Value* args, Value* result);
+bool add(VM* vm, int argCount, Value* args, Value* result);
+bool clockNative(VM* vm, int argCount, Value* args, Value* result);
+bool divide(VM* vm, int argCount, Value* args, Value* result);
+bool equal(VM* vm, int count, Value* args, Value* result);
+bool greater(VM* vm, int argCount, Value* args, Value* result);
+bool less(VM* vm, int argCount, Value* args, Value* result);
+bool multiply(VM* vm, int argCount, Value* args, Value* result);
+bool printVals(VM* vm, int argCount, Value* args, Value* result);
+bool strCat(VM* vm, int argCount, Value* args, Value* result);
+bool subtract(VM* vm, int argCount, Value* args, Value* result);
+bool not_(VM* vm, int argCount, Value* args, Value* result);
+bool rem(VM* vm, int argCount, Value* args, Value* result);
 
 // List related builtins
-bool list(int argCount, Value* args, Value* result);
-bool push_(int argCount, Value* args, Value* result);
-bool pushMut(int argCount, Value* args, Value* result);
-bool first(int argCount, Value* args, Value* result);
-bool rest(int argCount, Value* args, Value* result);
-bool len(int argCount, Value* args, Value* result);
+bool list(VM* vm, int argCount, Value* args, Value* result);
+bool push_(VM* vm, int argCount, Value* args, Value* result);
+bool pushMut(VM* vm, int argCount, Value* args, Value* result);
+bool first(VM* vm, int argCount, Value* args, Value* result);
+bool rest(VM* vm, int argCount, Value* args, Value* result);
+bool len(VM* vm, int argCount, Value* args, Value* result);
 
 // Dict related builtins
-bool dict(int argCount, Value* args, Value* result);
-bool set(int argCount, Value* args, Value* result);
-bool get(int argCount, Value* args, Value* result);
+bool dict(VM* vm, int argCount, Value* args, Value* result);
+bool set(VM* vm, int argCount, Value* args, Value* result);
+bool get(VM* vm, int argCount, Value* args, Value* result);
+
+// Coroutine related builtins
+bool coroutine(VM* vm, int argCount, Value* args, Value* result);
+bool isDone(VM* vm, int argCount, Value* args, Value* result);
+
+// GC builtins
+bool gcStatsNative(VM* vm, int argCount, Value* args, Value* result);
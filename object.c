@@ -1,6 +1,7 @@
 #include "object.h"
 #include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 
 #include "chunk.h"
@@ -9,18 +10,20 @@
 #include "value.h"
 #include "vm.h"
 
-#define ALLOCATE_OBJ(type, objectType) \
-    (type*)allocateObject(sizeof(type), objectType)
+#define ALLOCATE_OBJ(vm, type, objectType) \
+    (type*)allocateObject(vm, sizeof(type), objectType)
 
-// Allocate memory for an object of the provided type, associate it with the
-// objects in the VM, and return its address.
-static Obj* allocateObject(size_t size, ObjType type)
+// Allocate memory for an object of the provided type in the nursery and
+// return its address. The object stays in the nursery until it survives a
+// minor collection.
+static Obj* allocateObject(VM* vm, size_t size, ObjType type)
 {
-    Obj* object = (Obj*)reallocate(NULL, 0, size);
+    Obj* object = allocateYoung(vm, size);
     object->type = type;
-
-    object->next = vm.objects;
-    vm.objects = object;
+    object->isMarked = false;
+    object->isYoung = true;
+    object->isRemembered = false;
+    object->next = NULL;
 
 #ifdef DEBUG_LOG_GC
     printf("%p allocate %zu for %d\n", (void*)object, size, type);
@@ -30,63 +33,113 @@ static Obj* allocateObject(size_t size, ObjType type)
 }
 
 // Allocate a new closure object and return its address.
-ObjClosure* newClosure(ObjFunction* function)
+ObjClosure* newClosure(VM* vm, ObjFunction* function)
 {
-    ObjUpvalue** upvalues = ALLOCATE(ObjUpvalue*, function->upvalueCount);
+    ObjUpvalue** upvalues = ALLOCATE(vm, ObjUpvalue*, function->upvalueCount);
 
     for (int i = 0; i < function->upvalueCount; i++) {
         upvalues[i] = NULL;
     }
 
-    ObjClosure* closure = ALLOCATE_OBJ(ObjClosure, OBJ_CLOSURE);
+    ObjClosure* closure = ALLOCATE_OBJ(vm, ObjClosure, OBJ_CLOSURE);
     closure->function = function;
     closure->upvalues = upvalues;
     closure->upvalueCount = function->upvalueCount;
+    closure->id = vm->nextId++;
 
     return closure;
 }
 
 // Allocate a new function object and return its address.
-ObjFunction* newFunction(void)
+ObjFunction* newFunction(VM* vm)
 {
-    ObjFunction* function = ALLOCATE_OBJ(ObjFunction, OBJ_FUNCTION);
+    ObjFunction* function = ALLOCATE_OBJ(vm, ObjFunction, OBJ_FUNCTION);
     function->arity = 0;
     function->upvalueCount = 0;
     function->name = NULL;
+    function->id = vm->nextId++;
     initChunk(&function->chunk);
     return function;
 }
 
+// Return the parts of a function to be written out or copied.
+FunctionParts functionParts(ObjFunction* function)
+{
+    Chunk* chunk = &function->chunk;
+    FunctionParts parts = {
+        function->arity,
+        function->upvalueCount,
+        (uint32_t)chunk->count,
+        (uint32_t)chunk->constants.count,
+        chunk->code,
+        chunk->lines,
+    };
+    return parts;
+}
+
+// Fill in a new function from parts that were read back or copied, copying
+// its bytecode and line numbers. The caller adds the constants, which there
+// can be parts->constantCount of. Return false if the parts could not have
+// come from a function.
+bool fillFunction(VM* vm, ObjFunction* function, const FunctionParts* parts)
+{
+    if (parts->arity < 0 || parts->upvalueCount < 0
+        || parts->codeCount > INT32_MAX || parts->constantCount > UINT8_COUNT) {
+        return false;
+    }
+
+    function->arity = (int)parts->arity;
+    function->upvalueCount = (int)parts->upvalueCount;
+
+    Chunk* chunk = &function->chunk;
+    int count = (int)parts->codeCount;
+    chunk->code = GROW_ARRAY(vm, uint8_t, NULL, 0, count);
+    chunk->lines = GROW_ARRAY(vm, int, NULL, 0, count);
+    memcpy(chunk->code, parts->code, (size_t)count);
+    memcpy(chunk->lines, parts->lines, sizeof(int) * (size_t)count);
+    chunk->count = count;
+    chunk->capacity = count;
+    return true;
+}
+
 // Allocate a new native function object and return its address.
-ObjNative* newNative(NativeFn function)
+ObjNative* newNative(VM* vm, NativeFn function)
 {
-    ObjNative* native = ALLOCATE_OBJ(ObjNative, OBJ_NATIVE);
+    ObjNative* native = ALLOCATE_OBJ(vm, ObjNative, OBJ_NATIVE);
     native->function = function;
+    native->hash = 0;
+
+    for (int i = 0; i < builtinCount; i++) {
+        if (builtins[i].function == function)
+            native->hash = (uint32_t)(i + 1) * 2654435761u;
+    }
+
     return native;
 }
 
 // Create a new Upvalue object at runtime using the pointer provided.
-ObjUpvalue* newUpvalue(Value* slot)
+ObjUpvalue* newUpvalue(VM* vm, Value* slot)
 {
-    ObjUpvalue* upvalue = ALLOCATE_OBJ(ObjUpvalue, OBJ_UPVALUE);
+    ObjUpvalue* upvalue = ALLOCATE_OBJ(vm, ObjUpvalue, OBJ_UPVALUE);
     upvalue->location = slot;
     upvalue->next = NULL;
     upvalue->closed = NULL_VAL;
+    upvalue->coroutine = NULL;
     return upvalue;
 }
 
 // Allocate a string object with the given data, add the ObjString to the
 // strings table in the VM.
-static ObjString* allocateString(char* chars, int length, uint32_t hash)
+static ObjString* allocateString(VM* vm, char* chars, int length, uint32_t hash)
 {
-    ObjString* string = ALLOCATE_OBJ(ObjString, OBJ_STRING);
+    ObjString* string = ALLOCATE_OBJ(vm, ObjString, OBJ_STRING);
     string->length = length;
     string->chars = chars;
     string->hash = hash;
 
-    push(OBJ_VAL(string));
-    tableSet(&vm.strings, OBJ_VAL(string), NULL_VAL);
-    pop();
+    push(vm, OBJ_VAL(string));
+    tableSet(vm, &vm->strings, OBJ_VAL(string), NULL_VAL);
+    pop(vm);
 
     return string;
 }
@@ -106,51 +159,320 @@ static uint32_t hashString(const char* key, int length)
 
 // Create a string object from the provided data, taking ownership of the given
 // string's memory.
-ObjString* takeString(char* chars, int length)
+ObjString* takeString(VM* vm, char* chars, int length)
 {
     uint32_t hash = hashString(chars, length);
-    ObjString* interned = tableFindString(&vm.strings, chars, length, hash);
+    ObjString* interned = tableFindString(&vm->strings, chars, length, hash);
 
     if (interned != NULL) {
-        FREE_ARRAY(char, chars, length + 1);
+        FREE_ARRAY(vm, char, chars, length + 1);
         return interned;
     }
 
-    return allocateString(chars, length, hash);
+    return allocateString(vm, chars, length, hash);
 }
 
 // Create a string object from the provided data, making a copy of the provided
 // data since the given string is not owned by the new object.
-ObjString* copyString(const char* chars, int length)
+ObjString* copyString(VM* vm, const char* chars, int length)
 {
     uint32_t hash = hashString(chars, length);
-    ObjString* interned = tableFindString(&vm.strings, chars, length, hash);
+    ObjString* interned = tableFindString(&vm->strings, chars, length, hash);
 
     if (interned != NULL)
         return interned;
 
-    char* heapChars = ALLOCATE(char, length + 1);
+    char* heapChars = ALLOCATE(vm, char, length + 1);
     memcpy(heapChars, chars, (size_t)length);
     heapChars[length] = '\0';
-    return allocateString(heapChars, length, hash);
+    return allocateString(vm, heapChars, length, hash);
 }
 
 // Allocate a new list object and initialise its fields.
-ObjList* newList(void)
+ObjList* newList(VM* vm)
 {
-    ObjList* list = ALLOCATE_OBJ(ObjList, OBJ_LIST);
-    initValueArray(&list->array);
+    ObjList* list = ALLOCATE_OBJ(vm, ObjList, OBJ_LIST);
+    list->buffer = NULL;
+    list->start = 0;
+    list->count = 0;
+    list->isHashed = false;
     return list;
 }
 
+// Size in bytes of a ListBuffer with space for the given number of values.
+static size_t listBufferSize(int capacity)
+{
+    return sizeof(ListBuffer) + sizeof(Value) * (size_t)capacity;
+}
+
+// Allocate an empty buffer with space for the given number of values, not yet
+// used by any list.
+ListBuffer* newListBuffer(VM* vm, int capacity)
+{
+    ListBuffer* buffer = (ListBuffer*)reallocate(vm, NULL, 0,
+        listBufferSize(capacity));
+    buffer->refCount = 0;
+    buffer->count = 0;
+    buffer->capacity = capacity;
+    return buffer;
+}
+
+// Allocate a new list object that is a view of count values of the given
+// list, beginning at index start. Shares the values rather than copying them.
+ObjList* shareList(VM* vm, ObjList* list, int start, int count)
+{
+    ObjList* shared = newList(vm);
+    if (list->buffer == NULL || count == 0)
+        return shared;
+
+    shared->buffer = list->buffer;
+    shared->buffer->refCount++;
+    shared->start = list->start + start;
+    shared->count = count;
+    return shared;
+}
+
+// Drop the list's use of its buffer, freeing the buffer if no other list is
+// using it.
+void releaseList(VM* vm, ObjList* list)
+{
+    ListBuffer* buffer = list->buffer;
+    if (buffer == NULL)
+        return;
+
+    list->buffer = NULL;
+    if (--buffer->refCount == 0)
+        reallocate(vm, buffer, listBufferSize(buffer->capacity), 0);
+}
+
+// Append a value to the end of the list, in place.
+//
+// When the list ends at the end of its buffer, the value is written directly
+// after it. Otherwise another list has already appended past this one's end,
+// or the buffer is full, and the list's values are first copied to a new
+// buffer of its own.
+void appendToList(VM* vm, ObjList* list, Value value)
+{
+    ListBuffer* buffer = list->buffer;
+    bool atEnd = buffer != NULL && list->start + list->count == buffer->count;
+
+    if (!atEnd || buffer->count == buffer->capacity) {
+        int capacity = (int)GROW_CAPACITY(list->count);
+
+        if (atEnd && buffer->refCount == 1) {
+            // Nothing else can see the buffer, so it can grow where it is.
+            buffer = (ListBuffer*)reallocate(vm, buffer,
+                listBufferSize(buffer->capacity),
+                listBufferSize(list->start + capacity));
+            buffer->capacity = list->start + capacity;
+            list->buffer = buffer;
+        } else {
+            buffer = (ListBuffer*)reallocate(vm, NULL, 0,
+                listBufferSize(capacity));
+            buffer->refCount = 1;
+            buffer->count = list->count;
+            buffer->capacity = capacity;
+
+            if (list->count > 0) {
+                memcpy(buffer->values, listValues(list),
+                    sizeof(Value) * (size_t)list->count);
+            }
+
+            releaseList(vm, list);
+            list->buffer = buffer;
+            list->start = 0;
+        }
+    }
+
+    buffer->values[buffer->count++] = value;
+    list->count++;
+    list->isHashed = false;
+    writeBarrier(vm, (Obj*)list, value);
+}
+
 // Allocate a new dict object and initialise its fields.
-ObjDict* newDict(void)
+ObjDict* newDict(VM* vm)
 {
-    ObjDict* dict = ALLOCATE_OBJ(ObjDict, OBJ_DICT);
-    initTable(&dict->table);
+    ObjDict* dict = ALLOCATE_OBJ(vm, ObjDict, OBJ_DICT);
+    dict->root = NULL;
+    dict->count = 0;
+    dict->isHashed = false;
     return dict;
 }
 
+// Allocate a new trie node with the given number of empty slots.
+ObjDictNode* newDictNode(VM* vm, int count)
+{
+    Entry* slots = ALLOCATE(vm, Entry, count);
+    for (int i = 0; i < count; i++) {
+        slots[i].key = NULL_VAL;
+        slots[i].value = NULL_VAL;
+    }
+
+    ObjDictNode* node = ALLOCATE_OBJ(vm, ObjDictNode, OBJ_DICT_NODE);
+    node->bitmap = 0;
+    node->count = count;
+    node->slots = slots;
+    return node;
+}
+
+// Allocate a new future for a task that has been retained for it.
+ObjFuture* newFuture(VM* vm, struct Task* task)
+{
+    ObjFuture* future = ALLOCATE_OBJ(vm, ObjFuture, OBJ_FUTURE);
+    future->task = task;
+    future->value = NULL_VAL;
+    future->hasValue = false;
+    return future;
+}
+
+// Allocate a new coroutine that will call the closure with the given
+// arguments when it is first resumed. The closure must take that many
+// arguments.
+ObjCoroutine* newCoroutine(VM* vm, ObjClosure* closure, int argCount,
+    Value* args)
+{
+    ObjCoroutine* coroutine = ALLOCATE_OBJ(vm, ObjCoroutine, OBJ_COROUTINE);
+    coroutine->closure = closure;
+    coroutine->state = COROUTINE_NEW;
+    coroutine->caller = NULL;
+    coroutine->baseFrameCount = 0;
+    coroutine->baseSlot = 0;
+    coroutine->openUpvalues = NULL;
+
+    // The stack and frames are malloced like the VM's, as they are swapped
+    // with the VM's when the coroutine runs.
+    coroutine->frameCapacity = COROUTINE_FRAMES_INITIAL;
+    coroutine->frames = (CallFrame*)malloc(sizeof(CallFrame)
+        * (size_t)coroutine->frameCapacity);
+    coroutine->stackCapacity = argCount + 1 + FRAME_STACK_SLOTS;
+    coroutine->stack = (Value*)malloc(sizeof(Value)
+        * (size_t)coroutine->stackCapacity);
+
+    if (coroutine->frames == NULL || coroutine->stack == NULL)
+        exit(1);
+
+    coroutine->stack[0] = OBJ_VAL(closure);
+    memcpy(coroutine->stack + 1, args, sizeof(Value) * (size_t)argCount);
+    coroutine->stackTop = coroutine->stack + argCount + 1;
+
+    CallFrame* frame = &coroutine->frames[0];
+    frame->closure = closure;
+    frame->ip = closure->function->chunk.code;
+    frame->slots = coroutine->stack;
+    coroutine->frameCount = 1;
+
+    return coroutine;
+}
+
+// Free the stack and frames of a coroutine that isn't running.
+void freeCoroutineStack(ObjCoroutine* coroutine)
+{
+    free(coroutine->frames);
+    free(coroutine->stack);
+    coroutine->frames = NULL;
+    coroutine->frameCount = 0;
+    coroutine->frameCapacity = 0;
+    coroutine->stack = NULL;
+    coroutine->stackTop = NULL;
+    coroutine->stackCapacity = 0;
+    coroutine->openUpvalues = NULL;
+}
+
+// Allocate a new sequence of the given kind, with no source or function.
+ObjSequence* newSequence(VM* vm, SequenceKind kind)
+{
+    ObjSequence* sequence = ALLOCATE_OBJ(vm, ObjSequence, OBJ_SEQUENCE);
+    sequence->kind = kind;
+    sequence->source = NULL_VAL;
+    sequence->function = NULL_VAL;
+    sequence->start = 0;
+    sequence->step = 1;
+    sequence->count = 0;
+    return sequence;
+}
+
+// Allocate a new iterator over the list, or over an empty range if list is
+// null, with room for the given number of stages.
+ObjIterator* newIterator(VM* vm, Value list, int stageCount)
+{
+    IteratorStage* stages = ALLOCATE(vm, IteratorStage, stageCount);
+
+    for (int i = 0; i < stageCount; i++) {
+        stages[i].kind = SEQUENCE_MAP;
+        stages[i].function = NULL_VAL;
+        stages[i].remaining = 0;
+    }
+
+    ObjIterator* iterator = ALLOCATE_OBJ(vm, ObjIterator, OBJ_ITERATOR);
+    iterator->list = list;
+    iterator->index = 0;
+    iterator->count = IS_LIST(list) ? AS_LIST(list)->count : 0;
+    iterator->start = 0;
+    iterator->step = 1;
+    iterator->stages = stages;
+    iterator->stageCount = stageCount;
+    return iterator;
+}
+
+// The lists being printed on this thread, outermost first. Any cycle passes
+// through a list, since nothing else can be changed to hold itself, so a
+// list met again while it is being printed is shown as [ ... ] instead.
+static _Thread_local ObjList** printingLists;
+static _Thread_local int printingCount;
+static _Thread_local int printingCapacity;
+
+// Print the elements of a list, unless it is already being printed.
+static void printList(ObjList* list)
+{
+    for (int i = 0; i < printingCount; i++) {
+        if (printingLists[i] == list) {
+            printf("[ ... ]");
+            return;
+        }
+    }
+
+    if (printingCount == printingCapacity) {
+        printingCapacity = (int)GROW_CAPACITY(printingCapacity);
+        printingLists = realloc(printingLists,
+            sizeof(ObjList*) * (size_t)printingCapacity);
+        if (printingLists == NULL)
+            exit(1);
+    }
+    printingLists[printingCount++] = list;
+
+    printf("[ ");
+    Value* values = listValues(list);
+    for (int i = 0; i < list->count; i++) {
+        printValue(values[i]);
+        printf(" ");
+    }
+    printf("]");
+
+    if (--printingCount == 0) {
+        free(printingLists);
+        printingLists = NULL;
+        printingCapacity = 0;
+    }
+}
+
+// Print the entries held by a trie node and its children.
+static void printDictNode(ObjDictNode* node)
+{
+    for (int i = 0; i < node->count; i++) {
+        Entry* slot = &node->slots[i];
+
+        if (IS_NULL(slot->key)) {
+            printDictNode((ObjDictNode*)AS_OBJ(slot->value));
+        } else {
+            printValue(slot->key);
+            printf(" => ");
+            printValue(slot->value);
+            printf(" ");
+        }
+    }
+}
+
 // Print a string prepresentation of a function.
 static void printFunction(ObjFunction* function)
 {
@@ -181,31 +503,31 @@ void printObject(Value value)
     case OBJ_UPVALUE:
         printf("upvalue");
         break;
-    case OBJ_LIST: {
-        ObjList* list = AS_LIST(value);
-        printf("[ ");
-        for (int i = 0; i < list->array.count; i++) {
-            printValue(list->array.values[i]);
-            printf(" ");
-        }
-        printf("]");
+    case OBJ_LIST:
+        printList(AS_LIST(value));
         break;
-    }
     case OBJ_DICT: {
         ObjDict* dict = AS_DICT(value);
         printf("{ ");
-        for (int i = 0; i < dict->table.capacity; i++) {
-            Entry entry = dict->table.entries[i];
-
-            if (!IS_NULL(entry.key)) {
-                printValue(entry.key);
-                printf(" => ");
-                printValue(entry.value);
-                printf(" ");
-            }
-        }
+        if (dict->root != NULL)
+            printDictNode(dict->root);
         printf("}");
         break;
     }
+    case OBJ_DICT_NODE:
+        printf("dict node");
+        break;
+    case OBJ_FUTURE:
+        printf("<future>");
+        break;
+    case OBJ_COROUTINE:
+        printf("<coroutine>");
+        break;
+    case OBJ_SEQUENCE:
+        printf("<sequence>");
+        break;
+    case OBJ_ITERATOR:
+        printf("<iterator>");
+        break;
     }
 }
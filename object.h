@@ -17,6 +17,10 @@
 #define IS_STRING(value) isObjType(value, OBJ_STRING)
 #define IS_LIST(value) isObjType(value, OBJ_LIST)
 #define IS_DICT(value) isObjType(value, OBJ_DICT)
+#define IS_FUTURE(value) isObjType(value, OBJ_FUTURE)
+#define IS_COROUTINE(value) isObjType(value, OBJ_COROUTINE)
+#define IS_SEQUENCE(value) isObjType(value, OBJ_SEQUENCE)
+#define IS_ITERATOR(value) isObjType(value, OBJ_ITERATOR)
 
 // Helper macros to convert an object to a specific type.
 #define AS_CLOSURE(value) ((ObjClosure*)AS_OBJ(value))
@@ -26,6 +30,10 @@
 #define AS_CSTRING(value) (((ObjString*)AS_OBJ(value))->chars)
 #define AS_LIST(value) ((ObjList*)AS_OBJ(value))
 #define AS_DICT(value) ((ObjDict*)AS_OBJ(value))
+#define AS_FUTURE(value) ((ObjFuture*)AS_OBJ(value))
+#define AS_COROUTINE(value) ((ObjCoroutine*)AS_OBJ(value))
+#define AS_SEQUENCE(value) ((ObjSequence*)AS_OBJ(value))
+#define AS_ITERATOR(value) ((ObjIterator*)AS_OBJ(value))
 
 // Simple enum for identifying the type of an object.
 typedef enum {
@@ -36,8 +44,16 @@ typedef enum {
     OBJ_CLOSURE,
     OBJ_NATIVE,
     OBJ_UPVALUE,
+    OBJ_DICT_NODE,
+    OBJ_FUTURE,
+    OBJ_COROUTINE,
+    OBJ_SEQUENCE,
+    OBJ_ITERATOR,
 } ObjType;
 
+// Number of object types, for sizing tables indexed by type.
+#define OBJ_TYPE_COUNT (OBJ_ITERATOR + 1)
+
 // Obj is essentially a header for other object types so that they can be used
 // interchangeably, like a form of polymorphism.
 struct Obj {
@@ -46,8 +62,18 @@ struct Obj {
     // Whether the object been marked during garbage collection.
     bool isMarked;
 
-    // Instrusive list to keep track of all objects at runtime. Used to find
-    // objects to clean up during garbage collection.
+    // Whether the object is still in the nursery, the young generation that
+    // new objects are allocated into.
+    bool isYoung;
+
+    // Whether the object is old and has been added to the remembered set,
+    // because a young object has been stored in it.
+    bool isRemembered;
+
+    // Instrusive list to keep track of all old objects at runtime. Used to
+    // find objects to clean up during garbage collection. Young objects are
+    // not on the list, instead this points to the promoted copy of the object
+    // once it has survived a minor collection.
     struct Obj* next;
 };
 
@@ -67,9 +93,27 @@ typedef struct {
 
     // The name of the function when written.
     ObjString* name;
+
+    // Identity of the function, unique in the process. Copies of the
+    // function made for other VMs and messages keep it, so that the copy is
+    // still equal to the original and hashes the same way.
+    uint64_t id;
 } ObjFunction;
 
-typedef bool (*NativeFn)(int argCount, Value* args, Value* result);
+// The parts of a function kept the same way wherever it is cached, saved in
+// an image, sent in a message or copied to another VM. Its name and
+// constants refer to other objects, so each of those stores them its own
+// way, and its id depends on whether the function is a copy.
+typedef struct {
+    int32_t arity;
+    int32_t upvalueCount;
+    uint32_t codeCount;
+    uint32_t constantCount;
+    const uint8_t* code;
+    const int* lines;
+} FunctionParts;
+
+typedef bool (*NativeFn)(VM* vm, int argCount, Value* args, Value* result);
 
 // A representation of built-in functions that can be accessed at runtime.
 typedef struct {
@@ -77,6 +121,10 @@ typedef struct {
 
     // The C function to be ran when the function is called.
     NativeFn function;
+
+    // Hash of the builtin the function is defined as, which is the same in
+    // every process, unlike the address of the C function.
+    uint32_t hash;
 } ObjNative;
 
 // A string object.
@@ -94,20 +142,84 @@ struct ObjString {
     uint32_t hash;
 };
 
-// A list object.
+// Append-only storage for the values of lists, shared between every list
+// that is a view onto it. Values are never overwritten once written, so lists
+// can share a buffer as long as each one only appends directly after its own
+// last value.
+typedef struct {
+    // Number of lists using the buffer. The buffer is freed with the last one.
+    int refCount;
+
+    // Number of values that have been appended to the buffer.
+    int count;
+
+    // Number of values the buffer has space for.
+    int capacity;
+
+    // The values themselves.
+    Value values[];
+} ListBuffer;
+
+// A list object. A view onto a window of a shared buffer, so that `push` and
+// `rest` can make new lists without copying.
 struct ObjList {
     Obj obj;
 
-    // Dynamically allocated array of Values in list.
-    ValueArray array;
+    // Buffer holding the values of the list, NULL for a new empty list.
+    ListBuffer* buffer;
+
+    // Index of the first value of the list in the buffer.
+    int start;
+
+    // Number of values in the list.
+    int count;
+
+    // Structural hash of the values, used when the list is a dict key.
+    uint32_t hash;
+
+    // Whether hash has been calculated since the list last changed. Only set
+    // for lists with no list inside them: a list doesn't know which lists
+    // hold it, so changing it couldn't clear their cached hashes.
+    bool isHashed;
 };
 
-// A dictionary object.
+// A node of the hash array mapped trie that holds the entries of a dict.
+// Nodes are never changed once they belong to a dict, so that dicts made by
+// `set` can share every node that was not on the path to the changed key.
+//
+// Each level of the trie uses the next 5 bits of a key's hash. Below the
+// point where the hash runs out, a node holds entries that have colliding
+// hashes, in no particular order.
+typedef struct ObjDictNode {
+    Obj obj;
+
+    // One bit for each 5 bit hash chunk that has a slot in the node.
+    uint32_t bitmap;
+
+    // Number of slots in the node.
+    int count;
+
+    // Slots ordered by hash chunk. A slot is either a key and its value, or
+    // a null key with a child node as the value.
+    Entry* slots;
+} ObjDictNode;
+
+// A dictionary object, an immutable hash array mapped trie.
 struct ObjDict {
     Obj obj;
 
-    // Dynamically allocated hash table of key value pairs.
-    Table table;
+    // Root node of the trie, NULL when the dict is empty.
+    ObjDictNode* root;
+
+    // Number of entries in the dict.
+    int count;
+
+    // Structural hash of the entries, used when the dict is a dict key.
+    uint32_t hash;
+
+    // Whether hash has been calculated yet. Dicts never change, but one
+    // holding a list is not cached, for the same reason as ObjList.isHashed.
+    bool isHashed;
 };
 
 // ObjUpvalue is the runtime representation of a variable that has been lifted
@@ -128,6 +240,11 @@ typedef struct ObjUpvalue {
     // Used to keep track of all open Upvalues at runtime. An intrusive list
     // held by the VM.
     struct ObjUpvalue* next;
+
+    // The coroutine whose stack the open upvalue points into, or NULL if it
+    // points into the VM's own stack. Keeps a suspended coroutine's stack
+    // alive for as long as the upvalue is.
+    struct ObjCoroutine* coroutine;
 } ObjUpvalue;
 
 // A representation of a closure. Wraps a function object and any values
@@ -144,17 +261,166 @@ typedef struct {
 
     // Number of values in the upvalues array.
     int upvalueCount;
+
+    // Identity of the closure, unique in the process and kept by copies, as
+    // for functions.
+    uint64_t id;
 } ObjClosure;
 
-ObjClosure* newClosure(ObjFunction* function);
-ObjFunction* newFunction(void);
-ObjNative* newNative(NativeFn function);
-ObjUpvalue* newUpvalue(Value* slot);
-ObjString* takeString(char* chars, int length);
-ObjString* copyString(const char* chars, int length);
+// The result of a call started by `spawn`, which may still be running on
+// another thread.
+typedef struct {
+    Obj obj;
+
+    // The task making the call, shared with the scheduler and any copies of
+    // the future.
+    struct Task* task;
+
+    // The result of the call, copied into this VM once it has been awaited.
+    Value value;
+
+    // Whether value holds the result yet.
+    bool hasValue;
+} ObjFuture;
+
+// The states of a coroutine.
+typedef enum {
+    // Created, but not yet resumed.
+    COROUTINE_NEW,
+
+    // Waiting in a yield to be resumed.
+    COROUTINE_SUSPENDED,
+
+    // Running, or waiting for a coroutine that it resumed.
+    COROUTINE_RUNNING,
+
+    // Returned from its function, or stopped by a runtime error.
+    COROUTINE_DONE,
+} CoroutineState;
+
+// A function call that can suspend itself with `yield`, to be continued by
+// `resume`, with a stack and frames of its own.
+//
+// Switching to and from a coroutine swaps its stack and frames with the ones
+// the VM is using. While a coroutine runs, it holds the stack and frames of
+// the code that resumed it.
+typedef struct ObjCoroutine {
+    Obj obj;
+
+    // Closure the coroutine was created to call.
+    ObjClosure* closure;
+
+    CoroutineState state;
+
+    // The coroutine that resumed this one while it runs, or NULL if it was
+    // resumed by code outside of any coroutine.
+    struct ObjCoroutine* caller;
+
+    // Stored copies of the VM fields of the same name.
+    struct CallFrame* frames;
+    int frameCount;
+    int frameCapacity;
+    int baseFrameCount;
+    int baseSlot;
+    Value* stack;
+    int stackCapacity;
+    Value* stackTop;
+    ObjUpvalue* openUpvalues;
+} ObjCoroutine;
+
+// The kinds of lazy sequence.
+typedef enum {
+    // Numbers counting from a start value by a step.
+    SEQUENCE_RANGE,
+
+    // The result of calling a function with each value of the source.
+    SEQUENCE_MAP,
+
+    // The values of the source that a function returns true for.
+    SEQUENCE_FILTER,
+
+    // The first values of the source, up to a count.
+    SEQUENCE_TAKE,
+} SequenceKind;
+
+// A sequence whose values are only made as it is iterated over, one at a
+// time. A sequence never changes once made, so it can be iterated over any
+// number of times.
+typedef struct {
+    Obj obj;
+    SequenceKind kind;
+
+    // The list or sequence that a map, filter, or take gets its values from,
+    // or null for a range.
+    Value source;
+
+    // The function called by a map or filter, or null.
+    Value function;
+
+    // The first value of a range, and the difference between its values.
+    double start;
+    double step;
+
+    // The number of values in a range, or the most a take passes on.
+    double count;
+} ObjSequence;
+
+// A stage applied to each value an iterator pulls from its source.
+typedef struct {
+    SequenceKind kind;
+    Value function;
+
+    // Number of values a take has left to pass on.
+    double remaining;
+} IteratorStage;
+
+// The state of an iteration over a list or sequence.
+//
+// The stages of a chain of sequences are fused into a single iterator, so
+// getting the next value pulls one value from the list or range at the bottom
+// of the chain and runs it through each stage in turn, without making a list
+// or object for any stage along the way.
+typedef struct {
+    Obj obj;
+
+    // The list the values come from, or null if they come from a range.
+    Value list;
+
+    // Index of the next value of the list or range, out of count.
+    double index;
+    double count;
+
+    // The range the values come from.
+    double start;
+    double step;
+
+    // Stages in the order they are applied.
+    IteratorStage* stages;
+    int stageCount;
+} ObjIterator;
+
+ObjClosure* newClosure(VM* vm, ObjFunction* function);
+ObjFunction* newFunction(VM* vm);
+FunctionParts functionParts(ObjFunction* function);
+bool fillFunction(VM* vm, ObjFunction* function, const FunctionParts* parts);
+ObjNative* newNative(VM* vm, NativeFn function);
+ObjUpvalue* newUpvalue(VM* vm, Value* slot);
+ObjString* takeString(VM* vm, char* chars, int length);
+ObjString* copyString(VM* vm, const char* chars, int length);
 void printObject(Value value);
-ObjList* newList(void);
-ObjDict* newDict(void);
+ObjList* newList(VM* vm);
+ListBuffer* newListBuffer(VM* vm, int capacity);
+ObjList* shareList(VM* vm, ObjList* list, int start, int count);
+void appendToList(VM* vm, ObjList* list, Value value);
+void releaseList(VM* vm, ObjList* list);
+ObjDict* newDict(VM* vm);
+ObjDictNode* newDictNode(VM* vm, int count);
+ObjFuture* newFuture(VM* vm, struct Task* task);
+ObjCoroutine* newCoroutine(VM* vm, ObjClosure* closure, int argCount,
+    Value* args);
+void freeCoroutineStack(ObjCoroutine* coroutine);
+ObjSequence* newSequence(VM* vm, SequenceKind kind);
+ObjIterator* newIterator(VM* vm, Value list, int stageCount);
 
 // Return true if Value is an Object and has the matching Object type.
 static inline bool isObjType(Value value, ObjType type)
@@ -162,4 +428,10 @@ static inline bool isObjType(Value value, ObjType type)
     return IS_OBJ(value) && AS_OBJ(value)->type == type;
 }
 
+// Return the address of the first value in the list.
+static inline Value* listValues(ObjList* list)
+{
+    return list->buffer == NULL ? NULL : list->buffer->values + list->start;
+}
+
 #endif
@@ -0,0 +1,191 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "chunk.h"
+#include "opcodeStats.h"
+
+// Name of each opcode, in the order of the OpCode enum.
+static const char* opcodeNames[] = {
+    "OP_CONSTANT",
+    "OP_NULL",
+    "OP_TRUE",
+    "OP_FALSE",
+    "OP_POP",
+    "OP_DEFINE_GLOBAL",
+    "OP_GET_GLOBAL",
+    "OP_DEFINE_LOCAL",
+    "OP_GET_LOCAL",
+    "OP_GET_UPVALUE",
+    "OP_CLOSE_UPVALUE",
+    "OP_JUMP_FALSE",
+    "OP_JUMP",
+    "OP_LOOP",
+    "OP_CALL",
+    "OP_TAIL_CALL",
+    "OP_ADD",
+    "OP_SUBTRACT",
+    "OP_MULTIPLY",
+    "OP_DIVIDE",
+    "OP_BINARY_ADD",
+    "OP_BINARY_SUBTRACT",
+    "OP_BINARY_MULTIPLY",
+    "OP_BINARY_DIVIDE",
+    "OP_LESS",
+    "OP_GREATER",
+    "OP_EQUAL",
+    "OP_LESS_JUMP_FALSE",
+    "OP_GREATER_JUMP_FALSE",
+    "OP_EQUAL_JUMP_FALSE",
+    "OP_POP_JUMP_FALSE",
+    "OP_CLOSURE",
+    "OP_YIELD",
+    "OP_RESUME",
+    "OP_ITERATE",
+    "OP_ITERATE_NEXT",
+    "OP_RETURN",
+};
+
+_Static_assert(sizeof(opcodeNames) / sizeof(opcodeNames[0]) == OPCODE_COUNT,
+    "Every opcode needs a name.");
+
+// Class of each opcode, in the order of the OpCode enum.
+const OpcodeClass opcodeClasses[OPCODE_COUNT] = {
+    [OP_CONSTANT] = CLASS_STACK,
+    [OP_NULL] = CLASS_STACK,
+    [OP_TRUE] = CLASS_STACK,
+    [OP_FALSE] = CLASS_STACK,
+    [OP_POP] = CLASS_STACK,
+    [OP_DEFINE_GLOBAL] = CLASS_VARIABLE,
+    [OP_GET_GLOBAL] = CLASS_VARIABLE,
+    [OP_DEFINE_LOCAL] = CLASS_VARIABLE,
+    [OP_GET_LOCAL] = CLASS_VARIABLE,
+    [OP_GET_UPVALUE] = CLASS_VARIABLE,
+    [OP_CLOSE_UPVALUE] = CLASS_VARIABLE,
+    [OP_JUMP_FALSE] = CLASS_JUMP,
+    [OP_JUMP] = CLASS_JUMP,
+    [OP_LOOP] = CLASS_JUMP,
+    [OP_CALL] = CLASS_CALL,
+    [OP_TAIL_CALL] = CLASS_CALL,
+    [OP_ADD] = CLASS_ARITHMETIC,
+    [OP_SUBTRACT] = CLASS_ARITHMETIC,
+    [OP_MULTIPLY] = CLASS_ARITHMETIC,
+    [OP_DIVIDE] = CLASS_ARITHMETIC,
+    [OP_BINARY_ADD] = CLASS_ARITHMETIC,
+    [OP_BINARY_SUBTRACT] = CLASS_ARITHMETIC,
+    [OP_BINARY_MULTIPLY] = CLASS_ARITHMETIC,
+    [OP_BINARY_DIVIDE] = CLASS_ARITHMETIC,
+    [OP_LESS] = CLASS_COMPARISON,
+    [OP_GREATER] = CLASS_COMPARISON,
+    [OP_EQUAL] = CLASS_COMPARISON,
+    [OP_LESS_JUMP_FALSE] = CLASS_COMPARISON,
+    [OP_GREATER_JUMP_FALSE] = CLASS_COMPARISON,
+    [OP_EQUAL_JUMP_FALSE] = CLASS_COMPARISON,
+    [OP_POP_JUMP_FALSE] = CLASS_JUMP,
+    [OP_CLOSURE] = CLASS_CALL,
+    [OP_YIELD] = CLASS_COROUTINE,
+    [OP_RESUME] = CLASS_COROUTINE,
+    [OP_ITERATE] = CLASS_COROUTINE,
+    [OP_ITERATE_NEXT] = CLASS_COROUTINE,
+    [OP_RETURN] = CLASS_CALL,
+};
+
+static const char* classNames[] = {
+    "stack",
+    "variables",
+    "arithmetic",
+    "comparisons",
+    "jumps",
+    "calls",
+    "coroutines and iteration",
+};
+
+_Static_assert(sizeof(classNames) / sizeof(classNames[0]) == CLASS_COUNT,
+    "Every opcode class needs a name.");
+
+// Allocate a new set of counters, all zero.
+OpcodeStats* newOpcodeStats(void)
+{
+    OpcodeStats* stats = calloc(1, sizeof(OpcodeStats));
+    if (stats == NULL)
+        exit(1);
+
+    stats->started = nanoseconds();
+    return stats;
+}
+
+void freeOpcodeStats(OpcodeStats* stats)
+{
+    free(stats);
+}
+
+// Return the percentage that part is of total.
+static double percent(uint64_t part, uint64_t total)
+{
+    return total == 0 ? 0 : 100.0 * (double)part / (double)total;
+}
+
+// Return the index of the largest value in an array of counts that hasn't
+// been reported yet, or -1 if every count left is zero.
+static int largest(const uint64_t* counts, bool* reported, int count)
+{
+    int index = -1;
+
+    for (int i = 0; i < count; i++) {
+        if (!reported[i] && counts[i] > 0
+            && (index == -1 || counts[i] > counts[index])) {
+            index = i;
+        }
+    }
+
+    if (index != -1)
+        reported[index] = true;
+    return index;
+}
+
+// Print how often each opcode ran, the most frequent pairs of opcodes run
+// one after the other, and the time spent in each class of opcode. The times
+// include the cost of measuring them, which is about the same for every
+// instruction.
+void printOpcodeStats(OpcodeStats* stats, FILE* out)
+{
+    uint64_t total = 0;
+    for (int i = 0; i < OPCODE_COUNT; i++) {
+        total += stats->counts[i];
+    }
+
+    bool reported[OPCODE_COUNT * OPCODE_COUNT] = { false };
+    fprintf(out, "== opcodes (%llu run) ==\n", (unsigned long long)total);
+
+    int opcode;
+    while ((opcode = largest(stats->counts, reported, OPCODE_COUNT)) != -1) {
+        fprintf(out, "%-24s %14llu %6.2f%%\n", opcodeNames[opcode],
+            (unsigned long long)stats->counts[opcode],
+            percent(stats->counts[opcode], total));
+    }
+
+    uint64_t* pairs = &stats->pairs[0][0];
+    memset(reported, 0, sizeof(reported));
+    fprintf(out, "\n== opcode pairs ==\n");
+
+    for (int i = 0; i < OPCODE_PAIRS_REPORTED; i++) {
+        int pair = largest(pairs, reported, OPCODE_COUNT * OPCODE_COUNT);
+        if (pair == -1)
+            break;
+
+        fprintf(out, "%-24s %-24s %14llu %6.2f%%\n",
+            opcodeNames[pair / OPCODE_COUNT], opcodeNames[pair % OPCODE_COUNT],
+            (unsigned long long)pairs[pair], percent(pairs[pair], total));
+    }
+
+    uint64_t time = 0;
+    for (int i = 0; i < CLASS_COUNT; i++) {
+        time += stats->classTime[i];
+    }
+
+    fprintf(out, "\n== time by opcode class ==\n");
+    for (int i = 0; i < CLASS_COUNT; i++) {
+        fprintf(out, "%-24s %11.3f ms %6.2f%%\n", classNames[i],
+            (double)stats->classTime[i] / 1e6,
+            percent(stats->classTime[i], time));
+    }
+}
@@ -0,0 +1,62 @@
+#ifndef clisp_opcodeStats_h
+#define clisp_opcodeStats_h
+
+#include <stdio.h>
+
+#include "chunk.h"
+#include "common.h"
+
+// Number of opcodes, for sizing the counters.
+#define OPCODE_COUNT (OP_RETURN + 1)
+
+// Number of the most frequent opcode pairs included in the report.
+#define OPCODE_PAIRS_REPORTED 25
+
+// Groups of related opcodes that time is measured for.
+typedef enum {
+    CLASS_STACK,
+    CLASS_VARIABLE,
+    CLASS_ARITHMETIC,
+    CLASS_COMPARISON,
+    CLASS_JUMP,
+    CLASS_CALL,
+    CLASS_COROUTINE,
+    CLASS_COUNT,
+} OpcodeClass;
+
+// Counts of the instructions the VM has run, collected when the VM is
+// started with --opcode-stats.
+typedef struct OpcodeStats {
+    uint64_t counts[OPCODE_COUNT];
+
+    // Number of times each opcode was followed by each other opcode, indexed
+    // by the first of the pair.
+    uint64_t pairs[OPCODE_COUNT][OPCODE_COUNT];
+
+    // Nanoseconds spent running each class of opcode.
+    uint64_t classTime[CLASS_COUNT];
+
+    // The opcode run before the current one, and when it started.
+    uint8_t previous;
+    uint64_t started;
+} OpcodeStats;
+
+extern const OpcodeClass opcodeClasses[OPCODE_COUNT];
+
+OpcodeStats* newOpcodeStats(void);
+void freeOpcodeStats(OpcodeStats* stats);
+void printOpcodeStats(OpcodeStats* stats, FILE* out);
+
+// Count an instruction that is about to run, and charge the time since the
+// previous one started to that instruction's class.
+static inline void countOpcode(OpcodeStats* stats, uint8_t opcode)
+{
+    uint64_t now = nanoseconds();
+    stats->counts[opcode]++;
+    stats->pairs[stats->previous][opcode]++;
+    stats->classTime[opcodeClasses[stats->previous]] += now - stats->started;
+    stats->previous = opcode;
+    stats->started = now;
+}
+
+#endif
@@ -0,0 +1,252 @@
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "copy.h"
+#include "memory.h"
+#include "object.h"
+#include "parallel.h"
+#include "value.h"
+#include "vm.h"
+
+// A call to pmap, shared by its workers.
+typedef struct {
+    // The calling VM. Workers only read from its heap, which doesn't change
+    // while the caller waits for them.
+    VM* vm;
+
+    Value function;
+    ObjList* list;
+
+    // Index of the next value of the list to be taken by a worker.
+    atomic_int next;
+
+    // Number of values a worker takes at a time.
+    int batch;
+
+    // Set when a worker fails, so the others stop early.
+    atomic_bool failed;
+
+    // For each value of the list, the worker that mapped it and the index of
+    // the result in that worker's results.
+    int* owners;
+    int* positions;
+} Job;
+
+// A thread mapping values of the list with a VM of its own.
+typedef struct {
+    Job* job;
+    int index;
+    pthread_t thread;
+    VM vm;
+} Worker;
+
+// Map batches of the list until every value has been taken. The worker's VM
+// keeps the results in a list at the bottom of its stack, above the copy of
+// the function.
+static void* runWorker(void* arg)
+{
+    Worker* worker = (Worker*)arg;
+    Job* job = worker->job;
+    VM* vm = &worker->vm;
+    int count = job->list->count;
+
+    initVM(vm);
+    if (!copyGlobalSlots(vm, job->vm)) {
+        atomic_store(&job->failed, true);
+        return NULL;
+    }
+
+    Copier copier;
+    initCopier(&copier, job->vm, vm, true);
+    push(vm, OBJ_VAL(newList(vm)));
+    push(vm, copyValue(&copier, job->function));
+
+    while (!atomic_load(&job->failed)) {
+        int start = atomic_fetch_add(&job->next, job->batch);
+        if (start >= count)
+            break;
+
+        int end = start + job->batch < count ? start + job->batch : count;
+        for (int i = start; i < end; i++) {
+            // Running the function may move the copies made so far.
+            resetCopier(&copier);
+            push(vm, vm->stack[1]);
+            push(vm, copyValue(&copier, listValues(job->list)[i]));
+
+            if (copier.failed) {
+                fprintf(stderr, "Attempted to pass a coroutine to `pmap`.\n");
+                atomic_store(&job->failed, true);
+                break;
+            }
+
+            Value result;
+            if (callFunction(vm, 1, &result) != INTERPRET_OK) {
+                atomic_store(&job->failed, true);
+                break;
+            }
+
+            push(vm, result);
+            ObjList* results = AS_LIST(vm->stack[0]);
+            appendToList(vm, results, result);
+            pop(vm);
+            job->owners[i] = worker->index;
+            job->positions[i] = results->count - 1;
+        }
+    }
+
+    freeCopier(&copier);
+    return NULL;
+}
+
+// Return the number of workers to map a list of the given length with.
+static int workerCount(int count)
+{
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    int workers = cores < 1 ? 1 : (int)cores;
+
+    if (workers > PMAP_MAX_WORKERS)
+        workers = PMAP_MAX_WORKERS;
+    if (workers > count)
+        workers = count;
+
+    return workers;
+}
+
+// Copy the results out of the workers' heaps into a new list, in the order
+// of the values they were mapped from. Return NULL if a result can't be
+// copied.
+static ObjList* collectResults(VM* vm, Job* job, Worker* workers,
+    int workerCount)
+{
+    int count = job->list->count;
+    Copier* copiers = malloc(sizeof(Copier) * (size_t)workerCount);
+    if (copiers == NULL)
+        exit(1);
+
+    for (int i = 0; i < workerCount; i++) {
+        initCopier(&copiers[i], &workers[i].vm, vm, false);
+    }
+
+    ObjList* mapped = newList(vm);
+    mapped->buffer = newListBuffer(vm, count);
+    mapped->buffer->refCount = 1;
+
+    for (int i = 0; i < count; i++) {
+        Worker* worker = &workers[job->owners[i]];
+        Value result = listValues(AS_LIST(worker->vm.stack[0]))
+            [job->positions[i]];
+
+        mapped->buffer->values[i] = copyValue(&copiers[worker->index],
+            result);
+        mapped->buffer->count++;
+        mapped->count++;
+    }
+
+    bool failed = false;
+    for (int i = 0; i < workerCount; i++) {
+        failed = failed || copiers[i].failed;
+        freeCopier(&copiers[i]);
+    }
+    free(copiers);
+
+    return failed ? NULL : mapped;
+}
+
+// Return a new list of the results of calling the function with each value
+// of the list, the calls running in parallel on separate threads.
+//
+// Each thread has a VM of its own, with a copy of the function, the values it
+// is called with, and the globals the function reads. Results are copied
+// back into the calling VM. Changes the function makes to globals, or to the
+// values it is given, are not seen by the caller.
+bool pmap(VM* vm, int argCount, Value* args, Value* result)
+{
+    if (argCount != 2) {
+        runtimeError(vm,
+            "Attempted to call `pmap` with wrong number of arguments.");
+        return false;
+    }
+
+    if (!IS_CLOSURE(args[0]) && !IS_NATIVE(args[0])) {
+        runtimeError(vm, "Attempted to call `pmap` with non-function.");
+        return false;
+    }
+
+    if (!IS_LIST(args[1])) {
+        runtimeError(vm, "Attempted to call `pmap` on non-list object.");
+        return false;
+    }
+
+    Job job;
+    job.vm = vm;
+    job.function = args[0];
+    job.list = AS_LIST(args[1]);
+
+    int count = job.list->count;
+    if (count == 0) {
+        *result = OBJ_VAL(newList(vm));
+        return true;
+    }
+
+    int workerTotal = workerCount(count);
+    job.batch = count / (workerTotal * PMAP_BATCHES_PER_WORKER);
+    if (job.batch < 1)
+        job.batch = 1;
+    atomic_init(&job.next, 0);
+    atomic_init(&job.failed, false);
+
+    job.owners = malloc(sizeof(int) * (size_t)count);
+    job.positions = malloc(sizeof(int) * (size_t)count);
+    Worker* workers = malloc(sizeof(Worker) * (size_t)workerTotal);
+    if (job.owners == NULL || job.positions == NULL || workers == NULL)
+        exit(1);
+
+    // If a thread can't be started, the workers that did start take its
+    // share of the list. The calling thread is the first worker.
+    int started = 1;
+    for (int i = 0; i < workerTotal; i++) {
+        workers[i].job = &job;
+        workers[i].index = i;
+    }
+
+    for (int i = 1; i < workerTotal; i++) {
+        if (pthread_create(&workers[i].thread, NULL, runWorker, &workers[i])
+            != 0)
+            break;
+        started++;
+    }
+
+    runWorker(&workers[0]);
+
+    for (int i = 1; i < started; i++) {
+        pthread_join(workers[i].thread, NULL);
+    }
+
+    bool failed = atomic_load(&job.failed);
+    ObjList* mapped = NULL;
+    if (!failed)
+        mapped = collectResults(vm, &job, workers, started);
+
+    for (int i = 0; i < started; i++) {
+        freeVM(&workers[i].vm);
+    }
+    free(workers);
+    free(job.owners);
+    free(job.positions);
+
+    if (failed) {
+        runtimeError(vm, "Error in function called by `pmap`.");
+        return false;
+    }
+
+    if (mapped == NULL) {
+        runtimeError(vm, "Attempted to return a coroutine from `pmap`.");
+        return false;
+    }
+
+    *result = OBJ_VAL(mapped);
+    return true;
+}
@@ -0,0 +1,16 @@
+#ifndef clisp_parallel_h
+#define clisp_parallel_h
+
+#include "common.h"
+#include "value.h"
+
+// Most worker threads that a single call to pmap starts.
+#define PMAP_MAX_WORKERS 64
+
+// Number of batches each worker is expected to take from the list, so that
+// workers that finish early can take work from the end of the list.
+#define PMAP_BATCHES_PER_WORKER 16
+
+bool pmap(VM* vm, int argCount, Value* args, Value* result);
+
+#endif
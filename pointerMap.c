@@ -0,0 +1,78 @@
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "pointerMap.h"
+
+// Initialise an empty map.
+void initPointerMap(PointerMap* map)
+{
+    map->keys = NULL;
+    map->numbers = NULL;
+    map->capacity = 0;
+    map->pointers = NULL;
+    map->count = 0;
+}
+
+// Free the memory held by the map, leaving it empty.
+void freePointerMap(PointerMap* map)
+{
+    free(map->keys);
+    free(map->numbers);
+    free(map->pointers);
+    initPointerMap(map);
+}
+
+// Return the slot in the table that holds the pointer, or the empty slot
+// it would be placed in.
+static uint32_t findPointer(const void** keys, uint32_t capacity,
+    const void* pointer)
+{
+    uint64_t hash = (uint64_t)(uintptr_t)pointer * 0x9e3779b97f4a7c15u;
+    uint32_t index = (uint32_t)(hash >> 32) & (capacity - 1);
+
+    while (keys[index] != NULL && keys[index] != pointer)
+        index = (index + 1) & (capacity - 1);
+
+    return index;
+}
+
+// Return the number of the pointer, numbering it if it hasn't been seen yet.
+uint32_t numberPointer(PointerMap* map, const void* pointer)
+{
+    if (map->capacity > 0) {
+        uint32_t index = findPointer(map->keys, map->capacity, pointer);
+        if (map->keys[index] != NULL)
+            return map->numbers[index];
+    }
+
+    // Keep the table at most half full, and the list of pointers with room
+    // for every pointer the table can hold.
+    if ((map->count + 1) * 2 > map->capacity) {
+        uint32_t capacity = map->capacity < 64 ? 64 : map->capacity * 2;
+        const void** keys = calloc(capacity, sizeof(void*));
+        uint32_t* numbers = malloc(sizeof(uint32_t) * capacity);
+        const void** pointers = realloc(map->pointers,
+            sizeof(void*) * capacity / 2);
+        if (keys == NULL || numbers == NULL || pointers == NULL)
+            exit(1);
+
+        for (uint32_t i = 0; i < map->count; i++) {
+            uint32_t index = findPointer(keys, capacity, pointers[i]);
+            keys[index] = pointers[i];
+            numbers[index] = i;
+        }
+
+        free(map->keys);
+        free(map->numbers);
+        map->keys = keys;
+        map->numbers = numbers;
+        map->pointers = pointers;
+        map->capacity = capacity;
+    }
+
+    uint32_t index = findPointer(map->keys, map->capacity, pointer);
+    map->keys[index] = pointer;
+    map->numbers[index] = map->count;
+    map->pointers[map->count] = pointer;
+    return map->count++;
+}
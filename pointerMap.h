@@ -0,0 +1,22 @@
+#ifndef clisp_pointerMap_h
+#define clisp_pointerMap_h
+
+#include <stdint.h>
+
+// Numbers pointers in the order they are first seen.
+typedef struct {
+    // Open addressing table from pointer to number.
+    const void** keys;
+    uint32_t* numbers;
+    uint32_t capacity;
+
+    // Every pointer that has been numbered, in order.
+    const void** pointers;
+    uint32_t count;
+} PointerMap;
+
+void initPointerMap(PointerMap* map);
+void freePointerMap(PointerMap* map);
+uint32_t numberPointer(PointerMap* map, const void* pointer);
+
+#endif
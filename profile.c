@@ -0,0 +1,268 @@
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+
+#include "buffer.h"
+#include "object.h"
+#include "profile.h"
+#include "value.h"
+#include "vm.h"
+
+// Number of timer signals since the last sample was taken. The timer is
+// shared by the whole process, so only one VM is profiled at a time.
+static atomic_int pendingTicks;
+static atomic_bool timerRunning;
+static struct sigaction previousAction;
+
+// Count the tick for the profiled VM to sample at its next safepoint. The
+// frames are not walked here, as the signal may arrive while the collector is
+// moving the objects they refer to.
+static void handleTick(int signalNumber)
+{
+    (void)signalNumber;
+    atomic_fetch_add_explicit(&pendingTicks, 1, memory_order_relaxed);
+}
+
+// Start the timer that delivers SIGPROF, and sample the VM whenever it
+// reaches a safepoint after one. Return false if a VM is already being
+// profiled.
+bool startProfiler(VM* vm)
+{
+    if (atomic_exchange(&timerRunning, true))
+        return false;
+
+    Profiler* profiler = malloc(sizeof(Profiler));
+    if (profiler == NULL)
+        exit(1);
+
+    profiler->stacks = NULL;
+    profiler->count = 0;
+    profiler->capacity = 0;
+    initBuffer(&profiler->frames);
+    vm->profiler = profiler;
+    atomic_store(&pendingTicks, 0);
+
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = handleTick;
+    action.sa_flags = SA_RESTART;
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGPROF, &action, &previousAction);
+
+    struct itimerval timer = {
+        { 0, PROFILE_INTERVAL_US },
+        { 0, PROFILE_INTERVAL_US },
+    };
+    setitimer(ITIMER_PROF, &timer, NULL);
+    return true;
+}
+
+// Stop the VM's profiler, and append the stacks it sampled to the output in
+// the collapsed stack format read by flame graph tools: the frames of each
+// stack separated by semicolons, then a space and the number of samples.
+void stopProfiler(VM* vm, Buffer* output)
+{
+    Profiler* profiler = vm->profiler;
+
+    struct itimerval timer = { { 0, 0 }, { 0, 0 } };
+    setitimer(ITIMER_PROF, &timer, NULL);
+    sigaction(SIGPROF, &previousAction, NULL);
+
+    for (int i = 0; i < profiler->capacity; i++) {
+        ProfileStack* stack = &profiler->stacks[i];
+        if (stack->frames == NULL)
+            continue;
+
+        char count[32];
+        int length = snprintf(count, sizeof(count), " %ld\n", stack->count);
+        appendBytes(output, stack->frames, stack->length, 1);
+        appendBytes(output, count, (size_t)length, 1);
+        free(stack->frames);
+    }
+
+    free(profiler->stacks);
+    freeBuffer(&profiler->frames);
+    free(profiler);
+    vm->profiler = NULL;
+    atomic_store(&timerRunning, false);
+}
+
+// Return the FNV-1a hash of the frames.
+static uint64_t hashFrames(const uint8_t* frames, size_t length)
+{
+    uint64_t hash = 14695981039346656037u;
+
+    for (size_t i = 0; i < length; i++) {
+        hash ^= frames[i];
+        hash *= 1099511628211u;
+    }
+
+    return hash;
+}
+
+// Return the entry for the frames in the table, or the empty entry where
+// they belong.
+static ProfileStack* findStack(ProfileStack* stacks, int capacity,
+    const uint8_t* frames, size_t length, uint64_t hash)
+{
+    uint64_t index = hash & (uint64_t)(capacity - 1);
+
+    for (;;) {
+        ProfileStack* stack = &stacks[index];
+        if (stack->frames == NULL
+            || (stack->hash == hash && stack->length == length
+                && memcmp(stack->frames, frames, length) == 0)) {
+            return stack;
+        }
+
+        index = (index + 1) & (uint64_t)(capacity - 1);
+    }
+}
+
+// Add the samples to the count of the stack built up in the profiler's
+// frames.
+static void countStack(Profiler* profiler, long samples)
+{
+    if (profiler->count + 1 > profiler->capacity / 2) {
+        int capacity = profiler->capacity < PROFILE_STACKS_INITIAL
+            ? PROFILE_STACKS_INITIAL
+            : profiler->capacity * 2;
+        ProfileStack* stacks = calloc((size_t)capacity, sizeof(ProfileStack));
+        if (stacks == NULL)
+            exit(1);
+
+        for (int i = 0; i < profiler->capacity; i++) {
+            ProfileStack* stack = &profiler->stacks[i];
+            if (stack->frames != NULL) {
+                *findStack(stacks, capacity, (uint8_t*)stack->frames,
+                    stack->length, stack->hash)
+                    = *stack;
+            }
+        }
+
+        free(profiler->stacks);
+        profiler->stacks = stacks;
+        profiler->capacity = capacity;
+    }
+
+    const uint8_t* frames = profiler->frames.bytes;
+    size_t length = profiler->frames.count;
+    uint64_t hash = hashFrames(frames, length);
+    ProfileStack* stack = findStack(profiler->stacks, profiler->capacity,
+        frames, length, hash);
+
+    if (stack->frames == NULL) {
+        stack->frames = malloc(length);
+        if (stack->frames == NULL)
+            exit(1);
+
+        memcpy(stack->frames, frames, length);
+        stack->length = length;
+        stack->hash = hash;
+        stack->count = 0;
+        profiler->count++;
+    }
+
+    stack->count += samples;
+}
+
+// Append a frame for each of the calls, named by function and line.
+static void appendFrames(Buffer* frames, CallFrame* calls, int count)
+{
+    for (int i = 0; i < count; i++) {
+        ObjFunction* function = calls[i].closure->function;
+        size_t instruction = (size_t)(calls[i].ip - function->chunk.code - 1);
+
+        char line[32];
+        int length = snprintf(line, sizeof(line), ":%d",
+            function->chunk.lines[instruction]);
+
+        if (frames->count > 0)
+            appendBytes(frames, ";", 1, 1);
+        if (function->name == NULL) {
+            appendBytes(frames, "script", 6, 1);
+        } else {
+            appendBytes(frames, function->name->chars,
+                (size_t)function->name->length, 1);
+        }
+        appendBytes(frames, line, (size_t)length, 1);
+    }
+}
+
+// Append the frames of the code that resumed the coroutine, and the code
+// that resumed that, from the outermost. While a coroutine runs, it holds the
+// frames of the code that resumed it.
+static void appendResumers(Buffer* frames, ObjCoroutine* coroutine)
+{
+    if (coroutine == NULL)
+        return;
+
+    appendResumers(frames, coroutine->caller);
+    appendFrames(frames, coroutine->frames, coroutine->frameCount);
+}
+
+// Record the VM's call stack once for every tick since the last sample, if
+// there have been any. Called at safepoints while the VM is being profiled.
+void takeSample(VM* vm)
+{
+    int ticks = atomic_exchange_explicit(&pendingTicks, 0,
+        memory_order_relaxed);
+    if (ticks == 0)
+        return;
+
+    Profiler* profiler = vm->profiler;
+    profiler->frames.count = 0;
+    appendResumers(&profiler->frames, vm->coroutine);
+    appendFrames(&profiler->frames, vm->frames, vm->frameCount);
+    countStack(profiler, ticks);
+}
+
+// Start sampling the call stack of the running code.
+bool profileStart(VM* vm, int argCount, Value* args, Value* result)
+{
+    (void)args;
+
+    if (argCount != 0) {
+        runtimeError(vm,
+            "Attempted to call `profile-start` with wrong number of arguments.");
+        return false;
+    }
+
+    if (!startProfiler(vm)) {
+        runtimeError(vm, "Attempted to start profiling while already running.");
+        return false;
+    }
+
+    *result = NULL_VAL;
+    return true;
+}
+
+// Stop sampling, and return the stacks sampled since `profile-start` as a
+// string in collapsed stack format.
+bool profileStop(VM* vm, int argCount, Value* args, Value* result)
+{
+    (void)args;
+
+    if (argCount != 0) {
+        runtimeError(vm,
+            "Attempted to call `profile-stop` with wrong number of arguments.");
+        return false;
+    }
+
+    if (vm->profiler == NULL) {
+        runtimeError(vm, "Attempted to stop profiling while not running.");
+        return false;
+    }
+
+    Buffer output;
+    initBuffer(&output);
+    stopProfiler(vm, &output);
+
+    *result = OBJ_VAL(copyString(vm, (const char*)output.bytes,
+        (int)output.count));
+    freeBuffer(&output);
+    return true;
+}
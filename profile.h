@@ -0,0 +1,41 @@
+#ifndef clisp_profile_h
+#define clisp_profile_h
+
+#include "buffer.h"
+#include "common.h"
+#include "value.h"
+
+// Microseconds of CPU time between samples.
+#define PROFILE_INTERVAL_US 1000
+
+// Initial capacity of the table of sampled stacks.
+#define PROFILE_STACKS_INITIAL 64
+
+// A distinct call stack seen while sampling, and how many samples saw it.
+typedef struct {
+    // The frames of the stack from the outermost, in collapsed stack form.
+    char* frames;
+    size_t length;
+    uint64_t hash;
+    long count;
+} ProfileStack;
+
+// The samples taken by a running profiler, counted by call stack.
+typedef struct Profiler {
+    // Open addressed table of the stacks seen, with NULL frames when empty.
+    ProfileStack* stacks;
+    int count;
+    int capacity;
+
+    // Where the stack of the current sample is built up.
+    Buffer frames;
+} Profiler;
+
+bool startProfiler(VM* vm);
+void stopProfiler(VM* vm, Buffer* output);
+void takeSample(VM* vm);
+
+bool profileStart(VM* vm, int argCount, Value* args, Value* result);
+bool profileStop(VM* vm, int argCount, Value* args, Value* result);
+
+#endif
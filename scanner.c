@@ -3,21 +3,12 @@
 
 #include "scanner.h"
 
-// holds the data required by the scanner for scanning tokens.
-typedef struct {
-    const char* start; // points to the first character of the token.
-    const char* current; // points to the current character to be consumed.
-    int line; // the line number of the current token.
-} Scanner;
-
-Scanner scanner;
-
 // Initialise the scanner's data.
-void initScanner(const char* source)
+void initScanner(Scanner* scanner, const char* source)
 {
-    scanner.start = source;
-    scanner.current = source;
-    scanner.line = 1;
+    scanner->start = source;
+    scanner->current = source;
+    scanner->line = 1;
 }
 
 // is the given character a digit?
@@ -27,34 +18,34 @@ static bool isDigit(char c)
 }
 
 // Has the scanner reached the end of its input (null terminator).
-static bool isAtEnd(void)
+static bool isAtEnd(Scanner* scanner)
 {
-    return *scanner.current == '\0';
+    return *scanner->current == '\0';
 }
 
 // Progress the scanner to the next character.
-static char advance(void)
+static char advance(Scanner* scanner)
 {
-    scanner.current++;
-    return scanner.current[-1];
+    scanner->current++;
+    return scanner->current[-1];
 }
 
 // Return the next character to be consumed.
-static char peek(void)
+static char peek(Scanner* scanner)
 {
-    return *scanner.current;
+    return *scanner->current;
 }
 
 // Return second character to be consumed.
-static char peekNext(void)
+static char peekNext(Scanner* scanner)
 {
-    if (isAtEnd())
+    if (isAtEnd(scanner))
         return '\0';
-    return scanner.current[1];
+    return scanner->current[1];
 }
 
 // is the given character a letter or underscore?
-static bool isValidIdentChar(char c)
+static bool isValidIdentChar(Scanner* scanner, char c)
 {
     switch (c) {
     case '(':
@@ -68,7 +59,7 @@ static bool isValidIdentChar(char c)
     case '\n':
         return false;
     case '/':
-        if (peekNext() == '/')
+        if (peekNext(scanner) == '/')
             return false;
         [[fallthrough]];
     default:
@@ -78,47 +69,47 @@ static bool isValidIdentChar(char c)
 
 // Return a token of the provided type.
 // Add the start position of the token literal, the length, and the line number.
-static Token makeToken(TokenType type)
+static Token makeToken(Scanner* scanner, TokenType type)
 {
     Token token;
     token.type = type;
-    token.start = scanner.start;
-    token.length = (int)(scanner.current - scanner.start);
-    token.line = scanner.line;
+    token.start = scanner->start;
+    token.length = (int)(scanner->current - scanner->start);
+    token.line = scanner->line;
     return token;
 }
 
 // Create a token with the error type, along with the provided error message.
-static Token errorToken(const char* message)
+static Token errorToken(Scanner* scanner, const char* message)
 {
     Token token;
     token.type = TOKEN_ERROR;
     token.start = message;
     token.length = (int)strlen(message);
-    token.line = scanner.line;
+    token.line = scanner->line;
     return token;
 }
 
 // skip over all the whitespace characters from the current point in source,
 // adding to the line count when moving to the next one.
-static void skipWhitespace(void)
+static void skipWhitespace(Scanner* scanner)
 {
     for (;;) {
-        char c = peek();
+        char c = peek(scanner);
         switch (c) {
         case ' ':
         case '\r':
         case '\t':
-            advance();
+            advance(scanner);
             break;
         case '\n':
-            scanner.line++;
-            advance();
+            scanner->line++;
+            advance(scanner);
             break;
         case '/':
-            if (peekNext() == '/') {
-                while (peek() != '\n' && !isAtEnd())
-                    advance();
+            if (peekNext(scanner) == '/') {
+                while (peek(scanner) != '\n' && !isAtEnd(scanner))
+                    advance(scanner);
             } else {
                 return;
             }
@@ -132,10 +123,11 @@ static void skipWhitespace(void)
 // by checking first that the length of the remaining characters is the same as
 // the length of the remaining keyword. If so, then check that the remaining
 // characters match the remaining characters of the keyword.
-static TokenType checkKeyword(
+static TokenType checkKeyword(Scanner* scanner,
     int start, int length, const char* rest, TokenType type)
 {
-    if (scanner.current - scanner.start == start + length && memcmp(scanner.start + start, rest, (size_t)length) == 0) {
+    if (scanner->current - scanner->start == start + length
+        && memcmp(scanner->start + start, rest, (size_t)length) == 0) {
         return type;
     }
 
@@ -145,35 +137,39 @@ static TokenType checkKeyword(
 // Check if the current identifier is actually a keyword, reserved by the
 // language. Return the type of the matched keyword if any, else it is
 // an identifier.
-static TokenType identifierType(void)
+static TokenType identifierType(Scanner* scanner)
 {
-    switch (scanner.start[0]) {
+    switch (scanner->start[0]) {
     case 'a':
-        return checkKeyword(1, 2, "nd", TOKEN_AND);
+        return checkKeyword(scanner, 1, 2, "nd", TOKEN_AND);
     case 'd':
-        return checkKeyword(1, 2, "ef", TOKEN_DEF);
+        return checkKeyword(scanner, 1, 2, "ef", TOKEN_DEF);
     case 'i':
-        return checkKeyword(1, 1, "f", TOKEN_IF);
+        return checkKeyword(scanner, 1, 1, "f", TOKEN_IF);
     case 'f':
-        if (scanner.current - scanner.start > 1) {
-            switch (scanner.start[1]) {
+        if (scanner->current - scanner->start > 1) {
+            switch (scanner->start[1]) {
             case 'a':
-                return checkKeyword(2, 3, "lse", TOKEN_FALSE);
+                return checkKeyword(scanner, 2, 3, "lse", TOKEN_FALSE);
             case 'o':
-                return checkKeyword(2, 1, "r", TOKEN_FOR);
+                return checkKeyword(scanner, 2, 1, "r", TOKEN_FOR);
             }
         }
         break;
     case 'l':
-        return checkKeyword(1, 5, "ambda", TOKEN_LAMBDA);
+        return checkKeyword(scanner, 1, 5, "ambda", TOKEN_LAMBDA);
     case 'n':
-        return checkKeyword(1, 3, "ull", TOKEN_NULL);
+        return checkKeyword(scanner, 1, 3, "ull", TOKEN_NULL);
     case 'o':
-        return checkKeyword(1, 1, "r", TOKEN_OR);
+        return checkKeyword(scanner, 1, 1, "r", TOKEN_OR);
+    case 'r':
+        return checkKeyword(scanner, 1, 5, "esume", TOKEN_RESUME);
     case 't':
-        return checkKeyword(1, 3, "rue", TOKEN_TRUE);
+        return checkKeyword(scanner, 1, 3, "rue", TOKEN_TRUE);
     case 'w':
-        return checkKeyword(1, 4, "hile", TOKEN_WHILE);
+        return checkKeyword(scanner, 1, 4, "hile", TOKEN_WHILE);
+    case 'y':
+        return checkKeyword(scanner, 1, 4, "ield", TOKEN_YIELD);
     }
 
     return TOKEN_IDENTIFIER;
@@ -181,88 +177,88 @@ static TokenType identifierType(void)
 
 // Read the remaining characters of an identifier, which (after the initial
 // letter or underscore) can be any alphanumeric character or an underscore.
-static Token identifier(void)
+static Token identifier(Scanner* scanner)
 {
-    while (isValidIdentChar(peek()) || isDigit(peek()))
-        advance();
-    return makeToken(identifierType());
+    while (isValidIdentChar(scanner, peek(scanner)) || isDigit(peek(scanner)))
+        advance(scanner);
+    return makeToken(scanner, identifierType(scanner));
 }
 
 // Scan the characters involved in the number token and return a number token.
-static Token number(void)
+static Token number(Scanner* scanner)
 {
-    while (isDigit(peek()))
-        advance();
+    while (isDigit(peek(scanner)))
+        advance(scanner);
 
     // look for decimal
-    if (peek() == '.' && isDigit(peekNext())) {
-        advance();
+    if (peek(scanner) == '.' && isDigit(peekNext(scanner))) {
+        advance(scanner);
 
-        while (isDigit(peek()))
-            advance();
+        while (isDigit(peek(scanner)))
+            advance(scanner);
     }
 
-    return makeToken(TOKEN_NUMBER);
+    return makeToken(scanner, TOKEN_NUMBER);
 }
 
 // Scan the characters involved in the string token and return a string token.
-static Token string(void)
+static Token string(Scanner* scanner)
 {
-    while (peek() != '"' && !isAtEnd()) {
-        if (peek() == '\n')
-            scanner.line++;
-        advance();
+    while (peek(scanner) != '"' && !isAtEnd(scanner)) {
+        if (peek(scanner) == '\n')
+            scanner->line++;
+        advance(scanner);
     }
 
-    if (isAtEnd())
-        return errorToken("Unterminated string.");
+    if (isAtEnd(scanner))
+        return errorToken(scanner, "Unterminated string.");
 
-    advance();
-    return makeToken(TOKEN_STRING);
+    advance(scanner);
+    return makeToken(scanner, TOKEN_STRING);
 }
 
 // Scan and return whatever the next token type is.
-Token scanToken(void)
+Token scanToken(Scanner* scanner)
 {
-    skipWhitespace();
-    scanner.start = scanner.current;
+    skipWhitespace(scanner);
+    scanner->start = scanner->current;
 
-    if (isAtEnd())
-        return makeToken(TOKEN_EOF);
+    if (isAtEnd(scanner))
+        return makeToken(scanner, TOKEN_EOF);
 
-    char c = advance();
+    char c = advance(scanner);
 
     if (isDigit(c))
-        return number();
+        return number(scanner);
 
     switch (c) {
     case '(':
-        return makeToken(TOKEN_LEFT_PAREN);
+        return makeToken(scanner, TOKEN_LEFT_PAREN);
     case ')':
-        return makeToken(TOKEN_RIGHT_PAREN);
+        return makeToken(scanner, TOKEN_RIGHT_PAREN);
     case '{':
-        return makeToken(TOKEN_LEFT_BRACE);
+        return makeToken(scanner, TOKEN_LEFT_BRACE);
     case '}':
-        return makeToken(TOKEN_RIGHT_BRACE);
+        return makeToken(scanner, TOKEN_RIGHT_BRACE);
     case '+':
-        return makeToken(TOKEN_PLUS);
+        return makeToken(scanner, TOKEN_PLUS);
     case '-':
-        if (isDigit(peek()))
-            return number();
+        if (isDigit(peek(scanner)))
+            return number(scanner);
         else
-            return makeToken(TOKEN_DASH);
+            return makeToken(scanner, TOKEN_DASH);
     case '*':
-        return makeToken(TOKEN_STAR);
+        return makeToken(scanner, TOKEN_STAR);
     case '/':
-        return makeToken(TOKEN_SLASH);
+        return makeToken(scanner, TOKEN_SLASH);
     case '\'':
-        return makeToken(TOKEN_QUOTE);
+        return makeToken(scanner, TOKEN_QUOTE);
     case '"':
-        return string();
+        return string(scanner);
     }
 
-    if (isValidIdentChar(c))
-        return identifier();
+    if (isValidIdentChar(scanner, c))
+        return identifier(scanner);
 
-    return errorToken("Unexpected character.");
+    return errorToken(scanner, "Unexpected character.");
 }
@@ -25,8 +25,10 @@ typedef enum {
     TOKEN_LAMBDA,
     TOKEN_NULL,
     TOKEN_OR,
+    TOKEN_RESUME,
     TOKEN_TRUE,
     TOKEN_WHILE,
+    TOKEN_YIELD,
 
     TOKEN_ERROR,
     TOKEN_EOF
@@ -46,7 +48,14 @@ typedef struct {
     int line;
 } Token;
 
-void initScanner(const char* source);
-Token scanToken(void);
+// holds the data required by the scanner for scanning tokens.
+typedef struct {
+    const char* start; // points to the first character of the token.
+    const char* current; // points to the current character to be consumed.
+    int line; // the line number of the current token.
+} Scanner;
+
+void initScanner(Scanner* scanner, const char* source);
+Token scanToken(Scanner* scanner);
 
 #endif
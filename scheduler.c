@@ -0,0 +1,404 @@
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "buffer.h"
+#include "memory.h"
+#include "message.h"
+#include "object.h"
+#include "scheduler.h"
+#include "value.h"
+#include "vm.h"
+
+// Take a reference to the task.
+void retainTask(Task* task)
+{
+    atomic_fetch_add(&task->refCount, 1);
+}
+
+// Drop a reference to the task, freeing it if it was the last.
+void releaseTask(Task* task)
+{
+    if (atomic_fetch_sub(&task->refCount, 1) != 1)
+        return;
+
+    freeBuffer(&task->call);
+    freeBuffer(&task->result);
+    free(task);
+}
+
+static void initDeque(Deque* deque)
+{
+    pthread_mutex_init(&deque->lock, NULL);
+    deque->tasks = NULL;
+    deque->capacity = 0;
+    deque->top = 0;
+    deque->count = 0;
+}
+
+// Free the deque, releasing any tasks left in it.
+static void freeDeque(Deque* deque)
+{
+    for (int i = 0; i < deque->count; i++) {
+        releaseTask(deque->tasks[(deque->top + i) % deque->capacity]);
+    }
+
+    free(deque->tasks);
+    pthread_mutex_destroy(&deque->lock);
+}
+
+// Add a task to the bottom of the deque.
+static void pushTask(Deque* deque, Task* task)
+{
+    pthread_mutex_lock(&deque->lock);
+
+    if (deque->count == deque->capacity) {
+        int capacity = deque->capacity < DEQUE_INITIAL
+            ? DEQUE_INITIAL
+            : deque->capacity * 2;
+        Task** tasks = malloc(sizeof(Task*) * (size_t)capacity);
+        if (tasks == NULL)
+            exit(1);
+
+        for (int i = 0; i < deque->count; i++) {
+            tasks[i] = deque->tasks[(deque->top + i) % deque->capacity];
+        }
+
+        free(deque->tasks);
+        deque->tasks = tasks;
+        deque->capacity = capacity;
+        deque->top = 0;
+    }
+
+    deque->tasks[(deque->top + deque->count) % deque->capacity] = task;
+    deque->count++;
+
+    pthread_mutex_unlock(&deque->lock);
+}
+
+// Remove a task from the deque, or return NULL if it is empty. The owner
+// takes the newest task from the bottom, while thieves take the oldest from
+// the top, which in divide and conquer algorithms is the largest.
+static Task* takeTask(Deque* deque, bool steal)
+{
+    Task* task = NULL;
+    pthread_mutex_lock(&deque->lock);
+
+    if (deque->count > 0) {
+        if (steal) {
+            task = deque->tasks[deque->top];
+            deque->top = (deque->top + 1) % deque->capacity;
+        } else {
+            task = deque->tasks[(deque->top + deque->count - 1)
+                % deque->capacity];
+        }
+        deque->count--;
+    }
+
+    pthread_mutex_unlock(&deque->lock);
+    return task;
+}
+
+// Wake every thread waiting for a change, if there are any. Called after
+// queueing or finishing a task. Waiting threads count themselves as sleeping
+// before checking for a change, so either they see it or they are woken.
+static void signalChange(Scheduler* scheduler)
+{
+    if (atomic_load(&scheduler->sleeping) == 0)
+        return;
+
+    pthread_mutex_lock(&scheduler->lock);
+    pthread_cond_broadcast(&scheduler->changed);
+    pthread_mutex_unlock(&scheduler->lock);
+}
+
+// Return a task for the worker to run, from its own deque if it has any,
+// otherwise from the injector or another worker. Return NULL if there are no
+// tasks waiting.
+static Task* findTask(Worker* worker)
+{
+    Scheduler* scheduler = worker->scheduler;
+    Task* task = takeTask(&worker->deque, false);
+
+    if (task == NULL)
+        task = takeTask(&scheduler->injector, true);
+
+    for (int i = 1; task == NULL && i < scheduler->workerCount; i++) {
+        Worker* victim = &scheduler->workers[(worker->index + i)
+            % scheduler->workerCount];
+        task = takeTask(&victim->deque, true);
+    }
+
+    if (task != NULL)
+        atomic_fetch_sub(&scheduler->queued, 1);
+
+    return task;
+}
+
+// Run a task on the worker's VM, leaving its result in the task. The worker
+// may already be running another task that is waiting in `await`, in which
+// case this one runs on top of it.
+static void runTask(Worker* worker, Task* task)
+{
+    VM* vm = &worker->vm;
+    TaskState state = TASK_FAILED;
+    Value result;
+
+    int count = readMessage(vm, &task->call);
+    freeBuffer(&task->call);
+
+    if (count < 0) {
+        fprintf(stderr, "Too many global variables in spawned function.\n");
+    } else if (callFunction(vm, count - 1, &result) == INTERPRET_OK) {
+        if (writeMessage(vm, &task->result, &result, 1, false)) {
+            state = TASK_DONE;
+        } else {
+            fprintf(stderr, "Attempted to return a future or coroutine from "
+                            "a spawned function.\n");
+            freeBuffer(&task->result);
+        }
+    }
+
+    atomic_store(&task->state, state);
+    signalChange(worker->scheduler);
+    releaseTask(task);
+}
+
+// Run tasks until the scheduler is stopped and no tasks are left.
+static void* runWorker(void* arg)
+{
+    Worker* worker = (Worker*)arg;
+    Scheduler* scheduler = worker->scheduler;
+
+    initVM(&worker->vm);
+    worker->vm.scheduler = scheduler;
+    worker->vm.worker = worker;
+
+    for (;;) {
+        Task* task = findTask(worker);
+        if (task != NULL) {
+            runTask(worker, task);
+            continue;
+        }
+
+        pthread_mutex_lock(&scheduler->lock);
+        atomic_fetch_add(&scheduler->sleeping, 1);
+        while (atomic_load(&scheduler->queued) <= 0 && !scheduler->stopping) {
+            pthread_cond_wait(&scheduler->changed, &scheduler->lock);
+        }
+        atomic_fetch_sub(&scheduler->sleeping, 1);
+        bool stopped = scheduler->stopping
+            && atomic_load(&scheduler->queued) <= 0;
+        pthread_mutex_unlock(&scheduler->lock);
+
+        if (stopped)
+            break;
+    }
+
+    freeVM(&worker->vm);
+    return NULL;
+}
+
+// Wake the workers and wait for them to run every remaining task and stop,
+// then free the scheduler.
+static void stopWorkers(Scheduler* scheduler, int started)
+{
+    pthread_mutex_lock(&scheduler->lock);
+    scheduler->stopping = true;
+    pthread_cond_broadcast(&scheduler->changed);
+    pthread_mutex_unlock(&scheduler->lock);
+
+    for (int i = 0; i < started; i++) {
+        pthread_join(scheduler->workers[i].thread, NULL);
+    }
+
+    for (int i = 0; i < scheduler->workerCount; i++) {
+        freeDeque(&scheduler->workers[i].deque);
+    }
+    freeDeque(&scheduler->injector);
+
+    pthread_cond_destroy(&scheduler->changed);
+    pthread_mutex_destroy(&scheduler->lock);
+    free(scheduler->workers);
+    free(scheduler);
+}
+
+// Start a scheduler for the VM, with a worker for each core. Return false if
+// the worker threads can't be started.
+static bool startScheduler(VM* vm)
+{
+    Scheduler* scheduler = malloc(sizeof(Scheduler));
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    int count = cores < 1 ? 1 : (int)cores;
+    if (count > SCHEDULER_MAX_WORKERS)
+        count = SCHEDULER_MAX_WORKERS;
+
+    if (scheduler == NULL)
+        exit(1);
+    scheduler->workers = malloc(sizeof(Worker) * (size_t)count);
+    if (scheduler->workers == NULL)
+        exit(1);
+
+    scheduler->workerCount = count;
+    initDeque(&scheduler->injector);
+    atomic_init(&scheduler->queued, 0);
+    atomic_init(&scheduler->sleeping, 0);
+    pthread_mutex_init(&scheduler->lock, NULL);
+    pthread_cond_init(&scheduler->changed, NULL);
+    scheduler->stopping = false;
+
+    for (int i = 0; i < count; i++) {
+        scheduler->workers[i].scheduler = scheduler;
+        scheduler->workers[i].index = i;
+        initDeque(&scheduler->workers[i].deque);
+    }
+
+    for (int i = 0; i < count; i++) {
+        if (pthread_create(&scheduler->workers[i].thread, NULL, runWorker,
+                &scheduler->workers[i])
+            != 0) {
+            stopWorkers(scheduler, i);
+            return false;
+        }
+    }
+
+    vm->scheduler = scheduler;
+    return true;
+}
+
+// Stop the workers of a scheduler once they have run every task, and free
+// the scheduler.
+void freeScheduler(Scheduler* scheduler)
+{
+    stopWorkers(scheduler, scheduler->workerCount);
+}
+
+// Start calling the function with the given arguments on another thread, and
+// return a future for its result.
+//
+// The function runs on a worker with a VM of its own, given copies of the
+// function, the arguments, and the globals the function reads. Tasks spawned
+// by a worker are taken by the same worker first, and by other workers once
+// they run out of tasks of their own.
+bool spawn(VM* vm, int argCount, Value* args, Value* result)
+{
+    if (argCount < 1) {
+        runtimeError(vm,
+            "Attempted to call `spawn` with wrong number of arguments.");
+        return false;
+    }
+
+    if (!IS_CLOSURE(args[0]) && !IS_NATIVE(args[0])) {
+        runtimeError(vm, "Attempted to call `spawn` with non-function.");
+        return false;
+    }
+
+    if (vm->scheduler == NULL && !startScheduler(vm)) {
+        runtimeError(vm, "Could not start threads for `spawn`.");
+        return false;
+    }
+
+    Task* task = malloc(sizeof(Task));
+    if (task == NULL)
+        exit(1);
+
+    // One reference for the future and one for the worker that runs it.
+    atomic_init(&task->refCount, 2);
+    atomic_init(&task->state, TASK_PENDING);
+    task->scheduler = vm->scheduler;
+    initBuffer(&task->call);
+    initBuffer(&task->result);
+
+    if (!writeMessage(vm, &task->call, args, argCount, true)) {
+        freeBuffer(&task->call);
+        free(task);
+        runtimeError(vm,
+            "Attempted to pass a future or coroutine to a spawned function.");
+        return false;
+    }
+
+    *result = OBJ_VAL(newFuture(vm, task));
+
+    Scheduler* scheduler = vm->scheduler;
+    pushTask(vm->worker != NULL ? &vm->worker->deque : &scheduler->injector,
+        task);
+    atomic_fetch_add(&scheduler->queued, 1);
+    signalChange(scheduler);
+
+    return true;
+}
+
+// Wait for the task to finish. A worker of the task's scheduler runs other
+// tasks while it waits, so that every worker keeps busy while tasks wait on
+// the tasks they spawned.
+static void waitForTask(VM* vm, Task* task)
+{
+    Scheduler* scheduler = task->scheduler;
+    Worker* worker = vm->scheduler == scheduler ? vm->worker : NULL;
+
+    while (atomic_load(&task->state) == TASK_PENDING) {
+        if (worker != NULL) {
+            Task* other = findTask(worker);
+            if (other != NULL) {
+                runTask(worker, other);
+                continue;
+            }
+        }
+
+        pthread_mutex_lock(&scheduler->lock);
+        atomic_fetch_add(&scheduler->sleeping, 1);
+        while (atomic_load(&task->state) == TASK_PENDING
+            && (worker == NULL || atomic_load(&scheduler->queued) <= 0)) {
+            pthread_cond_wait(&scheduler->changed, &scheduler->lock);
+        }
+        atomic_fetch_sub(&scheduler->sleeping, 1);
+        pthread_mutex_unlock(&scheduler->lock);
+    }
+}
+
+// Return the result of the call that the future was spawned for, waiting for
+// it to finish if it hasn't yet.
+bool await(VM* vm, int argCount, Value* args, Value* result)
+{
+    if (argCount != 1) {
+        runtimeError(vm,
+            "Attempted to call `await` with wrong number of arguments.");
+        return false;
+    }
+
+    if (!IS_FUTURE(args[0])) {
+        runtimeError(vm, "Attempted to await non-future.");
+        return false;
+    }
+
+    ObjFuture* future = AS_FUTURE(args[0]);
+    if (future->hasValue) {
+        *result = future->value;
+        return true;
+    }
+
+    // Tasks run while waiting may move the future, or the stack holding it.
+    Task* task = future->task;
+    int slot = (int)(args - vm->stack);
+    waitForTask(vm, task);
+
+    if (atomic_load(&task->state) == TASK_FAILED) {
+        runtimeError(vm, "Error in function called by `spawn`.");
+        return false;
+    }
+
+    if (readMessage(vm, &task->result) < 0) {
+        runtimeError(vm, "Too many global variables.");
+        return false;
+    }
+
+    future = AS_FUTURE(vm->stack[slot]);
+    future->value = vm->stackTop[-1];
+    future->hasValue = true;
+    writeBarrier(vm, (Obj*)future, future->value);
+
+    *result = pop(vm);
+    return true;
+}
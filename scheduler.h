@@ -0,0 +1,100 @@
+#ifndef clisp_scheduler_h
+#define clisp_scheduler_h
+
+#include <pthread.h>
+#include <stdatomic.h>
+
+#include "buffer.h"
+#include "common.h"
+#include "value.h"
+#include "vm.h"
+
+// Most worker threads that a scheduler starts.
+#define SCHEDULER_MAX_WORKERS 64
+
+// Initial number of tasks that fit in a deque before it has to grow.
+#define DEQUE_INITIAL 64
+
+// The states of a task.
+typedef enum {
+    TASK_PENDING,
+    TASK_DONE,
+    TASK_FAILED,
+} TaskState;
+
+typedef struct Scheduler Scheduler;
+
+// A call started by `spawn`, run by whichever worker takes it.
+typedef struct Task {
+    // Number of references to the task, from the deque or worker that has it
+    // and from each future for it. The last to release it frees it.
+    atomic_int refCount;
+
+    // A TaskState, set once the call has finished.
+    atomic_int state;
+
+    Scheduler* scheduler;
+
+    // Message holding the function and its arguments, freed once it has been
+    // read by the worker.
+    Buffer call;
+
+    // Message holding the result, once the state is TASK_DONE.
+    Buffer result;
+} Task;
+
+// A double ended queue of tasks. The worker that owns it pushes and pops
+// tasks at the bottom, while idle workers steal from the top.
+typedef struct {
+    pthread_mutex_t lock;
+    Task** tasks;
+    int capacity;
+
+    // Index of the task at the top, and number of tasks in the deque.
+    int top;
+    int count;
+} Deque;
+
+// A thread running tasks with a VM of its own.
+typedef struct Worker {
+    Scheduler* scheduler;
+    int index;
+    pthread_t thread;
+    VM vm;
+
+    // Tasks spawned by this worker.
+    Deque deque;
+} Worker;
+
+// Workers sharing the tasks spawned by a VM and by the tasks themselves.
+struct Scheduler {
+    Worker* workers;
+    int workerCount;
+
+    // Tasks spawned by VMs that are not workers.
+    Deque injector;
+
+    // Number of tasks waiting in any deque.
+    atomic_int queued;
+
+    // Number of threads waiting on changed. Threads that queue or finish a
+    // task only take the lock to signal when there are any.
+    atomic_int sleeping;
+
+    pthread_mutex_t lock;
+
+    // Signalled when a task is queued or finishes, or the workers stop.
+    pthread_cond_t changed;
+
+    // Set when the workers should stop, once every task has been run.
+    bool stopping;
+};
+
+void retainTask(Task* task);
+void releaseTask(Task* task);
+void freeScheduler(Scheduler* scheduler);
+
+bool spawn(VM* vm, int argCount, Value* args, Value* result);
+bool await(VM* vm, int argCount, Value* args, Value* result);
+
+#endif
@@ -0,0 +1,450 @@
+#include <math.h>
+
+#include "memory.h"
+#include "object.h"
+#include "sequence.h"
+#include "value.h"
+#include "vm.h"
+
+// Return true if the value can be iterated over.
+static bool isIterable(Value value)
+{
+    return IS_LIST(value) || IS_SEQUENCE(value);
+}
+
+// Return a new iterator over the list or sequence, or NULL if the value can't
+// be iterated over. The value must be reachable from the stack.
+//
+// The map, filter and take sequences chained on top of the list or range are
+// each made a stage of the iterator, applied in the order they were chained.
+ObjIterator* iterate(VM* vm, Value value)
+{
+    if (!isIterable(value))
+        return NULL;
+
+    int stageCount = 0;
+    Value source = value;
+    while (IS_SEQUENCE(source) && AS_SEQUENCE(source)->kind != SEQUENCE_RANGE) {
+        stageCount++;
+        source = AS_SEQUENCE(source)->source;
+    }
+
+    ObjIterator* iterator = newIterator(vm,
+        IS_LIST(source) ? source : NULL_VAL, stageCount);
+
+    if (IS_SEQUENCE(source)) {
+        ObjSequence* range = AS_SEQUENCE(source);
+        iterator->start = range->start;
+        iterator->step = range->step;
+        iterator->count = range->count;
+    }
+
+    for (int i = stageCount - 1; i >= 0; i--) {
+        ObjSequence* sequence = AS_SEQUENCE(value);
+        IteratorStage* stage = &iterator->stages[i];
+        stage->kind = sequence->kind;
+        stage->function = sequence->function;
+        stage->remaining = sequence->count;
+
+        // Nothing gets past a take of no values.
+        if (stage->kind == SEQUENCE_TAKE && stage->remaining <= 0)
+            iterator->count = 0;
+
+        value = sequence->source;
+    }
+
+    return iterator;
+}
+
+// Pull the next value out of the iterator held in the given slot of the
+// stack, running it through each stage of the iterator. Return ITERATE_DONE
+// once there are no values left, or ITERATE_ERROR if a stage's function
+// failed, which has already been reported.
+//
+// Calling the functions of the stages may move the iterator, and the values
+// passed between them, so each is kept on the stack while a function runs.
+IterateResult iterateNext(VM* vm, int slot, Value* value)
+{
+    ensureStack(vm, 3);
+
+    for (;;) {
+        ObjIterator* iterator = AS_ITERATOR(vm->stack[slot]);
+        if (iterator->index >= iterator->count)
+            return ITERATE_DONE;
+
+        if (IS_LIST(iterator->list)) {
+            push(vm, listValues(AS_LIST(iterator->list))[(int)iterator->index]);
+        } else {
+            push(vm,
+                NUMBER_VAL(iterator->start + iterator->index * iterator->step));
+        }
+        iterator->index++;
+
+        bool passed = true;
+        for (int i = 0; passed && i < iterator->stageCount; i++) {
+            IteratorStage* stage = &iterator->stages[i];
+
+            if (stage->kind == SEQUENCE_TAKE) {
+                // Once a take has passed on its last value, no more values
+                // are pulled from the source.
+                if (--stage->remaining <= 0)
+                    iterator->count = iterator->index;
+                continue;
+            }
+
+            Value result;
+            push(vm, stage->function);
+            push(vm, vm->stackTop[-2]);
+            if (callFunction(vm, 1, &result) != INTERPRET_OK) {
+                runtimeError(vm, "Error in function called by sequence.");
+                return ITERATE_ERROR;
+            }
+
+            if (stage->kind == SEQUENCE_MAP) {
+                vm->stackTop[-1] = result;
+            } else {
+                passed = !isFalsey(result);
+            }
+
+            iterator = AS_ITERATOR(vm->stack[slot]);
+        }
+
+        *value = pop(vm);
+        if (passed)
+            return ITERATE_VALUE;
+    }
+}
+
+// Return true if the value is a function that a sequence can call.
+static bool isFunction(Value value)
+{
+    return IS_CLOSURE(value) || IS_NATIVE(value);
+}
+
+// Return a sequence of numbers counting up from a start value, or down if
+// the step is negative, stopping before the end value. Called as (range) for
+// every number from 0, (range end), (range start end), or
+// (range start end step).
+bool range(VM* vm, int argCount, Value* args, Value* result)
+{
+    if (argCount > 3) {
+        runtimeError(vm,
+            "Attempted to call `range` with wrong number of arguments.");
+        return false;
+    }
+
+    for (int i = 0; i < argCount; i++) {
+        if (!IS_NUMBER(args[i])) {
+            runtimeError(vm, "Attempted to call `range` with non-number.");
+            return false;
+        }
+    }
+
+    double start = argCount >= 2 ? AS_NUMBER(args[0]) : 0;
+    double end = argCount == 0 ? INFINITY
+        : AS_NUMBER(args[argCount == 1 ? 0 : 1]);
+    double step = argCount == 3 ? AS_NUMBER(args[2]) : 1;
+
+    if (step == 0) {
+        runtimeError(vm, "Attempted to call `range` with a step of 0.");
+        return false;
+    }
+
+    double count = ceil((end - start) / step);
+
+    ObjSequence* sequence = newSequence(vm, SEQUENCE_RANGE);
+    sequence->start = start;
+    sequence->step = step;
+    sequence->count = count > 0 ? count : 0;
+
+    *result = OBJ_VAL(sequence);
+    return true;
+}
+
+// Check the arguments of a native that chains a stage onto a list or
+// sequence, given the stage's argument first and the source second.
+static bool checkStage(VM* vm, const char* name, int argCount, Value* args)
+{
+    if (argCount != 2) {
+        runtimeError(vm,
+            "Attempted to call `%s` with wrong number of arguments.", name);
+        return false;
+    }
+
+    if (!isIterable(args[1])) {
+        runtimeError(vm,
+            "Attempted to call `%s` on non-list, non-sequence object.", name);
+        return false;
+    }
+
+    return true;
+}
+
+// Return a sequence of the results of calling the function with each value
+// of the list or sequence, made as they are needed.
+bool lazyMap(VM* vm, int argCount, Value* args, Value* result)
+{
+    if (!checkStage(vm, "lazy-map", argCount, args))
+        return false;
+
+    if (!isFunction(args[0])) {
+        runtimeError(vm, "Attempted to call `lazy-map` with non-function.");
+        return false;
+    }
+
+    ObjSequence* sequence = newSequence(vm, SEQUENCE_MAP);
+    sequence->function = args[0];
+    sequence->source = args[1];
+
+    *result = OBJ_VAL(sequence);
+    return true;
+}
+
+// Return a sequence of the values of the list or sequence that the function
+// returns a truthy value for, tested as they are needed.
+bool lazyFilter(VM* vm, int argCount, Value* args, Value* result)
+{
+    if (!checkStage(vm, "lazy-filter", argCount, args))
+        return false;
+
+    if (!isFunction(args[0])) {
+        runtimeError(vm, "Attempted to call `lazy-filter` with non-function.");
+        return false;
+    }
+
+    ObjSequence* sequence = newSequence(vm, SEQUENCE_FILTER);
+    sequence->function = args[0];
+    sequence->source = args[1];
+
+    *result = OBJ_VAL(sequence);
+    return true;
+}
+
+// Return a sequence of at most the given number of values from the start of
+// the list or sequence.
+bool take(VM* vm, int argCount, Value* args, Value* result)
+{
+    if (!checkStage(vm, "take", argCount, args))
+        return false;
+
+    if (!IS_NUMBER(args[0])) {
+        runtimeError(vm, "Attempted to call `take` with non-number count.");
+        return false;
+    }
+
+    ObjSequence* sequence = newSequence(vm, SEQUENCE_TAKE);
+    sequence->count = floor(AS_NUMBER(args[0]));
+    sequence->source = args[1];
+
+    *result = OBJ_VAL(sequence);
+    return true;
+}
+
+// Return a new list of every value of the list or sequence.
+bool collect(VM* vm, int argCount, Value* args, Value* result)
+{
+    if (argCount != 1) {
+        runtimeError(vm,
+            "Attempted to call `collect` with wrong number of arguments.");
+        return false;
+    }
+
+    if (!isIterable(args[0])) {
+        runtimeError(vm,
+            "Attempted to call `collect` on non-list, non-sequence object.");
+        return false;
+    }
+
+    // The list and the iterator are kept on the stack while the stages run,
+    // above the argument.
+    ensureStack(vm, 2);
+    int slot = (int)(vm->stackTop - vm->stack);
+    push(vm, OBJ_VAL(newList(vm)));
+    push(vm, OBJ_VAL(iterate(vm, vm->stack[slot - 1])));
+
+    Value value;
+    IterateResult status;
+    while ((status = iterateNext(vm, slot + 1, &value)) == ITERATE_VALUE) {
+        appendToList(vm, AS_LIST(vm->stack[slot]), value);
+    }
+
+    if (status == ITERATE_ERROR)
+        return false;
+
+    pop(vm);
+    *result = pop(vm);
+    return true;
+}
+
+// What to do with the results of calling a function with each value.
+typedef enum {
+    EACH_MAP,
+    EACH_FILTER,
+    EACH_FOR,
+} EachKind;
+
+// Call the function in the first argument of a native with each value of the
+// list or sequence in the second, the last two values on the stack. Return a
+// list of the results, of the values the function returned a truthy value
+// for, or null.
+//
+// The results and the iterator are kept on the stack above the arguments, as
+// is each value while the function runs, since calling the function may move
+// them.
+static bool each(VM* vm, const char* name, EachKind kind, Value* result)
+{
+    ensureStack(vm, 5);
+    int slot = (int)(vm->stackTop - vm->stack);
+    push(vm, OBJ_VAL(newList(vm)));
+    ObjIterator* iterator = iterate(vm, vm->stack[slot - 1]);
+    push(vm, OBJ_VAL(iterator));
+
+    // Mapping a list or range gives exactly as many results as it has
+    // values, so they are given room up front.
+    if (kind == EACH_MAP && iterator->stageCount == 0 && iterator->count > 0
+        && iterator->count <= INT32_MAX) {
+        ObjList* results = AS_LIST(vm->stack[slot]);
+        results->buffer = newListBuffer(vm, (int)iterator->count);
+        results->buffer->refCount = 1;
+    }
+
+    Value value;
+    IterateResult status;
+    while ((status = iterateNext(vm, slot + 1, &value)) == ITERATE_VALUE) {
+        push(vm, value);
+        push(vm, vm->stack[slot - 2]);
+        push(vm, value);
+
+        Value called;
+        if (callFunction(vm, 1, &called) != INTERPRET_OK) {
+            runtimeError(vm, "Error in function called by `%s`.", name);
+            return false;
+        }
+
+        if (kind == EACH_MAP) {
+            vm->stackTop[-1] = called;
+        } else if (kind == EACH_FOR || isFalsey(called)) {
+            pop(vm);
+            continue;
+        }
+
+        appendToList(vm, AS_LIST(vm->stack[slot]), vm->stackTop[-1]);
+        pop(vm);
+    }
+
+    if (status == ITERATE_ERROR)
+        return false;
+
+    pop(vm);
+    *result = kind == EACH_FOR ? NULL_VAL : vm->stackTop[-1];
+    pop(vm);
+    return true;
+}
+
+// Return a new list of the results of calling the function with each value
+// of the list or sequence.
+bool map(VM* vm, int argCount, Value* args, Value* result)
+{
+    if (!checkStage(vm, "map", argCount, args))
+        return false;
+
+    if (!isFunction(args[0])) {
+        runtimeError(vm, "Attempted to call `map` with non-function.");
+        return false;
+    }
+
+    return each(vm, "map", EACH_MAP, result);
+}
+
+// Return a new list of the values of the list or sequence that the function
+// returns a truthy value for.
+bool filter(VM* vm, int argCount, Value* args, Value* result)
+{
+    if (!checkStage(vm, "filter", argCount, args))
+        return false;
+
+    if (!isFunction(args[0])) {
+        runtimeError(vm, "Attempted to call `filter` with non-function.");
+        return false;
+    }
+
+    return each(vm, "filter", EACH_FILTER, result);
+}
+
+// Call the function with each value of the list or sequence, for its side
+// effects. Returns null.
+bool forEach(VM* vm, int argCount, Value* args, Value* result)
+{
+    if (!checkStage(vm, "for-each", argCount, args))
+        return false;
+
+    if (!isFunction(args[0])) {
+        runtimeError(vm, "Attempted to call `for-each` with non-function.");
+        return false;
+    }
+
+    return each(vm, "for-each", EACH_FOR, result);
+}
+
+// Combine the values of the list or sequence into one, by calling the
+// function with the combined value so far and each value in turn. Called as
+// (reduce f initial s), or as (reduce f s) to start from the first value.
+bool reduce(VM* vm, int argCount, Value* args, Value* result)
+{
+    if (argCount != 2 && argCount != 3) {
+        runtimeError(vm,
+            "Attempted to call `reduce` with wrong number of arguments.");
+        return false;
+    }
+
+    if (!isFunction(args[0])) {
+        runtimeError(vm, "Attempted to call `reduce` with non-function.");
+        return false;
+    }
+
+    if (!isIterable(args[argCount - 1])) {
+        runtimeError(vm,
+            "Attempted to call `reduce` on non-list, non-sequence object.");
+        return false;
+    }
+
+    // The combined value and the iterator are kept on the stack above the
+    // arguments while the function runs.
+    ensureStack(vm, 5);
+    int slot = (int)(vm->stackTop - vm->stack);
+    int function = slot - argCount;
+    push(vm, argCount == 3 ? vm->stack[slot - 2] : NULL_VAL);
+    push(vm, OBJ_VAL(iterate(vm, vm->stack[slot - 1])));
+
+    Value value;
+    IterateResult status;
+    if (argCount == 2) {
+        status = iterateNext(vm, slot + 1, &value);
+        if (status == ITERATE_DONE) {
+            runtimeError(vm, "Attempted to call `reduce` on empty list or "
+                             "sequence without an initial value.");
+            return false;
+        }
+        vm->stack[slot] = value;
+    }
+
+    while ((status = iterateNext(vm, slot + 1, &value)) == ITERATE_VALUE) {
+        push(vm, vm->stack[function]);
+        push(vm, vm->stack[slot]);
+        push(vm, value);
+
+        Value combined;
+        if (callFunction(vm, 2, &combined) != INTERPRET_OK) {
+            runtimeError(vm, "Error in function called by `reduce`.");
+            return false;
+        }
+        vm->stack[slot] = combined;
+    }
+
+    if (status == ITERATE_ERROR)
+        return false;
+
+    pop(vm);
+    *result = pop(vm);
+    return true;
+}
@@ -0,0 +1,28 @@
+#ifndef clisp_sequence_h
+#define clisp_sequence_h
+
+#include "common.h"
+#include "object.h"
+#include "value.h"
+
+// The outcomes of pulling the next value from an iterator.
+typedef enum {
+    ITERATE_VALUE,
+    ITERATE_DONE,
+    ITERATE_ERROR,
+} IterateResult;
+
+ObjIterator* iterate(VM* vm, Value value);
+IterateResult iterateNext(VM* vm, int slot, Value* value);
+
+bool range(VM* vm, int argCount, Value* args, Value* result);
+bool lazyMap(VM* vm, int argCount, Value* args, Value* result);
+bool lazyFilter(VM* vm, int argCount, Value* args, Value* result);
+bool take(VM* vm, int argCount, Value* args, Value* result);
+bool collect(VM* vm, int argCount, Value* args, Value* result);
+bool map(VM* vm, int argCount, Value* args, Value* result);
+bool filter(VM* vm, int argCount, Value* args, Value* result);
+bool reduce(VM* vm, int argCount, Value* args, Value* result);
+bool forEach(VM* vm, int argCount, Value* args, Value* result);
+
+#endif
@@ -3,101 +3,370 @@
 #include "object.h"
 #include "value.h"
 #include <stdint.h>
+#include <stdlib.h>
 #include <string.h>
 
-// Maximum percentage of array slots filled before reallocating to a bigger
-// underlying array.
-#define TABLE_MAX_LOAD 0.75
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+// Maximum number of slots in use (including deleted ones) for every 8 slots,
+// before reallocating to a bigger underlying array.
+#define TABLE_MAX_LOAD 7
+
+// Number of slots in a group, all of which are probed together.
+#define GROUP_WIDTH 16
+
+// Control byte values of slots that hold no entry. Both have the high bit set,
+// which is never set for a slot that is in use.
+#define CONTROL_EMPTY 0x80
+#define CONTROL_DELETED 0xfe
+
+// Control byte of a slot in use, the low 7 bits of its key's hash.
+#define CONTROL_HASH(hash) ((uint8_t)((hash) & 0x7f))
+
+// Return a bitmask of the slots in the group whose control byte matches.
+static uint32_t matchControl(const uint8_t* group, uint8_t control)
+{
+#ifdef __SSE2__
+    __m128i bytes = _mm_loadu_si128((const __m128i*)group);
+    __m128i matches = _mm_cmpeq_epi8(bytes, _mm_set1_epi8((char)control));
+    return (uint32_t)_mm_movemask_epi8(matches);
+#else
+    uint32_t mask = 0;
+    for (int i = 0; i < GROUP_WIDTH; i++) {
+        if (group[i] == control)
+            mask |= (uint32_t)1 << i;
+    }
+    return mask;
+#endif
+}
+
+// Return a bitmask of the slots in the group that are empty or deleted.
+static uint32_t matchFree(const uint8_t* group)
+{
+#ifdef __SSE2__
+    __m128i bytes = _mm_loadu_si128((const __m128i*)group);
+    return (uint32_t)_mm_movemask_epi8(bytes);
+#else
+    uint32_t mask = 0;
+    for (int i = 0; i < GROUP_WIDTH; i++) {
+        if (group[i] & 0x80)
+            mask |= (uint32_t)1 << i;
+    }
+    return mask;
+#endif
+}
+
+// Return the index of the first group to probe for the given hash. The low 7
+// bits are kept for the control bytes, so the group is picked with the rest.
+static int firstGroup(Table* table, uint32_t hash)
+{
+    return (int)((hash >> 7) & (uint32_t)(table->capacity / GROUP_WIDTH - 1));
+}
+
+// Return the group to probe after the given one. Stepping by 1, 2, 3 and so on
+// visits every group when the number of groups is a power of two.
+static int nextGroup(Table* table, int group, int step)
+{
+    return (group + step) & (table->capacity / GROUP_WIDTH - 1);
+}
+
+// Find the slot holding the given key, returning -1 if it is not in the Table.
+// Probing stops at the first group with an empty slot, since the key would
+// have been placed there if it had been free when the key was added.
+static int findSlot(Table* table, Value key, uint32_t hash)
+{
+    int group = firstGroup(table, hash);
+
+    for (int step = 1;; step++) {
+        uint8_t* control = table->control + group * GROUP_WIDTH;
+        uint32_t matches = matchControl(control, CONTROL_HASH(hash));
+
+        while (matches != 0) {
+            int index = group * GROUP_WIDTH + __builtin_ctz(matches);
+            if (table->hashes[index] == hash
+                && valuesEqual(table->entries[index].key, key)) {
+                return index;
+            }
+            matches &= matches - 1;
+        }
+
+        if (matchControl(control, CONTROL_EMPTY) != 0)
+            return -1;
+
+        group = nextGroup(table, group, step);
+    }
+}
+
+// Find the first empty or deleted slot that a key with the given hash can be
+// placed in.
+static int findFreeSlot(Table* table, uint32_t hash)
+{
+    int group = firstGroup(table, hash);
+
+    for (int step = 1;; step++) {
+        uint32_t free = matchFree(table->control + group * GROUP_WIDTH);
+        if (free != 0)
+            return group * GROUP_WIDTH + __builtin_ctz(free);
+
+        group = nextGroup(table, group, step);
+    }
+}
+
+// Size in bytes of the single block holding the entries, hashes and control
+// bytes of a Table with the given capacity.
+static size_t tableSize(int capacity)
+{
+    return (sizeof(Entry) + sizeof(uint32_t) + sizeof(uint8_t))
+        * (size_t)capacity;
+}
 
 // Instantiate a new hash table by setting all components to their zero value.
 void initTable(Table* table)
 {
     table->count = 0;
+    table->deleted = 0;
     table->capacity = 0;
     table->entries = NULL;
+    table->hashes = NULL;
+    table->control = NULL;
 }
 
 // Free all data that has been associated with a hash table.
-void freeTable(Table* table)
+void freeTable(VM* vm, Table* table)
 {
-    FREE_ARRAY(Entry, table->entries, table->capacity);
+    if (table->entries != NULL)
+        reallocate(vm, table->entries, tableSize(table->capacity), 0);
     initTable(table);
 }
 
-// Find an entry in a hash table by searching its Entry array for a given key.
-// Use the key's hash value as the first slot to check, then iterate through
-// the array until reaching a fully empty slot (not a tombstone value) or the
-// value with the matching key. Then returning either the matching entry, the
-// first tombstone encountered, or the first empty slot.
-static Entry* findEntry(Entry* entries, int capacity, Value key, uint32_t hash)
+// Mix the bits of a 64 bit value into a 32 bit hash, so that values that only
+// differ in a few bits get unrelated hashes.
+static uint32_t mixBits(uint64_t bits)
 {
-    // Bitwise and of the hash value and 1 less than the Table's capacity.
-    //
-    // For capacities that are powers of 2, this is equivalent to:
-    // uint32_t index = hash % capacity;
-    // But significantly more CPU efficient (modulo is slow).
-    uint32_t index = hash & (uint32_t)(capacity - 1);
-
-    Entry* tombstone = NULL;
-
-    for (;;) {
-        Entry* entry = &entries[index];
-
-        if (IS_NULL(entry->key)) {
-            if (IS_NULL(entry->value)) {
-                // empty entry
-                // return tombstone if one found
-                return tombstone != NULL ? tombstone : entry;
-            } else {
-                // tombstone found
-                if (tombstone == NULL)
-                    tombstone = entry;
-            }
-        } else if (valuesEqual(entry->key, key)) {
-            // entry found
-            return entry;
+    bits ^= bits >> 33;
+    bits *= 0xff51afd7ed558ccdULL;
+    bits ^= bits >> 33;
+    bits *= 0xc4ceb9fe1a85ec53ULL;
+    bits ^= bits >> 33;
+    return (uint32_t)bits;
+}
+
+// Hash a number from all the bits of its double. Negative zero is equal to
+// zero, so it hashes the same way.
+static uint32_t hashNumber(double number)
+{
+    if (number == 0)
+        number = 0;
+
+    uint64_t bits;
+    memcpy(&bits, &number, sizeof(bits));
+    return mixBits(bits);
+}
+
+// Hash an object by its address. Only used for objects that can't be copied
+// to another VM, so are only ever equal to themselves in this one.
+static uint32_t hashPointer(const void* pointer)
+{
+    return mixBits((uint64_t)(uintptr_t)pointer);
+}
+
+// How many lists a hash can be inside of before they spill to the heap.
+#define INLINE_HASH_PATH 16
+
+// The lists a hash is being taken inside of, outermost first. A list can
+// hold itself, and meeting a list again on the way down means the value
+// being hashed has no end. Such values are all hashed alike, which keeps
+// equal values hashed alike, as a value equal to one with no end has no end
+// either.
+typedef struct {
+    ObjList* inlineLists[INLINE_HASH_PATH];
+    ObjList** lists;
+    int count;
+    int capacity;
+    bool isCyclic;
+} HashPath;
+
+// Enter a list on the way down. Returns false if the path already holds it.
+static bool enterHashPath(HashPath* path, ObjList* list)
+{
+    for (int i = 0; i < path->count; i++) {
+        if (path->lists[i] == list) {
+            path->isCyclic = true;
+            return false;
         }
+    }
 
-        // Faster than modulo for powers of two. See index declaration.
-        index = (index + 1) & (uint32_t)(capacity - 1);
+    if (path->count == path->capacity) {
+        size_t size = sizeof(ObjList*) * (size_t)path->capacity;
+        ObjList** grown = path->lists == path->inlineLists
+            ? malloc(size * 2)
+            : realloc(path->lists, size * 2);
+        if (grown == NULL)
+            exit(1);
+        if (path->lists == path->inlineLists)
+            memcpy(grown, path->inlineLists, size);
+        path->lists = grown;
+        path->capacity *= 2;
     }
+
+    path->lists[path->count++] = list;
+    return true;
 }
 
-bool hashOf(Value* value, uint32_t* result)
+static uint32_t hashValue(Value value, bool* isStable, HashPath* path);
+
+// Hash the entries of a trie node and its children. Entries are combined by
+// addition so that the hash does not depend on their order.
+static uint32_t hashDictNode(ObjDictNode* node, bool* isStable,
+    HashPath* path)
 {
-#ifdef NAN_BOXING
-    if (IS_BOOL(*value)) {
-        *result = (uint32_t)AS_BOOL(*value);
-    } else if (IS_NUMBER(*value)) {
-        *result = (uint32_t)AS_NUMBER(*value);
-    } else if (IS_STRING(*value)) {
-        *result = AS_STRING(*value)->hash;
-    } else {
-        return false;
+    uint32_t hash = 0;
+
+    for (int i = 0; i < node->count; i++) {
+        Entry* slot = &node->slots[i];
+
+        if (IS_NULL(slot->key)) {
+            hash += hashDictNode((ObjDictNode*)AS_OBJ(slot->value), isStable,
+                path);
+        } else {
+            hash += mixBits(
+                ((uint64_t)hashValue(slot->key, isStable, path) << 32)
+                | hashValue(slot->value, isStable, path));
+        }
     }
 
-    return true;
-#else
-    switch (value->type) {
-    case VAL_BOOL:
-        *result = (uint32_t)value->as.boolean;
-        return true;
-    case VAL_NUMBER:
-        *result = (uint32_t)value->as.number;
-        return true;
-    case VAL_OBJ: {
-        if (!IS_STRING(*value))
-            return false;
+    return hash;
+}
+
+// Hash an object. Lists and dicts are hashed by their contents. Functions and
+// closures are hashed by their identity, which their copies keep, and natives
+// by the builtin they are.
+//
+// Lists can be changed in place, so isStable is cleared when the hash
+// depends on one. A list's own hash is cached until the list is changed, but
+// neither a list nor a dict caches a hash that depends on a list inside it,
+// as that list could change without them knowing.
+static uint32_t hashObject(Obj* object, bool* isStable, HashPath* path)
+{
+    switch (object->type) {
+    case OBJ_STRING:
+        return ((ObjString*)object)->hash;
+    case OBJ_LIST: {
+        ObjList* list = (ObjList*)object;
+        *isStable = false;
+        if (list->isHashed)
+            return list->hash;
+        if (!enterHashPath(path, list))
+            return 0;
+
+        Value* values = listValues(list);
+        uint32_t hash = 2166136261u;
+        bool isContentStable = true;
+
+        for (int i = 0; i < list->count && !path->isCyclic; i++) {
+            hash = (hash ^ hashValue(values[i], &isContentStable, path))
+                * 16777619;
+        }
+        path->count--;
 
-        *result = AS_STRING(*value)->hash;
-        return true;
+        list->hash = hash;
+        list->isHashed = isContentStable;
+        return hash;
+    }
+    case OBJ_DICT: {
+        ObjDict* dict = (ObjDict*)object;
+        if (dict->isHashed)
+            return dict->hash;
+
+        bool isContentStable = true;
+        dict->hash = dict->root == NULL
+            ? 0
+            : hashDictNode(dict->root, &isContentStable, path);
+        dict->isHashed = isContentStable;
+        *isStable = *isStable && isContentStable;
+        return dict->hash;
     }
+    case OBJ_FUNCTION:
+        return mixBits(((ObjFunction*)object)->id);
+    case OBJ_CLOSURE:
+        return mixBits(((ObjClosure*)object)->id);
+    case OBJ_NATIVE:
+        return ((ObjNative*)object)->hash;
+    case OBJ_FUTURE:
+        return hashPointer(((ObjFuture*)object)->task);
+    case OBJ_COROUTINE:
+        return mixBits(((ObjCoroutine*)object)->closure->id);
+    case OBJ_SEQUENCE: {
+        // Sequences move, so are hashed by the parts of them that don't.
+        ObjSequence* sequence = (ObjSequence*)object;
+        return mixBits(((uint64_t)hashNumber(sequence->start) << 32)
+                   | hashNumber(sequence->count))
+            + sequence->kind;
+    }
+    case OBJ_ITERATOR:
+        return hashPointer(((ObjIterator*)object)->stages);
+    case OBJ_UPVALUE:
+    case OBJ_DICT_NODE:
+        break;
+    }
+
+    return 0;
+}
+
+// Hash any Value, including null ones that are part of a list or dict key.
+// isStable is cleared if the hash could change without the value itself
+// being changed.
+static uint32_t hashValue(Value value, bool* isStable, HashPath* path)
+{
+#ifdef NAN_BOXING
+    if (IS_BOOL(value))
+        return AS_BOOL(value) ? 1231 : 1237;
+    if (IS_NULL(value))
+        return 0x9e3779b9;
+    if (IS_NUMBER(value))
+        return hashNumber(AS_NUMBER(value));
+    return hashObject(AS_OBJ(value), isStable, path);
+#else
+    switch (value.type) {
+    case VAL_BOOL:
+        return AS_BOOL(value) ? 1231 : 1237;
     case VAL_NULL:
-        return false;
+        return 0x9e3779b9;
+    case VAL_NUMBER:
+        return hashNumber(AS_NUMBER(value));
+    case VAL_OBJ:
+        return hashObject(AS_OBJ(value), isStable, path);
     }
+    return 0;
 #endif
 }
 
+// Calculate the hash of a Value used as a key, placing it in result. Null is
+// the only value that can't be a key, since it marks an empty slot, so false
+// is returned for it. Values with no end, found through a list that holds
+// itself, all share one hash.
+bool hashOf(Value* value, uint32_t* result)
+{
+    if (IS_NULL(*value))
+        return false;
+
+    HashPath path;
+    path.lists = path.inlineLists;
+    path.count = 0;
+    path.capacity = INLINE_HASH_PATH;
+    path.isCyclic = false;
+
+    bool isStable = true;
+    *result = hashValue(*value, &isStable, &path);
+    if (path.isCyclic)
+        *result = 0x85ebca6b;
+    if (path.lists != path.inlineLists)
+        free(path.lists);
+    return true;
+}
+
 // Retrieve the value in the table associated with the given key, and place it
 // in the provided value address. Return false if the value could not be
 // retrieved, otherwise true.
@@ -110,76 +379,102 @@ bool tableGet(Table* table, Value key, Value* value)
     if (!hashOf(&key, &hash))
         return false;
 
-    Entry* entry = findEntry(table->entries, table->capacity, key, hash);
-    if (IS_NULL(entry->key))
+    int index = findSlot(table, key, hash);
+    if (index < 0)
         return false;
 
-    *value = entry->value;
+    *value = table->entries[index].value;
     return true;
 }
 
-// Reallocate the entries array from the Table to a larger capacity array.
-// Transfer all non-tombstone values to the new array.
-static void adjustCapacity(Table* table, int capacity)
+// Place an entry in a free slot of the Table.
+static void insertSlot(Table* table, int index, Value key, Value value,
+    uint32_t hash)
+{
+    if (table->control[index] == CONTROL_DELETED)
+        table->deleted--;
+
+    table->control[index] = CONTROL_HASH(hash);
+    table->hashes[index] = hash;
+    table->entries[index].key = key;
+    table->entries[index].value = value;
+    table->count++;
+}
+
+// Reallocate the Table's arrays with the given capacity, and move every entry
+// over using its stored hash. Deleted slots are not carried over.
+static void adjustCapacity(VM* vm, Table* table, int capacity)
 {
-    Entry* entries = ALLOCATE(Entry, capacity);
+    // Allocated before anything is read from the old arrays, in case a
+    // collection changes the Table.
+    Entry* entries = (Entry*)reallocate(vm, NULL, 0, tableSize(capacity));
+
+    Table old = *table;
+    table->count = 0;
+    table->deleted = 0;
+    table->capacity = capacity;
+    table->entries = entries;
+    table->hashes = (uint32_t*)(entries + capacity);
+    table->control = (uint8_t*)(table->hashes + capacity);
 
     for (int i = 0; i < capacity; i++) {
         entries[i].key = NULL_VAL;
         entries[i].value = NULL_VAL;
     }
+    memset(table->control, CONTROL_EMPTY, (size_t)capacity);
 
-    // count recalculated since tombstones are not carried over
-    table->count = 0;
-    for (int i = 0; i < table->capacity; i++) {
-        Entry* entry = &table->entries[i];
-        if (IS_NULL(entry->key))
+    for (int i = 0; i < old.capacity; i++) {
+        if (old.control[i] & 0x80)
             continue;
 
-        uint32_t hash = 0;
-        hashOf(&entry->key, &hash);
-
-        Entry* dest = findEntry(entries, capacity, entry->key, hash);
-        dest->key = entry->key;
-        dest->value = entry->value;
-        table->count++;
+        int index = findFreeSlot(table, old.hashes[i]);
+        insertSlot(table, index, old.entries[i].key, old.entries[i].value,
+            old.hashes[i]);
     }
 
-    FREE_ARRAY(Entry, table->entries, table->capacity);
-    table->entries = entries;
-    table->capacity = capacity;
+    freeTable(vm, &old);
 }
 
 // Add the given Value into the Table's entries. If they key already exists
 // within the Table, the current value will be replaced at that slot. Return
 // true if the key did not already exist in the table.
-bool tableSet(Table* table, Value key, Value value)
+bool tableSet(VM* vm, Table* table, Value key, Value value)
 {
-    if (table->count + 1 > table->capacity * TABLE_MAX_LOAD) {
-        int capacity = (int)GROW_CAPACITY(table->capacity);
-        adjustCapacity(table, capacity);
-    }
-
     uint32_t hash;
     // TODO: solve return value to make sense
     if (!hashOf(&key, &hash))
         return false;
 
-    Entry* entry = findEntry(table->entries, table->capacity, key, hash);
-    bool isNewKey = IS_NULL(entry->key);
-    // if new key and entry not tombstone
-    if (isNewKey && IS_NULL(entry->value))
-        table->count++;
+    if (table->count > 0) {
+        int index = findSlot(table, key, hash);
+        if (index >= 0) {
+            table->entries[index].value = value;
+            return false;
+        }
+    }
+
+    if ((table->count + table->deleted + 1) * 8
+        > table->capacity * TABLE_MAX_LOAD) {
+        // Grow, unless most of the used slots are deleted ones, in which case
+        // the slots are just reclaimed.
+        int capacity = table->capacity < GROUP_WIDTH ? GROUP_WIDTH
+            : table->count * 2 < table->capacity ? table->capacity
+                                                 : table->capacity * 2;
+        adjustCapacity(vm, table, capacity);
+    }
 
-    entry->key = key;
-    entry->value = value;
-    return isNewKey;
+    insertSlot(table, findFreeSlot(table, hash), key, value, hash);
+    return true;
 }
 
-// Attempt to delete an entry in the Table that has the given key. Deleted
-// entries are replaced with a tombstone (a non-empty slot with no key, so that
-// searching for a key isn't broken by removing a key from the chain). Returns
+// Attempt to delete an entry in the Table that has the given key. Returns
 // false if there is no entry to delete.
+//
+// Probing only moves past a group once it is full, and a full group can only
+// gain deleted slots, never empty ones. So when the group still has an empty
+// slot, no probe has ever moved past it and the slot is simply made empty.
+// Only slots in groups that have been full are marked as deleted, so that
+// searching for a key isn't broken by removing a key from the chain.
 bool tableDelete(Table* table, Value key)
 {
     if (table->count == 0)
@@ -191,29 +486,37 @@ bool tableDelete(Table* table, Value key)
         return false;
 
     // Find entry
-    Entry* entry = findEntry(table->entries, table->capacity, key, hash);
-    if (IS_NULL(entry->key))
+    int index = findSlot(table, key, hash);
+    if (index < 0)
         return false;
 
-    // replace with tombstone
-    entry->key = NULL_VAL;
-    entry->value = BOOL_VAL(true);
+    uint8_t* group = table->control + index / GROUP_WIDTH * GROUP_WIDTH;
+    if (matchControl(group, CONTROL_EMPTY) != 0) {
+        table->control[index] = CONTROL_EMPTY;
+    } else {
+        table->control[index] = CONTROL_DELETED;
+        table->deleted++;
+    }
+
+    table->entries[index].key = NULL_VAL;
+    table->entries[index].value = NULL_VAL;
+    table->count--;
     return true;
 }
 
 // Add all entries from one table into another.
-void tableAddAll(Table* from, Table* to)
+void tableAddAll(VM* vm, Table* from, Table* to)
 {
     for (int i = 0; i < from->capacity; i++) {
         Entry* entry = &from->entries[i];
 
         if (!IS_NULL(entry->key)) {
-            tableSet(to, entry->key, entry->value);
+            tableSet(vm, to, entry->key, entry->value);
         }
     }
 }
 
-// Variation on findEntry that is used for the VM's string Table.
+// Variation on findSlot that is used for the VM's string Table.
 // The string Table is used more like a set, to keep track of unique
 // string values used in the VM's execution. The idea is to find and return
 // the string used as the key in the table rather than the Value.
@@ -226,55 +529,50 @@ ObjString* tableFindString(Table* table,
     if (table->count == 0)
         return NULL;
 
-    // Bitwise and of the hash value and 1 less than the Table's capacity.
-    //
-    // For capacities that are powers of 2, this is equivalent to:
-    // uint32_t index = hash % table->capacity;
-    // But significantly more CPU efficient (modulo is slow).
-    uint32_t index = hash & (uint32_t)(table->capacity - 1);
+    int group = firstGroup(table, hash);
 
-    for (;;) {
-        Entry* entry = &table->entries[index];
+    for (int step = 1;; step++) {
+        uint8_t* control = table->control + group * GROUP_WIDTH;
+        uint32_t matches = matchControl(control, CONTROL_HASH(hash));
 
-        if (IS_NULL(entry->key)) {
-            // stop at tombstone
-            if (IS_NULL(entry->value))
-                return NULL;
-        } else {
-            uint32_t entryHash = 0;
-            hashOf(&entry->key, &entryHash);
-            ObjString* entryString = AS_STRING(entry->key);
+        while (matches != 0) {
+            int index = group * GROUP_WIDTH + __builtin_ctz(matches);
+            ObjString* string = AS_STRING(table->entries[index].key);
 
-            if (entryHash == hash
-                && memcmp(entryString->chars, chars, (size_t)length) == 0) {
+            if (table->hashes[index] == hash && string->length == length
+                && memcmp(string->chars, chars, (size_t)length) == 0) {
                 // found
-                return entryString;
+                return string;
             }
+            matches &= matches - 1;
         }
 
-        // Faster than modulo for powers of two. See index declaration.
-        index = (index + 1) & (uint32_t)(table->capacity - 1);
+        if (matchControl(control, CONTROL_EMPTY) != 0)
+            return NULL;
+
+        group = nextGroup(table, group, step);
     }
 }
 
 // Called during garbage collection and used on the Table of interned strings.
-// Delete any strings that haven't been marked as reachable.
+// Delete any old strings that haven't been marked as reachable.
 void tableRemoveWhite(Table* table)
 {
     for (int i = 0; i < table->capacity; i++) {
         Entry* entry = &table->entries[i];
-        if (!IS_NULL(entry->key) && IS_OBJ(entry->key) && !AS_OBJ(entry->key)->isMarked) {
+        if (!IS_NULL(entry->key) && IS_OBJ(entry->key)
+            && !AS_OBJ(entry->key)->isMarked && !AS_OBJ(entry->key)->isYoung) {
             tableDelete(table, entry->key);
         }
     }
 }
 
 // Mark both the keys and values found in the provided Table.
-void markTable(Table* table)
+void markTable(VM* vm, Table* table)
 {
     for (int i = 0; i < table->capacity; i++) {
         Entry* entry = &table->entries[i];
-        markValue(entry->key);
-        markValue(entry->value);
+        markValue(vm, entry->key);
+        markValue(vm, entry->value);
     }
 }
@@ -7,8 +7,8 @@
 
 // Key-Value pair that has been added to the Table.
 typedef struct {
-    // All keys are stored as strings because they're the only type that has
-    // hashing implemented for it.
+    // Any value but null, which marks an empty slot. Lists and dicts are
+    // found by their contents, functions and closures by their identity.
     Value key;
 
     // Value retrieved by the key when getting/setting in the Table.
@@ -16,26 +16,41 @@ typedef struct {
 } Entry;
 
 // Data of Hash Table implementation, operated by associated functions.
+//
+// Slots are split into groups of 16, each with a control byte per slot that is
+// either empty, deleted, or holds the low 7 bits of the hash of the slot's key.
+// A lookup checks all control bytes of a group at once, and only compares keys
+// in the slots where the 7 bits match.
 typedef struct {
     // Number of entries in Table.
     int count;
 
+    // Number of deleted slots, which are reclaimed when the Table is resized.
+    int deleted;
+
     // Maximum spaces available in Table.
     int capacity;
 
-    // Pointer to first Entry slot in Array.
+    // Pointer to first Entry slot in Array. Empty slots have a null key.
     Entry* entries;
+
+    // Full hash of the key in each slot, so keys are never hashed again when
+    // the Table grows.
+    uint32_t* hashes;
+
+    // Control byte of each slot.
+    uint8_t* control;
 } Table;
 
 void initTable(Table* table);
-void freeTable(Table* table);
+void freeTable(VM* vm, Table* table);
 bool tableGet(Table* table, Value key, Value* value);
-bool tableSet(Table* table, Value key, Value value);
+bool tableSet(VM* vm, Table* table, Value key, Value value);
 bool tableDelete(Table* table, Value key);
-void tableAddAll(Table* from, Table* to);
+void tableAddAll(VM* vm, Table* from, Table* to);
 ObjString* tableFindString(Table* table, const char* chars,
     int length, uint32_t hash);
-void markTable(Table* table);
+void markTable(VM* vm, Table* table);
 void tableRemoveWhite(Table* table);
 bool hashOf(Value* value, uint32_t* result);
 
@@ -0,0 +1,19 @@
+(print (< 1 2) (> 1 2) (= 2 2) (< 1 2 3) (< 3 2 1) (= (list 1 2) (list 1 2)))
+(def i 0)
+(def hits 0)
+(while (< i 10)
+  (if (and (> i 2) (< i 7))
+    (def hits (+ hits 1))
+    null)
+  (if (or (= i 0) (= i 9))
+    (def hits (+ hits 100))
+    null)
+  (def i (+ i 1)))
+(print hits)
+(def shadowed (lambda (< a b) (if (< a b) "yes" "no")))
+(print (shadowed (lambda (a b) true) 5 1) (shadowed (lambda (a b) false) 1 5))
+(def outer (lambda (>)
+  (lambda (a b) (if (> a b) "yes" "no"))))
+(print ((outer (lambda (a b) (= a 0))) 0 9))
+(print (if (< 1 2) "then" "else") (if (> 1 2) "then" "else"))
+(print (< 1))
@@ -0,0 +1,29 @@
+(def counter (coroutine (lambda (n)
+  (def i 0)
+  (while (< i n)
+    (def got (yield i))
+    (if (= got null) null (print "sent" got))
+    (def i (+ i 1)))
+  "finished") 3))
+(print (resume counter null) (done? counter))
+(print (resume counter "a"))
+(print (resume counter null))
+(print (resume counter "b") (done? counter))
+(def gen (lambda (from)
+  (coroutine (lambda () (def n from) (while true (yield n) (def n (+ n 1)))))))
+(def evens (coroutine (lambda (source)
+  (while true
+    (def n (resume source null))
+    (if (= (rem n 2) 0) (yield n) null))) (gen 1)))
+(print (resume evens null) (resume evens null) (resume evens null))
+(def many (gen 0))
+(def total 0)
+(def i 0)
+(while (< i 10000) (def total (+ total (resume many null))) (def i (+ i 1)))
+(print total)
+(def failing (coroutine (lambda ()
+  (yield "before")
+  (+ 1 "oops")
+  (yield "after"))))
+(print (resume failing null) (done? failing))
+(print (resume failing null))
@@ -0,0 +1,19 @@
+(def a (list 1))
+(push! a a)
+(def b (list 1))
+(push! b b)
+(print (= a b))
+(def c (list 1))
+(push! c (list 1 c))
+(print (= a c))
+(print (= a (list 1 (list 2))))
+(print a)
+(def d (set {} a 1))
+(print (get d a))
+(print (get d b))
+(print (get d c))
+(print (get (set d (list 1 (list 1)) 2) (list 1 (list 1))))
+(def e (dict "self" a))
+(push! a e)
+(print (= (get e "self") a))
+(print (get (set {} e 3) e))
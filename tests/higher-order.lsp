@@ -0,0 +1,16 @@
+(print (map (lambda (x) (* x 2)) (list 1 2 3)))
+(print (filter (lambda (x) (= (rem x 2) 0)) (range 10)))
+(print (reduce (lambda (acc x) (+ acc x)) 0 (list 1 2 3 4)))
+(print (map (lambda (row) (map (lambda (x) (* row x)) (range 1 4))) (range 1 4)))
+(def depth (lambda (n) (if (= n 0) 0 (+ 1 (depth (- n 1))))))
+(print (map depth (list 10 50000 20)))
+(def offset 100)
+(print (map (lambda (x) (+ x offset)) (take 3 (range))))
+(def built (reduce (lambda (d i) (set d (str "k" i) (list i (* i i)))) {} (range 20000)))
+(print (get built "k19999"))
+(def log (list))
+(for-each (lambda (x) (push! log (reduce + 0 (range x)))) (list 3 4 5))
+(print log)
+(print (map + (list 1 2)))
+(def gen (coroutine (lambda () (map (lambda (x) (yield x)) (list 1 2)))))
+(resume gen null)
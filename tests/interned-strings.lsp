@@ -0,0 +1,10 @@
+(def churn (lambda (n)
+  (for-each (lambda (i) (str "garbage" i)) (range n))))
+(churn 50000)
+(def kept (reduce (lambda (d i) (set d (str "key" (* i 7)) i)) {} (range 2000)))
+(churn 50000)
+(def found (reduce (lambda (t i) (+ t (get kept (str "key" (* i 7))))) 0 (range 2000)))
+(print found)
+(print (= (str "garbage" 123) (str "garb" "age" 123)) (= (str "key" 7) "key7"))
+(churn 50000)
+(print (get kept "key13993") (get kept "key13994") (> (get (gc-stats) "minor-collections") 0))
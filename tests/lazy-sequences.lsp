@@ -0,0 +1,15 @@
+(print (reduce + 0 (take 1000 (range))))
+(print (collect (take 5 (lazy-map (lambda (x) (* x x)) (lazy-filter (lambda (x) (= (rem x 3) 0)) (range))))))
+(print (collect (range 5)) (collect (range 2 5)) (collect (take 0 (range))))
+(def seen (list))
+(def squares (lazy-map (lambda (x) (push! seen x) (* x x)) (range)))
+(print seen)
+(print (collect (take 3 squares)) seen)
+(def total 0)
+(for x (take 100000 (range)) (def total (+ total x)))
+(print total)
+(def fns (list))
+(for x (range 3) (push! fns (lambda () x)))
+(print (map (lambda (f) (f)) fns))
+(for x (list "a" "b") (print x))
+(print (collect (take 3 (lazy-filter (lambda (x) (> x 1000)) (range)))))
@@ -0,0 +1,14 @@
+(def a (dict "x" 1 "y" 2))
+(def b (set a "z" 3))
+(def c (set b "x" 10))
+(print (get a "x") (get a "z") (get b "z") (get c "x") (get b "x"))
+(def big (reduce (lambda (d i) (set d i (* i i))) {} (range 10000)))
+(def bigger (set big 5000 "changed"))
+(print (get big 5000) (get bigger 5000) (get big 9999) (get bigger 10000))
+(def sum (lambda (d n) (reduce (lambda (t i) (+ t (get d i))) 0 (range n))))
+(print (sum big 10000))
+(def again (reduce (lambda (d i) (set d i (* i i))) bigger (range 5000 5001)))
+(print (= again big) (= bigger big))
+(def keys (reduce (lambda (d i) (set d (str "k" i) i)) {} (range 1000)))
+(print (get keys "k0") (get keys "k999") (get keys "k1000"))
+(print (= (dict 1 2 3 4) (dict 3 4 1 2)) (= (dict 1 2) (dict 1 3)))
@@ -0,0 +1,4 @@
+(def f (lambda (x) x))
+(def d (dict f 1 (list f) 2 + 3))
+(print (get d f) (get d (list f)) (get d +))
+(print (pmap (lambda (x) (list (get d f) (get d (list f)) (get d +))) (list 1 2)))
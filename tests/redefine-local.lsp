@@ -0,0 +1,12 @@
+(def count-up (lambda (n)
+  (def i 0)
+  (def total 0)
+  (while (< i n)
+    (def total (+ total i))
+    (def i (+ i 1)))
+  (def after total)
+  (list i total after)))
+(def before (get (gc-stats) "stack-capacity"))
+(print (count-up 10))
+(print (count-up 100000))
+(print (= before (get (gc-stats) "stack-capacity")))
@@ -0,0 +1,19 @@
+(def a (list 1 2 3))
+(def b (push a 4))
+(def c (push a 5))
+(print a b c)
+(push! a 6)
+(print a b c)
+(def r (rest a))
+(push! a 7)
+(print r a)
+(def s (push r 8))
+(print r s a)
+(push! r 9)
+(print r s a)
+(def built (reduce (lambda (l i) (push l i)) (list) (range 5)))
+(def other (push (rest built) 99))
+(print built other (first other) (len other))
+(def walk (lambda (l total) (if (= (len l) 0) total (walk (rest l) (+ total (first l))))))
+(print (walk (reduce (lambda (l i) (push l i)) (list) (range 100000)) 0))
+(print (rest (list)) (rest (list 1)))
@@ -0,0 +1,9 @@
+(def f (lambda (x) x))
+(def d (dict f 1 (list f) 2 + 3 "a" 4))
+(def lookup (lambda (m) (list (get m f) (get m (list f)) (get m +) (get m "a"))))
+(print (await (spawn (lambda () (lookup d)))))
+(print (lookup (await (spawn (lambda () d)))))
+(print (await (spawn (lambda () (dict f "made in a task")))))
+(def big (reduce (lambda (m i) (set m (list i f) i)) (dict) (range 100)))
+(def copied (await (spawn (lambda () big))))
+(print (= big copied) (get copied (list 42 f)) (reduce + 0 (map (lambda (i) (get copied (list i f))) (range 100))))
@@ -0,0 +1,14 @@
+(def count-down (lambda (n acc)
+  (if (= n 0) acc (count-down (- n 1) (+ acc 1)))))
+(def before (get (gc-stats) "stack-capacity"))
+(print (count-down 1000000 0))
+(print (= before (get (gc-stats) "stack-capacity")))
+(def is-even (lambda (n) (if (= n 0) true (is-odd (- n 1)))))
+(def is-odd (lambda (n) (if (= n 0) false (is-even (- n 1)))))
+(print (is-even 1000001) (is-odd 1000001))
+(def depth (lambda (n) (if (= n 0) 0 (+ 1 (depth (- n 1))))))
+(print (depth 100000))
+(print (< before (get (gc-stats) "stack-capacity")))
+(def make-counter (lambda (start)
+  (lambda (n) (if (= n 0) start ((make-counter (+ start 1)) (- n 1))))))
+(print ((make-counter 0) 100000))
@@ -1,4 +1,5 @@
 #include "value.h"
+#include "dict.h"
 #include "memory.h"
 #include "object.h"
 #include <stdio.h>
@@ -14,13 +15,14 @@ void initValueArray(ValueArray* array)
 }
 
 // writeValueArray writes a byte to the given ValueArray.
-void writeValueArray(ValueArray* array, Value value)
+void writeValueArray(VM* vm, ValueArray* array, Value value)
 {
     if (array->capacity < array->count + 1) {
         int oldCapacity = array->capacity;
         int newCapacity = (int)GROW_CAPACITY(oldCapacity);
 
-        array->values = GROW_ARRAY(Value, array->values, oldCapacity, newCapacity);
+        array->values = GROW_ARRAY(vm, Value, array->values,
+            oldCapacity, newCapacity);
         array->capacity = newCapacity;
     }
 
@@ -29,9 +31,9 @@ void writeValueArray(ValueArray* array, Value value)
 }
 
 // freeValueArray frees any allocated memory associated with a ValueArray.
-void freeValueArray(ValueArray* array)
+void freeValueArray(VM* vm, ValueArray* array)
 {
-    FREE_ARRAY(Value, array->values, array->capacity);
+    FREE_ARRAY(vm, Value, array->values, array->capacity);
     initValueArray(array);
 }
 
@@ -91,8 +93,18 @@ char* valueType(Value value)
             return "list";
         case OBJ_UPVALUE:
             return "upvalue";
+        case OBJ_DICT_NODE:
+            return "dict node";
         case OBJ_NATIVE:
             return "native fn";
+        case OBJ_FUTURE:
+            return "future";
+        case OBJ_COROUTINE:
+            return "coroutine";
+        case OBJ_SEQUENCE:
+            return "sequence";
+        case OBJ_ITERATOR:
+            return "iterator";
         }
     }
     return "unreachable";
@@ -119,14 +131,136 @@ char* valueType(Value value)
             return "list";
         case OBJ_UPVALUE:
             return "upvalue";
+        case OBJ_DICT_NODE:
+            return "dict node";
         case OBJ_NATIVE:
             return "native fn";
+        case OBJ_FUTURE:
+            return "future";
+        case OBJ_COROUTINE:
+            return "coroutine";
+        case OBJ_SEQUENCE:
+            return "sequence";
+        case OBJ_ITERATOR:
+            return "iterator";
         }
     }
     }
 #endif
 }
 
+// How many comparisons can be in progress before they spill to the heap.
+#define INLINE_COMPARISONS 32
+
+// A pair of lists being compared.
+typedef struct {
+    ObjList* a;
+    ObjList* b;
+} Comparison;
+
+// The pairs of lists being compared on this thread, outermost first. Any
+// cycle passes through a list, since nothing else can be changed to hold
+// itself, so these are all that is needed to notice one.
+static _Thread_local Comparison inlineComparisons[INLINE_COMPARISONS];
+static _Thread_local Comparison* comparisons;
+static _Thread_local int comparisonCount;
+static _Thread_local int comparisonCapacity;
+
+// Start comparing a and b. Returns false if they are already being compared
+// further up, in which case they are taken to be equal: nothing found on the
+// way back round to them has told them apart.
+static bool enterComparison(ObjList* a, ObjList* b)
+{
+    for (int i = 0; i < comparisonCount; i++) {
+        if (comparisons[i].a == a && comparisons[i].b == b)
+            return false;
+    }
+
+    if (comparisonCount == 0) {
+        comparisons = inlineComparisons;
+        comparisonCapacity = INLINE_COMPARISONS;
+    } else if (comparisonCount == comparisonCapacity) {
+        size_t size = sizeof(Comparison) * (size_t)comparisonCapacity;
+        Comparison* grown = comparisons == inlineComparisons
+            ? malloc(size * 2)
+            : realloc(comparisons, size * 2);
+        if (grown == NULL)
+            exit(1);
+        if (comparisons == inlineComparisons)
+            memcpy(grown, inlineComparisons, size);
+        comparisons = grown;
+        comparisonCapacity *= 2;
+    }
+
+    comparisons[comparisonCount++] = (Comparison) { a, b };
+    return true;
+}
+
+// Finish the comparison most recently entered.
+static void leaveComparison(void)
+{
+    comparisonCount--;
+    if (comparisonCount == 0 && comparisons != inlineComparisons)
+        free(comparisons);
+}
+
+// Compare the elements of two lists of the same length.
+static bool listsEqual(ObjList* a, ObjList* b)
+{
+    Value* valuesA = listValues(a);
+    Value* valuesB = listValues(b);
+
+    for (int i = 0; i < a->count; i++) {
+        if (!valuesEqual(valuesA[i], valuesB[i]))
+            return false;
+    }
+    return true;
+}
+
+// Compare two distinct objects. Lists and dicts are equal when their contents
+// are, functions and closures when one is a copy of the other, and natives
+// when they are the same builtin. Every other object is only equal to itself.
+static bool objectsEqual(Obj* a, Obj* b)
+{
+    if (a->type != b->type)
+        return false;
+
+    switch (a->type) {
+    case OBJ_LIST: {
+        ObjList* listA = (ObjList*)a;
+        ObjList* listB = (ObjList*)b;
+
+        if (listA->count != listB->count)
+            return false;
+        if (listA->isHashed && listB->isHashed && listA->hash != listB->hash)
+            return false;
+        if (!enterComparison(listA, listB))
+            return true;
+
+        bool isEqual = listsEqual(listA, listB);
+        leaveComparison();
+        return isEqual;
+    }
+    case OBJ_DICT: {
+        ObjDict* dictA = (ObjDict*)a;
+        ObjDict* dictB = (ObjDict*)b;
+
+        if (dictA->isHashed && dictB->isHashed && dictA->hash != dictB->hash)
+            return false;
+        return dictsEqual(dictA, dictB);
+    }
+    case OBJ_FUNCTION:
+        return ((ObjFunction*)a)->id == ((ObjFunction*)b)->id;
+    case OBJ_CLOSURE:
+        return ((ObjClosure*)a)->id == ((ObjClosure*)b)->id;
+    case OBJ_NATIVE:
+        // Copies of a native made for other VMs are the same builtin.
+        return ((ObjNative*)a)->function == ((ObjNative*)b)->function;
+    default:
+        return false;
+    }
+}
+
 // Checks is two given values are the same, based on their types.
 bool valuesEqual(Value a, Value b)
 {
@@ -135,7 +269,9 @@ bool valuesEqual(Value a, Value b)
     if (IS_NUMBER(a) && IS_NUMBER(b)) {
         return AS_NUMBER(a) == AS_NUMBER(b);
     }
-    return a == b;
+    if (a == b)
+        return true;
+    return IS_OBJ(a) && IS_OBJ(b) && objectsEqual(AS_OBJ(a), AS_OBJ(b));
 #else
     if (a.type != b.type)
         return false;
@@ -148,7 +284,7 @@ bool valuesEqual(Value a, Value b)
     case VAL_NUMBER:
         return AS_NUMBER(a) == AS_NUMBER(b);
     case VAL_OBJ:
-        return AS_OBJ(a) == AS_OBJ(b);
+        return AS_OBJ(a) == AS_OBJ(b) || objectsEqual(AS_OBJ(a), AS_OBJ(b));
     default:
         return false;
     }
@@ -1,39 +1,98 @@
 #include <stdarg.h>
+#include <stdatomic.h>
 #include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 
 #include "chunk.h"
 #include "compiler.h"
 #include "debug.h"
+#include "image.h"
 #include "memory.h"
 #include "nativeFns.h"
 #include "object.h"
+#include "opcodeStats.h"
+#include "parallel.h"
+#include "profile.h"
+#include "scheduler.h"
+#include "sequence.h"
 #include "table.h"
 #include "value.h"
 #include "vm.h"
 
-VM vm;
-
 // Return the Value n positions from the top, without removing it.
-static Value peek(int distance)
+static Value peek(VM* vm, int distance)
 {
-    return vm.stackTop[-1 - distance];
+    return vm->stackTop[-1 - distance];
 }
 
+static void closeUpvalues(VM* vm, Value* last);
+
 // Reset the VM's stack my moving the pointer for the top of the stack to
-// the beginning of the stack array.
-static void resetStack(void)
+// the beginning of the stack array. While a native is calling back into the
+// VM, only the frames and values above the ones running the native are
+// removed.
+static void resetStack(VM* vm)
 {
-    vm.stackTop = vm.stack;
-    vm.frameCount = 0;
-    vm.openUpvalues = NULL;
+    vm->stackTop = vm->stack + vm->baseSlot;
+    vm->frameCount = vm->baseFrameCount;
+    closeUpvalues(vm, vm->stackTop);
+}
+
+// Swap the stack and frames the VM is using with the ones stored in the
+// coroutine.
+static void swapStacks(VM* vm, ObjCoroutine* coroutine)
+{
+#define SWAP(type, field)                  \
+    do {                                   \
+        type swapped = vm->field;          \
+        vm->field = coroutine->field;      \
+        coroutine->field = swapped;        \
+    } while (false)
+
+    SWAP(CallFrame*, frames);
+    SWAP(int, frameCount);
+    SWAP(int, frameCapacity);
+    SWAP(int, baseFrameCount);
+    SWAP(int, baseSlot);
+    SWAP(Value*, stack);
+    SWAP(int, stackCapacity);
+    SWAP(Value*, stackTop);
+    SWAP(ObjUpvalue*, openUpvalues);
+
+#undef SWAP
+
+    coroutineBarrier(vm, (Obj*)coroutine);
+}
+
+// Switch from the code that is running to the coroutine.
+static void enterCoroutine(VM* vm, ObjCoroutine* coroutine)
+{
+    coroutine->caller = vm->coroutine;
+    coroutine->state = COROUTINE_RUNNING;
+    vm->coroutine = coroutine;
+    swapStacks(vm, coroutine);
+}
+
+// Switch from the running coroutine back to the code that resumed it, leaving
+// the coroutine in the given state. A finished coroutine's stack is freed.
+static void leaveCoroutine(VM* vm, CoroutineState state)
+{
+    ObjCoroutine* coroutine = vm->coroutine;
+    swapStacks(vm, coroutine);
+    vm->coroutine = coroutine->caller;
+    coroutine->caller = NULL;
+    coroutine->state = state;
+
+    if (state == COROUTINE_DONE)
+        freeCoroutineStack(coroutine);
 }
 
 // Write an error message to stderr from the provided string template and
 // passed values. Print a stack trace of the call stack at the time of the error
 // and the remove all items from the stack.
-void runtimeError(const char* format, ...)
+void runtimeError(VM* vm, const char* format, ...)
 {
     va_list args;
     va_start(args, format);
@@ -41,159 +100,391 @@ void runtimeError(const char* format, ...)
     va_end(args);
     fputs("\n", stderr);
 
-    for (int i = vm.frameCount - 1; i >= 0; i--) {
-        CallFrame* frame = &vm.frames[i];
-        ObjFunction* function = frame->closure->function;
-        size_t instruction = (size_t)(frame->ip - function->chunk.code - 1);
-        fprintf(stderr, "[line %d] in ",
-            function->chunk.lines[instruction]);
-        if (function->name == NULL) {
-            fprintf(stderr, "script\n");
-        } else {
-            fprintf(stderr, "%s()\n", function->name->chars);
+    // An error in a coroutine finishes it, and is passed on to the code that
+    // resumed it, unless it was resumed by a native calling into the VM.
+    for (;;) {
+        for (int i = vm->frameCount - 1; i >= 0; i--) {
+            CallFrame* frame = &vm->frames[i];
+            ObjFunction* function = frame->closure->function;
+            size_t instruction =
+                (size_t)(frame->ip - function->chunk.code - 1);
+            fprintf(stderr, "[line %d] in ",
+                function->chunk.lines[instruction]);
+            if (function->name == NULL) {
+                fprintf(stderr, "script\n");
+            } else {
+                fprintf(stderr, "%s()\n", function->name->chars);
+            }
         }
+
+        if (vm->coroutine == NULL || vm->baseFrameCount != 0)
+            break;
+
+        closeUpvalues(vm, vm->stack);
+        leaveCoroutine(vm, COROUTINE_DONE);
+    }
+    resetStack(vm);
+}
+
+// Return the index of the slot used by the global with the given name. If the
+// name has not been seen before, a new undefined slot is assigned to it.
+// Returns -1 if there is no room for another global.
+int globalSlot(VM* vm, ObjString* name)
+{
+    Value slot;
+    if (tableGet(&vm->globalNames, OBJ_VAL(name), &slot))
+        return (int)AS_NUMBER(slot);
+
+    if (vm->globalCount == GLOBAL_MAX)
+        return -1;
+
+    // Keep the name reachable while the slot array and name table grow.
+    push(vm, OBJ_VAL(name));
+
+    if (vm->globalCapacity < vm->globalCount + 1) {
+        int oldCapacity = vm->globalCapacity;
+        vm->globalCapacity = (int)GROW_CAPACITY(oldCapacity);
+        vm->globals = GROW_ARRAY(vm, Global, vm->globals, oldCapacity,
+            vm->globalCapacity);
     }
-    resetStack();
+
+    Global* global = &vm->globals[vm->globalCount];
+    global->name = name;
+    global->value = NULL_VAL;
+    global->isDefined = false;
+    globalBarrier(vm, OBJ_VAL(name));
+
+    tableSet(vm, &vm->globalNames, OBJ_VAL(name), NUMBER_VAL(vm->globalCount));
+    pop(vm);
+
+    return vm->globalCount++;
 }
 
+// The native functions, defined as globals in this order when the VM starts.
+const Builtin builtins[] = {
+    { "+", add },
+    { "*", multiply },
+    { "-", subtract },
+    { "/", divide },
+    { "rem", rem },
+    { "<", less },
+    { ">", greater },
+    { "=", equal },
+    { "clock", clockNative },
+    { "print", printVals },
+    { "str", strCat },
+    { "not", not_ },
+
+    // List related builtins
+    { "list", list },
+    { "push", push_ },
+    { "push!", pushMut },
+    { "first", first },
+    { "rest", rest },
+    { "len", len },
+
+    // Dict related builtins
+    { "dict", dict },
+    { "set", set },
+    { "get", get },
+
+    // Coroutine related builtins
+    { "coroutine", coroutine },
+    { "done?", isDone },
+
+    // Sequence related builtins
+    { "range", range },
+    { "lazy-map", lazyMap },
+    { "lazy-filter", lazyFilter },
+    { "take", take },
+    { "collect", collect },
+    { "map", map },
+    { "filter", filter },
+    { "reduce", reduce },
+    { "for-each", forEach },
+
+    // GC builtins
+    { "gc-stats", gcStatsNative },
+
+    // Profiling builtins
+    { "profile-start", profileStart },
+    { "profile-stop", profileStop },
+
+    // Parallel builtins
+    { "pmap", pmap },
+    { "spawn", spawn },
+    { "await", await },
+};
+
+const int builtinCount = (int)(sizeof(builtins) / sizeof(builtins[0]));
+
 // Add a native function to the globals pool with the given identifier.
-static void defineNative(const char* name, NativeFn function)
+static void defineNative(VM* vm, const char* name, NativeFn function)
+{
+    push(vm, OBJ_VAL(copyString(vm, name, (int)strlen(name))));
+    push(vm, OBJ_VAL(newNative(vm, function)));
+
+    int slot = globalSlot(vm, AS_STRING(vm->stack[0]));
+    vm->globals[slot].value = vm->stack[1];
+    vm->globals[slot].isDefined = true;
+    globalBarrier(vm, vm->globals[slot].value);
+
+    pop(vm);
+    pop(vm);
+}
+
+// Number of VMs that have been started, for giving each a range of object
+// identities.
+static atomic_uint_fast64_t vmsStarted;
+
+// Zero all the VM's fields, leaving it without any globals.
+static void initState(VM* vm)
 {
-    push(OBJ_VAL(copyString(name, (int)strlen(name))));
-    push(OBJ_VAL(newNative(function)));
-    tableSet(&vm.globals, vm.stack[0], vm.stack[1]);
-    pop();
-    pop();
+    vm->frameCapacity = FRAMES_INITIAL;
+    vm->frames =
+        (CallFrame*)malloc(sizeof(CallFrame) * (size_t)vm->frameCapacity);
+    vm->stackCapacity = STACK_INITIAL;
+    vm->stack = (Value*)malloc(sizeof(Value) * (size_t)vm->stackCapacity);
+
+    if (vm->frames == NULL || vm->stack == NULL)
+        exit(1);
+
+    vm->baseFrameCount = 0;
+    vm->baseSlot = 0;
+    vm->openUpvalues = NULL;
+    resetStack(vm);
+    vm->objects = NULL;
+    initGC(vm);
+    initTable(&vm->strings);
+    initTable(&vm->globalNames);
+    initValueArray(&vm->scripts);
+    vm->parser = NULL;
+    vm->coroutine = NULL;
+    vm->scheduler = NULL;
+    vm->worker = NULL;
+    vm->profiler = NULL;
+    vm->opcodeStats = NULL;
+    vm->globals = NULL;
+    vm->globalCount = 0;
+    vm->globalCapacity = 0;
+
+    vm->greyCount = 0;
+    vm->greyCapacity = 0;
+    vm->greyStack = NULL;
+
+    vm->bytesAllocated = 0;
+    vm->nextGC = 1024 * 1024;
+    vm->nextId = (uint64_t)atomic_fetch_add(&vmsStarted, 1) << VM_ID_BITS;
 }
 
 // Set the initial state of the VM.
 // Zero all the VM's fields, and add all relevant native functions.
-void initVM(void)
+void initVM(VM* vm)
 {
-    resetStack();
-    vm.objects = NULL;
-    initTable(&vm.strings);
-    initTable(&vm.globals);
-
-    vm.greyCount = 0;
-    vm.greyCapacity = 0;
-    vm.greyStack = NULL;
-
-    vm.bytesAllocated = 0;
-    vm.nextGC = 1024 * 1024;
-
-    defineNative("+", add);
-    defineNative("*", multiply);
-    defineNative("-", subtract);
-    defineNative("/", divide);
-    defineNative("rem", rem);
-    defineNative("<", less);
-    defineNative(">", greater);
-    defineNative("=", equal);
-    defineNative("clock", clockNative);
-    defineNative("print", printVals);
-    defineNative("str", strCat);
-    defineNative("not", not_);
+    initState(vm);
 
-    // List related builtins
-    defineNative("list", list);
-    defineNative("push", push_);
-    defineNative("push!", pushMut);
-    defineNative("first", first);
-    defineNative("rest", rest);
-    defineNative("len", len);
+    for (int i = 0; i < builtinCount; i++) {
+        defineNative(vm, builtins[i].name, builtins[i].function);
+    }
+}
 
-    // Dict related builtins
-    defineNative("dict", dict);
-    defineNative("set", set);
-    defineNative("get", get);
+// Set the initial state of the VM from a heap image written by writeImage,
+// instead of defining the native functions. Return false if the image could
+// not be loaded.
+bool initVMFromImage(VM* vm, const char* path)
+{
+    initState(vm);
+    return loadImage(vm, path);
 }
 
 // Free all allocated memory associated with the VM.
-void freeVM(void)
+void freeVM(VM* vm)
 {
-    freeObjects();
-    freeTable(&vm.strings);
-    freeTable(&vm.globals);
+    // Tasks still running may be reading the VM's heap.
+    if (vm->scheduler != NULL && vm->worker == NULL)
+        freeScheduler(vm->scheduler);
+
+    if (vm->opcodeStats != NULL)
+        freeOpcodeStats(vm->opcodeStats);
+
+    if (vm->profiler != NULL) {
+        Buffer discarded;
+        initBuffer(&discarded);
+        stopProfiler(vm, &discarded);
+        freeBuffer(&discarded);
+    }
+
+    freeObjects(vm);
+    freeTable(vm, &vm->strings);
+    freeTable(vm, &vm->globalNames);
+    freeValueArray(vm, &vm->scripts);
+    FREE_ARRAY(vm, Global, vm->globals, vm->globalCapacity);
+    vm->globals = NULL;
+    vm->globalCount = 0;
+    vm->globalCapacity = 0;
+
+    free(vm->frames);
+    free(vm->stack);
+    vm->frames = NULL;
+    vm->stack = NULL;
+
+    freePools(vm);
 }
 
 // Add a new Value to the top of the VM's value stack.
-void push(Value value)
+//
+// Calls reserve FRAME_STACK_SLOTS for each frame, which covers almost every
+// function, but a frame can hold more pending values than that, through
+// deeply nested argument lists, so the stack is grown here when it is full.
+void push(VM* vm, Value value)
 {
-    *vm.stackTop = value;
-    vm.stackTop++;
+    if (vm->stackTop - vm->stack == vm->stackCapacity)
+        ensureStack(vm, FRAME_STACK_SLOTS);
+
+    *vm->stackTop = value;
+    vm->stackTop++;
 }
 
 // Remove the top Value from the VM's value stack and return it.
-Value pop(void)
+Value pop(VM* vm)
 {
-    vm.stackTop--;
-    return *vm.stackTop;
+    vm->stackTop--;
+    return *vm->stackTop;
+}
+
+// Grow the value stack until there are at least the given number of free slots
+// above stackTop. Everything that points into the stack (the frames' slots and
+// open upvalues) is moved over to the new allocation.
+void ensureStack(VM* vm, int slots)
+{
+    int used = (int)(vm->stackTop - vm->stack);
+    if (used + slots <= vm->stackCapacity)
+        return;
+
+    int capacity = vm->stackCapacity;
+    while (capacity < used + slots) {
+        capacity *= 2;
+    }
+
+    Value* stack = (Value*)malloc(sizeof(Value) * (size_t)capacity);
+    if (stack == NULL)
+        exit(1);
+
+    memcpy(stack, vm->stack, sizeof(Value) * (size_t)used);
+
+    for (int i = 0; i < vm->frameCount; i++) {
+        vm->frames[i].slots = stack + (vm->frames[i].slots - vm->stack);
+    }
+
+    for (ObjUpvalue* upvalue = vm->openUpvalues; upvalue != NULL;
+        upvalue = upvalue->next) {
+        upvalue->location = stack + (upvalue->location - vm->stack);
+    }
+
+    free(vm->stack);
+    vm->stack = stack;
+    vm->stackCapacity = capacity;
+    vm->stackTop = stack + used;
 }
 
 // Add a new frame to the call stack, designate the slots for parameters that
 // have been passed in, and execute the bytecode stored in the function of the
 // provided closure.
-static bool call(ObjClosure* closure, int argCount)
+static bool call(VM* vm, ObjClosure* closure, int argCount)
 {
     if (argCount != closure->function->arity) {
-        runtimeError("Expected %d arguments but got %d.",
+        runtimeError(vm, "Expected %d arguments but got %d.",
             closure->function->arity, argCount);
         return false;
     }
 
-    if (vm.frameCount == FRAME_MAX) {
-        runtimeError("Stack overflow.");
-        return false;
+    if (vm->frameCount == vm->frameCapacity) {
+        vm->frameCapacity *= 2;
+        vm->frames = (CallFrame*)realloc(vm->frames,
+            sizeof(CallFrame) * (size_t)vm->frameCapacity);
+
+        if (vm->frames == NULL)
+            exit(1);
     }
 
-    CallFrame* frame = &vm.frames[vm.frameCount++];
+    ensureStack(vm, FRAME_STACK_SLOTS);
+
+    CallFrame* frame = &vm->frames[vm->frameCount++];
     frame->closure = closure;
     frame->ip = closure->function->chunk.code;
-    frame->slots = vm.stackTop - argCount - 1; // -1 to account for function sat on stack
+    frame->slots = vm->stackTop - argCount - 1; // -1 to account for function sat on stack
     return true;
 }
 
-static bool callNative(NativeFn native, int argCount, bool popFunc)
+static bool callNative(VM* vm, NativeFn native, int argCount, bool popFunc)
 {
     Value result = NULL_VAL;
-    bool successful = native(argCount, vm.stackTop - argCount, &result);
+    bool successful = native(vm, argCount, vm->stackTop - argCount, &result);
 
     if (successful) {
-        vm.stackTop -= argCount + popFunc;
-        push(result);
+        vm->stackTop -= argCount + popFunc;
+        push(vm, result);
     }
     return successful;
 }
 
 // Properly execute the call convention for the given value type.
-static bool callValue(Value callee, int argCount)
+static bool callValue(VM* vm, Value callee, int argCount)
 {
     if (!IS_OBJ(callee)) {
-        runtimeError("Can only call functions.");
+        runtimeError(vm, "Can only call functions.");
         return false;
     }
 
     switch (AS_OBJ(callee)->type) {
     case OBJ_CLOSURE:
-        return call(AS_CLOSURE(callee), argCount);
+        return call(vm, AS_CLOSURE(callee), argCount);
     case OBJ_NATIVE: {
         NativeFn native = AS_NATIVE(callee);
-        return callNative(native, argCount, true);
+        return callNative(vm, native, argCount, true);
     }
     default:
-        runtimeError("Can only call functions.");
+        runtimeError(vm, "Can only call functions.");
+        return false;
+    }
+}
+
+// Call the given value from tail position. A closure reuses the current frame
+// and its window of the stack, so that recursion in tail position runs in
+// constant space. Any other value is called normally, since the instructions
+// following a tail call return its result.
+static bool tailCall(VM* vm, Value callee, int argCount)
+{
+    if (!IS_CLOSURE(callee))
+        return callValue(vm, callee, argCount);
+
+    ObjClosure* closure = AS_CLOSURE(callee);
+    if (argCount != closure->function->arity) {
+        runtimeError(vm, "Expected %d arguments but got %d.",
+            closure->function->arity, argCount);
         return false;
     }
+
+    CallFrame* frame = &vm->frames[vm->frameCount - 1];
+    closeUpvalues(vm, frame->slots);
+
+    // Slide the callee and its arguments down over the finished frame.
+    Value* callStart = vm->stackTop - argCount - 1;
+    memmove(frame->slots, callStart, sizeof(Value) * (size_t)(argCount + 1));
+    vm->stackTop = frame->slots + argCount + 1;
+
+    frame->closure = closure;
+    frame->ip = closure->function->chunk.code;
+    return true;
 }
 
 // Create an Upvalue object, insert it into the list of open upvalues held by
 // the VM. If the VM already contains a reference to the same variable then
 // return the existing Upvalue from the list.
-static ObjUpvalue* captureUpvalue(Value* local)
+static ObjUpvalue* captureUpvalue(VM* vm, Value* local)
 {
     ObjUpvalue* prevUpvalue = NULL;
-    ObjUpvalue* upvalue = vm.openUpvalues;
+    ObjUpvalue* upvalue = vm->openUpvalues;
 
     while (upvalue != NULL && upvalue->location > local) {
         prevUpvalue = upvalue;
@@ -204,11 +495,12 @@ static ObjUpvalue* captureUpvalue(Value* local)
         return upvalue;
     }
 
-    ObjUpvalue* createdUpvalue = newUpvalue(local);
+    ObjUpvalue* createdUpvalue = newUpvalue(vm, local);
     createdUpvalue->next = upvalue;
+    createdUpvalue->coroutine = vm->coroutine;
 
     if (prevUpvalue == NULL) {
-        vm.openUpvalues = createdUpvalue;
+        vm->openUpvalues = createdUpvalue;
     } else {
         prevUpvalue->next = createdUpvalue;
     }
@@ -217,13 +509,15 @@ static ObjUpvalue* captureUpvalue(Value* local)
 }
 
 // Close over all Upvalues until reaching the provided slot.
-static void closeUpvalues(Value* last)
+static void closeUpvalues(VM* vm, Value* last)
 {
-    while (vm.openUpvalues != NULL && vm.openUpvalues->location >= last) {
-        ObjUpvalue* upvalue = vm.openUpvalues;
+    while (vm->openUpvalues != NULL && vm->openUpvalues->location >= last) {
+        ObjUpvalue* upvalue = vm->openUpvalues;
         upvalue->closed = *upvalue->location;
         upvalue->location = &upvalue->closed;
-        vm.openUpvalues = upvalue->next;
+        upvalue->coroutine = NULL;
+        writeBarrier(vm, (Obj*)upvalue, upvalue->closed);
+        vm->openUpvalues = upvalue->next;
     }
 }
 
@@ -241,7 +535,7 @@ bool isFalsey(Value value)
 // The instruction is fetched (READ_BYTE in the switch statement), then
 // decoded (the case statements for each instruction), and executed
 // (the actions taken within each case statement).
-static InterpretResult run(void)
+static InterpretResult run(VM* vm)
 {
     static void* dispatchTable[] = {
         &&op_constant,
@@ -259,20 +553,44 @@ static InterpretResult run(void)
         &&op_jump,
         &&op_loop,
         &&op_call,
+        &&op_tail_call,
         &&op_add,
         &&op_subtract,
         &&op_multiply,
         &&op_divide,
+        &&op_binary_add,
+        &&op_binary_subtract,
+        &&op_binary_multiply,
+        &&op_binary_divide,
+        &&op_less,
+        &&op_greater,
+        &&op_equal,
+        &&op_less_jump_false,
+        &&op_greater_jump_false,
+        &&op_equal_jump_false,
+        &&op_pop_jump_false,
         &&op_closure,
+        &&op_yield,
+        &&op_resume,
+        &&op_iterate,
+        &&op_iterate_next,
         &&op_return,
     };
-    CallFrame* frame = &vm.frames[vm.frameCount - 1];
-    ObjString* name;
+
+    // While instructions are being counted, every opcode is dispatched to
+    // op_count first, so that counting costs nothing when it is off.
+    static void* countingTable[OPCODE_COUNT] = {
+        [0 ... OPCODE_COUNT - 1] = &&op_count,
+    };
+    void** table = vm->opcodeStats != NULL ? countingTable : dispatchTable;
+    CallFrame* frame = &vm->frames[vm->frameCount - 1];
+    Global* global;
     Value constant;
     uint8_t slot;
     uint16_t offset;
     int argCount;
     ObjFunction* function;
+    ObjIterator* iterator;
     Value result;
 
 #define READ_BYTE() (*frame->ip++)
@@ -281,72 +599,138 @@ static InterpretResult run(void)
 #define READ_SHORT() (frame->ip += 2, \
     (uint16_t)((frame->ip[-2] << 8) | frame->ip[-1]))
 #define READ_STRING() AS_STRING(READ_CONSTANT())
-#define DISPATCH() goto* dispatchTable[READ_BYTE()]
+#define DISPATCH() goto* table[READ_BYTE()]
+// Run a minor collection if one has been requested. Only used where nothing
+// but the stack and frames refers to young objects. The profiler samples the
+// call stack here too, where the frames are up to date.
+#define SAFEPOINT()                 \
+    if (vm->gcRequested) {          \
+        collectYoung(vm);           \
+    }                               \
+    if (vm->profiler != NULL) {     \
+        takeSample(vm);             \
+    }
+// Apply the operator directly when both operands are numbers, only falling
+// back to the native function (which reports the error) on a type mismatch.
+#define BINARY_OP(op, native)                                   \
+    do {                                                        \
+        Value b = peek(vm, 0);                                  \
+        Value a = peek(vm, 1);                                  \
+        if (IS_NUMBER(a) && IS_NUMBER(b)) {                     \
+            vm->stackTop--;                                     \
+            vm->stackTop[-1] = NUMBER_VAL(AS_NUMBER(a) op AS_NUMBER(b)); \
+        } else if (!callNative(vm, native, 2, false)) {         \
+            return INTERPRET_RUNTIME_ERROR;                     \
+        }                                                       \
+    } while (false)
+// Compare two numbers inline, falling back to the variadic native function for
+// any other argument count or on a type mismatch.
+#define COMPARE_OP(op, native)                                      \
+    do {                                                            \
+        argCount = READ_BYTE();                                     \
+        if (argCount == 2 && IS_NUMBER(peek(vm, 0))                 \
+            && IS_NUMBER(peek(vm, 1))) {                            \
+            Value b = peek(vm, 0);                                  \
+            Value a = peek(vm, 1);                                  \
+            vm->stackTop--;                                         \
+            vm->stackTop[-1] = BOOL_VAL(AS_NUMBER(a) op AS_NUMBER(b)); \
+        } else if (!callNative(vm, native, argCount, false)) {      \
+            return INTERPRET_RUNTIME_ERROR;                         \
+        }                                                           \
+    } while (false)
+// Compare the two operands on top of the stack, remove them, and jump if the
+// comparison is false.
+#define COMPARE_JUMP(op, native)                                    \
+    do {                                                            \
+        offset = READ_SHORT();                                      \
+        Value b = peek(vm, 0);                                      \
+        Value a = peek(vm, 1);                                      \
+        bool isTrue;                                                \
+        if (IS_NUMBER(a) && IS_NUMBER(b)) {                         \
+            isTrue = AS_NUMBER(a) op AS_NUMBER(b);                  \
+            vm->stackTop -= 2;                                      \
+        } else if (callNative(vm, native, 2, false)) {              \
+            isTrue = AS_BOOL(pop(vm));                              \
+        } else {                                                    \
+            return INTERPRET_RUNTIME_ERROR;                         \
+        }                                                           \
+        if (!isTrue)                                                \
+            frame->ip += offset;                                    \
+    } while (false)
 #ifdef DEBUG_TRACE_EXECUTION
     printf("        ");
-    for (Value* slot = vm.stack; slot < vm.stackTop; slot++) {
+    for (Value* slot = vm->stack; slot < vm->stackTop; slot++) {
         printf("[ ");
         printValue(*slot);
         printf(" ]");
     }
     printf("\n");
 
-    disassembleInstruction(&frame->closure->function->chunk,
+    disassembleInstruction(vm, &frame->closure->function->chunk,
         (int)(frame->ip - frame->closure->function->chunk.code));
 #endif
 
     DISPATCH();
+op_count:
+    countOpcode(vm->opcodeStats, frame->ip[-1]);
+    goto* dispatchTable[frame->ip[-1]];
 op_constant:
     constant = READ_CONSTANT();
-    push(constant);
+    push(vm, constant);
     DISPATCH();
 op_null:
-    push(NULL_VAL);
+    push(vm, NULL_VAL);
     DISPATCH();
 op_true:
-    push(BOOL_VAL(true));
+    push(vm, BOOL_VAL(true));
     DISPATCH();
 op_false:
-    push(BOOL_VAL(false));
+    push(vm, BOOL_VAL(false));
     DISPATCH();
 op_pop:
-    pop();
+    pop(vm);
     DISPATCH();
 op_define_global:
-    name = READ_STRING();
-    tableSet(&vm.globals, OBJ_VAL(name), peek(0));
+    global = &vm->globals[READ_SHORT()];
+    global->value = peek(vm, 0);
+    global->isDefined = true;
+    globalBarrier(vm, global->value);
     DISPATCH();
 op_get_global:
-    name = READ_STRING();
-    Value value;
+    global = &vm->globals[READ_SHORT()];
 
-    if (!tableGet(&vm.globals, OBJ_VAL(name), &value)) {
-        runtimeError("Undefined variable '%s'.", name->chars);
+    if (!global->isDefined) {
+        runtimeError(vm, "Undefined variable '%s'.", global->name->chars);
         return INTERPRET_RUNTIME_ERROR;
     }
 
-    push(value);
+    push(vm, global->value);
     DISPATCH();
 op_define_local:
+    // A new local's value is left in its slot, and pushed again as the result
+    // of the def. Redefining a local assigns the value to its slot instead,
+    // leaving the value as the result, so that a def in a loop doesn't grow
+    // the stack each time round.
     slot = READ_BYTE();
-    frame->slots[slot] = peek(0);
-    push(peek(0));
+    frame->slots[slot] = peek(vm, 0);
+    if (frame->slots + slot >= vm->stackTop - 1)
+        push(vm, peek(vm, 0));
     DISPATCH();
 op_get_local:
     slot = READ_BYTE();
-    push(frame->slots[slot]);
+    push(vm, frame->slots[slot]);
     DISPATCH();
 op_get_upvalue:
     slot = READ_BYTE();
-    push(*frame->closure->upvalues[slot]->location);
+    push(vm, *frame->closure->upvalues[slot]->location);
     DISPATCH();
 op_close_upvalue:
-    closeUpvalues(vm.stackTop - 1);
-    pop();
+    closeUpvalues(vm, vm->stackTop - 1);
+    pop(vm);
     DISPATCH();
 op_jump_false:
     offset = READ_SHORT();
-    if (isFalsey(peek(0)))
+    if (isFalsey(peek(vm, 0)))
         frame->ip += offset;
     DISPATCH();
 op_jump:
@@ -356,74 +740,232 @@ op_jump:
 op_loop:
     offset = READ_SHORT();
     frame->ip -= offset;
+    SAFEPOINT();
     DISPATCH();
 op_call:
+    SAFEPOINT();
+    argCount = READ_BYTE();
+    if (!callValue(vm, peek(vm, argCount), argCount))
+        return INTERPRET_RUNTIME_ERROR;
+    frame = &vm->frames[vm->frameCount - 1];
+
+    DISPATCH();
+op_tail_call:
+    SAFEPOINT();
     argCount = READ_BYTE();
-    if (!callValue(peek(argCount), argCount))
+    if (!tailCall(vm, peek(vm, argCount), argCount))
         return INTERPRET_RUNTIME_ERROR;
-    frame = &vm.frames[vm.frameCount - 1];
+    frame = &vm->frames[vm->frameCount - 1];
 
     DISPATCH();
 op_add:
     argCount = READ_BYTE();
-    if (!callNative(add, argCount, false))
+    if (!callNative(vm, add, argCount, false))
         return INTERPRET_RUNTIME_ERROR;
 
     DISPATCH();
 op_subtract:
     argCount = READ_BYTE();
-    if (!callNative(subtract, argCount, false))
+    if (!callNative(vm, subtract, argCount, false))
         return INTERPRET_RUNTIME_ERROR;
 
     DISPATCH();
 op_multiply:
     argCount = READ_BYTE();
-    if (!callNative(multiply, argCount, false))
+    if (!callNative(vm, multiply, argCount, false))
         return INTERPRET_RUNTIME_ERROR;
 
     DISPATCH();
 op_divide:
     argCount = READ_BYTE();
-    push(NULL_VAL);
-    if (!callNative(divide, argCount, false))
+    if (!callNative(vm, divide, argCount, false))
         return INTERPRET_RUNTIME_ERROR;
 
     DISPATCH();
+op_binary_add:
+    BINARY_OP(+, add);
+    DISPATCH();
+op_binary_subtract:
+    BINARY_OP(-, subtract);
+    DISPATCH();
+op_binary_multiply:
+    BINARY_OP(*, multiply);
+    DISPATCH();
+op_binary_divide:
+    // Division by zero is left to the native function to report.
+    if (IS_NUMBER(peek(vm, 1)) && IS_NUMBER(peek(vm, 0))
+        && AS_NUMBER(peek(vm, 0)) != 0) {
+        double b = AS_NUMBER(pop(vm));
+        vm->stackTop[-1] = NUMBER_VAL(AS_NUMBER(vm->stackTop[-1]) / b);
+    } else if (!callNative(vm, divide, 2, false)) {
+        return INTERPRET_RUNTIME_ERROR;
+    }
+
+    DISPATCH();
+op_less:
+    COMPARE_OP(<, less);
+    DISPATCH();
+op_greater:
+    COMPARE_OP(>, greater);
+    DISPATCH();
+op_equal:
+    argCount = READ_BYTE();
+    if (argCount == 2) {
+        Value b = pop(vm);
+        vm->stackTop[-1] = BOOL_VAL(valuesEqual(vm->stackTop[-1], b));
+    } else if (!callNative(vm, equal, argCount, false)) {
+        return INTERPRET_RUNTIME_ERROR;
+    }
+
+    DISPATCH();
+op_less_jump_false:
+    COMPARE_JUMP(<, less);
+    DISPATCH();
+op_greater_jump_false:
+    COMPARE_JUMP(>, greater);
+    DISPATCH();
+op_equal_jump_false:
+    offset = READ_SHORT();
+    vm->stackTop -= 2;
+    if (!valuesEqual(vm->stackTop[0], vm->stackTop[1]))
+        frame->ip += offset;
+    DISPATCH();
+op_pop_jump_false:
+    offset = READ_SHORT();
+    if (isFalsey(pop(vm)))
+        frame->ip += offset;
+    DISPATCH();
 op_closure:
     function = AS_FUNCTION(READ_CONSTANT());
-    ObjClosure* closure = newClosure(function);
-    push(OBJ_VAL(closure));
+    ObjClosure* closure = newClosure(vm, function);
+    push(vm, OBJ_VAL(closure));
 
     for (int i = 0; i < closure->upvalueCount; i++) {
         uint8_t isLocal = READ_BYTE();
         uint8_t index = READ_BYTE();
 
         if (isLocal)
-            closure->upvalues[i] = captureUpvalue(frame->slots + index);
+            closure->upvalues[i] = captureUpvalue(vm, frame->slots + index);
         else
             closure->upvalues[i] = frame->closure->upvalues[index];
     }
 
+    DISPATCH();
+op_yield:
+    // A native that called into the coroutine is still running on the C
+    // stack, and can't be suspended along with the coroutine.
+    if (vm->coroutine == NULL) {
+        runtimeError(vm, "Can only yield inside a coroutine.");
+        return INTERPRET_RUNTIME_ERROR;
+    }
+    if (vm->baseFrameCount != 0) {
+        runtimeError(vm, "Can't yield from a function called by a native.");
+        return INTERPRET_RUNTIME_ERROR;
+    }
+
+    result = pop(vm);
+    leaveCoroutine(vm, COROUTINE_SUSPENDED);
+    push(vm, result);
+
+    frame = &vm->frames[vm->frameCount - 1];
+    DISPATCH();
+op_resume:
+    if (!IS_COROUTINE(peek(vm, 1))) {
+        runtimeError(vm, "Can only resume coroutines.");
+        return INTERPRET_RUNTIME_ERROR;
+    }
+
+    ObjCoroutine* coroutine = AS_COROUTINE(peek(vm, 1));
+    if (coroutine->state == COROUTINE_RUNNING) {
+        runtimeError(vm, "Attempted to resume a running coroutine.");
+        return INTERPRET_RUNTIME_ERROR;
+    }
+    if (coroutine->state == COROUTINE_DONE) {
+        runtimeError(vm, "Attempted to resume a finished coroutine.");
+        return INTERPRET_RUNTIME_ERROR;
+    }
+
+    // The value is the result of the yield that suspended the coroutine. The
+    // first resume starts the coroutine's function instead.
+    result = pop(vm);
+    pop(vm);
+    bool started = coroutine->state == COROUTINE_SUSPENDED;
+    enterCoroutine(vm, coroutine);
+    if (started)
+        push(vm, result);
+
+    frame = &vm->frames[vm->frameCount - 1];
+    DISPATCH();
+op_iterate:
+    iterator = iterate(vm, peek(vm, 0));
+    if (iterator == NULL) {
+        runtimeError(vm, "Can only iterate over lists and sequences.");
+        return INTERPRET_RUNTIME_ERROR;
+    }
+
+    vm->stackTop[-1] = OBJ_VAL(iterator);
+    DISPATCH();
+op_iterate_next:
+    offset = READ_SHORT();
+    iterator = AS_ITERATOR(peek(vm, 0));
+
+    // A list or range with no stages is stepped through directly.
+    if (iterator->stageCount == 0) {
+        if (iterator->index >= iterator->count) {
+            frame->ip += offset;
+        } else if (IS_LIST(iterator->list)) {
+            push(vm, listValues(AS_LIST(iterator->list))[(int)iterator->index++]);
+        } else {
+            push(vm, NUMBER_VAL(iterator->start
+                         + iterator->index++ * iterator->step));
+        }
+        DISPATCH();
+    }
+
+    switch (iterateNext(vm, (int)(vm->stackTop - vm->stack) - 1, &result)) {
+    case ITERATE_VALUE:
+        push(vm, result);
+        break;
+    case ITERATE_DONE:
+        vm->frames[vm->frameCount - 1].ip += offset;
+        break;
+    case ITERATE_ERROR:
+        return INTERPRET_RUNTIME_ERROR;
+    }
+
+    frame = &vm->frames[vm->frameCount - 1];
     DISPATCH();
 op_return:
-    result = pop();
-    closeUpvalues(frame->slots);
-    vm.frameCount--;
+    result = pop(vm);
+    closeUpvalues(vm, frame->slots);
+    vm->frameCount--;
+    vm->stackTop = frame->slots;
 
-    if (vm.frameCount == 0) {
-        pop();
-        printValue(result);
-        printf("\n");
+    // A coroutine that returns from its function is finished, and the result
+    // is the result of the resume that ran it.
+    if (vm->frameCount == 0 && vm->coroutine != NULL) {
+        leaveCoroutine(vm, COROUTINE_DONE);
+        push(vm, result);
 
-        return INTERPRET_OK;
+        frame = &vm->frames[vm->frameCount - 1];
+        DISPATCH();
     }
 
-    vm.stackTop = frame->slots;
-    push(result);
-    frame = &vm.frames[vm.frameCount - 1];
+    push(vm, result);
+
+    // The result of the script, or of a function called by a native, is left
+    // on the stack for the caller.
+    if (vm->frameCount == vm->baseFrameCount)
+        return INTERPRET_OK;
+
+    frame = &vm->frames[vm->frameCount - 1];
     DISPATCH();
 
+#undef COMPARE_JUMP
+#undef COMPARE_OP
+#undef BINARY_OP
 #undef DISPATCH
+#undef SAFEPOINT
 #undef READ_STRING
 #undef READ_SHORT
 #undef READ_CONSTANT
@@ -433,17 +975,131 @@ op_return:
 // The given source code is compiled to bytecode and stored in a top-level
 // function. If there are no compilation errors, the returned function is then
 // executed on the VM.
-InterpretResult interpret(const char* source)
+InterpretResult interpret(VM* vm, const char* source)
 {
-    ObjFunction* function = compile(source);
+    ObjFunction* function = compile(vm, source);
     if (function == NULL)
         return INTERPRET_COMPILE_ERROR;
 
-    push(OBJ_VAL(function));
-    ObjClosure* closure = newClosure(function);
-    pop();
-    push(OBJ_VAL(closure));
-    call(closure, 0);
+    return interpretFunction(vm, function);
+}
+
+// Run a compiled script, such as one loaded from a bytecode cache.
+InterpretResult interpretFunction(VM* vm, ObjFunction* function)
+{
+    push(vm, OBJ_VAL(function));
+    ObjClosure* closure = newClosure(vm, function);
+    pop(vm);
+    push(vm, OBJ_VAL(closure));
+    call(vm, closure, 0);
 
-    return run();
+    InterpretResult result = run(vm);
+    if (result == INTERPRET_OK) {
+        printValue(pop(vm));
+        printf("\n");
+    }
+
+    return result;
+}
+
+// Compile the source into a script that can be run any number of times.
+// Return false if there were compilation errors.
+bool compileScript(VM* vm, const char* source, Script* script)
+{
+    ObjFunction* function = compile(vm, source);
+    return function != NULL && newScript(vm, function, script);
+}
+
+// Make a script that runs the compiled function, such as one loaded from a
+// bytecode cache. The script is kept alive until it is freed by freeScript.
+bool newScript(VM* vm, ObjFunction* function, Script* script)
+{
+    push(vm, OBJ_VAL(function));
+    script->inputSlot = globalSlot(vm, copyString(vm, "input", 5));
+    if (script->inputSlot < 0) {
+        pop(vm);
+        return false;
+    }
+
+    ObjClosure* closure = newClosure(vm, function);
+    pop(vm);
+    push(vm, OBJ_VAL(closure));
+
+    script->index = vm->scripts.count;
+    for (int i = 0; i < vm->scripts.count; i++) {
+        if (IS_NULL(vm->scripts.values[i])) {
+            script->index = i;
+            break;
+        }
+    }
+
+    if (script->index == vm->scripts.count) {
+        writeValueArray(vm, &vm->scripts, OBJ_VAL(closure));
+    } else {
+        vm->scripts.values[script->index] = OBJ_VAL(closure);
+    }
+    globalBarrier(vm, OBJ_VAL(closure));
+    pop(vm);
+
+    return true;
+}
+
+// Run the script with the `input` global set to the given value, without
+// printing the result. The result of the last expression in the script is
+// placed in result, which must be made reachable before anything else is
+// allocated.
+InterpretResult runScript(VM* vm, Script script, Value input, Value* result)
+{
+    Global* global = &vm->globals[script.inputSlot];
+    global->value = input;
+    global->isDefined = true;
+    globalBarrier(vm, input);
+
+    Value closure = vm->scripts.values[script.index];
+    push(vm, closure);
+    call(vm, AS_CLOSURE(closure), 0);
+
+    InterpretResult status = run(vm);
+    if (status == INTERPRET_OK)
+        *result = pop(vm);
+
+    return status;
+}
+
+// Call the function below the given number of arguments on top of the stack.
+// The function and its arguments are popped, and its result is placed in
+// result. Nothing keeps the result alive, so it must be made reachable before
+// anything else is allocated.
+//
+// Natives may call this while the VM is running code. The call runs on top of
+// the frames that are already running, and a runtime error only unwinds the
+// call itself. The stack may be reallocated by the call, so a native must not
+// use its args pointer afterwards.
+InterpretResult callFunction(VM* vm, int argCount, Value* result)
+{
+    int baseFrameCount = vm->baseFrameCount;
+    int baseSlot = vm->baseSlot;
+    vm->baseFrameCount = vm->frameCount;
+    vm->baseSlot = (int)(vm->stackTop - vm->stack) - argCount - 1;
+
+    Value callee = vm->stackTop[-1 - argCount];
+    InterpretResult status = INTERPRET_RUNTIME_ERROR;
+
+    // A native has already run and left its result on the stack.
+    if (callValue(vm, callee, argCount))
+        status = IS_CLOSURE(callee) ? run(vm) : INTERPRET_OK;
+
+    vm->baseFrameCount = baseFrameCount;
+    vm->baseSlot = baseSlot;
+
+    if (status == INTERPRET_OK)
+        *result = pop(vm);
+
+    return status;
+}
+
+// Release the script, so that its code can be garbage collected.
+void freeScript(VM* vm, Script script)
+{
+    vm->scripts.values[script.index] = NULL_VAL;
 }
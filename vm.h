@@ -9,11 +9,29 @@
 #include "table.h"
 #include "value.h"
 
-#define FRAME_MAX 64
-#define STACK_MAX (FRAME_MAX * UINT8_COUNT)
+// Initial capacities of the frame and value stacks. Both stacks grow on demand,
+// so these only determine how much is allocated up front.
+#define FRAMES_INITIAL 64
+#define STACK_INITIAL (FRAMES_INITIAL * UINT8_COUNT)
+
+// Number of identities each VM can give to functions and closures, as a power
+// of two.
+#define VM_ID_BITS 40
+
+// Number of free stack slots reserved for a function when it is called, enough
+// for its locals and the arguments of a call made from it. Frames that need
+// more grow the stack as values are pushed.
+#define FRAME_STACK_SLOTS (UINT8_COUNT * 2)
+
+// Maximum number of global variables, limited by the 16 bit operand of the
+// global instructions.
+#define GLOBAL_MAX (UINT16_MAX + 1)
+
+// Initial capacity of the frame stack of a coroutine.
+#define COROUTINE_FRAMES_INITIAL 8
 
 // Representation of an execution frame on the frame stack.
-typedef struct {
+typedef struct CallFrame {
     // Closure being executed in this Frame.
     ObjClosure* closure;
 
@@ -26,32 +44,205 @@ typedef struct {
     Value* slots;
 } CallFrame;
 
-// A container for the state of the VM.
+// A global variable, stored in a slot that is assigned when the variable is
+// first referenced during compilation.
+typedef struct {
+    // Name of the variable, used to report runtime errors.
+    ObjString* name;
+
+    // Current value of the variable.
+    Value value;
+
+    // Set once a def has run for the variable. Reading a global before it has
+    // been defined is a runtime error.
+    bool isDefined;
+} Global;
+
+// A block of memory in the nursery. Young objects are allocated by bumping
+// the used count of the current block.
+typedef struct NurseryBlock {
+    // The next (older, already full) block in the nursery.
+    struct NurseryBlock* next;
+
+    // Number of bytes of data that have been allocated.
+    size_t used;
+
+    // Memory that objects are allocated from.
+    uint8_t data[];
+} NurseryBlock;
+
+// The phases of an incremental collection of the old generation.
+typedef enum {
+    GC_IDLE,
+    GC_MARK,
+    GC_SWEEP,
+} GcPhase;
+
+// Number of buckets in the histograms of collection pauses. Bucket i counts
+// pauses shorter than 2^i microseconds, and the last bucket the rest.
+#define GC_PAUSE_BUCKETS 20
+
+// Number of the most recent thresholds kept in the nextGC history.
+#define GC_HISTORY 32
+
+// Counters kept by the garbage collector as it runs, reported by --gc-stats
+// and the gc-stats builtin.
 typedef struct {
+    // Number of minor collections run, and of collections of the old
+    // generation completed.
+    size_t minorCollections;
+    size_t majorCollections;
+
+    // Pause times of minor collections, and of each slice of work done on the
+    // old generation.
+    size_t minorPauses[GC_PAUSE_BUCKETS];
+    size_t majorPauses[GC_PAUSE_BUCKETS];
+    uint64_t totalPauseNs;
+    uint64_t maxPauseNs;
+
+    // Bytes copied into the old generation by minor collections.
+    size_t bytesPromoted;
+
+    // Bytes freed by collections of the old generation: in total, by the one
+    // in progress, by the last one completed, and by the largest.
+    size_t bytesFreed;
+    size_t currentFreed;
+    size_t lastFreed;
+    size_t maxFreed;
+
+    // The value of nextGC set by each of the most recent collections of the
+    // old generation, as a ring starting at historyCount % GC_HISTORY.
+    size_t nextGCHistory[GC_HISTORY];
+    size_t historyCount;
+} GcStats;
+
+// Number of size classes used by the pool allocator.
+#define POOL_CLASSES 16
+
+// A free cell in a pool, linked to the next free cell of the same size class.
+typedef struct FreeCell {
+    struct FreeCell* next;
+} FreeCell;
+
+// A page of memory in a pool, split into cells of a single size class.
+typedef struct PoolPage {
+    // The next page of the same size class.
+    struct PoolPage* next;
+
+    // Number of cells in the page that are currently allocated.
+    int liveCells;
+} PoolPage;
+
+// Memory for small allocations of a single size class.
+typedef struct {
+    // Cells that are available to be allocated.
+    FreeCell* freeList;
+
+    // All pages that have been allocated for this size class.
+    PoolPage* pages;
+
+    // Number of pages that have been allocated for this size class.
+    int pageCount;
+
+    // Number of cells that are currently allocated.
+    size_t liveCells;
+} Pool;
+
+// A container for the state of the VM. Every function that runs code, compiles
+// or allocates is given the VM to use, so separate VMs share no mutable state
+// and can run on separate threads.
+struct VM {
     // Frame stack of the VM, to track depth of execution of functions
     // during runtime.
-    CallFrame frames[FRAME_MAX];
+    CallFrame* frames;
 
     // The current number of frames actively used on the stack.
     int frameCount;
 
+    // Number of frames, and of stack slots, below the function that a native
+    // is currently calling with callFunction. Returning from or unwinding the
+    // call stops there, leaving the frames of the native's caller running.
+    int baseFrameCount;
+    int baseSlot;
+
+    // Number of frames that fit in the frames array before it has to grow.
+    int frameCapacity;
+
     // The stack of Values being actively used by the execution of the VM.
-    Value stack[STACK_MAX];
+    Value* stack;
+
+    // Number of Values that fit on the stack before it has to grow.
+    int stackCapacity;
 
     // Pointer to above the last Value placed on the stack.
     Value* stackTop;
 
-    // Table of top-scope Values that are accessed via a call to the hash table.
-    Table globals;
+    // Slots of top-scope Values, indexed directly by the global instructions.
+    Global* globals;
+
+    // Number of global slots that have been assigned.
+    int globalCount;
+
+    // Capacity of the globals array.
+    int globalCapacity;
+
+    // Maps the name of each global to the index of its slot. Only used when
+    // compiling, so that the VM never has to hash a name at runtime.
+    Table globalNames;
+
+    // State of the compiler while source is being compiled, so that the
+    // functions it is building can be marked. NULL otherwise.
+    struct Parser* parser;
+
+    // The coroutine that is running, whose stack and frames the VM is using,
+    // or NULL when no coroutine is running.
+    ObjCoroutine* coroutine;
+
+    // Scheduler running the tasks started by `spawn`, started by the first
+    // call to it. Workers share the scheduler of the VM that started them.
+    struct Scheduler* scheduler;
+
+    // The worker whose VM this is, or NULL if the VM is not a worker. Only a
+    // VM that is not a worker frees its scheduler.
+    struct Worker* worker;
+
+    // The profiler sampling the VM's call stack, or NULL when it isn't being
+    // profiled.
+    struct Profiler* profiler;
+
+    // Counters of the instructions run, or NULL when they aren't counted.
+    struct OpcodeStats* opcodeStats;
+
+    // Closures of the scripts made by compileScript, kept alive until they
+    // are freed. Freed entries are null, to be reused by the next script.
+    ValueArray scripts;
 
     // Table of unique strings used by the VM. The Table here is used more like
     // a set, with the key being the part of the entry that matters.
     Table strings;
 
-    // An intrusive list of all objects that have been created, used to find
-    // otherwise unreachable objects during garbage collection.
+    // An intrusive list of all old objects, used to find otherwise
+    // unreachable objects during garbage collection.
     Obj* objects;
 
+    // The blocks of the nursery, where new objects are allocated. The first
+    // block is the one currently being allocated from.
+    NurseryBlock* nursery;
+
+    // Set when the nursery has filled up. A minor collection runs the next
+    // time the VM reaches a safepoint.
+    bool gcRequested;
+
+    // Old objects that young objects have been stored into. Minor collections
+    // use them as roots, since they are not traced otherwise.
+    Obj** rememberedSet;
+
+    // Number of objects in the remembered set.
+    int rememberedCount;
+
+    // Capacity of the rememberedSet array.
+    int rememberedCapacity;
+
     // An intrusive list of Values that are both captured from an enclosing
     // scope, and not yet 'closed over' (taken off the stack and stored in
     // the closure itself).
@@ -67,14 +258,38 @@ typedef struct {
     // been checked for linked objects that can be reached through it.
     Obj** greyStack;
 
-    // Current number of bytes allocated to objects on the heap by the VM.
+    // Current number of bytes allocated on the heap by the VM, for old objects
+    // and the memory owned by objects of either generation.
     size_t bytesAllocated;
 
+    // Pools that small objects and buffers are allocated from, one for each
+    // size class.
+    Pool pools[POOL_CLASSES];
+
+    // Current phase of the incremental collection of the old generation.
+    GcPhase gcPhase;
+
+    // Old objects that have not yet been checked by the current sweep.
+    // Survivors are moved back onto the objects list as they are checked.
+    Obj* sweepList;
+
+    // Number of objects marked or swept in each slice of an incremental
+    // collection. When 0 every collection runs to completion in one pause.
+    size_t gcSliceBudget;
+
     // The threshold for the next garbage collection. When bytesAllocated
     // becomes higher than nextGC, the garbage collector is triggered, and
     // nextGC will be updated to a new threshold value for the next collection.
     size_t nextGC;
-} VM;
+
+    // Collection counts, pause times and heap growth, for telemetry.
+    GcStats gcStats;
+
+    // Identity given to the next function or closure created. Each VM hands
+    // out identities from its own range, so that they are unique in the
+    // process.
+    uint64_t nextId;
+};
 
 // A representation of the different return states of running the VM.
 typedef enum {
@@ -83,16 +298,41 @@ typedef enum {
     INTERPRET_RUNTIME_ERROR
 } InterpretResult;
 
-extern VM vm;
+// A native function that is defined as a global when the VM starts.
+typedef struct {
+    const char* name;
+    NativeFn function;
+} Builtin;
+
+// A script compiled once to be run any number of times, by the index of its
+// closure in the VM's scripts.
+typedef struct {
+    int index;
+
+    // Global slot of the `input` variable that each run is given.
+    int inputSlot;
+} Script;
+
+extern const Builtin builtins[];
+extern const int builtinCount;
 
-void initVM(void);
-void freeVM(void);
+void initVM(VM* vm);
+bool initVMFromImage(VM* vm, const char* path);
+void freeVM(VM* vm);
 
-InterpretResult interpret(const char* source);
-void push(Value value);
-Value pop(void);
+InterpretResult interpret(VM* vm, const char* source);
+InterpretResult interpretFunction(VM* vm, ObjFunction* function);
+bool compileScript(VM* vm, const char* source, Script* script);
+bool newScript(VM* vm, ObjFunction* function, Script* script);
+InterpretResult runScript(VM* vm, Script script, Value input, Value* result);
+void freeScript(VM* vm, Script script);
+InterpretResult callFunction(VM* vm, int argCount, Value* result);
+void push(VM* vm, Value value);
+Value pop(VM* vm);
+void ensureStack(VM* vm, int slots);
 
-void runtimeError(const char* format, ...);
+int globalSlot(VM* vm, ObjString* name);
+void runtimeError(VM* vm, const char* format, ...);
 bool isFalsey(Value value);
 
 #endif